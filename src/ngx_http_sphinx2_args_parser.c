@@ -5,278 +5,276 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
-#include <assert.h>
 #include "ngx_http_sphinx2_args_parser.h"
 
+/* longest number text a float arg may have */
+#define SPHX2_ARG_FLOAT_MAX_LEN  63
+
 /* FUNCTION DEFINITIONS */
 
-/* register the input, hints and delimiter to create a parsing ctx */
-ngx_int_t
-sphx2_arg_parse_register(
+/* set up a tokenizer over 'input', splitting it at 'delim' */
+void
+sphx2_arg_parse_init(
     sphx2_arg_parse_ctx_t    * ctxt,
-    ngx_pool_t               * pool,
-    char                     * input,
-    sphx2_arg_parse_hint_t   * hints,
-    const char               * delimiter)
+    ngx_str_t                * input,
+    u_char                     delim)
 {
-    ctxt->input = input;
-    ctxt->hints = hints;
-    ctxt->delimiter = delimiter;
-    ctxt->curr = NULL;
-    ctxt->num_tokens = 0;
-    ctxt->pool = pool;
-
-    return NGX_OK;
+    ctxt->pos = input->data;
+    ctxt->last = input->data + input->len;
+    ctxt->delim = delim;
 }
 
-/* register current 'token' of a ctx to another to parse it further */
+/* the next token, which may be empty. NGX_DONE when there are no more */
 ngx_int_t
-sphx2_arg_parse_register_child(
-    sphx2_arg_parse_ctx_t    * to,
-    sphx2_arg_parse_ctx_t    * from,
-    ngx_pool_t               * pool,
-    sphx2_arg_parse_hint_t   * hints,
-    const char               * delimiter)
+sphx2_arg_next(sphx2_arg_parse_ctx_t * ctxt, ngx_str_t * tok)
 {
-    assert(NULL != from->curr);
+    u_char * p;
+
+    if(NULL == ctxt->pos || ctxt->pos >= ctxt->last) {
+        return(NGX_DONE);
+    }
+
+    if(NULL == (p = memchr(ctxt->pos, ctxt->delim, ctxt->last - ctxt->pos))) {
+        p = ctxt->last;
+    }
 
-    return sphx2_arg_parse_register(to, pool, from->curr, hints, delimiter);
+    tok->data = ctxt->pos;
+    tok->len = p - ctxt->pos;
+
+    ctxt->pos = p + 1;
+
+    return(NGX_OK);
 }
 
-/* take one tokenizing step, so curr and input pointers are modified */
-ngx_int_t
-sphx2_arg_step(sphx2_arg_parse_ctx_t * ctxt)
+/* number of tokens left, for sizing an array before filling it */
+ngx_uint_t
+sphx2_arg_count(sphx2_arg_parse_ctx_t * ctxt)
 {
-#define SPHX2_ARG_KEYVAL_DELIM ':'
+    u_char      * p;
+    ngx_uint_t    n;
 
-    if(NULL == ctxt->input || 0 == *(ctxt->input)) {
-        return NGX_ERROR;
+    if(NULL == ctxt->pos || ctxt->pos >= ctxt->last) {
+        return(0);
     }
 
-    if(NULL == (ctxt->curr = strsep(&ctxt->input, ctxt->delimiter))) {
-        return NGX_ERROR;
+    for(n = 1, p = ctxt->pos;
+        NULL != (p = memchr(p, ctxt->delim, ctxt->last - p)); ++n)
+    {
+        if(++p == ctxt->last) {
+            break;
+        }
     }
 
-    /* in case the token is a key-val pair then we need to further token parse*/
-    if(ctxt->hints &&
-       ctxt->hints[ctxt->num_tokens].param_type & SPHX2_ARG_TYPE_KEYVAL)
-    {
-        if(NULL == (ctxt->curr = strchr(ctxt->curr, SPHX2_ARG_KEYVAL_DELIM)))
-            return NGX_ERROR;
+    return(n);
+}
+
+/* split a 'key:value' token, leaving the value in 'tok' */
+ngx_int_t
+sphx2_arg_parse_keyval(ngx_str_t * tok, ngx_str_t * key)
+{
+    u_char * p;
 
-        ctxt->curr = ctxt->curr + 1; /* move to value part */
+    if(NULL == (p = memchr(tok->data, ':', tok->len))) {
+        return(NGX_ERROR);
     }
 
-    ++ctxt->num_tokens;
+    key->data = tok->data;
+    key->len = p - tok->data;
+
+    tok->len -= key->len + 1;
+    tok->data = p + 1;
 
-    return NGX_OK;
+    return(NGX_OK);
 }
 
-/* get a string arg - internally does a 'step' and also a check using
- * the hints if available
-*/
-ngx_str_t*
-sphx2_arg_parse_get_str_arg(sphx2_arg_parse_ctx_t * ctxt)
+/* digits with an optional sign. Unsigned, a negative value wraps around
+ * as it did with atoi/strtoll; signed, it goes down to -'max' - 1, in
+ * two's complement
+ */
+static ngx_int_t
+s_parse_integer(ngx_str_t * tok, uint64_t max, ngx_uint_t sign,
+    uint64_t * val)
 {
-    ngx_str_t * str;
+    u_char      * p, * last;
+    uint64_t      v, limit;
+    ngx_uint_t    neg;
 
-    if(NULL != ctxt->hints &&
-            SPHX2_ARG_TYPE_STRING !=
-                ctxt->hints[ctxt->num_tokens].param_type)
-    {
-        return(NULL);
-    }
+    p = tok->data;
+    last = tok->data + tok->len;
 
-    if(NGX_ERROR == sphx2_arg_step(ctxt))
-        return (NULL);
+    neg = (p < last && '-' == *p);
 
-    if(NULL == (str = ngx_palloc(ctxt->pool, sizeof(ngx_str_t)))) {
-        return(NULL);
+    if(neg || (p < last && '+' == *p)) {
+        ++p;
     }
 
-    str->len = strlen(ctxt->curr)+1;
-
-    if(NULL == (str->data = ngx_palloc(ctxt->pool, str->len))) {
-        return(NULL);
+    if(p == last) {
+        return(NGX_ERROR);
     }
 
-    memcpy(str->data, ctxt->curr, str->len);
+    limit = (neg && sign) ? max + 1 : max;
 
-    return(str);
-}
+    for(v = 0; p < last; ++p) {
+        if(*p < '0' || *p > '9' || v > (limit - (*p - '0')) / 10) {
+            return(NGX_ERROR);
+        }
+        v = v * 10 + (*p - '0');
+    }
 
-/* get an integer arg - internally does a 'step' and also a check using
- * the hints if available
-*/
-uint32_t
-sphx2_arg_parse_get_int_arg(sphx2_arg_parse_ctx_t * ctxt)
-{
-    if(NULL != ctxt->hints &&
-            SPHX2_ARG_TYPE_INTEGER !=
-                ctxt->hints[ctxt->num_tokens].param_type)
-    {
-        return(NGX_ERROR);
+    if(neg) {
+        v = sign ? 0 - v : (0 - v) & max;
     }
 
-    if(NGX_ERROR == sphx2_arg_step(ctxt))
-        return (NGX_ERROR);
+    *val = v;
 
-    return(atoi(ctxt->curr));
+    return(NGX_OK);
 }
 
-/* get an int64 arg - internally does a 'step' and also a check using
- * the hints if available
-*/
-uint64_t
-sphx2_arg_parse_get_int64_arg(sphx2_arg_parse_ctx_t * ctxt)
+ngx_int_t
+sphx2_arg_parse_int(ngx_str_t * tok, uint32_t * val)
 {
-    if(NULL != ctxt->hints &&
-            SPHX2_ARG_TYPE_INTEGER64 !=
-                ctxt->hints[ctxt->num_tokens].param_type)
-    {
+    uint64_t v;
+
+    if(NGX_OK != s_parse_integer(tok, (uint32_t)-1, 0, &v)) {
         return(NGX_ERROR);
     }
 
-    if(NGX_ERROR == sphx2_arg_step(ctxt))
-        return (NGX_ERROR);
+    *val = (uint32_t)v;
 
-    return(strtoll(ctxt->curr, NULL, 10));
+    return(NGX_OK);
 }
 
-/* get a float arg - internally does a 'step' and also a check using
- * the hints if available
-*/
-float
-sphx2_arg_parse_get_float_arg(sphx2_arg_parse_ctx_t * ctxt)
+/* from INT64_MIN to INT64_MAX, as the values of a vals list */
+ngx_int_t
+sphx2_arg_parse_int64(ngx_str_t * tok, uint64_t * val)
 {
-    if(NULL != ctxt->hints &&
-            SPHX2_ARG_TYPE_FLOAT !=
-                ctxt->hints[ctxt->num_tokens].param_type)
-    {
-        return((float)NGX_ERROR);
-    }
-
-    if(NGX_ERROR == sphx2_arg_step(ctxt))
-        return ((float)NGX_ERROR);
-
-    return(atof(ctxt->curr));
+    return(s_parse_integer(tok, (uint64_t)INT64_MAX, 1, val));
 }
 
-/* get an enum arg - internally does a 'step' and also a check using
- * the hints if available. the matching str-arr if specified overrides
- * the hints (if specified). one of the arg here or hint must be
- * available.
-*/
-int32_t
-sphx2_arg_parse_get_enum_arg(
+/* the values are counted by their delimiters first, which memchr does at
+ * memory speed, so that the array is allocated at its size. Values are
+ * signed: from INT64_MIN to INT64_MAX, in two's complement
+ */
+ngx_int_t
+sphx2_arg_parse_int64_list(
+    ngx_pool_t               * pool,
     sphx2_arg_parse_ctx_t    * ctxt,
-    const char               * str_arr[],
-    size_t                     sz_str_arr)
+    uint64_t                ** vals,
+    ngx_uint_t               * n)
 {
-    size_t i;
+    u_char      * p, * last;
+    uint64_t    * v, cur, max;
+    ngx_uint_t    neg, digits, count;
 
-    if(NULL != ctxt->hints &&
-            SPHX2_ARG_TYPE_ENUM !=
-                ctxt->hints[ctxt->num_tokens].param_type)
-    {
+    if(NULL == ctxt->pos || ctxt->pos >= ctxt->last) {
         return(NGX_ERROR);
     }
 
-    assert(!(NULL == str_arr && NULL == ctxt->hints));
+    p = ctxt->pos;
+    last = ctxt->last;
 
-    if(NULL == str_arr) {
-        str_arr = ctxt->hints[ctxt->num_tokens].str_arr;
-        sz_str_arr = ctxt->hints[ctxt->num_tokens].sz_str_arr;
+    for(count = 1; NULL != (p = memchr(p, ctxt->delim, last - p)); ++count) {
+        ++p;
     }
 
-    if(NGX_ERROR == sphx2_arg_step(ctxt))
-        return (NGX_ERROR);
+    p = ctxt->pos;
+
+    if(NULL == (v = ngx_palloc(pool, count * sizeof(uint64_t)))) {
+        return(NGX_ERROR);
+    }
+
+    *vals = v;
+
+    for( ;; ) {
+        neg = (p < last && '-' == *p);
+
+        if(neg || (p < last && '+' == *p)) {
+            ++p;
+        }
+
+        max = neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+
+        for(cur = 0, digits = 0; p < last && *p != ctxt->delim; ++p) {
+            if(*p < '0' || *p > '9' || cur > (max - (*p - '0')) / 10)
+            {
+                return(NGX_ERROR);
+            }
+            cur = cur * 10 + (*p - '0');
+            ++digits;
+        }
 
-    for(i = 0; i < sz_str_arr; ++i) {
-        if(!strncmp(ctxt->curr, str_arr[i], strlen(str_arr[i]))) {
-            return (i);
+        if(0 == digits) {
+            return(NGX_ERROR);
+        }
+
+        *v++ = neg ? 0 - cur : cur;
+
+        /* a delimiter at the very end doesn't start another value */
+        if(p >= last || ++p == last) {
+            break;
         }
     }
 
-    return(NGX_ERROR);
+    ctxt->pos = last;
+
+    *n = v - *vals;
+
+    return(NGX_OK);
 }
 
-/* parse the whole input using the hints and copy the results in the
- * order specified by hints array into the target pointer arg assuming 
- * it is a struct pointer with elements of types specified in hints
- * occurring in that order 
- */
 ngx_int_t
-sphx2_arg_parse_whole_using_hints(
-    sphx2_arg_parse_ctx_t    * ctxt,
-    void                     * ptr)
+sphx2_arg_parse_double(ngx_str_t * tok, double * val)
 {
-#define APPEND_4_BYTES(p, v, a)  \
-do { \
-    memcpy(p, v, sizeof(uint32_t)); \
-    p = (void*)((uint64_t)p + sizeof(uint32_t)); \
-    a = 1 - a; \
-} while(0)
+    u_char    buf[SPHX2_ARG_FLOAT_MAX_LEN + 1];
+    char    * end;
 
-#define APPEND_8_BYTES(p, v, a) \
-do { \
-    if(0==a) { p = (void*)((uint64_t)p + sizeof(uint32_t)); a = 1;}; \
-    memcpy(p, v, sizeof(uint64_t)); \
-    p = (void*)((uint64_t)p + sizeof(uint64_t)); \
-} while(0)
+    if(0 == tok->len || tok->len > SPHX2_ARG_FLOAT_MAX_LEN) {
+        return(NGX_ERROR);
+    }
 
-    size_t i = 0;
-    int32_t is_ptr_aligned = 1;
-    union { uint32_t i; uint64_t i64; float f; ngx_str_t* s; int32_t e; } v;
+    /* strtod needs a null; the token is short, so it goes on the stack */
+    ngx_memcpy(buf, tok->data, tok->len);
+    buf[tok->len] = 0;
 
-    assert(NULL != ctxt->hints);
+    *val = strtod((char*)buf, &end);
 
-    while(SPHX2_ARG_TYPE_NONE != ctxt->hints[i].param_type) {
+    return((u_char*)end == buf + tok->len) ? NGX_OK : NGX_ERROR;
+}
 
-        switch(ctxt->hints[i].param_type & SPHX2_ARG_TYPE_MASK) {
+/* the value of an enum name, or NGX_ERROR */
+ngx_int_t
+sphx2_arg_parse_enum(ngx_str_t * tok, const sphx2_arg_enum_t * table)
+{
+    const sphx2_arg_enum_t * e;
 
-        case SPHX2_ARG_TYPE_INTEGER:
-            if((uint32_t)NGX_ERROR == (v.i = sphx2_arg_parse_get_int_arg(ctxt)))
-            {
-                return(NGX_ERROR);
-            }
-            APPEND_4_BYTES(ptr, &v.i, is_ptr_aligned);
-            break;
-        case SPHX2_ARG_TYPE_INTEGER64:
-            if((uint64_t)NGX_ERROR == (v.i64 = sphx2_arg_parse_get_int64_arg(ctxt)))
-            {
-                return(NGX_ERROR);
-            }
-            APPEND_8_BYTES(ptr, &v.i64, is_ptr_aligned);
-            break;
-        case SPHX2_ARG_TYPE_FLOAT:
-            if((float)NGX_ERROR == (v.f = sphx2_arg_parse_get_float_arg(ctxt)))
-            {
-                return(NGX_ERROR);
-            }
-            APPEND_4_BYTES(ptr, &v.i, is_ptr_aligned);
-            break;
-        case SPHX2_ARG_TYPE_STRING:
-            if(NULL == (v.s = sphx2_arg_parse_get_str_arg(ctxt)))
-            {
-                return(NGX_ERROR);
-            }
-            APPEND_8_BYTES(ptr, &v.s, is_ptr_aligned);
-            break;
-        case SPHX2_ARG_TYPE_ENUM:
-            if((int32_t)NGX_ERROR == (v.e = sphx2_arg_parse_get_enum_arg(ctxt,
-                    ctxt->hints[i].str_arr, ctxt->hints[i].sz_str_arr)))
-            {
-                return(NGX_ERROR);
-            }
-            APPEND_4_BYTES(ptr, &v.e, is_ptr_aligned);
-            break;
-        default:
-            assert(0);
-        }
+    if(0 == tok->len) {
+        return(NGX_ERROR);
+    }
+
+    e = &table[sphx2_arg_enum_hash(tok->data, tok->len)];
 
-        ++i;
+    if(e->name.len != tok->len
+       || 0 != ngx_memcmp(e->name.data, tok->data, tok->len))
+    {
+        return(NGX_ERROR);
+    }
+
+    return(e->value);
+}
+
+/* copy of a token as an ngx_str_t of its own, still referring to the
+ * value's bytes
+ */
+ngx_str_t*
+sphx2_arg_parse_str(ngx_pool_t * pool, ngx_str_t * tok)
+{
+    ngx_str_t * str;
+
+    if(NULL == (str = ngx_palloc(pool, sizeof(ngx_str_t)))) {
+        return(NULL);
     }
 
-    return (NGX_OK);
+    *str = *tok;
+
+    return(str);
 }
@@ -8,101 +8,81 @@
 
 /* TYPES  */
 
-typedef enum {
-    SPHX2_ARG_TYPE_NONE =  0,
-    SPHX2_ARG_TYPE_INTEGER = 0x01,
-    SPHX2_ARG_TYPE_INTEGER64 = 0x02,
-    SPHX2_ARG_TYPE_FLOAT = 0x04,
-    SPHX2_ARG_TYPE_STRING = 0x08,
-    SPHX2_ARG_TYPE_ENUM = 0x10,
-    SPHX2_ARG_TYPE_KEYVAL = 0x1000
-} sphx2_arg_type_t;
-
-#define SPHX2_ARG_TYPE_MASK  0x1F
-
+/* A tokenizer over a slice of an argument value. It holds all the state
+ * of a parse, so parses don't share anything, and it never writes to the
+ * value - tokens are slices of it and need no null termination.
+ */
 typedef struct {
-    sphx2_arg_type_t     param_type;
-    const char        ** str_arr;
-    size_t               sz_str_arr;
-} sphx2_arg_parse_hint_t;
+    u_char                   * pos;
+    u_char                   * last;
+    u_char                     delim;
+} sphx2_arg_parse_ctx_t;
 
+/* An enum name and its value. Names of an enum are kept in a table of
+ * SPHX2_ARG_ENUM_SLOTS slots, each at the slot that sphx2_arg_enum_hash()
+ * gives for it, so that a lookup is one hash and one compare; a name added
+ * to a table must land on a free slot.
+ */
 typedef struct {
-    char                     * input;
-    sphx2_arg_parse_hint_t   * hints;
-    const char               * delimiter;
-    char                     * curr;
-    size_t                     num_tokens;
-    ngx_pool_t               * pool;
-} sphx2_arg_parse_ctx_t;
+    ngx_str_t                  name;
+    ngx_int_t                  value;
+} sphx2_arg_enum_t;
+
+#define SPHX2_ARG_ENUM_SLOTS   32
+
+#define sphx2_arg_enum_hash(p, n) \
+    (((n) + (p)[0] + 2 * (p)[(n) - 1]) & (SPHX2_ARG_ENUM_SLOTS - 1))
 
 
 /* PROTOTYPES */
 
-/* register the input, hints and delimiter to create a parsing context */
-ngx_int_t
-sphx2_arg_parse_register(
+/* set up a tokenizer over 'input', splitting it at 'delim' */
+void
+sphx2_arg_parse_init(
     sphx2_arg_parse_ctx_t    * ctxt,
-    ngx_pool_t               * pool,
-    char                     * input,
-    sphx2_arg_parse_hint_t   * hints,
-    const char               * delimiter);
+    ngx_str_t                * input,
+    u_char                     delim);
 
-/* register current 'token' of a context to another to parse it further */
+/* the next token, which may be empty. NGX_DONE when there are no more -
+ * a delimiter at the very end doesn't start another token.
+ */
 ngx_int_t
-sphx2_arg_parse_register_child(
-    sphx2_arg_parse_ctx_t    * to,
-    sphx2_arg_parse_ctx_t    * from,
-    ngx_pool_t               * pool,
-    sphx2_arg_parse_hint_t   * hints,
-    const char               * delimiter);
+sphx2_arg_next(sphx2_arg_parse_ctx_t * ctxt, ngx_str_t * tok);
+
+/* number of tokens left, for sizing an array before filling it */
+ngx_uint_t
+sphx2_arg_count(sphx2_arg_parse_ctx_t * ctxt);
 
-/* take one tokenizing step, so curr and input pointers are modified */
+/* split a 'key:value' token, leaving the value in 'tok' */
 ngx_int_t
-sphx2_arg_step(sphx2_arg_parse_ctx_t * ctxt);
+sphx2_arg_parse_keyval(ngx_str_t * tok, ngx_str_t * key);
 
-/* parse the whole input using the hints and copy the results in the
- * order specified by hints array into the target pointer arg assuming 
- * it is a struct pointer with elements of types specified in hints
- * occurring in that order 
- */
+/* typed values of a token. The whole token must be the value. */
+ngx_int_t
+sphx2_arg_parse_int(ngx_str_t * tok, uint32_t * val);
+
+ngx_int_t
+sphx2_arg_parse_int64(ngx_str_t * tok, uint64_t * val);
+
+ngx_int_t
+sphx2_arg_parse_double(ngx_str_t * tok, double * val);
+
+/* all the tokens left, as int64s into an array of their own */
 ngx_int_t
-sphx2_arg_parse_whole_using_hints(
+sphx2_arg_parse_int64_list(
+    ngx_pool_t               * pool,
     sphx2_arg_parse_ctx_t    * ctxt,
-    void                     * ptr);
+    uint64_t                ** vals,
+    ngx_uint_t               * n);
+
+/* the value of an enum name, or NGX_ERROR */
+ngx_int_t
+sphx2_arg_parse_enum(ngx_str_t * tok, const sphx2_arg_enum_t * table);
 
-/* get a string arg - internally does a 'step' and also a check using
- * the hints if available
-*/
+/* copy of a token as an ngx_str_t of its own, still referring to the
+ * value's bytes
+ */
 ngx_str_t*
-sphx2_arg_parse_get_str_arg(sphx2_arg_parse_ctx_t * ctxt);
-
-/* get an integer arg - internally does a 'step' and also a check using
- * the hints if available
-*/
-uint32_t
-sphx2_arg_parse_get_int_arg(sphx2_arg_parse_ctx_t * ctxt);
-
-/* get an int64 arg - internally does a 'step' and also a check using
- * the hints if available
-*/
-uint64_t
-sphx2_arg_parse_get_int64_arg(sphx2_arg_parse_ctx_t * ctxt);
-
-/* get a float arg - internally does a 'step' and also a check using
- * the hints if available
-*/
-float
-sphx2_arg_parse_get_float_arg(sphx2_arg_parse_ctx_t * ctxt);
-
-/* get an enum arg - internally does a 'step' and also a check using
- * the hints if available. the matching str-arr if specified overrides
- * the hints (if specified). one of the arg here or hint must be
- * available.
-*/
-int32_t
-sphx2_arg_parse_get_enum_arg(
-    sphx2_arg_parse_ctx_t    * ctxt,
-    const char               * strarr[],
-    size_t                     sz_strarr);
+sphx2_arg_parse_str(ngx_pool_t * pool, ngx_str_t * tok);
 
 #endif /* SPHX2_QUERY_STRING_PARAMS_PARSING_H */
@@ -0,0 +1,612 @@
+/*
+ * Sphinx2 latency-aware balancer - power of two choices over a moving
+ * average of the peers' response times
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_result.h"
+#include "ngx_http_sphinx2_module.h"
+
+/*
+ * Each peer has a response time average and a count of the requests in
+ * flight on it, kept in shared memory, so every worker sees the load the
+ * others put on a peer. A request picks two peers at random from those
+ * that may be tried, and goes to the one with the lower cost:
+ *
+ *     (average + 1us) * (in flight + 1) / weight
+ *
+ * The average moves with time rather than with the number of samples: a
+ * sample 'dt' after the previous one counts for dt / (decay + dt) of it.
+ * A sample above the average replaces it, so a replica that turns slow
+ * is avoided at once, and is let back as faster samples pull it down. An
+ * average that hasn't moved for a while drifts the same way towards the
+ * mean of the peers, so that a peer which has been avoided, or not tried
+ * at all, is tried again. A failed try counts as twice the average.
+ *
+ * A peer which comes back - from being marked down, or failed out by
+ * max_fails - costs more for 'slow_start', from 10 times as much down to
+ * its own cost, so that it doesn't get a rush of requests on cold caches.
+ * That is noticed by each worker on its own.
+ *
+ * The peer lists and the tries are those of round robin, which the
+ * balancer is built on, the way nginx's least_conn is.
+ */
+
+/* TYPES */
+
+/* a peer, in shared memory */
+typedef struct {
+    ngx_atomic_t                     in_flight;
+    ngx_atomic_t                     average;   /* usec */
+    ngx_atomic_t                     stamp;     /* msec of the last sample */
+} ngx_http_sphinx2_ewma_peer_t;
+
+struct ngx_http_sphinx2_ewma_sh_s {
+    uint32_t                         sig;
+    ngx_uint_t                       number;
+    ngx_http_sphinx2_ewma_peer_t     peers[1];  /* primary, then backup */
+};
+
+/* a peer, as a worker sees it */
+struct ngx_http_sphinx2_ewma_local_s {
+    ngx_msec_t                       back;      /* when it came back */
+    unsigned                         out:1;     /* may not be tried */
+};
+
+typedef struct {
+    ngx_http_upstream_rr_peer_data_t   rrp;     /* what round robin frees */
+    ngx_http_sphinx2_balancer_conf_t * bcf;
+    ngx_uint_t                         current; /* of all the peers */
+    ngx_uint_t                         start;   /* usec */
+} ngx_http_sphinx2_ewma_peer_data_t;
+
+
+/* LOCALS */
+
+#define SPHX2_EWMA_NONE             ((ngx_uint_t) -1)
+
+/* cost of a peer which has just come back, relative to its own */
+#define SPHX2_EWMA_SLOW_START_MAX   10
+
+static ngx_int_t ngx_http_sphinx2_ewma_init_upstream(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_sphinx2_ewma_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_sphinx2_ewma_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_sphinx2_ewma_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+
+/* FUNCTION DEFINITIONS */
+
+/* sphinx2_balancer ewma [decay=time] [slow_start=time] */
+char*
+ngx_http_sphinx2_balancer(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_main_conf_t     *smcf = conf;
+    ngx_http_sphinx2_balancer_conf_t *bcf;
+    ngx_http_upstream_srv_conf_t     *uscf;
+    ngx_str_t                        *value, s;
+    ngx_int_t                         n;
+    ngx_uint_t                        i;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    value = cf->args->elts;
+
+    if(ngx_strcmp(value[1].data, "ewma") != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid balancer \"%V\", it must be \"ewma\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    bcf = smcf->balancers.elts;
+    for(i = 0; i < smcf->balancers.nelts; ++i) {
+        if(bcf[i].uscf == uscf) {
+            return "is duplicate";
+        }
+    }
+
+    if(uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    if(NULL == (bcf = ngx_array_push(&smcf->balancers))) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(bcf, sizeof(ngx_http_sphinx2_balancer_conf_t));
+
+    bcf->uscf = uscf;
+    bcf->decay = 10000;
+    bcf->slow_start = 10000;
+
+    for(i = 2; i < cf->args->nelts; ++i) {
+
+        if(ngx_strncmp(value[i].data, "decay=", 6) == 0) {
+            s.len = value[i].len - 6;
+            s.data = &value[i].data[6];
+
+            n = ngx_parse_time(&s, 0);
+            if(n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            bcf->decay = (ngx_msec_t) n;
+            continue;
+        }
+
+        if(ngx_strncmp(value[i].data, "slow_start=", 11) == 0) {
+            s.len = value[i].len - 11;
+            s.data = &value[i].data[11];
+
+            n = ngx_parse_time(&s, 0);
+            if(n == NGX_ERROR) {
+                goto invalid;
+            }
+
+            bcf->slow_start = (ngx_msec_t) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    uscf->peer.init_upstream = ngx_http_sphinx2_ewma_init_upstream;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_BACKUP;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+static ngx_http_sphinx2_balancer_conf_t *
+ngx_http_sphinx2_ewma_conf(ngx_http_sphinx2_main_conf_t *smcf,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_sphinx2_balancer_conf_t * bcf;
+    ngx_uint_t                         i;
+
+    bcf = smcf->balancers.elts;
+    for(i = 0; i < smcf->balancers.nelts; ++i) {
+        if(bcf[i].uscf == us) {
+            return &bcf[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* the averages are kept across reloads unless the peers change */
+static ngx_int_t
+ngx_http_sphinx2_ewma_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_sphinx2_balancer_conf_t * obcf = data;
+    ngx_http_sphinx2_balancer_conf_t * bcf;
+    ngx_slab_pool_t                  * shpool;
+    ngx_http_sphinx2_ewma_sh_t       * sh;
+
+    bcf = shm_zone->data;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if(shm_zone->shm.exists) {
+        bcf->sh = shpool->data;
+        return NGX_OK;
+    }
+
+    sh = NULL;
+
+    if(obcf) {
+        sh = obcf->sh;
+
+        /* the zone is as large for a few peers more or less */
+        if(sh->number != bcf->number) {
+            ngx_slab_free(shpool, sh);
+            sh = NULL;
+        }
+    }
+
+    if(NULL == sh) {
+        if(NULL == (sh = ngx_slab_alloc(shpool,
+                             sizeof(ngx_http_sphinx2_ewma_sh_t)
+                             + (bcf->number - 1)
+                                 * sizeof(ngx_http_sphinx2_ewma_peer_t))))
+        {
+            return NGX_ERROR;
+        }
+
+        shpool->data = sh;
+        sh->sig = ~bcf->sig;
+    }
+
+    bcf->sh = sh;
+
+    if(sh->sig != bcf->sig) {
+        ngx_memzero(sh->peers,
+                    bcf->number * sizeof(ngx_http_sphinx2_ewma_peer_t));
+
+        sh->sig = bcf->sig;
+        sh->number = bcf->number;
+    }
+
+    return NGX_OK;
+}
+
+/* round robin's peer lists, and a zone named after the upstream with a
+ * slot for each of their peers
+ */
+static ngx_int_t
+ngx_http_sphinx2_ewma_init_upstream(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_sphinx2_main_conf_t     * smcf;
+    ngx_http_sphinx2_balancer_conf_t * bcf;
+    ngx_http_upstream_rr_peers_t     * peers;
+    ngx_str_t                          name;
+    ngx_uint_t                         i;
+    size_t                             size;
+
+    if(NGX_OK != ngx_http_upstream_init_round_robin(cf, us)) {
+        return NGX_ERROR;
+    }
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_sphinx2_module);
+
+    if(NULL == (bcf = ngx_http_sphinx2_ewma_conf(smcf, us))) {
+        return NGX_ERROR;
+    }
+
+    ngx_crc32_init(bcf->sig);
+
+    for(peers = us->peer.data; peers; peers = peers->next) {
+        for(i = 0; i < peers->number; ++i) {
+            ngx_crc32_update(&bcf->sig, peers->peer[i].name.data,
+                             peers->peer[i].name.len);
+        }
+
+        bcf->number += peers->number;
+    }
+
+    ngx_crc32_final(bcf->sig);
+
+    if(NULL == (bcf->local = ngx_pcalloc(cf->pool, bcf->number
+                                 * sizeof(ngx_http_sphinx2_ewma_local_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    name.len = sizeof("sphinx2_balancer:") - 1 + us->host.len;
+
+    if(NULL == (name.data = ngx_pnalloc(cf->pool, name.len))) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(name.data, "sphinx2_balancer:%V", &us->host);
+
+    size = sizeof(ngx_http_sphinx2_ewma_sh_t)
+           + bcf->number * sizeof(ngx_http_sphinx2_ewma_peer_t);
+
+    size = ngx_align(size, ngx_pagesize) + 8 * ngx_pagesize;
+
+    if(NULL == (bcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                    &ngx_http_sphinx2_module)))
+    {
+        return NGX_ERROR;
+    }
+
+    if(bcf->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_ERROR;
+    }
+
+    bcf->shm_zone->init = ngx_http_sphinx2_ewma_init_zone;
+    bcf->shm_zone->data = bcf;
+
+    us->peer.init = ngx_http_sphinx2_ewma_init_peer;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_sphinx2_ewma_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_sphinx2_ewma_peer_data_t  * ep;
+
+    if(NULL == (ep = ngx_palloc(r->pool,
+                                sizeof(ngx_http_sphinx2_ewma_peer_data_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    /* round robin fills in the peer data given to it */
+    r->upstream->peer.data = &ep->rrp;
+
+    if(NGX_OK != ngx_http_upstream_init_round_robin_peer(r, us)) {
+        return NGX_ERROR;
+    }
+
+    ep->bcf = ngx_http_sphinx2_ewma_conf(
+                  ngx_http_get_module_main_conf(r, ngx_http_sphinx2_module),
+                  us);
+    ep->current = SPHX2_EWMA_NONE;
+
+    r->upstream->peer.get = ngx_http_sphinx2_ewma_get_peer;
+    r->upstream->peer.free = ngx_http_sphinx2_ewma_free_peer;
+
+    return NGX_OK;
+}
+
+/* the cost of a peer; 'mean' is the mean average of the peers */
+static double
+ngx_http_sphinx2_ewma_cost(ngx_http_sphinx2_balancer_conf_t *bcf,
+    ngx_http_upstream_rr_peer_t *peer, ngx_uint_t n, double mean)
+{
+    ngx_http_sphinx2_ewma_peer_t  * ewp = &bcf->sh->peers[n];
+    ngx_http_sphinx2_ewma_local_t * local = &bcf->local[n];
+    double                          average, cost, slow;
+    ngx_msec_int_t                  age;
+
+    average = (double) ewp->average;
+
+    if(0 == ewp->average) {
+        average = mean;
+
+    } else {
+        age = (ngx_msec_int_t) (ngx_current_msec - ewp->stamp);
+
+        if(age > 0) {
+            average = (average * bcf->decay + mean * age)
+                      / (double) (bcf->decay + age);
+        }
+    }
+
+    cost = (average + 1) * (ewp->in_flight + 1) / peer->weight;
+
+    if(0 != local->back) {
+        age = (ngx_msec_int_t) (ngx_current_msec - local->back);
+
+        if(age >= 0 && (ngx_msec_t) age < bcf->slow_start) {
+            slow = (double) bcf->slow_start / (age + 1);
+            cost *= ngx_min(slow, SPHX2_EWMA_SLOW_START_MAX);
+
+        } else {
+            local->back = 0;
+        }
+    }
+
+    return cost;
+}
+
+static ngx_int_t
+ngx_http_sphinx2_ewma_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_sphinx2_ewma_peer_data_t  * ep = data;
+    ngx_http_sphinx2_balancer_conf_t   * bcf = ep->bcf;
+    ngx_http_upstream_rr_peers_t       * peers;
+    ngx_http_upstream_rr_peer_t        * peer;
+    ngx_http_sphinx2_ewma_local_t      * local;
+    ngx_uint_t                           i, n, base, eligible, known;
+    ngx_uint_t                           pick[2], p;
+    uintptr_t                            m;
+    ngx_int_t                            rc;
+    time_t                               now;
+    double                               sum, mean;
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    peers = ep->rrp.peers;
+
+    /* the backup peers follow the primary ones in the zone */
+    base = (peers == bcf->uscf->peer.data)
+           ? 0
+           : ((ngx_http_upstream_rr_peers_t *) bcf->uscf->peer.data)->number;
+
+    eligible = 0;
+    known = 0;
+    sum = 0;
+
+    pick[0] = 0;
+    pick[1] = 0;
+
+    /* two of the peers which may be tried, picked at random as they go */
+    for(i = 0; i < peers->number; ++i) {
+
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if(ep->rrp.tried[n] & m) {
+            continue;
+        }
+
+        peer = &peers->peer[i];
+        local = &bcf->local[base + i];
+
+        if(peer->down
+           || (peer->max_fails
+               && peer->fails >= peer->max_fails
+               && now - peer->checked <= peer->fail_timeout))
+        {
+            local->out = 1;
+            continue;
+        }
+
+        if(local->out) {
+            local->out = 0;
+            local->back = ngx_current_msec;
+
+            if(0 == local->back) {
+                local->back = 1;
+            }
+        }
+
+        if(0 != bcf->sh->peers[base + i].average) {
+            sum += (double) bcf->sh->peers[base + i].average;
+            ++known;
+        }
+
+        if(++eligible <= 2) {
+            pick[eligible - 1] = i;
+
+        } else if((p = ngx_random() % eligible) < 2) {
+            pick[p] = i;
+        }
+    }
+
+    if(0 == eligible) {
+        goto failed;
+    }
+
+    p = pick[0];
+
+    if(eligible > 1) {
+        mean = known ? sum / known : 0;
+
+        if(ngx_http_sphinx2_ewma_cost(bcf, &peers->peer[pick[1]],
+                                      base + pick[1], mean)
+           < ngx_http_sphinx2_ewma_cost(bcf, &peers->peer[pick[0]],
+                                        base + pick[0], mean))
+        {
+            p = pick[1];
+        }
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "sphinx2 ewma peer: %ui of %ui eligible, %ui",
+                   p, eligible, known);
+
+    peer = &peers->peer[p];
+
+    if(now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    ep->rrp.current = p;
+
+    n = p / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+    ep->rrp.tried[n] |= m;
+
+    ep->current = base + p;
+    ep->start = ngx_http_sphinx2_usec();
+
+    (void) ngx_atomic_fetch_add(&bcf->sh->peers[ep->current].in_flight, 1);
+
+    if(pc->tries == 1 && peers->next) {
+        pc->tries += peers->next->number;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    if(peers->next) {
+        ep->rrp.peers = peers->next;
+        pc->tries = ep->rrp.peers->number;
+
+        n = (ep->rrp.peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+        for(i = 0; i < n; ++i) {
+             ep->rrp.tried[i] = 0;
+        }
+
+        rc = ngx_http_sphinx2_ewma_get_peer(pc, ep);
+
+        if(rc != NGX_BUSY) {
+            return rc;
+        }
+    }
+
+    /* all peers failed, mark them as live for quick recovery */
+    for(i = 0; i < peers->number; ++i) {
+        peers->peer[i].fails = 0;
+    }
+
+    pc->name = peers->name;
+
+    return NGX_BUSY;
+}
+
+/* a sample of a peer's response time, in usec */
+static void
+ngx_http_sphinx2_ewma_sample(ngx_http_sphinx2_balancer_conf_t *bcf,
+    ngx_http_sphinx2_ewma_peer_t *ewp, uint64_t rtt, ngx_uint_t failed)
+{
+    ngx_atomic_uint_t   old, average;
+    ngx_msec_int_t      dt;
+    uint64_t            v;
+
+    do {
+        old = ewp->average;
+
+        if(failed) {
+            rtt = ngx_max(rtt, 2 * (uint64_t) old);
+        }
+
+        dt = (ngx_msec_int_t) (ngx_current_msec - ewp->stamp);
+
+        if(0 == old || rtt >= old) {
+            v = rtt;
+
+        } else {
+            dt = ngx_max(dt, 1);
+            v = ((uint64_t) old * bcf->decay + rtt * dt) / (bcf->decay + dt);
+        }
+
+        /* 0 is for no samples yet */
+        average = (ngx_atomic_uint_t) ngx_max(v, 1);
+
+    } while(!ngx_atomic_cmp_set(&ewp->average, old, average));
+
+    ewp->stamp = ngx_current_msec;
+}
+
+static void
+ngx_http_sphinx2_ewma_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_sphinx2_ewma_peer_data_t  * ep = data;
+    ngx_http_sphinx2_ewma_peer_t       * ewp;
+
+    if(SPHX2_EWMA_NONE != ep->current) {
+        ewp = &ep->bcf->sh->peers[ep->current];
+
+        (void) ngx_atomic_fetch_add(&ewp->in_flight, -1);
+
+        ngx_http_sphinx2_ewma_sample(ep->bcf, ewp,
+                                     ngx_http_sphinx2_usec() - ep->start,
+                                     state & NGX_PEER_FAILED);
+
+        ep->current = SPHX2_EWMA_NONE;
+    }
+
+    ngx_http_upstream_free_round_robin_peer(pc, &ep->rrp, state);
+}
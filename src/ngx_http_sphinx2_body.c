@@ -0,0 +1,627 @@
+/*
+ * Sphinx2 request bodies - query arguments POSTed as JSON or in a compact
+ * length-prefixed form, for excerpt documents too big for a query string
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_result.h"
+#include "ngx_http_sphinx2_module.h"
+
+/*
+ * The arguments of a body are named as the query string params of
+ * 'sphinx2_query_args' are, and a value is in the format its param has.
+ * The one difference is excerpt documents, which are given one by one
+ * instead of ';'-separated in 'docs', and so may contain anything.
+ *
+ * The body is read into one buffer (request_body_in_single_buf) and
+ * parsed in one pass once it is all in. Nothing is unescaped and nothing
+ * is copied: the values refer to the body as it is, and a document long
+ * enough is referred to by the searchd request too, so it goes from the
+ * client's body to searchd without being touched. Only a body that went
+ * to a temp file is read back into memory first.
+ *
+ * application/json
+ *     One object. A member is a string, or a number, true or false taken
+ *     as its text; null is the same as leaving the member out. "docs" may
+ *     also be an array of strings, the documents. Escapes in a string are
+ *     decoded in place - a decoded escape is never longer than the escape
+ *     was - so only strings with escapes are written to at all. Members
+ *     that aren't arguments are skipped, but their values have to be
+ *     strings, numbers or literals too.
+ *
+ * application/x-sphinx2
+ *     A sequence of arguments, each one
+ *         name length     1 byte
+ *         name
+ *         value length    4 bytes, big endian
+ *         value
+ *     "docs" may be given any number of times, each time one document.
+ *
+ * As in a query string, the first value of an argument given twice is
+ * the one used; for "docs" in JSON, that is the first "docs" member,
+ * whether a string or an array.
+ */
+
+/* LOCALS */
+
+#define SPHX2_BODY_DOCS     16  /* first allocation of the docs array */
+
+static ngx_str_t  ngx_http_sphinx2_json_type = ngx_string("application/json");
+static ngx_str_t  ngx_http_sphinx2_binary_type =
+                                            ngx_string("application/x-sphinx2");
+
+static ngx_int_t ngx_http_sphinx2_body_buf(ngx_http_request_t *r,
+    ngx_str_t *body);
+static ngx_int_t ngx_http_sphinx2_body_type(ngx_http_request_t *r,
+    ngx_str_t *type);
+static ngx_int_t ngx_http_sphinx2_body_arg(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, ngx_str_t *name, ngx_str_t *value);
+static ngx_int_t ngx_http_sphinx2_body_doc(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, ngx_str_t *doc);
+static ngx_int_t ngx_http_sphinx2_body_binary(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, u_char *p, u_char *last);
+static ngx_int_t ngx_http_sphinx2_body_json(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, u_char *p, u_char *last);
+static u_char *ngx_http_sphinx2_json_string(u_char *p, u_char *last,
+    ngx_str_t *s);
+static u_char *ngx_http_sphinx2_json_literal(u_char *p, u_char *last,
+    ngx_str_t *s);
+static u_char *ngx_http_sphinx2_json_space(u_char *p, u_char *last);
+
+
+/* FUNCTION DEFINITIONS */
+
+/* the arguments of the body of a POST, into ctx->body_args and
+ * ctx->body_docs
+ */
+ngx_int_t
+ngx_http_sphinx2_body_args(ngx_http_request_t *r, ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_str_t                        body;
+
+    if(NGX_OK != ngx_http_sphinx2_body_buf(r, &body)) {
+        return NGX_ERROR;
+    }
+
+    if(0 == body.len) {
+        return NGX_OK;
+    }
+
+    if(NULL == (ctx->body_args = ngx_pcalloc(r->pool,
+                                     SPHX2_ARG_COUNT * sizeof(ngx_str_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    if(ngx_http_sphinx2_body_type(r, &ngx_http_sphinx2_json_type)) {
+        return ngx_http_sphinx2_body_json(r, ctx, body.data,
+                                          body.data + body.len);
+    }
+
+    if(ngx_http_sphinx2_body_type(r, &ngx_http_sphinx2_binary_type)) {
+        return ngx_http_sphinx2_body_binary(r, ctx, body.data,
+                                            body.data + body.len);
+    }
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "sphinx2: request body is neither \"%V\" nor \"%V\"",
+                  &ngx_http_sphinx2_json_type, &ngx_http_sphinx2_binary_type);
+
+    return NGX_ERROR;
+}
+
+/* the body as one run of bytes: the buffer it is in, or, if it is in a
+ * temp file, read back into memory
+ */
+static ngx_int_t
+ngx_http_sphinx2_body_buf(ngx_http_request_t *r, ngx_str_t *body)
+{
+    ngx_chain_t                    * cl;
+    ngx_buf_t                      * b;
+    u_char                         * p;
+    size_t                           len, size;
+    ssize_t                          n;
+
+    body->len = 0;
+
+    if(NULL == r->request_body || NULL == r->request_body->bufs) {
+        return NGX_OK;
+    }
+
+    cl = r->request_body->bufs;
+
+    if(NULL == cl->next && !cl->buf->in_file) {
+        body->data = cl->buf->pos;
+        body->len = cl->buf->last - cl->buf->pos;
+        return NGX_OK;
+    }
+
+    len = 0;
+
+    for( /* void */ ; cl; cl = cl->next) {
+        b = cl->buf;
+        len += b->in_file ? (size_t) (b->file_last - b->file_pos)
+                          : (size_t) (b->last - b->pos);
+    }
+
+    if(0 == len) {
+        return NGX_OK;
+    }
+
+    if(NULL == (p = ngx_pnalloc(r->pool, len))) {
+        return NGX_ERROR;
+    }
+
+    body->data = p;
+    body->len = len;
+
+    for(cl = r->request_body->bufs; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if(!b->in_file) {
+            p = ngx_cpymem(p, b->pos, b->last - b->pos);
+            continue;
+        }
+
+        size = (size_t) (b->file_last - b->file_pos);
+
+        n = ngx_read_file(b->file, p, size, b->file_pos);
+
+        if(NGX_ERROR == n) {
+            return NGX_ERROR;
+        }
+
+        if((size_t) n != size) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          ngx_read_file_n " read only %z of %uz bytes "
+                          "of the request body", n, size);
+            return NGX_ERROR;
+        }
+
+        p += size;
+    }
+
+    return NGX_OK;
+}
+
+/* the body's Content-Type is 'type', with or without parameters */
+static ngx_int_t
+ngx_http_sphinx2_body_type(ngx_http_request_t *r, ngx_str_t *type)
+{
+    ngx_str_t                      * ct;
+
+    if(NULL == r->headers_in.content_type) {
+        return 0;
+    }
+
+    ct = &r->headers_in.content_type->value;
+
+    return ct->len >= type->len
+           && 0 == ngx_strncasecmp(ct->data, type->data, type->len)
+           && (ct->len == type->len
+               || ';' == ct->data[type->len] || ' ' == ct->data[type->len]);
+}
+
+static ngx_int_t
+ngx_http_sphinx2_body_arg(ngx_http_request_t *r, ngx_http_sphinx2_ctx_t *ctx,
+    ngx_str_t *name, ngx_str_t *value)
+{
+    ngx_uint_t                       i;
+
+    i = ngx_http_sphinx2_param(name->data, name->len);
+
+    if(SPHX2_ARG_COUNT == i || NULL != ctx->body_args[i].data) {
+        return NGX_OK;
+    }
+
+    if(SPHX2_ARG_DOCS == i && NULL != ctx->body_docs) {
+        return NGX_OK;
+    }
+
+    ctx->body_args[i] = *value;
+
+    /* an empty value is still given */
+    if(NULL == value->data) {
+        ctx->body_args[i].data = name->data;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_sphinx2_body_doc(ngx_http_request_t *r, ngx_http_sphinx2_ctx_t *ctx,
+    ngx_str_t *doc)
+{
+    sphx2_doc_t                    * d;
+
+    if(NULL == ctx->body_docs) {
+        if(NULL == (ctx->body_docs = ngx_array_create(r->pool,
+                                         SPHX2_BODY_DOCS,
+                                         sizeof(sphx2_doc_t))))
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if(NULL == (d = ngx_array_push(ctx->body_docs))) {
+        return NGX_ERROR;
+    }
+
+    d->doc = *doc;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_sphinx2_body_binary(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, u_char *p, u_char *last)
+{
+    u_char                         * start, * arg;
+    ngx_str_t                        name, value;
+    ngx_int_t                        rc;
+    uint32_t                         len;
+
+    start = p;
+
+    while(p < last) {
+
+        arg = p;
+
+        name.len = *p++;
+        name.data = p;
+
+        if((size_t) (last - p) < name.len + sizeof(uint32_t)) {
+            goto invalid;
+        }
+
+        p += name.len;
+
+        len = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+              | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+
+        p += sizeof(uint32_t);
+
+        if((size_t) (last - p) < len) {
+            goto invalid;
+        }
+
+        value.data = p;
+        value.len = len;
+
+        p += len;
+
+        if(name.len == sizeof("docs") - 1
+           && 0 == ngx_strncmp(name.data, "docs", name.len))
+        {
+            rc = ngx_http_sphinx2_body_doc(r, ctx, &value);
+
+        } else {
+            rc = ngx_http_sphinx2_body_arg(r, ctx, &name, &value);
+        }
+
+        if(NGX_OK != rc) {
+            return rc;
+        }
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "sphinx2: truncated argument in request body at %uz",
+                  (size_t) (arg - start));
+
+    return NGX_ERROR;
+}
+
+static ngx_int_t
+ngx_http_sphinx2_body_json(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, u_char *p, u_char *last)
+{
+    u_char                         * start;
+    ngx_str_t                        name, value;
+    ngx_uint_t                       docs, taken;
+
+    start = p;
+
+    p = ngx_http_sphinx2_json_space(p, last);
+
+    if(p == last || '{' != *p++) {
+        goto invalid;
+    }
+
+    p = ngx_http_sphinx2_json_space(p, last);
+
+    if(p < last && '}' == *p) {
+        p++;
+        goto done;
+    }
+
+    for( ;; ) {
+
+        if(p == last || '"' != *p++
+           || NULL == (p = ngx_http_sphinx2_json_string(p, last, &name)))
+        {
+            goto invalid;
+        }
+
+        p = ngx_http_sphinx2_json_space(p, last);
+
+        if(p == last || ':' != *p++) {
+            goto invalid;
+        }
+
+        p = ngx_http_sphinx2_json_space(p, last);
+
+        if(p == last) {
+            goto invalid;
+        }
+
+        docs = (name.len == sizeof("docs") - 1
+                && 0 == ngx_strncmp(name.data, "docs", name.len));
+
+        if('[' == *p && docs) {
+            p = ngx_http_sphinx2_json_space(p + 1, last);
+
+            if(p < last && ']' == *p) {
+                /* no documents, but given */
+                value.len = 0;
+                value.data = NULL;
+
+                if(NGX_OK != ngx_http_sphinx2_body_arg(r, ctx, &name,
+                                                       &value))
+                {
+                    return NGX_ERROR;
+                }
+
+                p++;
+
+            } else {
+                /* the documents of a "docs" member that came earlier are
+                 * the ones used; those of this one are only skipped
+                 */
+                taken = (NULL != ctx->body_docs
+                         || NULL != ctx->body_args[SPHX2_ARG_DOCS].data);
+
+                for( ;; ) {
+                    if(p == last || '"' != *p++
+                       || NULL == (p = ngx_http_sphinx2_json_string(p, last,
+                                                                     &value)))
+                    {
+                        goto invalid;
+                    }
+
+                    if(!taken
+                       && NGX_OK != ngx_http_sphinx2_body_doc(r, ctx, &value))
+                    {
+                        return NGX_ERROR;
+                    }
+
+                    p = ngx_http_sphinx2_json_space(p, last);
+
+                    if(p == last) {
+                        goto invalid;
+                    }
+
+                    if(']' == *p) {
+                        p++;
+                        break;
+                    }
+
+                    if(',' != *p++) {
+                        goto invalid;
+                    }
+
+                    p = ngx_http_sphinx2_json_space(p, last);
+                }
+            }
+
+        } else if('"' == *p) {
+            if(NULL == (p = ngx_http_sphinx2_json_string(p + 1, last,
+                                                          &value)))
+            {
+                goto invalid;
+            }
+
+            if(NGX_OK != ngx_http_sphinx2_body_arg(r, ctx, &name, &value)) {
+                return NGX_ERROR;
+            }
+
+        } else {
+            if(NULL == (p = ngx_http_sphinx2_json_literal(p, last, &value))) {
+                goto invalid;
+            }
+
+            if(!(value.len == sizeof("null") - 1
+                 && 0 == ngx_strncmp(value.data, "null", value.len))
+               && NGX_OK != ngx_http_sphinx2_body_arg(r, ctx, &name, &value))
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        p = ngx_http_sphinx2_json_space(p, last);
+
+        if(p == last) {
+            goto invalid;
+        }
+
+        if('}' == *p) {
+            p++;
+            break;
+        }
+
+        if(',' != *p++) {
+            goto invalid;
+        }
+
+        p = ngx_http_sphinx2_json_space(p, last);
+    }
+
+done:
+
+    if(last == ngx_http_sphinx2_json_space(p, last)) {
+        return NGX_OK;
+    }
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "sphinx2: invalid JSON in request body at %uz",
+                  (size_t) ((p ? p : last) - start));
+
+    return NGX_ERROR;
+}
+
+/* a string, from just after its opening quote; escapes are decoded in
+ * place. A string without escapes - a document, mostly - is found with
+ * two memchr()s and never written to
+ */
+static u_char *
+ngx_http_sphinx2_json_string(u_char *p, u_char *last, ngx_str_t *s)
+{
+    u_char                         * q, * dst;
+    uint32_t                         c, lo;
+    ngx_uint_t                       i, n;
+
+    s->data = p;
+
+    if(NULL == (q = memchr(p, '"', last - p))) {
+        return NULL;
+    }
+
+    if(NULL == (dst = memchr(p, '\\', q - p))) {
+        s->len = q - p;
+        return q + 1;
+    }
+
+    for(p = dst; p < last; /* void */) {
+
+        if('"' == *p) {
+            s->len = dst - s->data;
+            return p + 1;
+        }
+
+        if('\\' != *p) {
+            *dst++ = *p++;
+            continue;
+        }
+
+        if(++p == last) {
+            return NULL;
+        }
+
+        switch(*p++) {
+        case '"':  *dst++ = '"';  continue;
+        case '\\': *dst++ = '\\'; continue;
+        case '/':  *dst++ = '/';  continue;
+        case 'b':  *dst++ = '\b'; continue;
+        case 'f':  *dst++ = '\f'; continue;
+        case 'n':  *dst++ = '\n'; continue;
+        case 'r':  *dst++ = '\r'; continue;
+        case 't':  *dst++ = '\t'; continue;
+        case 'u':  break;
+        default:   return NULL;
+        }
+
+        /* \uXXXX, or a surrogate pair of them */
+
+        for(n = 0, c = 0, lo = 0; n < 2; n++) {
+
+            if(last - p < 4) {
+                return NULL;
+            }
+
+            for(i = 0; i < 4; i++, p++) {
+                lo <<= 4;
+
+                if(*p >= '0' && *p <= '9') {
+                    lo |= *p - '0';
+
+                } else if((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f') {
+                    lo |= (*p | 0x20) - 'a' + 10;
+
+                } else {
+                    return NULL;
+                }
+            }
+
+            if(1 == n) {
+                if(lo < 0xdc00 || lo > 0xdfff) {
+                    return NULL;
+                }
+
+                c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                break;
+            }
+
+            c = lo;
+            lo = 0;
+
+            if(c < 0xd800 || c > 0xdfff) {
+                break;
+            }
+
+            if(c > 0xdbff || last - p < 2 || '\\' != p[0] || 'u' != p[1]) {
+                return NULL;
+            }
+
+            p += 2;
+        }
+
+        if(c < 0x80) {
+            *dst++ = (u_char) c;
+
+        } else if(c < 0x800) {
+            *dst++ = (u_char) (0xc0 | (c >> 6));
+            *dst++ = (u_char) (0x80 | (c & 0x3f));
+
+        } else if(c < 0x10000) {
+            *dst++ = (u_char) (0xe0 | (c >> 12));
+            *dst++ = (u_char) (0x80 | ((c >> 6) & 0x3f));
+            *dst++ = (u_char) (0x80 | (c & 0x3f));
+
+        } else {
+            *dst++ = (u_char) (0xf0 | (c >> 18));
+            *dst++ = (u_char) (0x80 | ((c >> 12) & 0x3f));
+            *dst++ = (u_char) (0x80 | ((c >> 6) & 0x3f));
+            *dst++ = (u_char) (0x80 | (c & 0x3f));
+        }
+    }
+
+    return NULL;
+}
+
+/* a number, true, false or null, as its text */
+static u_char *
+ngx_http_sphinx2_json_literal(u_char *p, u_char *last, ngx_str_t *s)
+{
+    s->data = p;
+
+    while(p < last
+          && ((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'z')
+              || '-' == *p || '+' == *p || '.' == *p || 'E' == *p))
+    {
+        p++;
+    }
+
+    s->len = p - s->data;
+
+    return s->len ? p : NULL;
+}
+
+static u_char *
+ngx_http_sphinx2_json_space(u_char *p, u_char *last)
+{
+    while(p < last
+          && (' ' == *p || '\t' == *p || '\r' == *p || '\n' == *p))
+    {
+        p++;
+    }
+
+    return p;
+}
@@ -0,0 +1,568 @@
+/*
+ * Sphinx2 circuit breakers - searchd peers left out by all the workers
+ * once they fail too much, until a probe gets through
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_result.h"
+#include "ngx_http_sphinx2_module.h"
+
+/*
+ * Each peer of an upstream with sphinx2_breaker has its failures counted
+ * in shared memory: a request that couldn't connect, timed out, got an
+ * invalid response or a RETRY is a failure. The breaker of a peer opens
+ * on 'failures' of them in a row, or when at least 'min_requests' were
+ * answered in the current 'window' and 'error_rate' percent of them were
+ * failures. It then stays open for 'open': the peer is left out by every
+ * worker, so a replica that says RETRY is skipped from the next request
+ * on, not found out again by each request.
+ *
+ * Once 'open' is over one request - in any worker - is let through to
+ * the peer as a probe (half-open). If it is answered the breaker closes,
+ * otherwise it stays open for another while. A probe that never comes
+ * back (a worker died with it) may be taken again after 'open'.
+ *
+ * A peer is left out by marking it down in the worker's peer list for
+ * the time the balancer picks, so any balancer which keeps the lists of
+ * round robin (round robin itself, least_conn, ip_hash, keepalive in
+ * front of them, sphinx2_balancer) skips it. Peers marked down by the
+ * configuration or by sphinx2_check stay so. If every peer is open, none
+ * is left out: a broken peer may still answer, a 502 surely doesn't.
+ */
+
+/* TYPES */
+
+/* a peer, in shared memory */
+typedef struct {
+    ngx_atomic_t                     until;     /* msec, 0 - closed */
+    ngx_atomic_t                     probe;     /* msec one went, 0 - none */
+    ngx_atomic_t                     run;       /* failures in a row */
+    ngx_atomic_t                     window;    /* msec it started */
+    ngx_atomic_t                     requests;  /* in the window */
+    ngx_atomic_t                     failures;
+} ngx_http_sphinx2_breaker_peer_t;
+
+struct ngx_http_sphinx2_breaker_sh_s {
+    uint32_t                         sig;
+    ngx_uint_t                       number;
+    ngx_http_sphinx2_breaker_peer_t  peers[1]; /* primary, then backup */
+};
+
+
+/* LOCALS */
+
+#define SPHX2_BREAKER_NONE          ((ngx_uint_t) -1)
+
+/* 0 stands for none in the shared times */
+#define SPHX2_BREAKER_MSEC(ms)      ((ms) ? (ms) : 1)
+
+
+/* FUNCTION DEFINITIONS */
+
+/* sphinx2_breaker [failures=n] [error_rate=n%] [min_requests=n]
+ *     [window=time] [open=time]
+ */
+char*
+ngx_http_sphinx2_breaker(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_main_conf_t     *smcf = conf;
+    ngx_http_sphinx2_breaker_conf_t  *bcf;
+    ngx_http_upstream_srv_conf_t     *uscf;
+    ngx_str_t                        *value, s;
+    ngx_int_t                         n;
+    ngx_uint_t                        i;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    value = cf->args->elts;
+
+    bcf = smcf->breakers.elts;
+    for(i = 0; i < smcf->breakers.nelts; ++i) {
+        if(bcf[i].uscf == uscf) {
+            return "is duplicate";
+        }
+    }
+
+    if(NULL == (bcf = ngx_array_push(&smcf->breakers))) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(bcf, sizeof(ngx_http_sphinx2_breaker_conf_t));
+
+    bcf->uscf = uscf;
+    bcf->failures = 5;
+    bcf->error_rate = 50;
+    bcf->min_requests = 20;
+    bcf->window = 10000;
+    bcf->open = 5000;
+
+    for(i = 1; i < cf->args->nelts; ++i) {
+
+        if(ngx_strncmp(value[i].data, "failures=", 9) == 0) {
+            n = ngx_atoi(&value[i].data[9], value[i].len - 9);
+            if(n == NGX_ERROR) {
+                goto invalid;
+            }
+
+            bcf->failures = (ngx_uint_t) n;
+            continue;
+        }
+
+        if(ngx_strncmp(value[i].data, "error_rate=", 11) == 0) {
+            s.len = value[i].len - 11;
+            s.data = &value[i].data[11];
+
+            if(s.len && '%' == s.data[s.len - 1]) {
+                --s.len;
+            }
+
+            n = ngx_atoi(s.data, s.len);
+            if(n == NGX_ERROR || n > 100) {
+                goto invalid;
+            }
+
+            bcf->error_rate = (ngx_uint_t) n;
+            continue;
+        }
+
+        if(ngx_strncmp(value[i].data, "min_requests=", 13) == 0) {
+            n = ngx_atoi(&value[i].data[13], value[i].len - 13);
+            if(n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            bcf->min_requests = (ngx_uint_t) n;
+            continue;
+        }
+
+        if(ngx_strncmp(value[i].data, "window=", 7) == 0) {
+            s.len = value[i].len - 7;
+            s.data = &value[i].data[7];
+
+            n = ngx_parse_time(&s, 0);
+            if(n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            bcf->window = (ngx_msec_t) n;
+            continue;
+        }
+
+        if(ngx_strncmp(value[i].data, "open=", 5) == 0) {
+            s.len = value[i].len - 5;
+            s.data = &value[i].data[5];
+
+            n = ngx_parse_time(&s, 0);
+            if(n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            bcf->open = (ngx_msec_t) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if(0 == bcf->failures && 0 == bcf->error_rate) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" with neither \"failures\" "
+                           "nor \"error_rate\"", &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+ngx_http_sphinx2_breaker_conf_t *
+ngx_http_sphinx2_breaker_conf(ngx_http_sphinx2_main_conf_t *smcf,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_sphinx2_breaker_conf_t  * bcf;
+    ngx_uint_t                         i;
+
+    bcf = smcf->breakers.elts;
+    for(i = 0; i < smcf->breakers.nelts; ++i) {
+        if(bcf[i].uscf == us) {
+            return &bcf[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/* the counts are kept across reloads unless the peers change */
+static ngx_int_t
+ngx_http_sphinx2_breaker_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_sphinx2_breaker_conf_t  * obcf = data;
+    ngx_http_sphinx2_breaker_conf_t  * bcf;
+    ngx_slab_pool_t                  * shpool;
+    ngx_http_sphinx2_breaker_sh_t    * sh;
+
+    bcf = shm_zone->data;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if(shm_zone->shm.exists) {
+        bcf->sh = shpool->data;
+        return NGX_OK;
+    }
+
+    sh = NULL;
+
+    if(obcf) {
+        sh = obcf->sh;
+
+        if(sh->number != bcf->number) {
+            ngx_slab_free(shpool, sh);
+            sh = NULL;
+        }
+    }
+
+    if(NULL == sh) {
+        if(NULL == (sh = ngx_slab_alloc(shpool,
+                             sizeof(ngx_http_sphinx2_breaker_sh_t)
+                             + (bcf->number - 1)
+                                 * sizeof(ngx_http_sphinx2_breaker_peer_t))))
+        {
+            return NGX_ERROR;
+        }
+
+        shpool->data = sh;
+        sh->sig = ~bcf->sig;
+    }
+
+    bcf->sh = sh;
+
+    if(sh->sig != bcf->sig) {
+        ngx_memzero(sh->peers,
+                    bcf->number * sizeof(ngx_http_sphinx2_breaker_peer_t));
+
+        sh->sig = bcf->sig;
+        sh->number = bcf->number;
+    }
+
+    return NGX_OK;
+}
+
+
+/* a zone for each upstream with a breaker, named after it, with a slot for
+ * each of its peers. The peer lists are there by postconfiguration
+ */
+ngx_int_t
+ngx_http_sphinx2_breaker_init(ngx_conf_t *cf)
+{
+    ngx_http_sphinx2_main_conf_t     * smcf;
+    ngx_http_sphinx2_breaker_conf_t  * bcf;
+    ngx_http_upstream_rr_peers_t     * peers;
+    ngx_str_t                          name;
+    ngx_uint_t                         i, k;
+    size_t                             size;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_sphinx2_module);
+
+    bcf = smcf->breakers.elts;
+    for(k = 0; k < smcf->breakers.nelts; ++k, ++bcf) {
+
+        if(NULL == bcf->uscf->peer.data) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "no servers for sphinx2_breaker in "
+                               "upstream \"%V\"", &bcf->uscf->host);
+            return NGX_ERROR;
+        }
+
+        ngx_crc32_init(bcf->sig);
+
+        for(peers = bcf->uscf->peer.data; peers; peers = peers->next) {
+            for(i = 0; i < peers->number; ++i) {
+                ngx_crc32_update(&bcf->sig, peers->peer[i].name.data,
+                                 peers->peer[i].name.len);
+            }
+
+            bcf->number += peers->number;
+        }
+
+        ngx_crc32_final(bcf->sig);
+
+        if(NULL == (bcf->masked = ngx_pcalloc(cf->pool, bcf->number))) {
+            return NGX_ERROR;
+        }
+
+        name.len = sizeof("sphinx2_breaker:") - 1 + bcf->uscf->host.len;
+
+        if(NULL == (name.data = ngx_pnalloc(cf->pool, name.len))) {
+            return NGX_ERROR;
+        }
+
+        ngx_sprintf(name.data, "sphinx2_breaker:%V", &bcf->uscf->host);
+
+        size = sizeof(ngx_http_sphinx2_breaker_sh_t)
+               + bcf->number * sizeof(ngx_http_sphinx2_breaker_peer_t);
+
+        size = ngx_align(size, ngx_pagesize) + 8 * ngx_pagesize;
+
+        if(NULL == (bcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                        &ngx_http_sphinx2_module)))
+        {
+            return NGX_ERROR;
+        }
+
+        if(bcf->shm_zone->data) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate zone \"%V\"", &name);
+            return NGX_ERROR;
+        }
+
+        bcf->shm_zone->init = ngx_http_sphinx2_breaker_init_zone;
+        bcf->shm_zone->data = bcf;
+    }
+
+    return NGX_OK;
+}
+
+
+/* whether the breaker of peer 'n' (of all the peers) is open, or half-open
+ * - a request which doesn't go through the balancer is no probe
+ */
+ngx_uint_t
+ngx_http_sphinx2_breaker_is_open(ngx_http_sphinx2_breaker_conf_t *bcf,
+    ngx_uint_t n)
+{
+    return 0 != bcf->sh->peers[n].until;
+}
+
+
+/* pick a peer with the balancer 'get', with the open peers left out */
+ngx_int_t
+ngx_http_sphinx2_breaker_get_peer(ngx_http_sphinx2_breaker_try_t *bt,
+    ngx_peer_connection_t *pc, ngx_event_get_peer_pt get, void *data)
+{
+    ngx_http_sphinx2_breaker_conf_t  * bcf = bt->conf;
+    ngx_http_sphinx2_breaker_peer_t  * bp;
+    ngx_http_upstream_rr_peers_t     * peers;
+    ngx_http_upstream_rr_peer_t      * peer;
+    ngx_atomic_uint_t                  until, probe;
+    ngx_uint_t                         i, n, base, up, open, claimed;
+    ngx_msec_t                         now;
+    ngx_int_t                          rc;
+
+    now = ngx_current_msec;
+
+    bt->current = SPHX2_BREAKER_NONE;
+    bt->probe = 0;
+
+    claimed = SPHX2_BREAKER_NONE;
+    up = 0;
+    open = 0;
+
+    for(base = 0, peers = bcf->uscf->peer.data;
+        peers;
+        base += peers->number, peers = peers->next)
+    {
+        for(i = 0; i < peers->number; ++i) {
+            n = base + i;
+            peer = &peers->peer[i];
+            bp = &bcf->sh->peers[n];
+
+            bcf->masked[n] = 0;
+
+            if(peer->down) {
+                continue;
+            }
+
+            ++up;
+
+            if(0 == (until = bp->until)) {
+                continue;
+            }
+
+            /* half-open - one request may go, from any worker */
+            if((ngx_msec_int_t) (now - until) >= 0
+               && SPHX2_BREAKER_NONE == claimed)
+            {
+                probe = bp->probe;
+
+                if((0 == probe || (ngx_msec_int_t) (now - probe)
+                                      >= (ngx_msec_int_t) bcf->open)
+                   && ngx_atomic_cmp_set(&bp->probe, probe,
+                                         SPHX2_BREAKER_MSEC(now)))
+                {
+                    claimed = n;
+                    continue;
+                }
+            }
+
+            bcf->masked[n] = 1;
+            ++open;
+        }
+    }
+
+    /* every peer is open - let the balancer have them all */
+    if(open == up) {
+        open = 0;
+    }
+
+    for(base = 0, peers = bcf->uscf->peer.data;
+        peers && open;
+        base += peers->number, peers = peers->next)
+    {
+        for(i = 0; i < peers->number; ++i) {
+            if(bcf->masked[base + i]) {
+                peers->peer[i].down = 1;
+            }
+        }
+    }
+
+    rc = get(pc, data);
+
+    for(base = 0, peers = bcf->uscf->peer.data;
+        peers;
+        base += peers->number, peers = peers->next)
+    {
+        for(i = 0; i < peers->number; ++i) {
+            n = base + i;
+
+            if(open && bcf->masked[n]) {
+                peers->peer[i].down = 0;
+            }
+
+            if((NGX_OK == rc || NGX_DONE == rc)
+               && peers->peer[i].sockaddr == pc->sockaddr)
+            {
+                bt->current = n;
+            }
+        }
+    }
+
+    if(SPHX2_BREAKER_NONE != claimed) {
+        if(claimed == bt->current) {
+            bt->probe = 1;
+
+            ngx_log_error(NGX_LOG_INFO, pc->log, 0,
+                          "sphinx2 breaker: probing \"%V\" of \"%V\"",
+                          pc->name, &bcf->uscf->host);
+
+        } else {
+            bcf->sh->peers[claimed].probe = 0;
+        }
+    }
+
+    return rc;
+}
+
+
+/* count how the request went with its peer, and open or close the peer's
+ * breaker on it
+ */
+void
+ngx_http_sphinx2_breaker_free_peer(ngx_http_sphinx2_breaker_try_t *bt,
+    ngx_peer_connection_t *pc, ngx_http_sphinx2_ctx_t *ctx, ngx_uint_t state)
+{
+    ngx_http_sphinx2_breaker_conf_t  * bcf = bt->conf;
+    ngx_http_sphinx2_breaker_peer_t  * bp;
+    ngx_atomic_uint_t                  run, window;
+    ngx_uint_t                         failed, answered;
+    ngx_msec_t                         now;
+
+    if(SPHX2_BREAKER_NONE == bt->current) {
+        return;
+    }
+
+    bp = &bcf->sh->peers[bt->current];
+    bt->current = SPHX2_BREAKER_NONE;
+
+    now = ngx_current_msec;
+
+    /* a hedge answered for the peer, which was only slow */
+    answered = NULL != ctx && ctx->header && !ctx->hedge_won;
+
+    failed = (state & NGX_PEER_FAILED)
+             || (answered
+                 && SPHX2_SEARCHD_RETRY == ctx->repctx.srch.status);
+
+    if(bt->probe) {
+        bt->probe = 0;
+
+        if(failed) {
+            bp->until = SPHX2_BREAKER_MSEC(now + bcf->open);
+
+            ngx_log_error(NGX_LOG_WARN, pc->log, 0,
+                          "sphinx2 breaker: \"%V\" of \"%V\" still failing, "
+                          "open for %M", pc->name, &bcf->uscf->host,
+                          bcf->open);
+
+        } else if(answered) {
+            bp->run = 0;
+            bp->requests = 0;
+            bp->failures = 0;
+            bp->window = now;
+            bp->until = 0;
+
+            ngx_log_error(NGX_LOG_WARN, pc->log, 0,
+                          "sphinx2 breaker: \"%V\" of \"%V\" closed",
+                          pc->name, &bcf->uscf->host);
+        }
+
+        bp->probe = 0;
+        return;
+    }
+
+    /* nothing learnt; or the breaker opened since the request went */
+    if((!failed && !answered) || 0 != bp->until) {
+        return;
+    }
+
+    window = bp->window;
+
+    if((ngx_msec_int_t) (now - window) >= (ngx_msec_int_t) bcf->window
+       && ngx_atomic_cmp_set(&bp->window, window, now))
+    {
+        bp->requests = 0;
+        bp->failures = 0;
+    }
+
+    (void) ngx_atomic_fetch_add(&bp->requests, 1);
+
+    if(!failed) {
+        bp->run = 0;
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&bp->failures, 1);
+    run = ngx_atomic_fetch_add(&bp->run, 1) + 1;
+
+    if(!((bcf->failures && run >= bcf->failures)
+         || (bcf->error_rate
+             && bp->requests >= bcf->min_requests
+             && bp->failures * 100 >= bcf->error_rate * bp->requests)))
+    {
+        return;
+    }
+
+    if(ngx_atomic_cmp_set(&bp->until, 0, SPHX2_BREAKER_MSEC(now + bcf->open)))
+    {
+        ngx_log_error(NGX_LOG_WARN, pc->log, 0,
+                      "sphinx2 breaker: \"%V\" of \"%V\" open for %M "
+                      "after %uA failures in a row, %uA of %uA",
+                      pc->name, &bcf->uscf->host, bcf->open,
+                      run, bp->failures, bp->requests);
+
+        bp->run = 0;
+        bp->requests = 0;
+        bp->failures = 0;
+        bp->window = now;
+    }
+}
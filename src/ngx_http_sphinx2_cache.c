@@ -0,0 +1,490 @@
+/*
+ * Sphinx2 searchd response cache in shared memory
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_md5.h>
+#include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_result.h"
+#include "ngx_http_sphinx2_module.h"
+
+/*
+ * Responses are keyed on the md5 of the serialized searchd request (the
+ * bytes following the handshake), so any two HTTP requests which would
+ * send the same bytes to searchd share an entry. Only the response body
+ * of an OK searchd response is kept. Entries live in an rbtree on the
+ * crc32 of the key and in an LRU queue; when the zone runs out of memory
+ * the least recently used entries go first.
+ *
+ * With coalescing on, a miss leaves a "busy" entry without a response
+ * behind, which tells requests in other workers that the response is on
+ * its way. It is replaced by the response, or dropped by its owner when
+ * no cacheable response comes, and in any case expires with the
+ * coalescing timeout.
+ */
+
+/* TYPES */
+
+typedef struct {
+    ngx_rbtree_node_t              node;
+    ngx_queue_t                    queue;
+    u_char                         key[16];
+    time_t                         expire;
+    u_char                         busy;   /* in flight, no data yet */
+    size_t                         len;
+    u_char                         data[1];
+} ngx_http_sphinx2_cache_node_t;
+
+typedef struct {
+    ngx_rbtree_t                   rbtree;
+    ngx_rbtree_node_t              sentinel;
+    ngx_queue_t                    queue; /* LRU, most recent at head */
+} ngx_http_sphinx2_cache_sh_t;
+
+typedef struct {
+    ngx_http_sphinx2_cache_sh_t  * sh;
+    ngx_slab_pool_t              * shpool;
+} ngx_http_sphinx2_cache_t;
+
+
+/* LOCALS */
+
+/* max entries evicted to make room for a new one */
+#define SPHX2_CACHE_MAX_EVICT   64
+
+
+/* FUNCTION DEFINITIONS */
+
+static void
+ngx_http_sphinx2_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t              ** p;
+    ngx_http_sphinx2_cache_node_t   * cn, * cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+            cn = (ngx_http_sphinx2_cache_node_t *) node;
+            cnt = (ngx_http_sphinx2_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key, sizeof(cn->key)) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_sphinx2_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_sphinx2_cache_t  * ocache = data;
+    ngx_http_sphinx2_cache_t  * cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    if(NULL == (cache->sh = ngx_slab_alloc(cache->shpool,
+                                sizeof(ngx_http_sphinx2_cache_sh_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_sphinx2_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    return NGX_OK;
+}
+
+
+/* sphinx2_cache_zone <name> <size> */
+char *
+ngx_http_sphinx2_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t                 * value;
+    ssize_t                     size;
+    ngx_shm_zone_t            * shm_zone;
+    ngx_http_sphinx2_cache_t  * cache;
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+
+    if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid sphinx2 cache zone size \"%V\"",
+                           &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if(NULL == (cache = ngx_pcalloc(cf->pool,
+                            sizeof(ngx_http_sphinx2_cache_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &value[1], size,
+                                     &ngx_http_sphinx2_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate sphinx2 cache zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_sphinx2_cache_init_zone;
+    shm_zone->data = cache;
+
+    return NGX_CONF_OK;
+}
+
+
+/* sphinx2_cache <name>|off */
+char *
+ngx_http_sphinx2_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_loc_conf_t  * slcf = conf;
+    ngx_str_t                    * value;
+
+    if (slcf->cache_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        slcf->cache_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    slcf->cache_zone = ngx_shared_memory_add(cf, &value[1], 0,
+                                             &ngx_http_sphinx2_module);
+    if (slcf->cache_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (slcf->cache_zone->data == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown sphinx2 cache zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/* key of the request - md5 of the names of the upstreams it goes to and
+ * of the bytes following the handshake. Locations may share a zone while
+ * passing to different upstreams, or to different sets of shards, whose
+ * answers to the same request differ
+ */
+void
+ngx_http_sphinx2_cache_key(ngx_http_sphinx2_loc_conf_t *slcf,
+    ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_md5_t                        md5;
+    ngx_chain_t                    * cl;
+    ngx_http_upstream_srv_conf_t  ** uscfp;
+    ngx_uint_t                       i, n;
+
+    ngx_md5_init(&md5);
+
+    if(NULL != slcf->shards) {
+        uscfp = slcf->shards->elts;
+        n = slcf->shards->nelts;
+    } else {
+        uscfp = &slcf->upstream.upstream;
+        n = 1;
+    }
+
+    /* each name ends in a NUL, which a name can't have */
+    for(i = 0; i < n; ++i) {
+        ngx_md5_update(&md5, uscfp[i]->host.data, uscfp[i]->host.len);
+        ngx_md5_update(&md5, "", 1);
+    }
+
+    for(cl = ctx->request_cl; cl; cl = cl->next) {
+        ngx_md5_update(&md5, cl->buf->pos, cl->buf->last - cl->buf->pos);
+    }
+
+    ngx_md5_final(ctx->key, &md5);
+}
+
+
+static ngx_http_sphinx2_cache_node_t *
+ngx_http_sphinx2_cache_find(ngx_http_sphinx2_cache_t *cache, uint32_t hash,
+    u_char *key)
+{
+    ngx_rbtree_node_t              * node, * sentinel;
+    ngx_http_sphinx2_cache_node_t  * cn;
+    ngx_int_t                        rc;
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        cn = (ngx_http_sphinx2_cache_node_t *) node;
+
+        rc = ngx_memcmp(key, cn->key, sizeof(cn->key));
+
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_sphinx2_cache_delete(ngx_http_sphinx2_cache_t *cache,
+    ngx_http_sphinx2_cache_node_t *cn)
+{
+    ngx_queue_remove(&cn->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+    ngx_slab_free_locked(cache->shpool, cn);
+}
+
+
+/* allocate a node, evicting the least recently used ones if need be;
+ * called with the mutex held
+ */
+static ngx_http_sphinx2_cache_node_t *
+ngx_http_sphinx2_cache_alloc(ngx_http_sphinx2_cache_t *cache, size_t size)
+{
+    ngx_http_sphinx2_cache_node_t  * cn;
+    ngx_queue_t                    * q;
+    ngx_uint_t                       n;
+
+    for(n = 0; NULL == (cn = ngx_slab_alloc_locked(cache->shpool, size));
+        ++n)
+    {
+        if(n == SPHX2_CACHE_MAX_EVICT || ngx_queue_empty(&cache->sh->queue)) {
+            return NULL;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+        ngx_http_sphinx2_cache_delete(cache,
+            ngx_queue_data(q, ngx_http_sphinx2_cache_node_t, queue));
+    }
+
+    return cn;
+}
+
+
+/* NGX_OK with the cached response body in 'b' on a hit, NGX_DECLINED on
+ * a miss and NGX_BUSY if another request is fetching the response. With
+ * 'claim' a miss marks the key busy for this request.
+ */
+ngx_int_t
+ngx_http_sphinx2_cache_lookup(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, ngx_buf_t **b, ngx_uint_t claim)
+{
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+    ngx_http_sphinx2_cache_t       * cache;
+    ngx_http_sphinx2_cache_node_t  * cn;
+    ngx_int_t                        rc;
+    uint32_t                         hash;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    cache = slcf->cache_zone->data;
+
+    rc = NGX_DECLINED;
+
+    hash = ngx_crc32_short(ctx->key, sizeof(ctx->key));
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_sphinx2_cache_find(cache, hash, ctx->key);
+
+    if (cn != NULL && cn->expire <= ngx_time()) {
+        ngx_http_sphinx2_cache_delete(cache, cn);
+        cn = NULL;
+    }
+
+    if (cn == NULL) {
+        if (claim && NULL != (cn = ngx_http_sphinx2_cache_alloc(cache,
+                                 offsetof(ngx_http_sphinx2_cache_node_t,
+                                          data))))
+        {
+            cn->node.key = hash;
+            ngx_memcpy(cn->key, ctx->key, sizeof(cn->key));
+            cn->expire = ngx_time() + slcf->coalesce_timeout / 1000 + 1;
+            cn->busy = 1;
+            cn->len = 0;
+
+            ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+            ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+            ctx->claimed = 1;
+        }
+        goto done;
+    }
+
+    if (cn->busy) {
+        rc = NGX_BUSY;
+        goto done;
+    }
+
+    if(NULL == (*b = ngx_create_temp_buf(r->pool, cn->len ? cn->len : 1))) {
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    (*b)->last = ngx_cpymem((*b)->pos, cn->data, cn->len);
+
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    rc = NGX_OK;
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "sphinx2 cache %s", (rc == NGX_OK) ? "hit"
+                                       : (rc == NGX_BUSY) ? "busy" : "miss");
+
+    return rc;
+}
+
+
+/* keep the response body collected in ctx->body */
+ngx_int_t
+ngx_http_sphinx2_cache_store(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+    ngx_http_sphinx2_cache_t       * cache;
+    ngx_http_sphinx2_cache_node_t  * cn;
+    size_t                           len, size;
+    uint32_t                         hash;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    cache = slcf->cache_zone->data;
+
+    len = ctx->body->last - ctx->body->pos;
+    size = offsetof(ngx_http_sphinx2_cache_node_t, data) + len;
+
+    hash = ngx_crc32_short(ctx->key, sizeof(ctx->key));
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    ctx->claimed = 0;
+
+    /* our busy entry, or another worker may have stored it meanwhile -
+     * take the latest
+     */
+    if(NULL != (cn = ngx_http_sphinx2_cache_find(cache, hash, ctx->key))) {
+        ngx_http_sphinx2_cache_delete(cache, cn);
+    }
+
+    if(NULL == (cn = ngx_http_sphinx2_cache_alloc(cache, size))) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+            "sphinx2 cache: no room for a %uz byte response", len);
+        return NGX_DECLINED;
+    }
+
+    cn->node.key = hash;
+    ngx_memcpy(cn->key, ctx->key, sizeof(cn->key));
+    cn->expire = ngx_time() + slcf->cache_valid;
+    cn->busy = 0;
+    cn->len = len;
+    ngx_memcpy(cn->data, ctx->body->pos, len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+/* drop the busy entry of a request which got no cacheable response, so
+ * that requests waiting in other workers stop waiting
+ */
+void
+ngx_http_sphinx2_cache_abandon(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+    ngx_http_sphinx2_cache_t       * cache;
+    ngx_http_sphinx2_cache_node_t  * cn;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    cache = slcf->cache_zone->data;
+
+    ctx->claimed = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_sphinx2_cache_find(cache,
+             ngx_crc32_short(ctx->key, sizeof(ctx->key)), ctx->key);
+
+    if (cn != NULL && cn->busy) {
+        ngx_http_sphinx2_cache_delete(cache, cn);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
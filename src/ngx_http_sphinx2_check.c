@@ -0,0 +1,625 @@
+/*
+ * Sphinx2 active health checks - searchd peers probed with STATUS from a
+ * timer in every worker
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_sphinx2_args_parser.h"
+#include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_result.h"
+#include "ngx_http_sphinx2_module.h"
+
+/*
+ * Every worker probes every peer of the upstreams with sphinx2_check on
+ * connections of its own, and marks the peers in its own copy of the peer
+ * list, which is the one its balancer picks from. Nothing is shared
+ * between the workers: a probe is one small request per interval, and the
+ * marks are where the balancer reads them, with no locking.
+ *
+ * A peer that doesn't answer STATUS, or answers with anything but OK,
+ * 'fails' times in a row is marked down, and is back after 'passes' good
+ * answers. A peer that answers but is overloaded - it turned connections
+ * away since the last probe (maxed_out went up), its queries took longer
+ * than max_time on average since then, or its work queue is longer than
+ * max_queue - is degraded: it is left out for as long as another peer of
+ * its list is fine.
+ *
+ * Only the peer lists of round robin are known here; nginx's own
+ * balancers (ip_hash, least_conn, keepalive) all keep theirs that way.
+ */
+
+/* TYPES */
+
+typedef struct ngx_http_sphinx2_check_peer_s  ngx_http_sphinx2_check_peer_t;
+
+/* the primary or the backup servers of an upstream */
+typedef struct {
+    ngx_http_sphinx2_check_conf_t  * conf;
+    ngx_http_upstream_rr_peers_t   * peers;
+    ngx_http_sphinx2_check_peer_t  * checks;    /* one per peer */
+} ngx_http_sphinx2_check_list_t;
+
+struct ngx_http_sphinx2_check_peer_s {
+    ngx_http_sphinx2_check_list_t  * list;
+    ngx_http_upstream_rr_peer_t    * peer;
+    ngx_event_t                      timer;     /* the next probe */
+    ngx_peer_connection_t            pc;
+    ngx_pool_t                     * pool;      /* of the current probe */
+    ngx_buf_t                      * out;
+    ngx_buf_t                      * in;
+    ngx_msec_t                       deadline;
+    ngx_uint_t                       state;     /* SPHX2_CHECK_* */
+    ngx_uint_t                       fails;
+    ngx_uint_t                       passes;
+    const char                     * reason;    /* of the last probe */
+    /* searchd's counters at the last probe */
+    uint64_t                         uptime;
+    uint64_t                         queries;
+    uint64_t                         maxed_out;
+    double                           query_wall;
+    unsigned                         down:1;    /* configured so */
+    unsigned                         seen:1;    /* the counters are set */
+};
+
+
+/* LOCALS */
+
+#define SPHX2_CHECK_UP              0
+#define SPHX2_CHECK_DEGRADED        1
+#define SPHX2_CHECK_DOWN            2
+
+/* a STATUS response is a couple dozen short rows */
+#define SPHX2_CHECK_BUFFER_SIZE     16384
+
+static const char * s_state_names[] = {
+    "up",       /* SPHX2_CHECK_UP */
+    "degraded", /* SPHX2_CHECK_DEGRADED */
+    "down"      /* SPHX2_CHECK_DOWN */
+};
+
+static void ngx_http_sphinx2_check_begin(ngx_event_t *ev);
+
+
+/* FUNCTION DEFINITIONS */
+
+/* sphinx2_check [interval=time] [timeout=time] [fails=N] [passes=N]
+ *               [max_time=time] [max_queue=N]
+ */
+char*
+ngx_http_sphinx2_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_main_conf_t  *smcf = conf;
+    ngx_http_sphinx2_check_conf_t *chcf;
+    ngx_http_upstream_srv_conf_t  *uscf;
+    ngx_str_t                     *value, s;
+    ngx_int_t                      n;
+    ngx_uint_t                     i;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    chcf = smcf->checks.elts;
+    for(i = 0; i < smcf->checks.nelts; ++i) {
+        if(chcf[i].uscf == uscf) {
+            return "is duplicate";
+        }
+    }
+
+    if(NULL == (chcf = ngx_array_push(&smcf->checks))) {
+        return NGX_CONF_ERROR;
+    }
+
+    chcf->uscf = uscf;
+    chcf->interval = 5000;
+    chcf->timeout = 1000;
+    chcf->fails = 2;
+    chcf->passes = 1;
+    chcf->max_time = 0;
+    chcf->max_queue = 0;
+
+    value = cf->args->elts;
+
+    for(i = 1; i < cf->args->nelts; ++i) {
+
+        if(ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            n = ngx_parse_time(&s, 0);
+            if(n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            chcf->interval = (ngx_msec_t) n;
+            continue;
+        }
+
+        if(ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            n = ngx_parse_time(&s, 0);
+            if(n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            chcf->timeout = (ngx_msec_t) n;
+            continue;
+        }
+
+        if(ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if(n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            chcf->fails = (ngx_uint_t) n;
+            continue;
+        }
+
+        if(ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+            if(n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            chcf->passes = (ngx_uint_t) n;
+            continue;
+        }
+
+        if(ngx_strncmp(value[i].data, "max_time=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            n = ngx_parse_time(&s, 0);
+            if(n == NGX_ERROR) {
+                goto invalid;
+            }
+
+            chcf->max_time = (ngx_msec_t) n;
+            continue;
+        }
+
+        if(ngx_strncmp(value[i].data, "max_queue=", 10) == 0) {
+            n = ngx_atoi(&value[i].data[10], value[i].len - 10);
+            if(n == NGX_ERROR) {
+                goto invalid;
+            }
+
+            chcf->max_queue = (ngx_uint_t) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if(chcf->timeout >= chcf->interval) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" timeout must be shorter than its interval",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+/* the checks of a peer list, each with its first probe at a random point
+ * of the interval, so that the probes of the peers and of the workers
+ * don't all go at once
+ */
+static ngx_int_t
+ngx_http_sphinx2_check_init_list(ngx_cycle_t *cycle,
+    ngx_http_sphinx2_check_conf_t *chcf, ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_http_sphinx2_check_list_t * list;
+    ngx_http_sphinx2_check_peer_t * chk;
+    ngx_uint_t                      i;
+
+    if(NULL == (list = ngx_palloc(cycle->pool,
+                                  sizeof(ngx_http_sphinx2_check_list_t)))
+       || NULL == (list->checks = ngx_pcalloc(cycle->pool,
+                       peers->number * sizeof(ngx_http_sphinx2_check_peer_t))))
+    {
+        return(NGX_ERROR);
+    }
+
+    list->conf = chcf;
+    list->peers = peers;
+
+    for(i = 0; i < peers->number; ++i) {
+        chk = &list->checks[i];
+
+        chk->list = list;
+        chk->peer = &peers->peer[i];
+        chk->state = SPHX2_CHECK_UP;
+        chk->down = peers->peer[i].down;
+
+        chk->timer.handler = ngx_http_sphinx2_check_begin;
+        chk->timer.data = chk;
+        chk->timer.log = cycle->log;
+
+        ngx_add_timer(&chk->timer, ngx_random() % chcf->interval);
+    }
+
+    return(NGX_OK);
+}
+
+ngx_int_t
+ngx_http_sphinx2_check_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_sphinx2_main_conf_t  * smcf;
+    ngx_http_sphinx2_check_conf_t * chcf;
+    ngx_http_upstream_rr_peers_t  * peers;
+    ngx_uint_t                      i;
+
+    /* not in the cache manager and loader */
+    if(ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return(NGX_OK);
+    }
+
+    if(NULL == (smcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                                    ngx_http_sphinx2_module)))
+    {
+        return(NGX_OK);
+    }
+
+    chcf = smcf->checks.elts;
+    for(i = 0; i < smcf->checks.nelts; ++i) {
+
+        for(peers = chcf[i].uscf->peer.data; peers; peers = peers->next) {
+            if(NGX_OK != ngx_http_sphinx2_check_init_list(cycle, &chcf[i],
+                                                          peers))
+            {
+                return(NGX_ERROR);
+            }
+        }
+    }
+
+    return(NGX_OK);
+}
+
+/* what the balancer of a list may pick: degraded peers only when there is
+ * nothing better
+ */
+static void
+ngx_http_sphinx2_check_mark(ngx_http_sphinx2_check_list_t *list)
+{
+    ngx_http_sphinx2_check_peer_t * chk;
+    ngx_uint_t                      i, fine;
+
+    for(fine = 0, i = 0; i < list->peers->number; ++i) {
+        chk = &list->checks[i];
+
+        if(!chk->down && SPHX2_CHECK_UP == chk->state) {
+            fine = 1;
+            break;
+        }
+    }
+
+    for(i = 0; i < list->peers->number; ++i) {
+        chk = &list->checks[i];
+
+        chk->peer->down = chk->down
+                          || SPHX2_CHECK_DOWN == chk->state
+                          || (fine && SPHX2_CHECK_DEGRADED == chk->state);
+    }
+}
+
+/* the value of a STATUS counter; NGX_DECLINED if searchd has no such one */
+static ngx_int_t
+ngx_http_sphinx2_check_counter(ngx_array_t *rows, const char *name,
+    uint64_t *n, double *d)
+{
+    sphx2_status_row_t * row;
+    size_t               len;
+    ngx_uint_t           i;
+
+    len = ngx_strlen(name);
+
+    row = rows->elts;
+    for(i = 0; i < rows->nelts; ++i) {
+        if(row[i].name.len != len
+           || 0 != ngx_strncmp(row[i].name.data, name, len))
+        {
+            continue;
+        }
+
+        /* counters that searchd doesn't keep are OFF */
+        return (NULL != n) ? sphx2_arg_parse_int64(&row[i].value, n)
+                           : sphx2_arg_parse_double(&row[i].value, d);
+    }
+
+    return(NGX_DECLINED);
+}
+
+/* NGX_OK if the peer is fine, NGX_DECLINED if it's overloaded */
+static ngx_int_t
+ngx_http_sphinx2_check_load(ngx_http_sphinx2_check_peer_t *chk,
+    ngx_array_t *rows)
+{
+    ngx_http_sphinx2_check_conf_t * chcf = chk->list->conf;
+    uint64_t                        uptime, queries, maxed_out, queue;
+    double                          query_wall;
+    ngx_int_t                       rc;
+
+    rc = NGX_OK;
+
+    if(0 != chcf->max_queue
+       && NGX_OK == ngx_http_sphinx2_check_counter(rows, "work_queue_length",
+                                                   &queue, NULL)
+       && queue > chcf->max_queue)
+    {
+        chk->reason = "work queue too long";
+        rc = NGX_DECLINED;
+    }
+
+    if(NGX_OK != ngx_http_sphinx2_check_counter(rows, "uptime", &uptime, NULL)
+       || NGX_OK != ngx_http_sphinx2_check_counter(rows, "queries",
+                                                   &queries, NULL)
+       || NGX_OK != ngx_http_sphinx2_check_counter(rows, "maxed_out",
+                                                   &maxed_out, NULL)
+       || NGX_OK != ngx_http_sphinx2_check_counter(rows, "query_wall",
+                                                   NULL, &query_wall))
+    {
+        chk->seen = 0;
+        return(rc);
+    }
+
+    /* what happened since the last probe, unless searchd restarted */
+    if(chk->seen && uptime >= chk->uptime) {
+
+        if(maxed_out > chk->maxed_out) {
+            chk->reason = "connections turned away";
+            rc = NGX_DECLINED;
+        }
+
+        if(0 != chcf->max_time && queries > chk->queries
+           && (query_wall - chk->query_wall) * 1000
+                  > (double) chcf->max_time * (queries - chk->queries))
+        {
+            chk->reason = "queries too slow";
+            rc = NGX_DECLINED;
+        }
+    }
+
+    chk->uptime = uptime;
+    chk->queries = queries;
+    chk->maxed_out = maxed_out;
+    chk->query_wall = query_wall;
+    chk->seen = 1;
+
+    return(rc);
+}
+
+/* the end of a probe - rc is NGX_OK, NGX_DECLINED for overloaded, or
+ * NGX_ERROR for no good answer
+ */
+static void
+ngx_http_sphinx2_check_done(ngx_http_sphinx2_check_peer_t *chk, ngx_int_t rc)
+{
+    ngx_uint_t state;
+
+    if(NULL != chk->pc.connection) {
+        ngx_close_connection(chk->pc.connection);
+        chk->pc.connection = NULL;
+    }
+
+    if(NULL != chk->pool) {
+        ngx_destroy_pool(chk->pool);
+        chk->pool = NULL;
+    }
+
+    state = chk->state;
+
+    if(NGX_ERROR == rc) {
+        chk->passes = 0;
+
+        if(++chk->fails >= chk->list->conf->fails) {
+            state = SPHX2_CHECK_DOWN;
+        }
+
+    } else {
+        chk->fails = 0;
+
+        if(SPHX2_CHECK_DOWN != state
+           || ++chk->passes >= chk->list->conf->passes)
+        {
+            chk->passes = 0;
+            state = (NGX_OK == rc) ? SPHX2_CHECK_UP : SPHX2_CHECK_DEGRADED;
+        }
+    }
+
+    if(state != chk->state) {
+        ngx_log_error((SPHX2_CHECK_UP == state) ? NGX_LOG_NOTICE
+                                                : NGX_LOG_WARN,
+                      chk->timer.log, 0,
+                      "sphinx2 peer %V of upstream \"%V\" is %s%s%s",
+                      &chk->peer->name, &chk->list->conf->uscf->host,
+                      s_state_names[state],
+                      (SPHX2_CHECK_UP == state) ? "" : ": ",
+                      (SPHX2_CHECK_UP == state) ? "" : chk->reason);
+
+        chk->state = state;
+
+        ngx_http_sphinx2_check_mark(chk->list);
+    }
+
+    if(!ngx_exiting) {
+        ngx_add_timer(&chk->timer, chk->list->conf->interval);
+    }
+}
+
+static void
+ngx_http_sphinx2_check_dummy_handler(ngx_event_t *ev)
+{
+}
+
+static void
+ngx_http_sphinx2_check_recv(ngx_event_t *rev)
+{
+    ngx_connection_t              * c = rev->data;
+    ngx_http_sphinx2_check_peer_t * chk = c->data;
+    ngx_buf_t                     * b = chk->in;
+    ngx_array_t                   * rows;
+    ssize_t                         n;
+    ngx_int_t                       rc;
+
+    if(rev->timedout) {
+        chk->reason = "timed out";
+        ngx_http_sphinx2_check_done(chk, NGX_ERROR);
+        return;
+    }
+
+    for( ;; ) {
+        if(b->last == b->end) {
+            chk->reason = "response too long";
+            ngx_http_sphinx2_check_done(chk, NGX_ERROR);
+            return;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if(NGX_AGAIN == n) {
+            if(NGX_OK != ngx_handle_read_event(rev, 0)) {
+                chk->reason = "read failed";
+                ngx_http_sphinx2_check_done(chk, NGX_ERROR);
+            }
+            return;
+        }
+
+        if(NGX_ERROR == n || 0 == n) {
+            chk->reason = (0 == n) ? "connection closed" : "read failed";
+            ngx_http_sphinx2_check_done(chk, NGX_ERROR);
+            return;
+        }
+
+        b->last += n;
+
+        rc = sphx2_parse_status_response(chk->pool, b, &rows);
+
+        if(NGX_AGAIN == rc) {
+            continue;
+        }
+
+        if(NGX_OK != rc) {
+            chk->reason = (NGX_DECLINED == rc) ? "STATUS failed"
+                                               : "invalid response";
+            ngx_http_sphinx2_check_done(chk, NGX_ERROR);
+            return;
+        }
+
+        ngx_http_sphinx2_check_done(chk, ngx_http_sphinx2_check_load(chk,
+                                                                     rows));
+        return;
+    }
+}
+
+static void
+ngx_http_sphinx2_check_send(ngx_event_t *wev)
+{
+    ngx_connection_t              * c = wev->data;
+    ngx_http_sphinx2_check_peer_t * chk = c->data;
+    ngx_buf_t                     * b = chk->out;
+    ssize_t                         n;
+
+    if(wev->timedout) {
+        chk->reason = "timed out";
+        ngx_http_sphinx2_check_done(chk, NGX_ERROR);
+        return;
+    }
+
+    while(b->pos < b->last) {
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if(NGX_ERROR == n) {
+            chk->reason = "connect or send failed";
+            ngx_http_sphinx2_check_done(chk, NGX_ERROR);
+            return;
+        }
+
+        if(NGX_AGAIN == n) {
+            if(NGX_OK != ngx_handle_write_event(wev, 0)) {
+                chk->reason = "send failed";
+                ngx_http_sphinx2_check_done(chk, NGX_ERROR);
+            }
+            return;
+        }
+
+        b->pos += n;
+    }
+
+    wev->handler = ngx_http_sphinx2_check_dummy_handler;
+
+    if(wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    ngx_add_timer(c->read, (chk->deadline > ngx_current_msec)
+                           ? chk->deadline - ngx_current_msec : 1);
+
+    ngx_http_sphinx2_check_recv(c->read);
+}
+
+/* a probe: connect, send the handshake with STATUS, read the counters */
+static void
+ngx_http_sphinx2_check_begin(ngx_event_t *ev)
+{
+    ngx_http_sphinx2_check_peer_t * chk = ev->data;
+    ngx_connection_t              * c;
+    ngx_int_t                       rc;
+
+    if(ngx_exiting) {
+        return;
+    }
+
+    chk->reason = "connect failed";
+
+    if(NULL == (chk->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ev->log))
+       || NGX_OK != sphx2_create_status_request(chk->pool, &chk->out)
+       || NULL == (chk->in = ngx_create_temp_buf(chk->pool,
+                                                 SPHX2_CHECK_BUFFER_SIZE)))
+    {
+        chk->reason = "no memory";
+        ngx_http_sphinx2_check_done(chk, NGX_ERROR);
+        return;
+    }
+
+    ngx_memzero(&chk->pc, sizeof(ngx_peer_connection_t));
+
+    chk->pc.sockaddr = chk->peer->sockaddr;
+    chk->pc.socklen = chk->peer->socklen;
+    chk->pc.name = &chk->peer->name;
+    chk->pc.get = ngx_event_get_peer;
+    chk->pc.log = ev->log;
+    chk->pc.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&chk->pc);
+
+    if(NGX_ERROR == rc || NGX_BUSY == rc || NGX_DECLINED == rc) {
+        ngx_http_sphinx2_check_done(chk, NGX_ERROR);
+        return;
+    }
+
+    c = chk->pc.connection;
+
+    c->data = chk;
+    c->read->handler = ngx_http_sphinx2_check_recv;
+    c->write->handler = ngx_http_sphinx2_check_send;
+
+    chk->deadline = ngx_current_msec + chk->list->conf->timeout;
+
+    ngx_add_timer(c->write, chk->list->conf->timeout);
+
+    if(NGX_OK == rc) {
+        ngx_http_sphinx2_check_send(c->write);
+    }
+}
@@ -0,0 +1,367 @@
+/*
+ * Sphinx2 request coalescing - identical concurrent requests share one
+ * searchd round trip
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_result.h"
+#include "ngx_http_sphinx2_module.h"
+
+/*
+ * The first request for a key in a worker becomes the leader of a
+ * "flight" and goes upstream; later requests with the same key park on
+ * the flight's queue. When the leader has the complete response each
+ * waiter gets its own copy and is woken through a posted event, so that
+ * it is finalized from its own event context. If the leader ends without
+ * a response the waiters are woken without one and go to searchd on
+ * their own.
+ *
+ * Flights are per worker. Across workers the cache zone carries an
+ * in-flight marker for the key (see ngx_http_sphinx2_cache_lookup); a
+ * leader which finds another worker's marker polls the cache until the
+ * response shows up there. Without a cache zone there is no marker, and
+ * each worker sends its own request for a key. A response too large for
+ * the cache is still shared with the waiters of the worker; those of
+ * other workers find the marker gone once the leader is done, and go on
+ * their own.
+ */
+
+/* TYPES */
+
+struct ngx_http_sphinx2_flight_s {
+    ngx_rbtree_node_t              node;
+    u_char                       * key;        /* the leader's ctx->key */
+    ngx_http_sphinx2_ctx_t       * leader;
+    ngx_queue_t                    waiters;
+};
+
+
+/* LOCALS */
+
+/* interval at which a leader polls the cache for another worker's
+ * response
+ */
+#define SPHX2_COALESCE_POLL_MSEC    10
+
+static ngx_rbtree_t         s_flights;
+static ngx_rbtree_node_t    s_flights_sentinel;
+
+static void ngx_http_sphinx2_coalesce_wake(ngx_event_t *ev);
+static void ngx_http_sphinx2_coalesce_poll_handler(ngx_event_t *ev);
+
+
+/* FUNCTION DEFINITIONS */
+
+static void
+ngx_http_sphinx2_flight_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t              ** p;
+    ngx_http_sphinx2_flight_t       * f, * ft;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+            f = (ngx_http_sphinx2_flight_t *) node;
+            ft = (ngx_http_sphinx2_flight_t *) temp;
+
+            p = (ngx_memcmp(f->key, ft->key, 16) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_http_sphinx2_flight_t *
+ngx_http_sphinx2_flight_find(uint32_t hash, u_char *key)
+{
+    ngx_rbtree_node_t              * node, * sentinel;
+    ngx_http_sphinx2_flight_t      * f;
+    ngx_int_t                        rc;
+
+    node = s_flights.root;
+    sentinel = s_flights.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        f = (ngx_http_sphinx2_flight_t *) node;
+
+        rc = ngx_memcmp(key, f->key, 16);
+
+        if (rc == 0) {
+            return f;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+/* the request is going away - let go of whatever it holds */
+static void
+ngx_http_sphinx2_coalesce_cleanup(void *data)
+{
+    ngx_http_sphinx2_ctx_t  * ctx = data;
+
+    if(ctx->wait_ev.timer_set) {
+        ngx_del_timer(&ctx->wait_ev);
+    }
+
+    if(ctx->wait_ev.posted) {
+        ngx_delete_posted_event(&ctx->wait_ev);
+    }
+
+    if(ctx->waiting) {
+        ngx_queue_remove(&ctx->wait);
+        ctx->waiting = 0;
+    }
+
+    if(NULL != ctx->flight) {
+        ngx_http_sphinx2_coalesce_done(ctx->request, ctx, NULL);
+    }
+
+    if(ctx->claimed) {
+        ngx_http_sphinx2_cache_abandon(ctx->request, ctx);
+    }
+}
+
+
+/* NGX_DECLINED when the request should go on (it leads, or coalescing is
+ * off for it), NGX_AGAIN when it has been parked behind a leader
+ */
+ngx_int_t
+ngx_http_sphinx2_coalesce_join(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+    ngx_http_sphinx2_flight_t      * f;
+    ngx_pool_cleanup_t             * cln;
+    uint32_t                         hash;
+
+    if(ctx->alone || NULL != ctx->flight) {
+        return NGX_DECLINED;
+    }
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    if(NULL == s_flights.root) {
+        ngx_rbtree_init(&s_flights, &s_flights_sentinel,
+                        ngx_http_sphinx2_flight_insert_value);
+    }
+
+    if(!ctx->cleanup) {
+        if(NULL == (cln = ngx_pool_cleanup_add(r->pool, 0))) {
+            return NGX_ERROR;
+        }
+        cln->handler = ngx_http_sphinx2_coalesce_cleanup;
+        cln->data = ctx;
+        ctx->cleanup = 1;
+
+        ctx->wait_ev.handler = ngx_http_sphinx2_coalesce_wake;
+        ctx->wait_ev.data = r;
+        ctx->wait_ev.log = r->connection->log;
+    }
+
+    hash = ngx_crc32_short(ctx->key, sizeof(ctx->key));
+
+    if(NULL != (f = ngx_http_sphinx2_flight_find(hash, ctx->key))) {
+        ngx_queue_insert_tail(&f->waiters, &ctx->wait);
+        ctx->waiting = 1;
+
+        ngx_add_timer(&ctx->wait_ev, slcf->coalesce_timeout);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "sphinx2 coalesce: waiting on request %p",
+                       f->leader->request);
+        return NGX_AGAIN;
+    }
+
+    if(NULL == (f = ngx_palloc(r->pool, sizeof(ngx_http_sphinx2_flight_t)))) {
+        return NGX_ERROR;
+    }
+
+    f->node.key = hash;
+    f->key = ctx->key;
+    f->leader = ctx;
+    ngx_queue_init(&f->waiters);
+
+    ngx_rbtree_insert(&s_flights, &f->node);
+
+    ctx->flight = f;
+
+    return NGX_DECLINED;
+}
+
+
+/* the leader is through - hand each waiter a copy of 'b', or nothing if
+ * 'b' is NULL
+ */
+void
+ngx_http_sphinx2_coalesce_done(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, ngx_buf_t *b)
+{
+    ngx_http_sphinx2_flight_t      * f;
+    ngx_http_sphinx2_ctx_t         * wctx;
+    ngx_queue_t                    * q;
+    size_t                           len;
+    ngx_uint_t                       n;
+
+    if(NULL == (f = ctx->flight)) {
+        return;
+    }
+
+    ngx_rbtree_delete(&s_flights, &f->node);
+    ctx->flight = NULL;
+
+    n = 0;
+
+    while(!ngx_queue_empty(&f->waiters)) {
+        q = ngx_queue_head(&f->waiters);
+        ngx_queue_remove(q);
+
+        wctx = ngx_queue_data(q, ngx_http_sphinx2_ctx_t, wait);
+        wctx->waiting = 0;
+
+        if(NULL != b) {
+            len = b->last - b->pos;
+            if(NULL != (wctx->body = ngx_create_temp_buf(
+                                         wctx->request->pool, len ? len : 1)))
+            {
+                wctx->body->last = ngx_cpymem(wctx->body->pos, b->pos, len);
+            }
+
+            /* the status is needed to decode the body */
+            wctx->repctx = ctx->repctx;
+        }
+
+        if(wctx->wait_ev.timer_set) {
+            ngx_del_timer(&wctx->wait_ev);
+        }
+
+        ngx_post_event(&wctx->wait_ev, &ngx_posted_events);
+        ++n;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "sphinx2 coalesce: %ui waiters woken, %s response",
+                   n, b ? "with" : "without");
+}
+
+
+/* a waiter's turn - serve the leader's response, or go on alone */
+static void
+ngx_http_sphinx2_coalesce_wake(ngx_event_t *ev)
+{
+    ngx_http_request_t             * r;
+    ngx_http_sphinx2_ctx_t         * ctx;
+    ngx_connection_t               * c;
+
+    r = ev->data;
+    c = r->connection;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(ev->timedout) {
+        ev->timedout = 0;
+
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "sphinx2 coalesce: timed out waiting for a response");
+
+        if(ctx->waiting) {
+            ngx_queue_remove(&ctx->wait);
+            ctx->waiting = 0;
+        }
+    }
+
+    if(NULL != ctx->body) {
+        ngx_http_finalize_request(r,
+            ngx_http_sphinx2_send_response(r, ctx->body));
+
+    } else {
+        ctx->alone = 1;
+        ngx_http_sphinx2_forward(r);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+/* another worker is fetching the response - check the cache for it a bit
+ * later, up to the coalescing timeout
+ */
+void
+ngx_http_sphinx2_coalesce_poll(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    if(0 == ctx->wait_deadline) {
+        ctx->wait_deadline = ngx_current_msec + slcf->coalesce_timeout;
+    }
+
+    ctx->wait_ev.handler = ngx_http_sphinx2_coalesce_poll_handler;
+
+    ngx_add_timer(&ctx->wait_ev, SPHX2_COALESCE_POLL_MSEC);
+}
+
+
+static void
+ngx_http_sphinx2_coalesce_poll_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t             * r;
+    ngx_http_sphinx2_ctx_t         * ctx;
+    ngx_connection_t               * c;
+
+    r = ev->data;
+    c = r->connection;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    ev->timedout = 0;
+    ev->handler = ngx_http_sphinx2_coalesce_wake;
+
+    /* stop waiting on the other worker, but keep leading this one's */
+    if((ngx_msec_int_t) (ngx_current_msec - ctx->wait_deadline) >= 0) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "sphinx2 coalesce: timed out waiting for a response "
+                      "from another worker");
+        ctx->alone = 1;
+    }
+
+    ngx_http_sphinx2_forward(r);
+
+    ngx_http_run_posted_requests(c);
+}
@@ -0,0 +1,1006 @@
+/*
+ * Sphinx2 concurrency limits - how many requests an upstream is sent at
+ * once, adapted to the latency it answers with
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_result.h"
+#include "ngx_http_sphinx2_module.h"
+
+/*
+ * searchd runs a fixed number of children. Past that it queues requests,
+ * or turns them away with RETRY, and the latency of all of them goes up
+ * together. The limit keeps requests out of searchd before that happens:
+ * a request takes a slot of the upstream before ngx_http_upstream_init,
+ * so one that doesn't get one never opens a connection.
+ *
+ * The limit and the slots in use are in shared memory, so all the workers
+ * go by the same count. Every request that gave its slot back is a sample
+ * of the time it held it. Samples are summed over a window of at least
+ * SPHX2_CONCURRENCY_WINDOW and SPHX2_CONCURRENCY_SAMPLES, and the worker
+ * which closes a window moves the limit:
+ *
+ *  - if searchd failed a request (said RETRY, or never answered) in the
+ *    window, the limit goes down by a tenth;
+ *  - otherwise it follows the gradient of the least window average seen
+ *    (with some tolerance) to this window's one, capped at 1, plus the
+ *    square root of the limit as room to grow. The limit grows only when
+ *    at least half of it is in use, lest it run away while idle.
+ *
+ * The least average drifts up towards the current one, so that an index
+ * which got slower for good doesn't keep the limit down forever.
+ *
+ * A request which finds the upstream full waits for a slot in a queue of
+ * its worker, for up to 'timeout'; it is answered 503 if it times out or
+ * if the queue is full, and 504 if its sphinx2_deadline comes first. The
+ * head of the queue is woken when a request of the worker gives back a
+ * slot, and looks every SPHX2_CONCURRENCY_POLL meanwhile for one given
+ * back by another worker. A queued request watches its client's
+ * connection as the upstream module would, and leaves the queue if the
+ * client goes away.
+ *
+ * Requests may be put in classes (sphinx2_class), each with a weight in
+ * the upstream. Each class queues on its own, and the classes share the
+ * slots by start-time fair queueing: a class has a virtual time, which
+ * every slot it is given moves on by SPHX2_CONCURRENCY_VSTEP / weight,
+ * and the next slot goes to the class with requests waiting - in any
+ * worker - whose time is the least. A class which had nothing waiting
+ * starts from the virtual time of the last slot given out, so it can't
+ * save up slots while idle. A heavy class thus gets no more than its
+ * share of the slots as they free up while a lighter one has requests
+ * waiting, however many it queues. A head which has found a slot free
+ * SPHX2_CONCURRENCY_PASSES times and been passed over each time takes
+ * it anyway, lest a count of waiters left behind by a crashed worker
+ * hold its class back for good.
+ *
+ * The second connection of a hedged request (sphinx2_hedge) takes a slot
+ * of its own, charged to the request's class, but only one free right
+ * then with nothing queued: otherwise the request isn't hedged.
+ */
+
+/* TYPES */
+
+/* a class, as all the workers see it */
+typedef struct {
+    ngx_atomic_t                     waiting;
+    ngx_atomic_t                     vtime;     /* of its next slot */
+} ngx_http_sphinx2_concurrency_share_t;
+
+struct ngx_http_sphinx2_concurrency_sh_s {
+    ngx_atomic_t                     limit;
+    ngx_atomic_t                     in_flight;
+    ngx_atomic_t                     window;    /* msec it closes */
+    ngx_atomic_t                     samples;   /* in the window */
+    ngx_atomic_t                     rtt;       /* usec, their sum */
+    ngx_atomic_t                     drops;     /* failed requests */
+    ngx_atomic_t                     min_rtt;   /* usec, least average */
+    ngx_atomic_t                     vclock;    /* of the last slot */
+    ngx_http_sphinx2_concurrency_share_t classes[SPHX2_CONCURRENCY_CLASSES];
+};
+
+
+/* LOCALS */
+
+#define SPHX2_CONCURRENCY_VSTEP     1024
+#define SPHX2_CONCURRENCY_PASSES    5
+
+/* virtual times wrap around */
+#define SPHX2_CONCURRENCY_BEFORE(a, b)                                       \
+    ((ngx_atomic_int_t) ((a) - (b)) < 0)
+
+#define SPHX2_CONCURRENCY_WINDOW    100     /* msec */
+#define SPHX2_CONCURRENCY_SAMPLES   10
+#define SPHX2_CONCURRENCY_POLL      10      /* msec */
+
+/* the average may be as much above the least one without a cut */
+#define SPHX2_CONCURRENCY_TOLERANCE 1.5
+
+/* each window moves the least average a 1/64 of the way to its own */
+#define SPHX2_CONCURRENCY_DRIFT     6
+
+static void ngx_http_sphinx2_concurrency_wake(ngx_event_t *ev);
+static void ngx_http_sphinx2_concurrency_broken(ngx_http_request_t *r);
+
+
+/* FUNCTION DEFINITIONS */
+
+/* the limit is kept across reloads, within the new bounds */
+static ngx_int_t
+ngx_http_sphinx2_concurrency_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_sphinx2_concurrency_conf_t * occf = data;
+    ngx_http_sphinx2_concurrency_conf_t * ccf;
+    ngx_http_sphinx2_concurrency_sh_t   * sh;
+    ngx_slab_pool_t                     * shpool;
+
+    ccf = shm_zone->data;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if(shm_zone->shm.exists) {
+        ccf->sh = shpool->data;
+        return NGX_OK;
+    }
+
+    if(occf) {
+        sh = occf->sh;
+
+    } else {
+        if(NULL == (sh = ngx_slab_alloc(shpool,
+                             sizeof(ngx_http_sphinx2_concurrency_sh_t))))
+        {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(sh, sizeof(ngx_http_sphinx2_concurrency_sh_t));
+
+        shpool->data = sh;
+
+        sh->limit = ngx_max(ccf->min, ccf->max / 4);
+    }
+
+    /* the old workers give back what they hold into the same count */
+    sh->limit = ngx_min(ngx_max(sh->limit, ccf->min), ccf->max);
+
+    ccf->sh = sh;
+
+    return NGX_OK;
+}
+
+
+/* sphinx2_concurrency [min=n] [max=n] [queue=n] [timeout=time]
+ *     [class=name:weight ...]
+ */
+char*
+ngx_http_sphinx2_concurrency(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_main_conf_t        *smcf = conf;
+    ngx_http_sphinx2_concurrency_conf_t  *ccf, **ccfp;
+    ngx_http_sphinx2_concurrency_class_t *cls;
+    ngx_http_upstream_srv_conf_t         *uscf;
+    ngx_str_t                            *value, s, name;
+    ngx_int_t                             n;
+    ngx_uint_t                            i, k;
+    u_char                               *colon;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    value = cf->args->elts;
+
+    ccfp = smcf->concurrencies.elts;
+    for(i = 0; i < smcf->concurrencies.nelts; ++i) {
+        if(ccfp[i]->uscf == uscf) {
+            return "is duplicate";
+        }
+    }
+
+    /* not in the array itself, which moves as it grows: the zone and the
+     * queue point to it
+     */
+    if(NULL == (ccfp = ngx_array_push(&smcf->concurrencies))
+       || NULL == (ccf = ngx_pcalloc(cf->pool,
+                             sizeof(ngx_http_sphinx2_concurrency_conf_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    *ccfp = ccf;
+
+    ccf->uscf = uscf;
+    ccf->min = 4;
+    ccf->max = 256;
+    ccf->queue = 100;
+    ccf->timeout = 1000;
+
+    /* the default class, and room for every class= */
+    if(NULL == (ccf->classes = ngx_pcalloc(cf->pool, cf->args->nelts
+                                   * sizeof(ngx_http_sphinx2_concurrency_class_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    ccf->classes[0].weight = 1;
+    ccf->nclasses = 1;
+
+    for(i = 1; i < cf->args->nelts; ++i) {
+
+        if(ngx_strncmp(value[i].data, "class=", 6) == 0) {
+            if(NULL == (colon = ngx_strlchr(&value[i].data[6],
+                                            value[i].data + value[i].len,
+                                            ':'))
+               || colon == &value[i].data[6])
+            {
+                goto invalid;
+            }
+
+            n = ngx_atoi(colon + 1, value[i].data + value[i].len - colon - 1);
+            if(n == NGX_ERROR || n == 0 || n > SPHX2_CONCURRENCY_VSTEP) {
+                goto invalid;
+            }
+
+            if(ccf->nclasses == SPHX2_CONCURRENCY_CLASSES) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "too many classes in \"%V\", "
+                                   "%d at most", &cmd->name,
+                                   SPHX2_CONCURRENCY_CLASSES - 1);
+                return NGX_CONF_ERROR;
+            }
+
+            cls = &ccf->classes[ccf->nclasses];
+
+            cls->name.data = &value[i].data[6];
+            cls->name.len = colon - cls->name.data;
+            cls->weight = (ngx_uint_t) n;
+
+            for(k = 1; k < ccf->nclasses; ++k) {
+                if(ccf->classes[k].name.len == cls->name.len
+                   && ngx_strncmp(ccf->classes[k].name.data, cls->name.data,
+                                  cls->name.len) == 0)
+                {
+                    goto invalid;
+                }
+            }
+
+            ++ccf->nclasses;
+            continue;
+        }
+
+        if(ngx_strncmp(value[i].data, "min=", 4) == 0) {
+            n = ngx_atoi(&value[i].data[4], value[i].len - 4);
+            if(n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            ccf->min = (ngx_uint_t) n;
+            continue;
+        }
+
+        if(ngx_strncmp(value[i].data, "max=", 4) == 0) {
+            n = ngx_atoi(&value[i].data[4], value[i].len - 4);
+            if(n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            ccf->max = (ngx_uint_t) n;
+            continue;
+        }
+
+        if(ngx_strncmp(value[i].data, "queue=", 6) == 0) {
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if(n == NGX_ERROR) {
+                goto invalid;
+            }
+
+            ccf->queue = (ngx_uint_t) n;
+            continue;
+        }
+
+        if(ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            n = ngx_parse_time(&s, 0);
+            if(n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            ccf->timeout = (ngx_msec_t) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    for(k = 0; k < ccf->nclasses; ++k) {
+        ngx_queue_init(&ccf->classes[k].waiters);
+    }
+
+    if(ccf->min > ccf->max) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"min\" is above \"max\" in \"%V\"", &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = sizeof("sphinx2_concurrency:") - 1 + uscf->host.len;
+
+    if(NULL == (name.data = ngx_pnalloc(cf->pool, name.len))) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_sprintf(name.data, "sphinx2_concurrency:%V", &uscf->host);
+
+    if(NULL == (ccf->shm_zone = ngx_shared_memory_add(cf, &name,
+                                    8 * ngx_pagesize,
+                                    &ngx_http_sphinx2_module)))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if(ccf->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    ccf->shm_zone->init = ngx_http_sphinx2_concurrency_init_zone;
+    ccf->shm_zone->data = ccf;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_http_sphinx2_concurrency_conf_t *
+ngx_http_sphinx2_concurrency_conf(ngx_http_request_t *r)
+{
+    ngx_http_sphinx2_main_conf_t        * smcf;
+    ngx_http_sphinx2_concurrency_conf_t ** ccfp;
+    ngx_http_upstream_srv_conf_t        * us;
+    ngx_uint_t                            i;
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_sphinx2_module);
+    us = r->upstream->conf->upstream;
+
+    ccfp = smcf->concurrencies.elts;
+    for(i = 0; i < smcf->concurrencies.nelts; ++i) {
+        if(ccfp[i]->uscf == us) {
+            return ccfp[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/* a slot of the upstream, if there is one free */
+static ngx_uint_t
+ngx_http_sphinx2_concurrency_take(ngx_http_sphinx2_concurrency_conf_t *ccf)
+{
+    ngx_http_sphinx2_concurrency_sh_t   * sh = ccf->sh;
+    ngx_atomic_uint_t                     n;
+
+    for( ;; ) {
+        n = sh->in_flight;
+
+        if(n >= sh->limit) {
+            return 0;
+        }
+
+        if(ngx_atomic_cmp_set(&sh->in_flight, n, n + 1)) {
+            return 1;
+        }
+    }
+}
+
+
+/* a sample of the time a slot was held; moves the limit when it closes a
+ * window
+ */
+static void
+ngx_http_sphinx2_concurrency_sample(ngx_http_sphinx2_concurrency_conf_t *ccf,
+    ngx_uint_t rtt, ngx_uint_t drop, ngx_log_t *log)
+{
+    ngx_http_sphinx2_concurrency_sh_t   * sh = ccf->sh;
+    ngx_atomic_uint_t                     end, samples, sum, drops;
+    ngx_uint_t                            limit, least, average, room;
+    double                                gradient, next;
+
+    (void) ngx_atomic_fetch_add(&sh->rtt, rtt);
+    (void) ngx_atomic_fetch_add(&sh->drops, drop);
+    (void) ngx_atomic_fetch_add(&sh->samples, 1);
+
+    end = sh->window;
+
+    if(sh->samples < SPHX2_CONCURRENCY_SAMPLES
+       || (ngx_msec_int_t) (ngx_current_msec - end) < 0
+       || !ngx_atomic_cmp_set(&sh->window, end,
+                              ngx_current_msec + SPHX2_CONCURRENCY_WINDOW))
+    {
+        return;
+    }
+
+    /* samples added meanwhile are left to the next window */
+    samples = sh->samples;
+    sum = sh->rtt;
+    drops = sh->drops;
+
+    (void) ngx_atomic_fetch_add(&sh->samples, -(ngx_atomic_int_t) samples);
+    (void) ngx_atomic_fetch_add(&sh->rtt, -(ngx_atomic_int_t) sum);
+    (void) ngx_atomic_fetch_add(&sh->drops, -(ngx_atomic_int_t) drops);
+
+    average = sum / samples + 1;
+
+    least = sh->min_rtt;
+
+    if(0 == least || average < least) {
+        least = average;
+
+    } else {
+        least += (average - least) >> SPHX2_CONCURRENCY_DRIFT;
+    }
+
+    sh->min_rtt = least;
+
+    limit = sh->limit;
+
+    if(drops) {
+        next = limit * 0.9;
+
+    } else {
+        gradient = SPHX2_CONCURRENCY_TOLERANCE * least / average;
+
+        if(gradient > 1.0) {
+            gradient = 1.0;
+
+        } else if(gradient < 0.5) {
+            gradient = 0.5;
+        }
+
+        for(room = 1; (room + 1) * (room + 1) <= limit; ++room) {
+            /* void */
+        }
+
+        if(gradient == 1.0 && sh->in_flight < limit / 2) {
+            room = 0;
+        }
+
+        next = limit * gradient + room;
+    }
+
+    limit = (ngx_uint_t) next;
+    limit = ngx_min(ngx_max(limit, ccf->min), ccf->max);
+
+    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "sphinx2 concurrency: %uA samples, %uA failed, "
+                   "%uius average, %uius least, limit %ui",
+                   samples, drops, average, least, limit);
+
+    sh->limit = limit;
+}
+
+
+/* the virtual time the next slot of class 'k' would start at */
+static ngx_atomic_uint_t
+ngx_http_sphinx2_concurrency_start(ngx_http_sphinx2_concurrency_sh_t *sh,
+    ngx_uint_t k)
+{
+    ngx_atomic_uint_t                     vtime, vclock;
+
+    vtime = sh->classes[k].vtime;
+    vclock = sh->vclock;
+
+    return SPHX2_CONCURRENCY_BEFORE(vtime, vclock) ? vclock : vtime;
+}
+
+
+/* whether class 'k' is due the next slot: no class with requests waiting
+ * would start before it
+ */
+static ngx_uint_t
+ngx_http_sphinx2_concurrency_due(ngx_http_sphinx2_concurrency_conf_t *ccf,
+    ngx_uint_t k)
+{
+    ngx_http_sphinx2_concurrency_sh_t   * sh = ccf->sh;
+    ngx_atomic_uint_t                     start;
+    ngx_uint_t                            i;
+
+    start = ngx_http_sphinx2_concurrency_start(sh, k);
+
+    for(i = 0; i < ccf->nclasses; ++i) {
+        if(i != k
+           && 0 != sh->classes[i].waiting
+           && SPHX2_CONCURRENCY_BEFORE(
+                  ngx_http_sphinx2_concurrency_start(sh, i), start))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/* a slot was given to class 'k'. Workers racing here may blur the shares
+ * a little, which is all the harm it does
+ */
+static void
+ngx_http_sphinx2_concurrency_charge(ngx_http_sphinx2_concurrency_conf_t *ccf,
+    ngx_uint_t k)
+{
+    ngx_http_sphinx2_concurrency_sh_t   * sh = ccf->sh;
+    ngx_atomic_uint_t                     start;
+
+    start = ngx_http_sphinx2_concurrency_start(sh, k);
+
+    sh->classes[k].vtime = start
+                           + SPHX2_CONCURRENCY_VSTEP / ccf->classes[k].weight;
+
+    if(SPHX2_CONCURRENCY_BEFORE(sh->vclock, start)) {
+        sh->vclock = start;
+    }
+}
+
+
+/* wake the head of the class due first of those queued in this worker */
+static void
+ngx_http_sphinx2_concurrency_post(ngx_http_sphinx2_concurrency_conf_t *ccf)
+{
+    ngx_http_sphinx2_concurrency_class_t * cls, * next;
+    ngx_http_sphinx2_ctx_t               * wctx;
+    ngx_atomic_uint_t                      start, first;
+    ngx_uint_t                             k;
+
+    next = NULL;
+    first = 0;
+
+    for(k = 0; k < ccf->nclasses; ++k) {
+        cls = &ccf->classes[k];
+
+        if(ngx_queue_empty(&cls->waiters)) {
+            continue;
+        }
+
+        start = ngx_http_sphinx2_concurrency_start(ccf->sh, k);
+
+        if(NULL == next || SPHX2_CONCURRENCY_BEFORE(start, first)) {
+            next = cls;
+            first = start;
+        }
+    }
+
+    if(NULL == next) {
+        return;
+    }
+
+    wctx = ngx_queue_data(ngx_queue_head(&next->waiters),
+                          ngx_http_sphinx2_ctx_t, limit_wait);
+
+    if(!wctx->limit_ev.posted) {
+        ngx_post_event(&wctx->limit_ev, &ngx_posted_events);
+    }
+}
+
+
+/* out of its class's queue */
+static void
+ngx_http_sphinx2_concurrency_unqueue(ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_http_sphinx2_concurrency_conf_t * ccf = ctx->limiter;
+
+    ngx_queue_remove(&ctx->limit_wait);
+    --ccf->classes[ctx->limit_class].waiting;
+
+    (void) ngx_atomic_fetch_add(&ccf->sh->classes[ctx->limit_class].waiting,
+                                -1);
+
+    ctx->limit_waiting = 0;
+}
+
+
+/* the request holds a slot from now on */
+static void
+ngx_http_sphinx2_concurrency_hold(ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_http_sphinx2_concurrency_charge(ctx->limiter, ctx->limit_class);
+
+    ctx->limited = 1;
+    ctx->limit_start = ngx_http_sphinx2_usec();
+}
+
+
+/* the slot goes back, and the time it was held with it - unless the
+ * client went away before searchd answered, which says nothing about it
+ */
+static void
+ngx_http_sphinx2_concurrency_put(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, ngx_int_t rc)
+{
+    ngx_http_sphinx2_concurrency_conf_t * ccf = ctx->limiter;
+    ngx_uint_t                            drop;
+
+    ctx->limited = 0;
+
+    (void) ngx_atomic_fetch_add(&ccf->sh->in_flight, -1);
+
+    if(NGX_ERROR != rc
+       && (ctx->header || NGX_HTTP_CLIENT_CLOSED_REQUEST != rc))
+    {
+        drop = !ctx->header
+               || SPHX2_SEARCHD_RETRY == ctx->repctx.srch.status;
+
+        ngx_http_sphinx2_concurrency_sample(ccf,
+            ngx_http_sphinx2_usec() - ctx->limit_start, drop,
+            r->connection->log);
+    }
+
+    ngx_http_sphinx2_concurrency_post(ccf);
+}
+
+
+/* the request is going away - out of the queue, and its slot back */
+static void
+ngx_http_sphinx2_concurrency_cleanup(void *data)
+{
+    ngx_http_sphinx2_ctx_t  * ctx = data;
+
+    if(ctx->limit_ev.timer_set) {
+        ngx_del_timer(&ctx->limit_ev);
+    }
+
+    if(ctx->limit_ev.posted) {
+        ngx_delete_posted_event(&ctx->limit_ev);
+    }
+
+    if(ctx->limit_waiting) {
+        ngx_http_sphinx2_concurrency_unqueue(ctx);
+    }
+
+    if(ctx->limited) {
+        ngx_http_sphinx2_concurrency_put(ctx->request, ctx, NGX_ERROR);
+    }
+}
+
+
+/* the class of a request by sphinx2_class, 0 if it names none of the
+ * upstream's
+ */
+static ngx_uint_t
+ngx_http_sphinx2_concurrency_class(ngx_http_request_t *r,
+    ngx_http_sphinx2_concurrency_conf_t *ccf)
+{
+    ngx_http_sphinx2_loc_conf_t         * slcf;
+    ngx_str_t                             name;
+    ngx_uint_t                            k;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    if(1 == ccf->nclasses || NULL == slcf->query_class
+       || NGX_OK != ngx_http_complex_value(r, slcf->query_class, &name))
+    {
+        return 0;
+    }
+
+    for(k = 1; k < ccf->nclasses; ++k) {
+        if(ccf->classes[k].name.len == name.len
+           && ngx_strncmp(ccf->classes[k].name.data, name.data, name.len) == 0)
+        {
+            return k;
+        }
+    }
+
+    return 0;
+}
+
+
+/* NGX_OK when the request may go to searchd, NGX_AGAIN when it has been
+ * queued for a slot, NGX_BUSY when it is to be shed
+ */
+ngx_int_t
+ngx_http_sphinx2_concurrency_acquire(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_http_sphinx2_concurrency_conf_t  * ccf;
+    ngx_http_sphinx2_concurrency_class_t * cls;
+    ngx_http_sphinx2_loc_conf_t          * slcf;
+    ngx_pool_cleanup_t                   * cln;
+
+    if(NULL == (ccf = ngx_http_sphinx2_concurrency_conf(r))) {
+        return NGX_OK;
+    }
+
+    if(NULL == ctx->limiter) {
+        if(NULL == (cln = ngx_pool_cleanup_add(r->pool, 0))) {
+            return NGX_ERROR;
+        }
+        cln->handler = ngx_http_sphinx2_concurrency_cleanup;
+        cln->data = ctx;
+
+        ctx->limiter = ccf;
+
+        ctx->limit_ev.handler = ngx_http_sphinx2_concurrency_wake;
+        ctx->limit_ev.data = r;
+        ctx->limit_ev.log = r->connection->log;
+    }
+
+    ctx->limit_class = ngx_http_sphinx2_concurrency_class(r, ccf);
+    cls = &ccf->classes[ctx->limit_class];
+
+    /* those of the class queued before go first */
+    if(ngx_queue_empty(&cls->waiters)
+       && ngx_http_sphinx2_concurrency_due(ccf, ctx->limit_class)
+       && ngx_http_sphinx2_concurrency_take(ccf))
+    {
+        ngx_http_sphinx2_concurrency_hold(ctx);
+        return NGX_OK;
+    }
+
+    if(cls->waiting >= ccf->queue) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "sphinx2 concurrency: \"%V\" at its limit of %uA "
+                      "with %ui requests of class \"%V\" queued, shedding",
+                      &ccf->uscf->host, ccf->sh->limit, cls->waiting,
+                      &cls->name);
+        return NGX_BUSY;
+    }
+
+    ngx_queue_insert_tail(&cls->waiters, &ctx->limit_wait);
+    ++cls->waiting;
+    ctx->limit_waiting = 1;
+    ctx->limit_passes = 0;
+
+    (void) ngx_atomic_fetch_add(&ccf->sh->classes[ctx->limit_class].waiting,
+                                1);
+
+    ctx->limit_deadline = ngx_current_msec + ccf->timeout;
+
+    if(0 != ctx->deadline
+       && (ngx_msec_int_t) (ctx->deadline - ctx->limit_deadline) < 0)
+    {
+        ctx->limit_deadline = ctx->deadline;
+    }
+
+    ngx_add_timer(&ctx->limit_ev,
+                  ngx_min(ctx->limit_deadline - ngx_current_msec,
+                          SPHX2_CONCURRENCY_POLL));
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    if(!slcf->upstream.ignore_client_abort) {
+        r->read_event_handler = ngx_http_sphinx2_concurrency_broken;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "sphinx2 concurrency: queued in class \"%V\", "
+                   "%ui waiting, limit %uA",
+                   &cls->name, cls->waiting, ccf->sh->limit);
+
+    return NGX_AGAIN;
+}
+
+
+/* a queued request looks for a slot - only the head of a class's queue
+ * takes one, and only when the class is due it; the others just watch
+ * their time
+ */
+static void
+ngx_http_sphinx2_concurrency_wake(ngx_event_t *ev)
+{
+    ngx_http_request_t                  * r;
+    ngx_http_sphinx2_ctx_t              * ctx;
+    ngx_http_sphinx2_concurrency_conf_t * ccf;
+    ngx_connection_t                    * c;
+    ngx_msec_int_t                        left;
+    ngx_uint_t                            due;
+
+    r = ev->data;
+    c = r->connection;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+    ccf = ctx->limiter;
+
+    ev->timedout = 0;
+
+    if(ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    if(ngx_queue_head(&ccf->classes[ctx->limit_class].waiters)
+       == &ctx->limit_wait)
+    {
+        due = ctx->limit_passes >= SPHX2_CONCURRENCY_PASSES
+              || ngx_http_sphinx2_concurrency_due(ccf, ctx->limit_class);
+
+        if(due && ngx_http_sphinx2_concurrency_take(ccf)) {
+            ngx_http_sphinx2_concurrency_unqueue(ctx);
+            ngx_http_sphinx2_concurrency_hold(ctx);
+
+            r->read_event_handler = ngx_http_block_reading;
+
+            /* there may be room for the next one too */
+            ngx_http_sphinx2_concurrency_post(ccf);
+
+            ngx_http_sphinx2_start(r);
+
+            ngx_http_run_posted_requests(c);
+            return;
+        }
+
+        if(!due && ccf->sh->in_flight < ccf->sh->limit) {
+            ++ctx->limit_passes;
+        }
+    }
+
+    left = (ngx_msec_int_t) (ctx->limit_deadline - ngx_current_msec);
+
+    if(left > 0) {
+        ngx_add_timer(ev, ngx_min((ngx_msec_t) left,
+                                  SPHX2_CONCURRENCY_POLL));
+        return;
+    }
+
+    ngx_http_sphinx2_concurrency_unqueue(ctx);
+
+    /* the class may have held the next one back */
+    ngx_http_sphinx2_concurrency_post(ccf);
+
+    ngx_http_sphinx2_coalesce_done(r, ctx, NULL);
+
+    if(ctx->limit_deadline == ctx->deadline) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "sphinx2 concurrency: deadline passed waiting for "
+                      "\"%V\"", &ccf->uscf->host);
+        ngx_http_finalize_request(r, NGX_HTTP_GATEWAY_TIME_OUT);
+
+    } else {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "sphinx2 concurrency: timed out waiting for \"%V\"",
+                      &ccf->uscf->host);
+        ngx_http_finalize_request(r, NGX_HTTP_SERVICE_UNAVAILABLE);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+/* the client's connection, while the request is queued - as
+ * ngx_http_upstream_check_broken_connection looks at it once the request
+ * has gone to searchd
+ */
+static void
+ngx_http_sphinx2_concurrency_broken(ngx_http_request_t *r)
+{
+    ngx_http_sphinx2_ctx_t              * ctx;
+    ngx_connection_t                    * c;
+    ngx_event_t                         * ev;
+    ngx_err_t                             err;
+    char                                  buf[1];
+    int                                   n;
+
+    c = r->connection;
+    ev = c->read;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(!ctx->limit_waiting) {
+        return;
+    }
+
+#if (NGX_HAVE_KQUEUE)
+
+    if(ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+
+        if(!ev->pending_eof) {
+            return;
+        }
+
+        ev->eof = 1;
+        c->error = 1;
+
+        if(ev->kq_errno) {
+            ev->error = 1;
+        }
+
+        goto closed;
+    }
+
+#endif
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    err = ngx_socket_errno;
+
+    if((ngx_event_flags & NGX_USE_LEVEL_EVENT) && ev->active) {
+        if(ngx_del_event(ev, NGX_READ_EVENT, 0) != NGX_OK) {
+            err = 0;
+            goto closed;
+        }
+    }
+
+    /* a pipelined request, which waits its turn */
+    if(n > 0) {
+        return;
+    }
+
+    if(n == -1) {
+        if(err == NGX_EAGAIN) {
+            return;
+        }
+
+        ev->error = 1;
+
+    } else { /* n == 0 */
+        err = 0;
+    }
+
+    ev->eof = 1;
+    c->error = 1;
+
+closed:
+
+    ngx_log_error(NGX_LOG_INFO, c->log, err,
+                  "client closed connection while waiting for a slot of "
+                  "\"%V\"", &ctx->limiter->uscf->host);
+
+    if(ctx->limit_ev.timer_set) {
+        ngx_del_timer(&ctx->limit_ev);
+    }
+
+    if(ctx->limit_ev.posted) {
+        ngx_delete_posted_event(&ctx->limit_ev);
+    }
+
+    ngx_http_sphinx2_concurrency_unqueue(ctx);
+    ngx_http_sphinx2_concurrency_post(ctx->limiter);
+
+    ngx_http_sphinx2_coalesce_done(r, ctx, NULL);
+    ngx_http_finalize_request(r, NGX_HTTP_CLIENT_CLOSED_REQUEST);
+}
+
+
+/* the upstream is through with the request */
+void
+ngx_http_sphinx2_concurrency_release(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, ngx_int_t rc)
+{
+    if(ctx->limited) {
+        ngx_http_sphinx2_concurrency_put(r, ctx, rc);
+    }
+}
+
+
+/* a slot for the hedge of a request, if one is free now. A hedge never
+ * queues, and takes no slot while requests of any class wait for one.
+ * NGX_OK with '*ccfp' the limiter to give the slot back to - NULL if the
+ * upstream has no limit - or NGX_BUSY
+ */
+ngx_int_t
+ngx_http_sphinx2_concurrency_take_hedge(ngx_http_request_t *r,
+    ngx_http_sphinx2_concurrency_conf_t **ccfp)
+{
+    ngx_http_sphinx2_concurrency_conf_t  * ccf;
+    ngx_uint_t                             k;
+
+    *ccfp = NULL;
+
+    if(NULL == (ccf = ngx_http_sphinx2_concurrency_conf(r))) {
+        return NGX_OK;
+    }
+
+    for(k = 0; k < ccf->nclasses; ++k) {
+        if(0 != ccf->sh->classes[k].waiting) {
+            return NGX_BUSY;
+        }
+    }
+
+    if(!ngx_http_sphinx2_concurrency_take(ccf)) {
+        return NGX_BUSY;
+    }
+
+    ngx_http_sphinx2_concurrency_charge(ccf,
+        ngx_http_sphinx2_concurrency_class(r, ccf));
+
+    *ccfp = ccf;
+
+    return NGX_OK;
+}
+
+
+/* the hedge's slot back. The time it was held is no sample: the hedge was
+ * sent late, and may be closed before searchd answers it
+ */
+void
+ngx_http_sphinx2_concurrency_put_hedge(
+    ngx_http_sphinx2_concurrency_conf_t *ccf)
+{
+    (void) ngx_atomic_fetch_add(&ccf->sh->in_flight, -1);
+
+    ngx_http_sphinx2_concurrency_post(ccf);
+}
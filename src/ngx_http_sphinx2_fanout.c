@@ -0,0 +1,678 @@
+/*
+ * Sphinx2 scatter-gather search over sharded searchd pools, and excerpt
+ * batches split across searchd peers
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_result.h"
+#include "ngx_http_sphinx2_module.h"
+
+/*
+ * The search request is serialized once, with offset 0 and a limit of
+ * offset + limit, and sent to every shard from an in-memory subrequest to
+ * the same location. The subrequest is given a context prepared here so
+ * that it skips argument parsing and only talks to its shard's upstream.
+ * Each shard's response is decoded as it arrives; once all are in, the
+ * result sets of each query are merged in their sort order and encoded
+ * back into a searchd response for the client.
+ *
+ * With sphinx2_excerpt_split the documents of an excerpt request are cut
+ * into runs of about the same size in bytes, as searchd's work on them
+ * goes by their length, and each run is sent as an excerpt request of its
+ * own, from a subrequest like a shard's. The runs go to the upstream of
+ * sphinx2_pass, whose balancer spreads them over its peers, or in turn to
+ * the upstreams of sphinx2_shards. The response to an excerpt request is
+ * just the excerpts in the order of the documents, so those of the runs,
+ * put one after another, are the response to the whole request. The whole
+ * request is still built, as the key it is cached and coalesced by.
+ */
+
+/* TYPES */
+
+struct ngx_http_sphinx2_shard_s {
+    ngx_http_sphinx2_ctx_t         ctx;        /* the subrequest's context */
+    ngx_http_request_t           * parent;
+    ngx_http_upstream_srv_conf_t * uscf;
+    sphx2_result_t               * results;    /* one per query */
+    unsigned                       done:1;
+    unsigned                       ok:1;       /* got a whole response */
+};
+
+
+/* LOCALS */
+
+static ngx_str_t  s_shard_failed = ngx_string("shard request failed");
+
+/* sphinx2_excerpt_split min= default - smaller runs aren't worth a
+ * round trip of their own
+ */
+#define SPHX2_EXCERPT_SPLIT_MIN     16384
+#define SPHX2_EXCERPT_SPLIT_MAX     64
+
+static ngx_int_t  ngx_http_sphinx2_fanout_send(ngx_http_request_t *r,
+                      ngx_http_sphinx2_ctx_t *ctx);
+static ngx_int_t  ngx_http_sphinx2_fanout_done(ngx_http_request_t *r,
+                      void *data, ngx_int_t rc);
+static void       ngx_http_sphinx2_fanout_resume(ngx_http_request_t *r);
+
+
+/* FUNCTION DEFINITIONS */
+
+/* a shard gets its own bufs over the same request bytes, as sending moves
+ * buf positions; the links from 'in' up to 'end' are cloned, and 'next'
+ * follows them
+ */
+static ngx_chain_t *
+ngx_http_sphinx2_fanout_clone(ngx_pool_t *pool, ngx_chain_t *in,
+    ngx_chain_t *end, ngx_chain_t *next)
+{
+    ngx_chain_t  * out, ** ll, * cl;
+
+    ll = &out;
+
+    for(/* void */; in != end; in = in->next) {
+        if(NULL == (cl = ngx_alloc_chain_link(pool))
+           || NULL == (cl->buf = ngx_calloc_buf(pool)))
+        {
+            return NULL;
+        }
+
+        *cl->buf = *in->buf;
+        cl->buf->pos = cl->buf->start;
+
+        *ll = cl;
+        ll = &cl->next;
+    }
+
+    *ll = next;
+
+    return out;
+}
+
+
+/* sphinx2_excerpt_split off|<n> [min=<size>] */
+char *
+ngx_http_sphinx2_excerpt_split(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_loc_conf_t *slcf = conf;
+    ngx_str_t                  *value, s;
+    ngx_int_t                   n;
+    ssize_t                     size;
+
+    if (slcf->excerpt_split != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    slcf->excerpt_split_min = SPHX2_EXCERPT_SPLIT_MIN;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts > 2) {
+            goto invalid;
+        }
+
+        slcf->excerpt_split = 0;
+        return NGX_CONF_OK;
+    }
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n < 2 || n > SPHX2_EXCERPT_SPLIT_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive, "
+                           "it must be \"off\" or 2..%d",
+                           &value[1], &cmd->name, SPHX2_EXCERPT_SPLIT_MAX);
+        return NGX_CONF_ERROR;
+    }
+
+    slcf->excerpt_split = (ngx_uint_t) n;
+
+    if (cf->args->nelts == 2) {
+        return NGX_CONF_OK;
+    }
+
+    if (value[2].len > sizeof("min=") - 1
+        && ngx_strncmp(value[2].data, "min=", sizeof("min=") - 1) == 0)
+    {
+        s.len = value[2].len - (sizeof("min=") - 1);
+        s.data = value[2].data + sizeof("min=") - 1;
+
+        size = ngx_parse_size(&s);
+
+        if (size != NGX_ERROR) {
+            slcf->excerpt_split_min = (size_t) size;
+            return NGX_CONF_OK;
+        }
+    }
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[2]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+/* cut the documents of an excerpt request into runs, each sent as a
+ * request of its own; nothing is done for a request too small to split
+ */
+ngx_int_t
+ngx_http_sphinx2_fanout_split(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, sphx2_excerpt_input_t *input)
+{
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+    ngx_http_upstream_srv_conf_t  ** uscfs;
+    ngx_http_sphinx2_shard_t       * sh;
+    ngx_http_sphinx2_ctx_t         * sctx;
+    sphx2_excerpt_input_t            run;
+    ngx_chain_t                    * cl;
+    ngx_buf_t                      * hs;
+    ngx_uint_t                       i, n, k, start;
+    size_t                           total, acc;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    for(total = 0, i = 0; i < input->num_docs; ++i) {
+        total += input->docs[i].doc.len;
+    }
+
+    n = slcf->excerpt_split;
+
+    if(slcf->excerpt_split_min && n > total / slcf->excerpt_split_min) {
+        n = total / slcf->excerpt_split_min;
+    }
+
+    if(n > input->num_docs) {
+        n = input->num_docs;
+    }
+
+    if(n < 2) {
+        return NGX_OK;
+    }
+
+    if(NULL == (ctx->shards = ngx_pcalloc(r->pool,
+                                  n * sizeof(ngx_http_sphinx2_shard_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    uscfs = (NULL != slcf->shards) ? slcf->shards->elts : NULL;
+
+    run = *input;
+
+    /* run k ends with the document that takes it past (k + 1) / n of the
+     * bytes, leaving at least a document for each run after it
+     */
+    for(k = 0, start = 0, acc = 0, i = 0; i < input->num_docs; ++i) {
+        acc += input->docs[i].doc.len;
+
+        if(i + 1 < input->num_docs
+           && (k + 1 == n || acc * n < (k + 1) * total)
+           && input->num_docs - (i + 1) > n - (k + 1))
+        {
+            continue;
+        }
+
+        sh = &ctx->shards[k];
+        sctx = &sh->ctx;
+
+        sh->parent = r;
+        sh->uscf = (NULL != uscfs)
+                       ? uscfs[k % slcf->shards->nelts]
+                       : slcf->upstream.upstream;
+
+        sctx->command = SPHX2_COMMAND_EXCERPT;
+        sctx->num_queries = 1;
+        sctx->index = ctx->index;
+        sctx->persist = ctx->persist;
+        sctx->deadline = ctx->deadline;
+        sctx->shard = 1;
+
+        run.docs = input->docs + start;
+        run.num_docs = i + 1 - start;
+
+        if(NGX_ERROR == sphx2_create_excerpt_request(r->pool, &run,
+                                                     &sctx->request_cl)
+           || NGX_OK != sphx2_create_handshake(r->pool, ctx->persist, &hs)
+           || NULL == (cl = ngx_alloc_chain_link(r->pool)))
+        {
+            return NGX_ERROR;
+        }
+
+        cl->buf = hs;
+        cl->next = sctx->request_cl;
+
+        sctx->handshake_cl = cl;
+
+        start = i + 1;
+
+        if(++k == n) {
+            break;
+        }
+    }
+
+    ctx->num_shards = k;
+
+    return NGX_OK;
+}
+
+
+/* send the built request to every shard, or the runs of an excerpt
+ * request split already
+ */
+ngx_int_t
+ngx_http_sphinx2_fanout(ngx_http_request_t *r, ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+    ngx_http_upstream_srv_conf_t  ** uscfs;
+    ngx_http_sphinx2_shard_t       * sh;
+    ngx_http_sphinx2_ctx_t         * sctx;
+    ngx_uint_t                       i, n;
+
+    if(NULL != ctx->shards) {
+        ctx->pending = ctx->num_shards;
+        return ngx_http_sphinx2_fanout_send(r, ctx);
+    }
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    uscfs = slcf->shards->elts;
+    n = slcf->shards->nelts;
+
+    /* excerpts don't depend on what is in an index - any shard does */
+    if(SPHX2_COMMAND_SEARCH != ctx->command) {
+        n = 1;
+    }
+
+    if(NULL == (ctx->shards = ngx_pcalloc(r->pool,
+                                  n * sizeof(ngx_http_sphinx2_shard_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    ctx->num_shards = n;
+    ctx->pending = n;
+
+    for(i = 0; i < n; ++i) {
+        sh = &ctx->shards[i];
+        sctx = &sh->ctx;
+
+        sh->parent = r;
+        sh->uscf = uscfs[i];
+
+        sctx->command = ctx->command;
+        sctx->num_queries = ctx->num_queries;
+        sctx->index = ctx->index;
+        sctx->persist = ctx->persist;
+        sctx->deadline = ctx->deadline;
+        sctx->shard = 1;
+
+        if(NULL == (sctx->request_cl = ngx_http_sphinx2_fanout_clone(
+                                   r->pool, ctx->request_cl, NULL, NULL))
+           || NULL == (sctx->handshake_cl = ngx_http_sphinx2_fanout_clone(
+                                   r->pool, ctx->handshake_cl,
+                                   ctx->request_cl, sctx->request_cl)))
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return ngx_http_sphinx2_fanout_send(r, ctx);
+}
+
+
+/* a subrequest per shard, with the context prepared for it. Once one
+ * subrequest is created the parent can no longer be finalized before it
+ * is done, so a failure after that only stops the rest from being sent:
+ * the parent waits for those created and then fails
+ */
+static ngx_int_t
+ngx_http_sphinx2_fanout_send(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_http_sphinx2_shard_t       * sh;
+    ngx_http_sphinx2_ctx_t         * sctx;
+    ngx_http_post_subrequest_t     * ps;
+    ngx_http_request_t             * sr;
+    ngx_uint_t                       i;
+
+    if(NULL == (ps = ngx_palloc(r->pool, ctx->num_shards
+                                     * sizeof(ngx_http_post_subrequest_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    for(i = 0; i < ctx->num_shards; ++i) {
+        sh = &ctx->shards[i];
+        sctx = &sh->ctx;
+
+        ps[i].handler = ngx_http_sphinx2_fanout_done;
+        ps[i].data = sh;
+
+        if(NGX_OK != ngx_http_subrequest(r, &r->uri, &r->args, &sr, &ps[i],
+                         NGX_HTTP_SUBREQUEST_IN_MEMORY
+                         |NGX_HTTP_SUBREQUEST_WAITED))
+        {
+            if(0 == i) {
+                return NGX_ERROR;
+            }
+
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "sphinx2: %ui of %ui shard requests not sent",
+                          ctx->num_shards - i, ctx->num_shards);
+
+            /* the subrequests run only once the parent is back in the
+             * event loop, so none of them is done yet
+             */
+            ctx->pending = i;
+            ctx->unsent = 1;
+            break;
+        }
+
+        sctx->request = sr;
+
+        ngx_http_set_ctx(sr, sctx, ngx_http_sphinx2_module);
+    }
+
+    r->write_event_handler = ngx_http_sphinx2_fanout_resume;
+
+    return NGX_OK;
+}
+
+
+/* point a shard subrequest's upstream at its shard */
+ngx_int_t
+ngx_http_sphinx2_fanout_init_shard(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_http_sphinx2_shard_t       * sh;
+    ngx_http_upstream_conf_t       * uc;
+
+    sh = (ngx_http_sphinx2_shard_t *) ctx;
+
+    if(NULL == (uc = ngx_palloc(r->pool, sizeof(ngx_http_upstream_conf_t)))) {
+        return NGX_ERROR;
+    }
+
+    *uc = *r->upstream->conf;
+    uc->upstream = sh->uscf;
+
+    r->upstream->conf = uc;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_sphinx2_fanout_done(ngx_http_request_t *r, void *data, ngx_int_t rc)
+{
+    ngx_http_sphinx2_shard_t       * sh = data;
+    ngx_http_sphinx2_ctx_t         * pctx, * sctx;
+    ngx_http_upstream_t            * u;
+
+    /* a subrequest can be finalized more than once */
+    if(sh->done) {
+        return rc;
+    }
+
+    sh->done = 1;
+
+    sctx = &sh->ctx;
+    pctx = ngx_http_get_module_ctx(sh->parent, ngx_http_sphinx2_module);
+
+    --pctx->pending;
+
+    u = r->upstream;
+
+    if(NGX_OK != rc || NULL == u || NGX_HTTP_OK != u->headers_in.status_n
+       || 0 != u->length || NULL == sctx->body)
+    {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "sphinx2: shard \"%V\" failed", &sh->uscf->host);
+        return rc;
+    }
+
+    sh->ok = 1;
+
+    if(SPHX2_COMMAND_SEARCH != sctx->command) {
+        return rc;
+    }
+
+    if(NGX_OK != sphx2_decode_search_response(r->pool, sctx->body,
+                     sctx->repctx.srch.status, sctx->num_queries,
+                     &sh->results))
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "sphinx2: bad search response from shard \"%V\"",
+                      &sh->uscf->host);
+        sh->results = NULL;
+    }
+
+    return rc;
+}
+
+
+/* merge each query's result sets from all shards */
+static ngx_int_t
+ngx_http_sphinx2_fanout_merge(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, ngx_buf_t **b, ngx_uint_t *complete)
+{
+    sphx2_result_t                 * out, ** in, * failed;
+    ngx_uint_t                       i, q, ok;
+
+    if(NULL == (out = ngx_palloc(r->pool,
+                          ctx->num_queries * sizeof(sphx2_result_t)))
+       || NULL == (in = ngx_palloc(r->pool,
+                            ctx->num_shards * sizeof(sphx2_result_t*)))
+       || NULL == (failed = ngx_pcalloc(r->pool, sizeof(sphx2_result_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    failed->status = SPHX2_SEARCHD_ERROR;
+    failed->message = s_shard_failed;
+
+    for(ok = 0, i = 0; i < ctx->num_shards; ++i) {
+        if(NULL != ctx->shards[i].results) {
+            ++ok;
+        }
+    }
+
+    if(0 == ok) {
+        return NGX_HTTP_BAD_GATEWAY;
+    }
+
+    *complete = (ok == ctx->num_shards);
+
+    for(q = 0; q < ctx->num_queries; ++q) {
+        for(i = 0; i < ctx->num_shards; ++i) {
+            in[i] = ctx->shards[i].results
+                        ? &ctx->shards[i].results[q] : failed;
+        }
+
+        if(NGX_OK != sphx2_merge_results(r->pool, in, ctx->num_shards,
+                                         &ctx->merge[q], &out[q]))
+        {
+            return NGX_ERROR;
+        }
+
+        if(SPHX2_SEARCHD_OK != out[q].status) {
+            *complete = 0;
+        }
+    }
+
+    if(NGX_OK != sphx2_encode_search_response(r->pool, out, ctx->num_queries,
+                                              b))
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/* bytes of the warning, with its length, an excerpt response with a
+ * warning starts with
+ */
+static ssize_t
+ngx_http_sphinx2_fanout_warning(ngx_buf_t *in)
+{
+    u_char                         * p;
+    size_t                           len;
+
+    p = in->pos;
+
+    if(in->last - p < 4) {
+        return NGX_ERROR;
+    }
+
+    len = 4 + (((size_t) p[0] << 24) | ((size_t) p[1] << 16)
+               | ((size_t) p[2] << 8) | (size_t) p[3]);
+
+    return ((size_t) (in->last - p) < len) ? NGX_ERROR : (ssize_t) len;
+}
+
+
+/* the excerpts of the runs of a split request, one after another. A run
+ * that failed fails them all, as there must be an excerpt per document;
+ * one that searchd refused is the response, as it would have been from a
+ * single searchd. Of the warnings only the first is kept, in front
+ */
+static ngx_int_t
+ngx_http_sphinx2_fanout_join(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, ngx_buf_t **b, ngx_uint_t *complete)
+{
+    ngx_http_sphinx2_ctx_t         * sctx;
+    ngx_buf_t                      * out, * in;
+    ssize_t                          skip;
+    size_t                           len;
+    ngx_uint_t                       i, warned;
+
+    for(len = 0, i = 0; i < ctx->num_shards; ++i) {
+        if(!ctx->shards[i].ok) {
+            return NGX_HTTP_BAD_GATEWAY;
+        }
+
+        sctx = &ctx->shards[i].ctx;
+
+        if(SPHX2_SEARCHD_OK != sctx->repctx.exrp.status
+           && SPHX2_SEARCHD_WARNING != sctx->repctx.exrp.status)
+        {
+            ctx->repctx.exrp.status = sctx->repctx.exrp.status;
+            *b = sctx->body;
+            *complete = 0;
+            return NGX_OK;
+        }
+
+        len += sctx->body->last - sctx->body->pos;
+    }
+
+    if(NULL == (out = ngx_create_temp_buf(r->pool, len))) {
+        return NGX_ERROR;
+    }
+
+    for(warned = 0, i = 0; i < ctx->num_shards && !warned; ++i) {
+        in = ctx->shards[i].ctx.body;
+
+        if(SPHX2_SEARCHD_WARNING == ctx->shards[i].ctx.repctx.exrp.status) {
+            if(NGX_ERROR == (skip = ngx_http_sphinx2_fanout_warning(in))) {
+                return NGX_HTTP_BAD_GATEWAY;
+            }
+
+            out->last = ngx_cpymem(out->last, in->pos, skip);
+            warned = 1;
+        }
+    }
+
+    for(i = 0; i < ctx->num_shards; ++i) {
+        in = ctx->shards[i].ctx.body;
+        skip = 0;
+
+        if(SPHX2_SEARCHD_WARNING == ctx->shards[i].ctx.repctx.exrp.status
+           && NGX_ERROR == (skip = ngx_http_sphinx2_fanout_warning(in)))
+        {
+            return NGX_HTTP_BAD_GATEWAY;
+        }
+
+        out->last = ngx_cpymem(out->last, in->pos + skip,
+                               in->last - in->pos - skip);
+    }
+
+    ctx->repctx.exrp.status = warned ? SPHX2_SEARCHD_WARNING
+                                     : SPHX2_SEARCHD_OK;
+
+    *b = out;
+    *complete = !warned;
+
+    return NGX_OK;
+}
+
+
+/* the parent runs this as each shard finishes */
+static void
+ngx_http_sphinx2_fanout_resume(ngx_http_request_t *r)
+{
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+    ngx_http_sphinx2_ctx_t         * ctx, * sctx;
+    ngx_buf_t                      * b;
+    ngx_int_t                        rc;
+    ngx_uint_t                       complete;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(ctx->pending || ctx->merged) {
+        return;
+    }
+
+    ctx->merged = 1;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    complete = 0;
+
+    if(ctx->unsent) {
+        rc = NGX_ERROR;
+
+    } else if(SPHX2_COMMAND_SEARCH == ctx->command) {
+        rc = ngx_http_sphinx2_fanout_merge(r, ctx, &b, &complete);
+
+    } else if(ctx->num_shards > 1) {
+        rc = ngx_http_sphinx2_fanout_join(r, ctx, &b, &complete);
+
+    } else {
+        sctx = &ctx->shards[0].ctx;
+
+        if(ctx->shards[0].ok) {
+            b = sctx->body;
+            complete = (SPHX2_SEARCHD_OK == sctx->repctx.exrp.status);
+            rc = NGX_OK;
+        } else {
+            rc = NGX_HTTP_BAD_GATEWAY;
+        }
+    }
+
+    if(NGX_OK != rc) {
+        ngx_http_sphinx2_coalesce_done(r, ctx, NULL);
+        ngx_http_finalize_request(r, (NGX_ERROR == rc)
+                                  ? NGX_HTTP_INTERNAL_SERVER_ERROR : rc);
+        return;
+    }
+
+    ctx->body = b;
+
+    /* partial results are passed on, but neither cached nor shared */
+    if(complete && NULL != slcf->cache_zone
+       && (size_t)(b->last - b->pos) <= slcf->cache_max_size)
+    {
+        (void)ngx_http_sphinx2_cache_store(r, ctx);
+    }
+
+    ngx_http_sphinx2_coalesce_done(r, ctx, complete ? b : NULL);
+
+    ngx_http_finalize_request(r, ngx_http_sphinx2_send_response(r, b));
+}
@@ -0,0 +1,190 @@
+/*
+ * Sphinx2 filter sets - named lists of filter values loaded from files at
+ * startup, for filters too long to be sent in each query string
+ */
+
+#include <sys/mman.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_stream.h"
+#include "ngx_http_sphinx2_result.h"
+#include "ngx_http_sphinx2_module.h"
+
+/*
+ * A set file is an ascending array of int64s in the host's byte order -
+ * just the bytes, with no header. The master maps the file privately when
+ * the configuration is read, and byte-swaps the values in place into the
+ * order they have on the wire; the mapping is then made read-only. Every
+ * page has been written by then, so the set no longer depends on the file,
+ * which may be replaced or truncated at will, and the workers forked after
+ * share the pages with the master until they exit.
+ *
+ * A filter "attr,in|ex,set,name" is sent as a values filter whose values
+ * are the bytes of the set, which the request chain refers to rather than
+ * copies. The values of a set are strictly ascending, as those of a values
+ * filter are once sorted and deduplicated.
+ *
+ * Sets are loaded again with the configuration, on a reload; the mapping
+ * of the old configuration goes with its pool. A request looks its sets
+ * up in the main conf of the configuration it is served by, so requests
+ * still in flight in an old worker keep the old sets.
+ */
+
+/* LOCALS */
+
+static void ngx_http_sphinx2_filter_set_unmap(void *data);
+
+
+/* FUNCTION DEFINITIONS */
+
+/* sphinx2_filter_set name=/path/to/file */
+char*
+ngx_http_sphinx2_filter_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_main_conf_t  *smcf = conf;
+    ngx_str_t                     *value, name, path;
+    sphx2_filter_set_t            *set;
+    ngx_pool_cleanup_t            *cln;
+    ngx_file_info_t                fi;
+    ngx_fd_t                       fd;
+    u_char                        *p, *wire;
+    uint64_t                      *v;
+    ngx_uint_t                     i, n;
+    size_t                         size;
+
+    value = cf->args->elts;
+
+    p = (u_char *) ngx_strlchr(value[1].data, value[1].data + value[1].len,
+                               '=');
+
+    if(NULL == p || p == value[1].data
+       || p == value[1].data + value[1].len - 1)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data;
+    name.len = p - value[1].data;
+
+    path.data = p + 1;
+    path.len = value[1].data + value[1].len - path.data;
+
+    set = smcf->filter_sets.elts;
+    for(i = 0; i < smcf->filter_sets.nelts; ++i) {
+        if(set[i].name.len == name.len
+           && 0 == ngx_strncmp(set[i].name.data, name.data, name.len))
+        {
+            return "is duplicate";
+        }
+    }
+
+    if(NGX_OK != ngx_conf_full_name(cf->cycle, &path, 1)) {
+        return NGX_CONF_ERROR;
+    }
+
+    fd = ngx_open_file(path.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if(NGX_INVALID_FILE == fd) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%s\" failed", path.data);
+        return NGX_CONF_ERROR;
+    }
+
+    if(NGX_FILE_ERROR == ngx_fd_info(fd, &fi)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_fd_info_n " \"%s\" failed", path.data);
+        goto failed;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    if(0 == size || size % sizeof(uint64_t)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "filter set \"%s\" is not a non-empty array of "
+                           "int64s", path.data);
+        goto failed;
+    }
+
+    wire = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+    if(MAP_FAILED == wire) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           "mmap(\"%s\") failed", path.data);
+        goto failed;
+    }
+
+    if(NGX_FILE_ERROR == ngx_close_file(fd)) {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                           ngx_close_file_n " \"%s\" failed", path.data);
+    }
+
+    fd = NGX_INVALID_FILE;
+
+    /* once the mapping is in the pool, it goes with the configuration
+     * whatever happens next
+     */
+
+    if(NULL == (set = ngx_array_push(&smcf->filter_sets))
+       || NULL == (cln = ngx_pool_cleanup_add(cf->pool, 0)))
+    {
+        munmap(wire, size);
+        return NGX_CONF_ERROR;
+    }
+
+    n = size / sizeof(uint64_t);
+
+    set->name = name;
+    set->wire = wire;
+    set->n = n;
+    set->size = size;
+
+    cln->handler = ngx_http_sphinx2_filter_set_unmap;
+    cln->data = set;
+
+    /* searchd wants the values ascending, as it looks them up by bisection */
+
+    v = (uint64_t *) wire;
+
+    for(i = 1; i < n; ++i) {
+        if((int64_t) v[i - 1] >= (int64_t) v[i]) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "filter set \"%s\" is not sorted or has a "
+                               "duplicate at value %ui", path.data, i);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    sphx2_swap_int64s(wire, v, n);
+
+    if(-1 == mprotect(wire, size, PROT_READ)) {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                           "mprotect(\"%s\") failed", path.data);
+    }
+
+    return NGX_CONF_OK;
+
+failed:
+
+    if(NGX_FILE_ERROR == ngx_close_file(fd)) {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                           ngx_close_file_n " \"%s\" failed", path.data);
+    }
+
+    return NGX_CONF_ERROR;
+}
+
+
+static void
+ngx_http_sphinx2_filter_set_unmap(void *data)
+{
+    sphx2_filter_set_t  * set = data;
+
+    if(-1 == munmap(set->wire, set->size)) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "munmap() of filter set \"%V\" failed", &set->name);
+    }
+}
@@ -0,0 +1,596 @@
+/*
+ * Sphinx2 hedged requests - a request searchd is slow to answer goes to a
+ * second peer too, and the first answer is taken
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_result.h"
+#include "ngx_http_sphinx2_module.h"
+
+/*
+ * A request of a location with sphinx2_hedge arms a timer as it goes to
+ * the upstream. If no response header has come from searchd when the
+ * timer fires, the bytes already built for the upstream - handshake and
+ * request - are sent to another peer of the upstream, on a connection the
+ * module makes itself: a primary peer which is not down, not failed
+ * (max_fails), not open in the upstream's sphinx2_breaker, and not the one
+ * the request is on. The balancer is not asked; the peer is picked at
+ * random. The hedge's response is read whole into memory.
+ *
+ * Under sphinx2_concurrency the hedge takes a slot of the upstream, which
+ * it holds until its connection is closed. It doesn't queue for one: if
+ * none is free, or requests are queued, the request isn't hedged.
+ *
+ * If the upstream's response header comes first, the hedge is closed and
+ * the response is streamed as usual. If the hedge's complete response
+ * comes first, the upstream is finalized under the request - its
+ * connection closed, its peer freed - and the hedge's response is sent
+ * the way one from the cache is. A hedge that fails, or is answered with
+ * ERROR or RETRY, is dropped and the request goes on waiting.
+ *
+ * Only requests which go to searchd through ngx_http_sphinx2_forward are
+ * hedged - not shard subrequests, nor those answered from the cache or by
+ * a coalesced request.
+ */
+
+/* TYPES */
+
+struct ngx_http_sphinx2_hedge_s {
+    ngx_http_request_t           * request;
+    ngx_event_t                    timer;
+    ngx_peer_connection_t          pc;
+    ngx_http_sphinx2_concurrency_conf_t * limiter; /* its slot's, if any */
+    ngx_chain_t                  * out;      /* handshake + request */
+    ngx_buf_t                    * header;
+    ngx_buf_t                    * body;
+    sphx2_response_ctx_t           repctx;
+    ngx_msec_t                     start;
+    ngx_msec_t                     connect_time;
+    ngx_msec_t                     first_byte_time;
+    unsigned                       connected:1;
+    unsigned                       first_byte:1;
+};
+
+
+/* LOCALS */
+
+/* a percentile is taken once the location has this many requests counted */
+#define SPHX2_HEDGE_MIN_SAMPLES     100
+
+static void ngx_http_sphinx2_hedge_recv(ngx_event_t *rev);
+
+
+/* FUNCTION DEFINITIONS */
+
+/* sphinx2_hedge off|after=<time>|after=p<n> */
+char*
+ngx_http_sphinx2_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_loc_conf_t *slcf = conf;
+    ngx_str_t                  *value, s;
+    ngx_int_t                   n;
+
+    if (slcf->hedge_after != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        slcf->hedge_after = 0;
+        slcf->hedge_percent = 0;
+        return NGX_CONF_OK;
+    }
+
+    if (value[1].len > sizeof("after=") - 1
+        && ngx_strncmp(value[1].data, "after=", sizeof("after=") - 1) == 0)
+    {
+        s.len = value[1].len - (sizeof("after=") - 1);
+        s.data = value[1].data + sizeof("after=") - 1;
+
+        if (s.data[0] == 'p') {
+            n = ngx_atoi(s.data + 1, s.len - 1);
+
+            if (n != NGX_ERROR && n >= 50 && n <= 99) {
+                slcf->hedge_after = 0;
+                slcf->hedge_percent = (ngx_uint_t) n;
+                return NGX_CONF_OK;
+            }
+
+        } else {
+            n = ngx_parse_time(&s, 0);
+
+            if (n != NGX_ERROR && n > 0) {
+                slcf->hedge_after = (ngx_msec_t) n;
+                slcf->hedge_percent = 0;
+                return NGX_CONF_OK;
+            }
+        }
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid value \"%V\" in \"%V\" directive, "
+                       "it must be \"off\", \"after=<time>\" or "
+                       "\"after=p<50..99>\"",
+                       &value[1], &cmd->name);
+
+    return NGX_CONF_ERROR;
+}
+
+
+/* a peer to hedge to - any usable one but the request's own */
+static ngx_http_upstream_rr_peer_t *
+ngx_http_sphinx2_hedge_peer(ngx_http_request_t *r)
+{
+    ngx_http_sphinx2_main_conf_t   * smcf;
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+    ngx_http_sphinx2_breaker_conf_t * bcf;
+    ngx_http_upstream_rr_peers_t   * peers;
+    ngx_http_upstream_rr_peer_t    * peer;
+    ngx_uint_t                       i, k, n, first;
+    time_t                           now;
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_sphinx2_module);
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    peers = slcf->upstream.upstream->peer.data;
+
+    if(NULL == peers || peers->number < 2) {
+        return NULL;
+    }
+
+    /* the primary peers come first among the breaker's */
+    bcf = ngx_http_sphinx2_breaker_conf(smcf, slcf->upstream.upstream);
+
+    now = ngx_time();
+    n = peers->number;
+    first = ngx_random() % n;
+
+    for(i = 0; i < n; ++i) {
+        k = (first + i) % n;
+        peer = &peers->peer[k];
+
+        if(peer->down || peer->sockaddr == r->upstream->peer.sockaddr) {
+            continue;
+        }
+
+        if(NULL != bcf && ngx_http_sphinx2_breaker_is_open(bcf, k)) {
+            continue;
+        }
+
+        if(peer->max_fails && peer->fails >= peer->max_fails
+           && now - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        return peer;
+    }
+
+    return NULL;
+}
+
+
+/* close the hedge's connection, if it has one, and give its slot back */
+static void
+ngx_http_sphinx2_hedge_close(ngx_http_sphinx2_hedge_t *h)
+{
+    if(NULL != h->pc.connection) {
+        ngx_close_connection(h->pc.connection);
+        h->pc.connection = NULL;
+    }
+
+    if(NULL != h->limiter) {
+        ngx_http_sphinx2_concurrency_put_hedge(h->limiter);
+        h->limiter = NULL;
+    }
+}
+
+
+/* close the hedge, and stop its timer */
+void
+ngx_http_sphinx2_hedge_cancel(ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_http_sphinx2_hedge_t       * h;
+
+    if(NULL == (h = ctx->hedge)) {
+        return;
+    }
+
+    if(h->timer.timer_set) {
+        ngx_del_timer(&h->timer);
+    }
+
+    ngx_http_sphinx2_hedge_close(h);
+}
+
+
+static void
+ngx_http_sphinx2_hedge_cleanup(void *data)
+{
+    ngx_http_sphinx2_hedge_cancel(data);
+}
+
+
+static void
+ngx_http_sphinx2_hedge_drop(ngx_http_sphinx2_hedge_t *h, const char *reason)
+{
+    ngx_log_error(NGX_LOG_INFO, h->request->connection->log, 0,
+                  "sphinx2 hedge to %V dropped: %s", h->pc.name, reason);
+
+    ngx_http_sphinx2_hedge_close(h);
+}
+
+
+/* the hedge answered first - the upstream is let go of, and the request
+ * becomes the hedge's
+ */
+static void
+ngx_http_sphinx2_hedge_win(ngx_http_sphinx2_hedge_t *h)
+{
+    ngx_http_request_t             * r;
+    ngx_http_upstream_t            * u;
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+    ngx_http_sphinx2_ctx_t         * ctx;
+    ngx_connection_t               * c;
+    ngx_buf_t                      * b;
+
+    r = h->request;
+    u = r->upstream;
+    c = r->connection;
+    b = h->body;
+
+    ngx_http_sphinx2_hedge_close(h);
+
+    if(NULL == u->cleanup) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "sphinx2 hedge to %V answered first", h->pc.name);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    /* the upstream's try counts as failed for its peer; the request is
+     * counted with the hedge's response and timings, for the hedge's peer
+     */
+    ngx_http_sphinx2_metrics_free_peer(ctx, NGX_PEER_FAILED);
+
+    ctx->repctx = h->repctx;
+    ctx->header = 1;
+    ctx->hedge_won = 1;
+    ctx->peer_start = h->start;
+    ctx->connected = h->connected;
+    ctx->connect_time = h->connect_time;
+    ctx->first_byte = h->first_byte;
+    ctx->first_byte_time = h->first_byte_time;
+    ctx->bytes_in = (h->header->last - h->header->start) + (b->last - b->pos);
+
+    ngx_http_sphinx2_metrics_peer(r, ctx, &slcf->upstream.upstream->host,
+                                  h->pc.name);
+
+    /* finalized with NGX_DONE, which takes a reference of the request */
+    r->main->count++;
+    (*u->cleanup)(r);
+
+    ctx->body = b;
+
+    if(NULL != slcf->cache_zone
+       && SPHX2_SEARCHD_OK == ctx->repctx.srch.status
+       && (size_t)(b->last - b->pos) <= slcf->cache_max_size)
+    {
+        (void)ngx_http_sphinx2_cache_store(r, ctx);
+    }
+
+    ngx_http_sphinx2_coalesce_done(r, ctx, b);
+
+    ngx_http_finalize_request(r, ngx_http_sphinx2_send_response(r, b));
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+/* the hedge's response header, read whole - NGX_OK if the hedge may
+ * answer the request
+ */
+static ngx_int_t
+ngx_http_sphinx2_hedge_header(ngx_http_sphinx2_hedge_t *h)
+{
+    ngx_http_request_t             * r;
+    ngx_http_sphinx2_ctx_t         * ctx;
+    ngx_int_t                        rc;
+
+    r = h->request;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    switch(ctx->command) {
+    case SPHX2_COMMAND_SEARCH:
+        rc = sphx2_parse_search_response_header(r->pool, h->header, 1,
+                                                &h->repctx.srch);
+        break;
+    case SPHX2_COMMAND_EXCERPT:
+        rc = sphx2_parse_excerpt_response_header(r->pool, h->header, 1,
+                                                 &h->repctx.exrp);
+        break;
+    default:
+        return NGX_ERROR;
+    }
+
+    if(NGX_OK != rc) {
+        ngx_http_sphinx2_hedge_drop(h, "invalid response header");
+        return NGX_ERROR;
+    }
+
+    /* status is where it is in either response context */
+    if(SPHX2_SEARCHD_OK != h->repctx.srch.status
+       && SPHX2_SEARCHD_WARNING != h->repctx.srch.status)
+    {
+        ngx_http_sphinx2_hedge_drop(h, "searchd failed the request");
+        return NGX_ERROR;
+    }
+
+    /* len is the first member in either response context */
+    if(NULL == (h->body = ngx_create_temp_buf(r->pool,
+                              h->repctx.srch.len ? h->repctx.srch.len : 1)))
+    {
+        ngx_http_sphinx2_hedge_drop(h, "no memory");
+        return NGX_ERROR;
+    }
+
+    h->body->end = h->body->start + h->repctx.srch.len;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_sphinx2_hedge_dummy_handler(ngx_event_t *ev)
+{
+}
+
+static void
+ngx_http_sphinx2_hedge_recv(ngx_event_t *rev)
+{
+    ngx_connection_t              * c = rev->data;
+    ngx_http_sphinx2_hedge_t      * h = c->data;
+    ngx_buf_t                     * b;
+    ssize_t                         n;
+
+    if(rev->timedout) {
+        ngx_http_sphinx2_hedge_drop(h, "timed out");
+        return;
+    }
+
+    for( ;; ) {
+        b = (NULL == h->body) ? h->header : h->body;
+
+        if(b->last < b->end) {
+            n = c->recv(c, b->last, b->end - b->last);
+
+            if(NGX_AGAIN == n) {
+                if(NGX_OK != ngx_handle_read_event(rev, 0)) {
+                    ngx_http_sphinx2_hedge_drop(h, "read failed");
+                }
+                return;
+            }
+
+            if(NGX_ERROR == n || 0 == n) {
+                ngx_http_sphinx2_hedge_drop(h, (0 == n) ? "connection closed"
+                                                        : "read failed");
+                return;
+            }
+
+            if(!h->first_byte) {
+                h->first_byte = 1;
+                h->first_byte_time = ngx_current_msec - h->start;
+            }
+
+            b->last += n;
+
+            if(b->last < b->end) {
+                continue;
+            }
+        }
+
+        if(NULL == h->body) {
+            if(NGX_OK != ngx_http_sphinx2_hedge_header(h)) {
+                return;
+            }
+            continue;
+        }
+
+        ngx_http_sphinx2_hedge_win(h);
+        return;
+    }
+}
+
+
+static void
+ngx_http_sphinx2_hedge_send(ngx_event_t *wev)
+{
+    ngx_connection_t              * c = wev->data;
+    ngx_http_sphinx2_hedge_t      * h = c->data;
+    ngx_http_sphinx2_loc_conf_t   * slcf;
+
+    if(wev->timedout) {
+        ngx_http_sphinx2_hedge_drop(h, "timed out");
+        return;
+    }
+
+    if(!h->connected) {
+        h->connected = 1;
+        h->connect_time = ngx_current_msec - h->start;
+    }
+
+    h->out = c->send_chain(c, h->out, 0);
+
+    if(NGX_CHAIN_ERROR == h->out) {
+        ngx_http_sphinx2_hedge_drop(h, "connect or send failed");
+        return;
+    }
+
+    if(NULL != h->out) {
+        if(NGX_OK != ngx_handle_write_event(wev, 0)) {
+            ngx_http_sphinx2_hedge_drop(h, "send failed");
+        }
+        return;
+    }
+
+    wev->handler = ngx_http_sphinx2_hedge_dummy_handler;
+
+    if(wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    slcf = ngx_http_get_module_loc_conf(h->request, ngx_http_sphinx2_module);
+
+    ngx_add_timer(c->read, slcf->upstream.read_timeout);
+
+    ngx_http_sphinx2_hedge_recv(c->read);
+}
+
+
+/* the threshold is up: send the request to a second peer */
+static void
+ngx_http_sphinx2_hedge_begin(ngx_event_t *ev)
+{
+    ngx_http_sphinx2_hedge_t      * h = ev->data;
+    ngx_http_request_t            * r;
+    ngx_http_sphinx2_loc_conf_t   * slcf;
+    ngx_http_sphinx2_ctx_t        * ctx;
+    ngx_http_upstream_rr_peer_t   * peer;
+    ngx_chain_t                   * cl, ** ll;
+    ngx_connection_t              * c;
+    ngx_int_t                       rc;
+
+    r = h->request;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(ctx->header || NULL == r->upstream || NULL == r->upstream->cleanup) {
+        return;
+    }
+
+    if(NULL == (peer = ngx_http_sphinx2_hedge_peer(r))) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "sphinx2 hedge: no other peer");
+        return;
+    }
+
+    /* buffers of its own over the request's bytes, which the upstream
+     * keeps sending from
+     */
+    for(ll = &h->out, cl = ctx->handshake_cl; cl; cl = cl->next) {
+        if(NULL == (*ll = ngx_alloc_chain_link(r->pool))
+           || NULL == ((*ll)->buf = ngx_calloc_buf(r->pool)))
+        {
+            return;
+        }
+
+        (*ll)->buf->pos = cl->buf->start;
+        (*ll)->buf->last = cl->buf->last;
+        (*ll)->buf->start = cl->buf->start;
+        (*ll)->buf->end = cl->buf->end;
+        (*ll)->buf->memory = 1;
+
+        ll = &(*ll)->next;
+    }
+
+    *ll = NULL;
+
+    if(NULL == (h->header = ngx_create_temp_buf(r->pool,
+                                sphx2_min_search_header_len)))
+    {
+        return;
+    }
+
+    if(NGX_OK != ngx_http_sphinx2_concurrency_take_hedge(r, &h->limiter)) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "sphinx2 hedge: no free slot");
+        return;
+    }
+
+    h->pc.sockaddr = peer->sockaddr;
+    h->pc.socklen = peer->socklen;
+    h->pc.name = &peer->name;
+    h->pc.get = ngx_event_get_peer;
+    h->pc.log = r->connection->log;
+    h->pc.log_error = NGX_ERROR_ERR;
+
+    ctx->hedged = 1;
+    h->start = ngx_current_msec;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "sphinx2 hedge: request sent to %V", h->pc.name);
+
+    rc = ngx_event_connect_peer(&h->pc);
+
+    if(NGX_ERROR == rc || NGX_BUSY == rc || NGX_DECLINED == rc) {
+        ngx_http_sphinx2_hedge_drop(h, "connect failed");
+        return;
+    }
+
+    c = h->pc.connection;
+
+    c->data = h;
+    c->read->handler = ngx_http_sphinx2_hedge_recv;
+    c->write->handler = ngx_http_sphinx2_hedge_send;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    ngx_add_timer(c->write, slcf->upstream.connect_timeout);
+
+    if(NGX_OK == rc) {
+        ngx_http_sphinx2_hedge_send(c->write);
+    }
+}
+
+
+/* arm the hedge of a request about to go to the upstream. NGX_DECLINED if
+ * it isn't hedged
+ */
+ngx_int_t
+ngx_http_sphinx2_hedge_arm(ngx_http_request_t *r, ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+    ngx_http_sphinx2_hedge_t       * h;
+    ngx_pool_cleanup_t             * cln;
+    ngx_msec_t                       after;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    if(0 != slcf->hedge_percent) {
+        after = ngx_http_sphinx2_metrics_quantile(r, ctx,
+                    SPHX2_METRICS_FIRST_BYTE, slcf->hedge_percent,
+                    SPHX2_HEDGE_MIN_SAMPLES);
+    } else {
+        after = slcf->hedge_after;
+    }
+
+    if(0 == after || NULL != ctx->hedge) {
+        return NGX_DECLINED;
+    }
+
+    if(NULL == (h = ngx_pcalloc(r->pool, sizeof(ngx_http_sphinx2_hedge_t)))
+       || NULL == (cln = ngx_pool_cleanup_add(r->pool, 0)))
+    {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_sphinx2_hedge_cleanup;
+    cln->data = ctx;
+
+    h->request = r;
+    h->timer.handler = ngx_http_sphinx2_hedge_begin;
+    h->timer.data = h;
+    h->timer.log = r->connection->log;
+
+    ctx->hedge = h;
+
+    ngx_add_timer(&h->timer, after);
+
+    return NGX_OK;
+}
@@ -0,0 +1,891 @@
+/*
+ * Sphinx2 streaming search response to JSON decoder
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_result.h"
+#include "ngx_http_sphinx2_json.h"
+
+/*
+ * The decoder is a state machine over the items of a search response -
+ * dwords, qwords and length prefixed strings - so that it can stop at any
+ * byte and go on when the next read comes in. An item split across reads
+ * is gathered in a scratch area, except for strings, which are escaped
+ * and written out piece by piece. Only the attribute names are kept, as
+ * each match refers to them.
+ *
+ * The output looks like:
+ *
+ *   {"status":"ok","results":[
+ *     {"status":"ok",
+ *      "fields":["title","body"],
+ *      "attrs":[{"name":"gid","type":"int"}],
+ *      "matches":[{"id":1,"weight":2,"attrs":{"gid":3}}],
+ *      "total":1,"total_found":1,"time":0.004,
+ *      "words":[{"word":"test","docs":1,"hits":2}]}]}
+ *
+ * with an "error" or "warning" member next to any status which is not
+ * "ok".
+ */
+
+/* TYPES */
+
+typedef enum {
+    SJ_BEGIN = 0,
+    SJ_TOP_MSG,
+    SJ_QUERY,
+    SJ_QUERY_MSG,
+    SJ_NUM_FIELDS,
+    SJ_FIELD,
+    SJ_NUM_ATTRS,
+    SJ_ATTR_NAME,
+    SJ_ATTR_TYPE,
+    SJ_NUM_MATCHES,
+    SJ_ID64,
+    SJ_MATCH_ID,
+    SJ_MATCH_WEIGHT,
+    SJ_MATCH_ATTR,
+    SJ_MVA,
+    SJ_TOTAL,
+    SJ_TOTAL_FOUND,
+    SJ_TIME,
+    SJ_NUM_WORDS,
+    SJ_WORD,
+    SJ_WORD_DOCS,
+    SJ_WORD_HITS,
+    SJ_END
+} sphx2_json_state_t;
+
+typedef struct {
+    ngx_str_t              name;        /* JSON escaped */
+    uint32_t               type;
+} sphx2_json_attr_t;
+
+struct sphx2_json_s {
+    ngx_pool_t           * pool;
+    ngx_chain_t         ** free;
+    ngx_buf_tag_t          tag;
+    size_t                 buf_size;
+
+    /* output of the current feed */
+    ngx_chain_t          * out;
+    ngx_chain_t         ** last_out;
+    ngx_buf_t            * ob;
+
+    /* input of the current feed */
+    u_char               * in;
+    u_char               * in_end;
+    size_t                 left;        /* body bytes not decoded yet */
+
+    u_char                 scratch[8];
+    size_t                 have;
+
+    sphx2_json_state_t     state;
+    sphx2_searchd_status_t status;
+    sphx2_searchd_status_t qstatus;
+    ngx_uint_t             num_queries;
+    ngx_uint_t             q;
+    ngx_uint_t             n;           /* fields, matches or words */
+    ngx_uint_t             i;
+    ngx_uint_t             a;           /* attribute of a match */
+    uint32_t               num_mva;
+    uint32_t               mva;
+    uint32_t               id64;
+
+    sphx2_json_attr_t    * attrs;
+    ngx_uint_t             num_attrs;
+
+    uint32_t             * totals;      /* total_found of each query */
+
+    /* a string being read */
+    size_t                 str_left;
+    u_char               * coll;
+    u_char               * coll_last;
+    unsigned               in_str:1;
+    unsigned               opened:1;    /* current item's prefix is out */
+};
+
+
+/* LOCALS */
+
+static const char * s_status_strs[] = {
+    "ok",       /* SPHX2_SEARCHD_OK */
+    "error",    /* SPHX2_SEARCHD_ERROR */
+    "retry",    /* SPHX2_SEARCHD_RETRY */
+    "warning"   /* SPHX2_SEARCHD_WARNING */
+};
+
+static const char * s_attr_type_strs[] = {
+    NULL,
+    "int",          /* SPHX2_ATTR_INTEGER */
+    "timestamp",    /* SPHX2_ATTR_TIMESTAMP */
+    "ordinal",      /* SPHX2_ATTR_ORDINAL */
+    "bool",         /* SPHX2_ATTR_BOOL */
+    "float",        /* SPHX2_ATTR_FLOAT */
+    "bigint",       /* SPHX2_ATTR_BIGINT */
+    "string"        /* SPHX2_ATTR_STRING */
+};
+
+#define SPHX2_JSON_NUM_LEN  (NGX_INT64_LEN + 32)
+
+#define sphx2_json_lit(j, s) \
+    sphx2_json_out(j, (u_char *) s, sizeof(s) - 1)
+
+#define sphx2_json_u32(p) \
+    (((uint32_t) (p)[0] << 24) | ((uint32_t) (p)[1] << 16) \
+     | ((uint32_t) (p)[2] << 8) | (uint32_t) (p)[3])
+
+#define sphx2_json_u64(p) \
+    (((uint64_t) sphx2_json_u32(p) << 32) | sphx2_json_u32((p) + 4))
+
+
+/* FUNCTION DEFINITIONS */
+
+/* get an output buf, recycled if one is free */
+static ngx_int_t
+sphx2_json_next_buf(sphx2_json_t * j)
+{
+    ngx_chain_t  * cl;
+    ngx_buf_t    * b;
+
+    if(NULL == (cl = ngx_chain_get_free_buf(j->pool, j->free))) {
+        return(NGX_ERROR);
+    }
+
+    b = cl->buf;
+
+    if(NULL == b->start) {
+        if(NULL == (b->start = ngx_palloc(j->pool, j->buf_size))) {
+            return(NGX_ERROR);
+        }
+        b->end = b->start + j->buf_size;
+        b->temporary = 1;
+    }
+
+    b->pos = b->start;
+    b->last = b->start;
+    b->flush = 1;
+    b->tag = j->tag;
+
+    *j->last_out = cl;
+    j->last_out = &cl->next;
+    j->ob = b;
+
+    return(NGX_OK);
+}
+
+static ngx_int_t
+sphx2_json_out(
+    sphx2_json_t * j,
+    u_char       * p,
+    size_t         len)
+{
+    size_t  n;
+
+    while(len) {
+        if(NULL == j->ob || j->ob->last == j->ob->end) {
+            if(NGX_OK != sphx2_json_next_buf(j)) {
+                return(NGX_ERROR);
+            }
+        }
+
+        n = ngx_min(len, (size_t) (j->ob->end - j->ob->last));
+
+        j->ob->last = ngx_cpymem(j->ob->last, p, n);
+        p += n;
+        len -= n;
+    }
+
+    return(NGX_OK);
+}
+
+/* a number, or a short constant string - never a name from searchd, which
+ * would be cut to the size of the buffer
+ */
+static ngx_int_t
+sphx2_json_printf(sphx2_json_t * j, const char * fmt, ...)
+{
+    u_char    buf[SPHX2_JSON_NUM_LEN], * last;
+    va_list   args;
+
+    va_start(args, fmt);
+    last = ngx_vslprintf(buf, buf + sizeof(buf), fmt, args);
+    va_end(args);
+
+    return(sphx2_json_out(j, buf, last - buf));
+}
+
+/* escape a byte for a JSON string, if it needs to be */
+u_char*
+sphx2_json_escape_char(u_char * dst, u_char c)
+{
+    static u_char   hex[] = "0123456789abcdef";
+
+    switch(c) {
+    case '"':  *dst++ = '\\'; *dst++ = '"'; break;
+    case '\\': *dst++ = '\\'; *dst++ = '\\'; break;
+    case '\n': *dst++ = '\\'; *dst++ = 'n'; break;
+    case '\r': *dst++ = '\\'; *dst++ = 'r'; break;
+    case '\t': *dst++ = '\\'; *dst++ = 't'; break;
+    default:
+        if(c < 0x20) {
+            dst = ngx_cpymem(dst, "\\u00", 4);
+            *dst++ = hex[c >> 4];
+            *dst++ = hex[c & 0xf];
+        } else {
+            *dst++ = c;
+        }
+    }
+
+    return(dst);
+}
+
+#define sphx2_json_plain(c) ((c) >= 0x20 && (c) != '"' && (c) != '\\')
+
+static ngx_int_t
+sphx2_json_out_escaped(
+    sphx2_json_t * j,
+    u_char       * p,
+    size_t         len)
+{
+    u_char  * last, * run, esc[6];
+
+    last = p + len;
+
+    while(p < last) {
+        for(run = p; p < last && sphx2_json_plain(*p); ++p) {
+            /* void */
+        }
+
+        if(p > run && NGX_OK != sphx2_json_out(j, run, p - run)) {
+            return(NGX_ERROR);
+        }
+
+        if(p < last) {
+            if(NGX_OK != sphx2_json_out(j, esc,
+                             sphx2_json_escape_char(esc, *p) - esc))
+            {
+                return(NGX_ERROR);
+            }
+            ++p;
+        }
+    }
+
+    return(NGX_OK);
+}
+
+/* consume 'n' bytes of input */
+#define sphx2_json_take(j, n) \
+    do { (j)->in += (n); (j)->left -= (n); } while(0)
+
+/* the next 'n' (at most 8) bytes of the body, gathered across feeds */
+static ngx_int_t
+sphx2_json_need(
+    sphx2_json_t * j,
+    size_t         n,
+    u_char      ** p)
+{
+    size_t  k;
+
+    if(0 == j->have && (size_t) (j->in_end - j->in) >= n) {
+        *p = j->in;
+        sphx2_json_take(j, n);
+        return(NGX_OK);
+    }
+
+    k = ngx_min(n - j->have, (size_t) (j->in_end - j->in));
+
+    ngx_memcpy(j->scratch + j->have, j->in, k);
+    sphx2_json_take(j, k);
+    j->have += k;
+
+    if(j->have < n) {
+        return(NGX_AGAIN);
+    }
+
+    j->have = 0;
+    *p = j->scratch;
+
+    return(NGX_OK);
+}
+
+/* a string - written out as a JSON string, or collected if 'collect' */
+static ngx_int_t
+sphx2_json_string(
+    sphx2_json_t * j,
+    ngx_uint_t     collect)
+{
+    u_char     * p;
+    size_t       k;
+    ngx_int_t    rc;
+
+    if(!j->in_str) {
+        if(NGX_OK != (rc = sphx2_json_need(j, 4, &p))) {
+            return(rc);
+        }
+
+        j->str_left = sphx2_json_u32(p);
+
+        if(j->str_left > j->left) {
+            return(NGX_ERROR);
+        }
+
+        if(collect) {
+            if(NULL == (j->coll = ngx_pnalloc(j->pool, j->str_left + 1))) {
+                return(NGX_ERROR);
+            }
+            j->coll_last = j->coll;
+
+        } else if(NGX_OK != sphx2_json_lit(j, "\"")) {
+            return(NGX_ERROR);
+        }
+
+        j->in_str = 1;
+    }
+
+    k = ngx_min(j->str_left, (size_t) (j->in_end - j->in));
+
+    if(collect) {
+        j->coll_last = ngx_cpymem(j->coll_last, j->in, k);
+
+    } else if(NGX_OK != sphx2_json_out_escaped(j, j->in, k)) {
+        return(NGX_ERROR);
+    }
+
+    sphx2_json_take(j, k);
+    j->str_left -= k;
+
+    if(j->str_left) {
+        return(NGX_AGAIN);
+    }
+
+    j->in_str = 0;
+
+    if(!collect && NGX_OK != sphx2_json_lit(j, "\"")) {
+        return(NGX_ERROR);
+    }
+
+    return(NGX_OK);
+}
+
+/* keep a collected attribute name, escaped */
+static ngx_int_t
+sphx2_json_keep_name(
+    sphx2_json_t * j,
+    ngx_str_t    * name)
+{
+    u_char  * p, * d;
+
+    if(NULL == (name->data = ngx_pnalloc(j->pool,
+                                 6 * (j->coll_last - j->coll) + 1)))
+    {
+        return(NGX_ERROR);
+    }
+
+    for(d = name->data, p = j->coll; p < j->coll_last; ++p) {
+        d = sphx2_json_escape_char(d, *p);
+    }
+
+    name->len = d - name->data;
+
+    return(NGX_OK);
+}
+
+static const char*
+sphx2_json_attr_type_str(uint32_t type)
+{
+    if(SPHX2_ATTR_MULTI == type) {
+        return("mva");
+    }
+
+    if(SPHX2_ATTR_MULTI64 == type) {
+        return("mva64");
+    }
+
+    if(type > 0 && type <= SPHX2_ATTR_STRING) {
+        return(s_attr_type_strs[type]);
+    }
+
+    return(NULL);
+}
+
+/* value of a fixed size attribute of a match */
+static ngx_int_t
+sphx2_json_attr_value(
+    sphx2_json_t * j,
+    uint32_t       type)
+{
+    u_char     * p;
+    ngx_int_t    rc;
+    uint32_t     v;
+    float        f;
+
+    switch(type) {
+    case SPHX2_ATTR_BIGINT:
+        if(NGX_OK != (rc = sphx2_json_need(j, 8, &p))) {
+            return(rc);
+        }
+        return(sphx2_json_printf(j, "%L", (int64_t) sphx2_json_u64(p)));
+
+    case SPHX2_ATTR_FLOAT:
+        if(NGX_OK != (rc = sphx2_json_need(j, 4, &p))) {
+            return(rc);
+        }
+        v = sphx2_json_u32(p);
+        ngx_memcpy(&f, &v, sizeof(float));
+        return(sphx2_json_printf(j, "%.6f", (double) f));
+
+    default:
+        if(NGX_OK != (rc = sphx2_json_need(j, 4, &p))) {
+            return(rc);
+        }
+        return(sphx2_json_printf(j, "%uD", sphx2_json_u32(p)));
+    }
+}
+
+/* one step through the response; NGX_AGAIN when out of input */
+static ngx_int_t
+sphx2_json_step(sphx2_json_t * j)
+{
+    u_char              * p;
+    ngx_int_t             rc;
+    uint32_t              v;
+    sphx2_json_attr_t   * attr;
+    const char          * s;
+
+#define NEED(len) \
+    if(NGX_OK != (rc = sphx2_json_need(j, len, &p))) { return(rc); }
+
+#define STRING(collect) \
+    if(NGX_OK != (rc = sphx2_json_string(j, collect))) { return(rc); }
+
+#define OUT(expr) \
+    if(NGX_OK != (expr)) { return(NGX_ERROR); }
+
+    switch(j->state) {
+
+    case SJ_BEGIN:
+        OUT(sphx2_json_printf(j, "{\"status\":\"%s\"",
+                              s_status_strs[j->status]));
+
+        if(SPHX2_SEARCHD_OK != j->status) {
+            OUT(sphx2_json_printf(j, ",\"%s\":",
+                    SPHX2_SEARCHD_WARNING == j->status ? "warning" : "error"));
+            j->state = SJ_TOP_MSG;
+            break;
+        }
+
+        OUT(sphx2_json_lit(j, ",\"results\":["));
+        j->state = SJ_QUERY;
+        break;
+
+    case SJ_TOP_MSG:
+        STRING(0);
+
+        if(SPHX2_SEARCHD_WARNING != j->status) {
+            OUT(sphx2_json_lit(j, ",\"results\":[]}"));
+            j->state = SJ_END;
+            break;
+        }
+
+        OUT(sphx2_json_lit(j, ",\"results\":["));
+        j->state = SJ_QUERY;
+        break;
+
+    case SJ_QUERY:
+        if(j->q == j->num_queries) {
+            OUT(sphx2_json_lit(j, "]}"));
+            j->state = SJ_END;
+            break;
+        }
+
+        NEED(4);
+
+        if((v = sphx2_json_u32(p)) > SPHX2_SEARCHD_WARNING) {
+            return(NGX_ERROR);
+        }
+
+        j->qstatus = v;
+
+        OUT(sphx2_json_printf(j, "%s{\"status\":\"%s\"",
+                              j->q ? "," : "", s_status_strs[v]));
+
+        if(SPHX2_SEARCHD_OK != j->qstatus) {
+            OUT(sphx2_json_printf(j, ",\"%s\":",
+                    SPHX2_SEARCHD_WARNING == v ? "warning" : "error"));
+            j->state = SJ_QUERY_MSG;
+            break;
+        }
+
+        j->state = SJ_NUM_FIELDS;
+        break;
+
+    case SJ_QUERY_MSG:
+        STRING(0);
+
+        /* nothing follows the message of a failed query */
+        if(SPHX2_SEARCHD_WARNING != j->qstatus) {
+            OUT(sphx2_json_lit(j, "}"));
+            ++j->q;
+            j->state = SJ_QUERY;
+            break;
+        }
+
+        j->state = SJ_NUM_FIELDS;
+        break;
+
+    case SJ_NUM_FIELDS:
+        NEED(4);
+        j->n = sphx2_json_u32(p);
+        j->i = 0;
+        OUT(sphx2_json_lit(j, ",\"fields\":["));
+        j->state = SJ_FIELD;
+        break;
+
+    case SJ_FIELD:
+        if(j->i == j->n) {
+            OUT(sphx2_json_lit(j, "]"));
+            j->state = SJ_NUM_ATTRS;
+            break;
+        }
+
+        if(!j->opened) {
+            if(j->i) {
+                OUT(sphx2_json_lit(j, ","));
+            }
+            j->opened = 1;
+        }
+
+        STRING(0);
+
+        j->opened = 0;
+        ++j->i;
+        break;
+
+    case SJ_NUM_ATTRS:
+        NEED(4);
+        v = sphx2_json_u32(p);
+
+        /* each attribute takes at least a name length and a type */
+        if(v > j->left / 8) {
+            return(NGX_ERROR);
+        }
+
+        j->num_attrs = v;
+        j->i = 0;
+
+        if(v && NULL == (j->attrs = ngx_palloc(j->pool,
+                                        v * sizeof(sphx2_json_attr_t))))
+        {
+            return(NGX_ERROR);
+        }
+
+        OUT(sphx2_json_lit(j, ",\"attrs\":["));
+        j->state = SJ_ATTR_NAME;
+        break;
+
+    case SJ_ATTR_NAME:
+        if(j->i == j->num_attrs) {
+            OUT(sphx2_json_lit(j, "]"));
+            j->state = SJ_NUM_MATCHES;
+            break;
+        }
+
+        STRING(1);
+        OUT(sphx2_json_keep_name(j, &j->attrs[j->i].name));
+        j->state = SJ_ATTR_TYPE;
+        break;
+
+    case SJ_ATTR_TYPE:
+        NEED(4);
+        attr = &j->attrs[j->i];
+        attr->type = sphx2_json_u32(p);
+
+        if(NULL == (s = sphx2_json_attr_type_str(attr->type))) {
+            return(NGX_ERROR);
+        }
+
+        if(j->i) {
+            OUT(sphx2_json_lit(j, ","));
+        }
+
+        OUT(sphx2_json_lit(j, "{\"name\":\""));
+        OUT(sphx2_json_out(j, attr->name.data, attr->name.len));
+        OUT(sphx2_json_lit(j, "\",\"type\":\""));
+        OUT(sphx2_json_out(j, (u_char *) s, ngx_strlen(s)));
+        OUT(sphx2_json_lit(j, "\"}"));
+        ++j->i;
+        j->state = SJ_ATTR_NAME;
+        break;
+
+    case SJ_NUM_MATCHES:
+        NEED(4);
+        j->n = sphx2_json_u32(p);
+        j->state = SJ_ID64;
+        break;
+
+    case SJ_ID64:
+        NEED(4);
+        j->id64 = sphx2_json_u32(p);
+        j->i = 0;
+        OUT(sphx2_json_lit(j, ",\"matches\":["));
+        j->state = SJ_MATCH_ID;
+        break;
+
+    case SJ_MATCH_ID:
+        if(j->i == j->n) {
+            OUT(sphx2_json_lit(j, "]"));
+            j->state = SJ_TOTAL;
+            break;
+        }
+
+        if(j->id64) {
+            NEED(8);
+            OUT(sphx2_json_printf(j, "%s{\"id\":%uL", j->i ? "," : "",
+                                  sphx2_json_u64(p)));
+        } else {
+            NEED(4);
+            OUT(sphx2_json_printf(j, "%s{\"id\":%uD", j->i ? "," : "",
+                                  sphx2_json_u32(p)));
+        }
+
+        j->state = SJ_MATCH_WEIGHT;
+        break;
+
+    case SJ_MATCH_WEIGHT:
+        NEED(4);
+        OUT(sphx2_json_printf(j, ",\"weight\":%uD,\"attrs\":{",
+                              sphx2_json_u32(p)));
+        j->a = 0;
+        j->state = SJ_MATCH_ATTR;
+        break;
+
+    case SJ_MATCH_ATTR:
+        if(j->a == j->num_attrs) {
+            OUT(sphx2_json_lit(j, "}}"));
+            ++j->i;
+            j->state = SJ_MATCH_ID;
+            break;
+        }
+
+        attr = &j->attrs[j->a];
+
+        if(!j->opened) {
+            if(j->a) {
+                OUT(sphx2_json_lit(j, ","));
+            }
+
+            OUT(sphx2_json_lit(j, "\""));
+            OUT(sphx2_json_out(j, attr->name.data, attr->name.len));
+            OUT(sphx2_json_lit(j, "\":"));
+            j->opened = 1;
+        }
+
+        switch(attr->type) {
+        case SPHX2_ATTR_STRING:
+            STRING(0);
+            break;
+
+        case SPHX2_ATTR_MULTI:
+        case SPHX2_ATTR_MULTI64:
+            NEED(4);
+            j->num_mva = sphx2_json_u32(p);
+            j->mva = 0;
+
+            /* a 64 bit value takes two dwords */
+            if((SPHX2_ATTR_MULTI64 == attr->type && (j->num_mva & 1))
+               || j->num_mva > j->left / 4)
+            {
+                return(NGX_ERROR);
+            }
+
+            OUT(sphx2_json_lit(j, "["));
+            j->state = SJ_MVA;
+            return(NGX_OK);
+
+        default:
+            if(NGX_OK != (rc = sphx2_json_attr_value(j, attr->type))) {
+                return(rc);
+            }
+        }
+
+        j->opened = 0;
+        ++j->a;
+        break;
+
+    case SJ_MVA:
+        attr = &j->attrs[j->a];
+
+        if(j->mva == j->num_mva) {
+            OUT(sphx2_json_lit(j, "]"));
+            j->opened = 0;
+            ++j->a;
+            j->state = SJ_MATCH_ATTR;
+            break;
+        }
+
+        if(SPHX2_ATTR_MULTI64 == attr->type) {
+            NEED(8);
+            OUT(sphx2_json_printf(j, "%s%L", j->mva ? "," : "",
+                                  (int64_t) sphx2_json_u64(p)));
+            j->mva += 2;
+        } else {
+            NEED(4);
+            OUT(sphx2_json_printf(j, "%s%uD", j->mva ? "," : "",
+                                  sphx2_json_u32(p)));
+            ++j->mva;
+        }
+        break;
+
+    case SJ_TOTAL:
+        NEED(4);
+        OUT(sphx2_json_printf(j, ",\"total\":%uD", sphx2_json_u32(p)));
+        j->state = SJ_TOTAL_FOUND;
+        break;
+
+    case SJ_TOTAL_FOUND:
+        NEED(4);
+        j->totals[j->q] = sphx2_json_u32(p);
+        OUT(sphx2_json_printf(j, ",\"total_found\":%uD", j->totals[j->q]));
+        j->state = SJ_TIME;
+        break;
+
+    case SJ_TIME:
+        NEED(4);
+        v = sphx2_json_u32(p);
+        OUT(sphx2_json_printf(j, ",\"time\":%uD.%03uD", v / 1000, v % 1000));
+        j->state = SJ_NUM_WORDS;
+        break;
+
+    case SJ_NUM_WORDS:
+        NEED(4);
+        j->n = sphx2_json_u32(p);
+        j->i = 0;
+        OUT(sphx2_json_lit(j, ",\"words\":["));
+        j->state = SJ_WORD;
+        break;
+
+    case SJ_WORD:
+        if(j->i == j->n) {
+            OUT(sphx2_json_lit(j, "]}"));
+            ++j->q;
+            j->state = SJ_QUERY;
+            break;
+        }
+
+        if(!j->opened) {
+            OUT(sphx2_json_printf(j, "%s{\"word\":", j->i ? "," : ""));
+            j->opened = 1;
+        }
+
+        STRING(0);
+
+        j->opened = 0;
+        j->state = SJ_WORD_DOCS;
+        break;
+
+    case SJ_WORD_DOCS:
+        NEED(4);
+        OUT(sphx2_json_printf(j, ",\"docs\":%uD", sphx2_json_u32(p)));
+        j->state = SJ_WORD_HITS;
+        break;
+
+    case SJ_WORD_HITS:
+        NEED(4);
+        OUT(sphx2_json_printf(j, ",\"hits\":%uD}", sphx2_json_u32(p)));
+        ++j->i;
+        j->state = SJ_WORD;
+        break;
+
+    case SJ_END:
+        /* searchd sent more than the results */
+        return(j->left ? NGX_ERROR : NGX_DONE);
+    }
+
+#undef NEED
+#undef STRING
+#undef OUT
+
+    return(NGX_OK);
+}
+
+sphx2_json_t*
+sphx2_json_create(
+    ngx_pool_t           * pool,
+    sphx2_searchd_status_t status,
+    ngx_uint_t             num_queries,
+    size_t                 len,
+    ngx_chain_t         ** free,
+    ngx_buf_tag_t          tag,
+    size_t                 buf_size)
+{
+    sphx2_json_t  * j;
+
+    if(status > SPHX2_SEARCHD_WARNING) {
+        return(NULL);
+    }
+
+    if(NULL == (j = ngx_pcalloc(pool, sizeof(sphx2_json_t)))
+       || NULL == (j->totals = ngx_pcalloc(pool,
+                                   num_queries * sizeof(uint32_t))))
+    {
+        return(NULL);
+    }
+
+    j->pool = pool;
+    j->free = free;
+    j->tag = tag;
+    j->buf_size = buf_size;
+    j->left = len;
+    j->status = status;
+    j->num_queries = num_queries;
+    j->state = SJ_BEGIN;
+
+    return(j);
+}
+
+ngx_int_t
+sphx2_json_feed(
+    sphx2_json_t * j,
+    u_char       * p,
+    size_t         len,
+    ngx_chain_t ** out)
+{
+    ngx_int_t  rc;
+
+    if(len > j->left) {
+        return(NGX_ERROR);
+    }
+
+    j->in = p;
+    j->in_end = p + len;
+
+    j->out = NULL;
+    j->last_out = &j->out;
+
+    while(NGX_OK == (rc = sphx2_json_step(j))) {
+        /* void */
+    }
+
+    /* what has been written goes out now; the next feed starts afresh */
+    j->ob = NULL;
+    *out = j->out;
+
+    /* out of input with none left to come */
+    if(NGX_AGAIN == rc && 0 == j->left) {
+        return(NGX_ERROR);
+    }
+
+    return(rc);
+}
+
+ngx_uint_t
+sphx2_json_totals(sphx2_json_t * j, uint32_t ** totals)
+{
+    *totals = j->totals;
+
+    return(j->q);
+}
@@ -0,0 +1,45 @@
+/*
+ * Sphinx2 streaming search response to JSON decoder
+ */
+
+#ifndef NGX_HTTP_SPHINX2_JSON_H
+#define NGX_HTTP_SPHINX2_JSON_H
+
+
+/* TYPES */
+
+typedef struct sphx2_json_s sphx2_json_t;
+
+
+/* FUNCTION PROTOTYPES */
+
+/* Create a decoder for a search response body of the given length and
+ * status (from the response header) holding 'n' result sets. Output bufs
+ * of the given size are taken from and recycled through 'free', and
+ * tagged with 'tag'.
+ */
+sphx2_json_t*
+sphx2_json_create(ngx_pool_t*, sphx2_searchd_status_t, ngx_uint_t, size_t,
+    ngx_chain_t**, ngx_buf_tag_t, size_t);
+
+/* Decode the next bytes of the body, as they arrive. The JSON they make
+ * is returned in a chain (NULL if there is none yet). Returns NGX_AGAIN
+ * if more of the body is expected, NGX_DONE once it has all been decoded,
+ * NGX_ERROR if it is malformed.
+ */
+ngx_int_t
+sphx2_json_feed(sphx2_json_t*, u_char*, size_t, ngx_chain_t**);
+
+/* The total_found of each query of the response decoded so far - 0 for
+ * a query which failed. Returns the number of queries decoded.
+ */
+ngx_uint_t
+sphx2_json_totals(sphx2_json_t*, uint32_t**);
+
+/* Write a byte escaped for a JSON string, if it needs to be - up to 6
+ * bytes. Returns the end of what was written.
+ */
+u_char*
+sphx2_json_escape_char(u_char*, u_char);
+
+#endif /* NGX_HTTP_SPHINX2_JSON_H */
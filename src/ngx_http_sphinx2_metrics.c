@@ -0,0 +1,1285 @@
+/*
+ * Sphinx2 traffic metrics in shared memory - counters and latency
+ * histograms per location, index and command
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_result.h"
+#include "ngx_http_sphinx2_json.h"
+#include "ngx_http_sphinx2_module.h"
+
+/*
+ * A metrics node is kept for each (location, index, command) that has
+ * sent requests to searchd. A node is created the first time its key is
+ * seen, under the zone's mutex, and is never freed, so once a worker has
+ * found a node it keeps a pointer to it and updates its counters with
+ * atomic adds, without locking - the key bytes of a node never change.
+ * Peers have nodes of their own, keyed on the upstream's name and the
+ * peer's address, with SPHX2_METRICS_PEER for a command.
+ *
+ * Latencies go to log-linear histograms, in milliseconds: values below
+ * SPHX2_METRICS_LINEAR have a bucket each, and every power of two above
+ * that is split in 2^SPHX2_METRICS_SUB_BITS buckets, so a bucket is
+ * never wider than 1/8th of the values in it. The last bucket takes
+ * everything from 2^SPHX2_METRICS_MAX_EXP ms (about 17 minutes) up.
+ */
+
+/* TYPES */
+
+struct ngx_http_sphinx2_metrics_node_s {
+    ngx_rbtree_node_t              node;
+    ngx_queue_t                    queue;
+    ngx_atomic_t                   requests;
+    ngx_atomic_t                   status[SPHX2_METRICS_STATUSES];
+    ngx_atomic_t                   failed;   /* no valid response header */
+    ngx_atomic_t                   in_flight;
+    ngx_atomic_t                   bytes_in;
+    ngx_atomic_t                   bytes_out;
+    ngx_atomic_t                   cache_hits;
+    ngx_atomic_t                   cache_misses;
+    ngx_atomic_t                   rate_sec; /* requests of a second: */
+    ngx_atomic_t                   rate_cur; /* - this one */
+    ngx_atomic_t                   rate_prev;/* - the one before */
+    ngx_atomic_t                   sum[SPHX2_METRICS_PHASES];  /* ms */
+    ngx_atomic_t                   hist[SPHX2_METRICS_PHASES]
+                                       [SPHX2_METRICS_BUCKETS];
+    ngx_uint_t                     indexes;  /* of "other": nodes made */
+    ngx_uint_t                     command;
+    size_t                         loc_len;
+    size_t                         index_len;
+    u_char                         data[1];  /* location . index */
+};
+
+typedef struct {
+    ngx_rbtree_t                   rbtree;
+    ngx_rbtree_node_t              sentinel;
+    ngx_queue_t                    queue;    /* all nodes, oldest first */
+    ngx_atomic_t                   overflow; /* requests left uncounted */
+    time_t                         start;
+} ngx_http_sphinx2_metrics_sh_t;
+
+typedef struct {
+    ngx_http_sphinx2_metrics_sh_t * sh;
+    ngx_slab_pool_t               * shpool;
+} ngx_http_sphinx2_metrics_t;
+
+/* a node found by this worker */
+typedef struct {
+    ngx_shm_zone_t                * zone;
+    uint32_t                        hash;
+    ngx_http_sphinx2_metrics_node_t * node;
+} ngx_http_sphinx2_metrics_slot_t;
+
+/* a node as the status page shows it */
+typedef struct {
+    ngx_http_sphinx2_metrics_node_t   copy;   /* counters only */
+    ngx_http_sphinx2_metrics_node_t * node;
+    ngx_str_t                         labels;
+    ngx_atomic_uint_t                 qps;
+} ngx_http_sphinx2_status_row_t;
+
+/* a counter of a node, as a sample of its own */
+typedef struct {
+    const char                      * name;
+    const char                      * help;
+    const char                      * type;
+    size_t                            offset;
+    ngx_uint_t                        peers;  /* kept for peers too */
+} ngx_http_sphinx2_status_metric_t;
+
+
+/* LOCALS */
+
+/* nodes a worker remembers; a slot is overwritten by a colliding key */
+#define SPHX2_METRICS_SLOTS     256
+
+static ngx_http_sphinx2_metrics_slot_t  s_metrics_slots[SPHX2_METRICS_SLOTS];
+
+/* indexes counted apart for a location and command, and the rest */
+#define SPHX2_METRICS_INDEXES   64
+
+static ngx_str_t  s_metrics_other = ngx_string("other");
+
+static ngx_msec_t ngx_http_sphinx2_status_bound(ngx_uint_t b);
+
+/* room for the status page: the lines of its metric families, those of a
+ * row besides its buckets, and one line, labels aside
+ */
+#define SPHX2_STATUS_HEADERS_LEN    4096
+#define SPHX2_STATUS_ROW_LINES      (16 + 3 * SPHX2_METRICS_PHASES)
+#define SPHX2_STATUS_LINE_LEN       128
+#define SPHX2_STATUS_LABELS_LEN     64
+
+#define SPHX2_STATUS_COUNTER(name, help, type, field, peers)                 \
+    { name, help, type,                                                      \
+      offsetof(ngx_http_sphinx2_metrics_node_t, field), peers }
+
+static ngx_http_sphinx2_status_metric_t  s_status_metrics[] = {
+    SPHX2_STATUS_COUNTER("requests_total", "Requests sent to searchd.",
+                         "counter", requests, 1),
+    SPHX2_STATUS_COUNTER("failed_total", "Requests without a valid "
+                         "searchd response.", "counter", failed, 1),
+    SPHX2_STATUS_COUNTER("in_flight", "Requests waiting for searchd.",
+                         "gauge", in_flight, 1),
+    SPHX2_STATUS_COUNTER("received_bytes_total", "Bytes of searchd "
+                         "responses.", "counter", bytes_in, 1),
+    SPHX2_STATUS_COUNTER("sent_bytes_total", "Bytes of searchd requests.",
+                         "counter", bytes_out, 1),
+    SPHX2_STATUS_COUNTER("cache_hits_total", "Requests answered from the "
+                         "cache.", "counter", cache_hits, 0),
+    SPHX2_STATUS_COUNTER("cache_misses_total", "Requests not found in the "
+                         "cache.", "counter", cache_misses, 0),
+    { NULL, NULL, NULL, 0, 0 }
+};
+
+static const char * s_status_names[] = {
+    "ok",               /* SPHX2_SEARCHD_OK */
+    "error",            /* SPHX2_SEARCHD_ERROR */
+    "retry",            /* SPHX2_SEARCHD_RETRY */
+    "warning"           /* SPHX2_SEARCHD_WARNING */
+};
+
+static const char * s_phase_names[] = {
+    "connect",          /* SPHX2_METRICS_CONNECT */
+    "first_byte",       /* SPHX2_METRICS_FIRST_BYTE */
+    "total"             /* SPHX2_METRICS_TOTAL */
+};
+
+
+/* FUNCTION DEFINITIONS */
+
+static ngx_int_t
+ngx_http_sphinx2_metrics_cmp(ngx_http_sphinx2_metrics_node_t *mn,
+    ngx_uint_t command, ngx_str_t *loc, ngx_str_t *index)
+{
+    ngx_int_t  rc;
+
+    if(mn->command != command) {
+        return (mn->command < command) ? -1 : 1;
+    }
+
+    if(mn->loc_len != loc->len) {
+        return (mn->loc_len < loc->len) ? -1 : 1;
+    }
+
+    if(mn->index_len != index->len) {
+        return (mn->index_len < index->len) ? -1 : 1;
+    }
+
+    rc = ngx_memcmp(mn->data, loc->data, loc->len);
+
+    if(0 != rc) {
+        return rc;
+    }
+
+    return ngx_memcmp(mn->data + loc->len, index->data, index->len);
+}
+
+
+static void
+ngx_http_sphinx2_metrics_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t                ** p;
+    ngx_http_sphinx2_metrics_node_t   * mn, * mnt;
+    ngx_str_t                           loc, index;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+            mn = (ngx_http_sphinx2_metrics_node_t *) node;
+            mnt = (ngx_http_sphinx2_metrics_node_t *) temp;
+
+            loc.data = mn->data;
+            loc.len = mn->loc_len;
+            index.data = mn->data + mn->loc_len;
+            index.len = mn->index_len;
+
+            p = (ngx_http_sphinx2_metrics_cmp(mnt, mn->command, &loc, &index)
+                 > 0) ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_sphinx2_metrics_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_sphinx2_metrics_t  * ometrics = data;
+    ngx_http_sphinx2_metrics_t  * metrics;
+
+    metrics = shm_zone->data;
+
+    if (ometrics) {
+        metrics->sh = ometrics->sh;
+        metrics->shpool = ometrics->shpool;
+        return NGX_OK;
+    }
+
+    metrics->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        metrics->sh = metrics->shpool->data;
+        return NGX_OK;
+    }
+
+    if(NULL == (metrics->sh = ngx_slab_alloc(metrics->shpool,
+                                  sizeof(ngx_http_sphinx2_metrics_sh_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    metrics->shpool->data = metrics->sh;
+
+    ngx_rbtree_init(&metrics->sh->rbtree, &metrics->sh->sentinel,
+                    ngx_http_sphinx2_metrics_rbtree_insert_value);
+
+    ngx_queue_init(&metrics->sh->queue);
+
+    metrics->sh->overflow = 0;
+    metrics->sh->start = ngx_time();
+
+    return NGX_OK;
+}
+
+
+/* sphinx2_metrics_zone <name> <size> */
+char *
+ngx_http_sphinx2_metrics_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t                   * value;
+    ssize_t                       size;
+    ngx_shm_zone_t              * shm_zone;
+    ngx_http_sphinx2_metrics_t  * metrics;
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+
+    if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid sphinx2 metrics zone size \"%V\"",
+                           &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if(NULL == (metrics = ngx_pcalloc(cf->pool,
+                              sizeof(ngx_http_sphinx2_metrics_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &value[1], size,
+                                     &ngx_http_sphinx2_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate sphinx2 metrics zone \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_sphinx2_metrics_init_zone;
+    shm_zone->data = metrics;
+
+    return NGX_CONF_OK;
+}
+
+
+/* a metrics zone declared before, and not some other zone of the module */
+static ngx_shm_zone_t *
+ngx_http_sphinx2_metrics_get_zone(ngx_conf_t *cf, ngx_str_t *name)
+{
+    ngx_shm_zone_t  * shm_zone;
+
+    shm_zone = ngx_shared_memory_add(cf, name, 0, &ngx_http_sphinx2_module);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->data == NULL
+        || shm_zone->init != ngx_http_sphinx2_metrics_init_zone)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown sphinx2 metrics zone \"%V\"", name);
+        return NULL;
+    }
+
+    return shm_zone;
+}
+
+
+/* sphinx2_metrics <name>|off */
+char *
+ngx_http_sphinx2_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_loc_conf_t  * slcf = conf;
+    ngx_str_t                    * value;
+
+    if (slcf->metrics_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        slcf->metrics_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    slcf->metrics_zone = ngx_http_sphinx2_metrics_get_zone(cf, &value[1]);
+
+    return (slcf->metrics_zone == NULL) ? NGX_CONF_ERROR : NGX_CONF_OK;
+}
+
+
+/* the histogram bucket of a latency */
+ngx_uint_t
+ngx_http_sphinx2_metrics_bucket(ngx_msec_t ms)
+{
+    ngx_uint_t  e;
+
+    if(ms < SPHX2_METRICS_LINEAR) {
+        return ms;
+    }
+
+    if(ms >> SPHX2_METRICS_MAX_EXP) {
+        return SPHX2_METRICS_BUCKETS - 1;
+    }
+
+    for(e = SPHX2_METRICS_SUB_BITS + 1; ms >> (e + 1); ++e) { /* void */ }
+
+    return SPHX2_METRICS_LINEAR
+           + ((e - SPHX2_METRICS_SUB_BITS - 1) << SPHX2_METRICS_SUB_BITS)
+           + ((ms >> (e - SPHX2_METRICS_SUB_BITS))
+              & ((1 << SPHX2_METRICS_SUB_BITS) - 1));
+}
+
+
+static uint32_t
+ngx_http_sphinx2_metrics_hash(ngx_uint_t command, ngx_str_t *loc,
+    ngx_str_t *index)
+{
+    uint32_t  hash;
+
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, (u_char *) &command, sizeof(command));
+    ngx_crc32_update(&hash, loc->data, loc->len);
+    ngx_crc32_update(&hash, index->data, index->len);
+    ngx_crc32_final(hash);
+
+    return hash;
+}
+
+
+/* the node of a key, if there is one - under the zone's mutex */
+static ngx_http_sphinx2_metrics_node_t *
+ngx_http_sphinx2_metrics_lookup(ngx_http_sphinx2_metrics_t *metrics,
+    uint32_t hash, ngx_uint_t command, ngx_str_t *loc, ngx_str_t *index)
+{
+    ngx_http_sphinx2_metrics_node_t  * mn;
+    ngx_rbtree_node_t                * node, * sentinel;
+    ngx_int_t                          rc;
+
+    node = metrics->sh->rbtree.root;
+    sentinel = metrics->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        mn = (ngx_http_sphinx2_metrics_node_t *) node;
+
+        rc = ngx_http_sphinx2_metrics_cmp(mn, command, loc, index);
+
+        if (rc == 0) {
+            return mn;
+        }
+
+        node = (rc > 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+/* a new node for a key - under the zone's mutex. NULL if the zone is full */
+static ngx_http_sphinx2_metrics_node_t *
+ngx_http_sphinx2_metrics_insert(ngx_http_sphinx2_metrics_t *metrics,
+    uint32_t hash, ngx_uint_t command, ngx_str_t *loc, ngx_str_t *index)
+{
+    ngx_http_sphinx2_metrics_node_t  * mn;
+
+    if(NULL == (mn = ngx_slab_alloc_locked(metrics->shpool,
+                         offsetof(ngx_http_sphinx2_metrics_node_t, data)
+                         + loc->len + index->len)))
+    {
+        return NULL;
+    }
+
+    ngx_memzero(mn, offsetof(ngx_http_sphinx2_metrics_node_t, data));
+
+    mn->node.key = hash;
+    mn->command = command;
+    mn->loc_len = loc->len;
+    mn->index_len = index->len;
+    ngx_memcpy(ngx_cpymem(mn->data, loc->data, loc->len),
+               index->data, index->len);
+
+    ngx_rbtree_insert(&metrics->sh->rbtree, &mn->node);
+    ngx_queue_insert_tail(&metrics->sh->queue, &mn->queue);
+
+    return mn;
+}
+
+
+/* the node of a key, made if there is none yet. NULL if the zone is full.
+ * Indexes come from the request, so a location and command get at most
+ * SPHX2_METRICS_INDEXES of them, and requests for any more are counted
+ * under the index "other" - its node is made along with the first one,
+ * and keeps the count.
+ */
+static ngx_http_sphinx2_metrics_node_t *
+ngx_http_sphinx2_metrics_node(ngx_shm_zone_t *zone, ngx_uint_t command,
+    ngx_str_t *loc, ngx_str_t *index)
+{
+    ngx_http_sphinx2_metrics_t       * metrics;
+    ngx_http_sphinx2_metrics_slot_t  * slot;
+    ngx_http_sphinx2_metrics_node_t  * mn, * other;
+    uint32_t                           hash, other_hash;
+
+    hash = ngx_http_sphinx2_metrics_hash(command, loc, index);
+
+    slot = &s_metrics_slots[hash % SPHX2_METRICS_SLOTS];
+
+    if(slot->zone == zone && slot->hash == hash
+       && 0 == ngx_http_sphinx2_metrics_cmp(slot->node, command, loc, index))
+    {
+        return slot->node;
+    }
+
+    metrics = zone->data;
+
+    ngx_shmtx_lock(&metrics->shpool->mutex);
+
+    mn = ngx_http_sphinx2_metrics_lookup(metrics, hash, command, loc, index);
+
+    if(NULL == mn && SPHX2_METRICS_PEER != command) {
+        other_hash = ngx_http_sphinx2_metrics_hash(command, loc,
+                                                   &s_metrics_other);
+
+        if(NULL == (other = ngx_http_sphinx2_metrics_lookup(metrics,
+                                other_hash, command, loc, &s_metrics_other))
+           && NULL == (other = ngx_http_sphinx2_metrics_insert(metrics,
+                                other_hash, command, loc, &s_metrics_other)))
+        {
+            ngx_shmtx_unlock(&metrics->shpool->mutex);
+            return NULL;
+        }
+
+        if(other->indexes >= SPHX2_METRICS_INDEXES) {
+            ngx_shmtx_unlock(&metrics->shpool->mutex);
+
+            /* not remembered in a slot, as it is not the node of the key */
+            return other;
+        }
+
+        if(NULL != (mn = ngx_http_sphinx2_metrics_insert(metrics, hash,
+                                                command, loc, index)))
+        {
+            ++other->indexes;
+        }
+
+    } else if(NULL == mn) {
+        mn = ngx_http_sphinx2_metrics_insert(metrics, hash, command, loc,
+                                             index);
+    }
+
+    ngx_shmtx_unlock(&metrics->shpool->mutex);
+
+    if(NULL == mn) {
+        return NULL;
+    }
+
+    slot->zone = zone;
+    slot->hash = hash;
+    slot->node = mn;
+
+    return mn;
+}
+
+
+/* a request done, for the rate of the last whole second. Workers race to
+ * start a new second, and a count may be lost to the race - it is a rate
+ * to watch, not to add up.
+ */
+static void
+ngx_http_sphinx2_metrics_tick(ngx_http_sphinx2_metrics_node_t *mn)
+{
+    ngx_atomic_uint_t  sec, now;
+
+    now = (ngx_atomic_uint_t) ngx_time();
+    sec = mn->rate_sec;
+
+    if(sec != now && ngx_atomic_cmp_set(&mn->rate_sec, sec, now)) {
+        mn->rate_prev = (sec + 1 == now) ? mn->rate_cur : 0;
+        mn->rate_cur = 0;
+    }
+
+    (void) ngx_atomic_fetch_add(&mn->requests, 1);
+    (void) ngx_atomic_fetch_add(&mn->rate_cur, 1);
+}
+
+
+static void
+ngx_http_sphinx2_metrics_latency(ngx_http_sphinx2_metrics_node_t *mn,
+    ngx_uint_t phase, ngx_msec_t ms)
+{
+    (void) ngx_atomic_fetch_add(&mn->sum[phase], ms);
+    (void) ngx_atomic_fetch_add(
+               &mn->hist[phase][ngx_http_sphinx2_metrics_bucket(ms)], 1);
+}
+
+
+/* the request's node, found once */
+static ngx_http_sphinx2_metrics_node_t *
+ngx_http_sphinx2_metrics_index(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, ngx_shm_zone_t *zone)
+{
+    ngx_http_core_loc_conf_t         * clcf;
+
+    if(NULL == ctx->metrics) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        ctx->metrics = ngx_http_sphinx2_metrics_node(zone, ctx->command,
+                                                     &clcf->name, &ctx->index);
+    }
+
+    return ctx->metrics;
+}
+
+
+static void
+ngx_http_sphinx2_metrics_overflow(ngx_shm_zone_t *zone)
+{
+    ngx_http_sphinx2_metrics_t       * metrics;
+
+    metrics = zone->data;
+
+    (void) ngx_atomic_fetch_add(&metrics->sh->overflow, 1);
+}
+
+
+/* a cache lookup, hit or missed, of a request with a cache */
+void
+ngx_http_sphinx2_metrics_cache(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, ngx_uint_t hit)
+{
+    ngx_http_sphinx2_loc_conf_t      * slcf;
+    ngx_http_sphinx2_metrics_node_t  * mn;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    if(NULL == slcf->metrics_zone) {
+        return;
+    }
+
+    if(NULL == (mn = ngx_http_sphinx2_metrics_index(r, ctx,
+                                                    slcf->metrics_zone)))
+    {
+        ngx_http_sphinx2_metrics_overflow(slcf->metrics_zone);
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(hit ? &mn->cache_hits : &mn->cache_misses, 1);
+}
+
+
+/* a peer got for the request - 'upstream' is the name of its upstream
+ * block and 'peer' its address. The request is in flight on the peer
+ * until it is freed, and in flight for its index until it is finalized.
+ */
+void
+ngx_http_sphinx2_metrics_peer(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, ngx_str_t *upstream, ngx_str_t *peer)
+{
+    ngx_http_sphinx2_loc_conf_t      * slcf;
+    ngx_http_sphinx2_metrics_node_t  * mn;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    if(NULL == slcf->metrics_zone) {
+        return;
+    }
+
+    if(!ctx->counted) {
+        ctx->counted = 1;
+
+        if(NULL == (mn = ngx_http_sphinx2_metrics_index(r, ctx,
+                                                        slcf->metrics_zone)))
+        {
+            ngx_http_sphinx2_metrics_overflow(slcf->metrics_zone);
+        } else {
+            (void) ngx_atomic_fetch_add(&mn->in_flight, 1);
+        }
+    }
+
+    ctx->peer_recorded = 0;
+
+    if(NULL == (ctx->peer_metrics = ngx_http_sphinx2_metrics_node(
+                                        slcf->metrics_zone, SPHX2_METRICS_PEER,
+                                        upstream, peer)))
+    {
+        ngx_http_sphinx2_metrics_overflow(slcf->metrics_zone);
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&ctx->peer_metrics->in_flight, 1);
+}
+
+
+/* the request is done with its peer; 'state' is that given to free_peer */
+void
+ngx_http_sphinx2_metrics_free_peer(ngx_http_sphinx2_ctx_t *ctx,
+    ngx_uint_t state)
+{
+    ngx_http_sphinx2_metrics_node_t  * mn;
+
+    if(NULL == (mn = ctx->peer_metrics)) {
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&mn->in_flight, -1);
+
+    /* a failed try the upstream moves on from - never finalized here */
+    if((state & NGX_PEER_FAILED) && !ctx->peer_recorded) {
+        ngx_http_sphinx2_metrics_tick(mn);
+        (void) ngx_atomic_fetch_add(&mn->failed, 1);
+    }
+
+    ctx->peer_metrics = NULL;
+}
+
+
+/* count what came of a request in a node */
+static void
+ngx_http_sphinx2_metrics_count(ngx_http_sphinx2_metrics_node_t *mn,
+    ngx_http_sphinx2_ctx_t *ctx, size_t out, ngx_msec_t total)
+{
+    ngx_http_sphinx2_metrics_tick(mn);
+
+    if(ctx->header) {
+        /* status is where it is in either response context */
+        (void) ngx_atomic_fetch_add(&mn->status[ctx->repctx.srch.status], 1);
+    } else {
+        (void) ngx_atomic_fetch_add(&mn->failed, 1);
+    }
+
+    (void) ngx_atomic_fetch_add(&mn->bytes_out, out);
+    (void) ngx_atomic_fetch_add(&mn->bytes_in, ctx->bytes_in);
+
+    if(ctx->connected) {
+        ngx_http_sphinx2_metrics_latency(mn, SPHX2_METRICS_CONNECT,
+                                         ctx->connect_time);
+    }
+
+    if(ctx->first_byte) {
+        ngx_http_sphinx2_metrics_latency(mn, SPHX2_METRICS_FIRST_BYTE,
+                                         ctx->first_byte_time);
+    }
+
+    ngx_http_sphinx2_metrics_latency(mn, SPHX2_METRICS_TOTAL, total);
+}
+
+
+/* count a request that went to searchd, as it is finalized - for its
+ * index, and for the peer which answered it or was tried last
+ */
+void
+ngx_http_sphinx2_metrics_record(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_http_sphinx2_loc_conf_t      * slcf;
+    ngx_chain_t                      * cl;
+    size_t                             out;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    /* never got as far as a peer */
+    if(NULL == slcf->metrics_zone || !ctx->counted) {
+        return;
+    }
+
+    out = 0;
+
+    if(ctx->connected) {
+        for(cl = r->upstream->request_bufs; cl; cl = cl->next) {
+            out += cl->buf->last - cl->buf->start;
+        }
+    }
+
+    if(NULL != ctx->metrics) {
+        (void) ngx_atomic_fetch_add(&ctx->metrics->in_flight, -1);
+
+        ngx_http_sphinx2_metrics_count(ctx->metrics, ctx, out,
+                                       ngx_current_msec - ctx->start);
+    }
+
+    if(NULL != ctx->peer_metrics && !ctx->peer_recorded) {
+        ngx_http_sphinx2_metrics_count(ctx->peer_metrics, ctx, out,
+                                       ngx_current_msec - ctx->peer_start);
+        ctx->peer_recorded = 1;
+    }
+}
+
+
+/* the latency 'percent' of the request's node's samples of a phase are
+ * under, in ms - the upper bound of the bucket it falls in. 0 if the node
+ * has fewer than 'min' samples.
+ */
+ngx_msec_t
+ngx_http_sphinx2_metrics_quantile(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, ngx_uint_t phase, ngx_uint_t percent,
+    ngx_uint_t min)
+{
+    ngx_http_sphinx2_loc_conf_t      * slcf;
+    ngx_http_sphinx2_metrics_node_t  * mn;
+    ngx_atomic_uint_t                  total, rank, n;
+    ngx_uint_t                         b;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    if(NULL == slcf->metrics_zone
+       || NULL == (mn = ngx_http_sphinx2_metrics_index(r, ctx,
+                                                       slcf->metrics_zone)))
+    {
+        return 0;
+    }
+
+    for(total = 0, b = 0; b < SPHX2_METRICS_BUCKETS; ++b) {
+        total += mn->hist[phase][b];
+    }
+
+    if(total < min || 0 == total) {
+        return 0;
+    }
+
+    rank = (total * percent + 99) / 100;
+
+    for(n = 0, b = 0; b < SPHX2_METRICS_BUCKETS - 1; ++b) {
+        if((n += mn->hist[phase][b]) >= rank) {
+            break;
+        }
+    }
+
+    return ngx_http_sphinx2_status_bound(b);
+}
+
+
+/* STATUS PAGE */
+
+/* the nodes there are, and a copy of each node's counters taken as the
+ * page is made
+ */
+static ngx_int_t
+ngx_http_sphinx2_status_rows(ngx_http_request_t *r,
+    ngx_http_sphinx2_metrics_t *metrics, ngx_array_t *rows)
+{
+    ngx_http_sphinx2_metrics_node_t  * mn, ** live;
+    ngx_http_sphinx2_status_row_t    * row;
+    ngx_queue_t                      * q;
+    ngx_uint_t                         i, n;
+    ngx_atomic_uint_t                  now;
+
+    ngx_shmtx_lock(&metrics->shpool->mutex);
+
+    for(n = 0, q = ngx_queue_head(&metrics->sh->queue);
+        q != ngx_queue_sentinel(&metrics->sh->queue);
+        q = ngx_queue_next(q))
+    {
+        ++n;
+    }
+
+    ngx_shmtx_unlock(&metrics->shpool->mutex);
+
+    if(NGX_OK != ngx_array_init(rows, r->pool, n ? n : 1,
+                                sizeof(ngx_http_sphinx2_status_row_t))
+       || NULL == (live = ngx_palloc(r->pool, (n ? n : 1) * sizeof(*live))))
+    {
+        return NGX_ERROR;
+    }
+
+    /* nodes are only ever added, at the tail */
+    ngx_shmtx_lock(&metrics->shpool->mutex);
+
+    for(i = 0, q = ngx_queue_head(&metrics->sh->queue);
+        i < n && q != ngx_queue_sentinel(&metrics->sh->queue);
+        q = ngx_queue_next(q))
+    {
+        live[i++] = ngx_queue_data(q, ngx_http_sphinx2_metrics_node_t, queue);
+    }
+
+    ngx_shmtx_unlock(&metrics->shpool->mutex);
+
+    now = (ngx_atomic_uint_t) ngx_time();
+
+    for(n = i, i = 0; i < n; ++i) {
+        mn = live[i];
+
+        if(NULL == (row = ngx_array_push(rows))) {
+            return NGX_ERROR;
+        }
+
+        /* counters are read as they are; the key is never written to */
+        ngx_memcpy(&row->copy, mn,
+                   offsetof(ngx_http_sphinx2_metrics_node_t, data));
+
+        row->node = mn;
+
+        row->qps = (row->copy.rate_sec == now) ? row->copy.rate_prev
+                   : (row->copy.rate_sec + 1 == now) ? row->copy.rate_cur
+                   : 0;
+    }
+
+    return NGX_OK;
+}
+
+
+/* the exclusive upper bound of a bucket, in ms */
+static ngx_msec_t
+ngx_http_sphinx2_status_bound(ngx_uint_t b)
+{
+    ngx_uint_t  e;
+
+    if(b < SPHX2_METRICS_LINEAR) {
+        return b + 1;
+    }
+
+    b -= SPHX2_METRICS_LINEAR;
+    e = (b >> SPHX2_METRICS_SUB_BITS) + SPHX2_METRICS_SUB_BITS + 1;
+
+    return ((1 << SPHX2_METRICS_SUB_BITS)
+            + (b & ((1 << SPHX2_METRICS_SUB_BITS) - 1)) + 1)
+           << (e - SPHX2_METRICS_SUB_BITS);
+}
+
+
+/* bytes of 'src' escaped for a label value or a JSON string */
+static u_char *
+ngx_http_sphinx2_status_escape(u_char *dst, u_char *src, size_t len,
+    ngx_uint_t json)
+{
+    u_char  * last;
+
+    for(last = src + len; src < last; ++src) {
+        if(json) {
+            dst = sphx2_json_escape_char(dst, *src);
+            continue;
+        }
+
+        switch(*src) {
+        case '"':  *dst++ = '\\'; *dst++ = '"'; break;
+        case '\\': *dst++ = '\\'; *dst++ = '\\'; break;
+        case '\n': *dst++ = '\\'; *dst++ = 'n'; break;
+        default:   *dst++ = *src;
+        }
+    }
+
+    return dst;
+}
+
+
+/* the labels of a row - its key - in either format:
+ * location="..",index="..",command=".." or upstream="..",peer=".."
+ */
+static ngx_int_t
+ngx_http_sphinx2_status_labels(ngx_http_request_t *r,
+    ngx_http_sphinx2_status_row_t *row, ngx_uint_t json)
+{
+    ngx_http_sphinx2_metrics_node_t  * mn = row->node;
+    ngx_uint_t                         peer;
+    const char                       * k1, * k2, * q, * sep;
+    u_char                           * p;
+
+    peer = (SPHX2_METRICS_PEER == mn->command);
+
+    k1 = peer ? "upstream" : "location";
+    k2 = peer ? "peer" : "index";
+    q = json ? "\"" : "";
+    sep = json ? ":" : "=";
+
+    if(NULL == (p = ngx_pnalloc(r->pool, SPHX2_STATUS_LABELS_LEN
+                                + (mn->loc_len + mn->index_len) * 6)))
+    {
+        return NGX_ERROR;
+    }
+
+    row->labels.data = p;
+
+    p = ngx_sprintf(p, "%s%s%s%s\"", q, k1, q, sep);
+    p = ngx_http_sphinx2_status_escape(p, mn->data, mn->loc_len, json);
+    p = ngx_sprintf(p, "\",%s%s%s%s\"", q, k2, q, sep);
+    p = ngx_http_sphinx2_status_escape(p, mn->data + mn->loc_len,
+                                       mn->index_len, json);
+    *p++ = '"';
+
+    if(!peer) {
+        p = ngx_sprintf(p, ",%scommand%s%s\"%s\"", q, q, sep,
+                        (SPHX2_COMMAND_EXCERPT == mn->command)
+                            ? "excerpt" : "search");
+    }
+
+    row->labels.len = p - row->labels.data;
+
+    return NGX_OK;
+}
+
+
+/* room for the lines or the JSON of a row */
+static size_t
+ngx_http_sphinx2_status_row_len(ngx_http_sphinx2_status_row_t *row)
+{
+    return (SPHX2_STATUS_ROW_LINES
+            + SPHX2_METRICS_PHASES * SPHX2_METRICS_BUCKETS)
+           * (SPHX2_STATUS_LINE_LEN + row->labels.len);
+}
+
+
+/* prometheus text exposition - a family of samples at a time */
+static u_char *
+ngx_http_sphinx2_status_prometheus(u_char *p,
+    ngx_http_sphinx2_status_row_t *rows, ngx_uint_t n, ngx_uint_t peers)
+{
+    ngx_http_sphinx2_status_row_t    * row;
+    ngx_http_sphinx2_status_metric_t * m;
+    const char                       * pfx;
+    ngx_uint_t                         i, st, ph, b;
+    ngx_atomic_uint_t                  cum;
+    ngx_msec_t                         le;
+
+    pfx = peers ? "sphinx2_peer_" : "sphinx2_";
+
+    for(m = s_status_metrics; m->name; ++m) {
+        if(peers && !m->peers) {
+            continue;
+        }
+
+        p = ngx_sprintf(p, "# HELP %s%s %s\n# TYPE %s%s %s\n",
+                        pfx, m->name, m->help, pfx, m->name, m->type);
+
+        for(i = 0, row = rows; i < n; ++i, ++row) {
+            if(peers != (SPHX2_METRICS_PEER == row->node->command)) {
+                continue;
+            }
+
+            p = ngx_sprintf(p, "%s%s{%V} %uA\n", pfx, m->name, &row->labels,
+                            *(ngx_atomic_t *) ((u_char *) &row->copy
+                                               + m->offset));
+        }
+    }
+
+    p = ngx_sprintf(p, "# HELP %sresponses_total Responses by searchd "
+                    "status.\n# TYPE %sresponses_total counter\n", pfx, pfx);
+
+    for(i = 0, row = rows; i < n; ++i, ++row) {
+        if(peers != (SPHX2_METRICS_PEER == row->node->command)) {
+            continue;
+        }
+
+        for(st = 0; st < SPHX2_METRICS_STATUSES; ++st) {
+            p = ngx_sprintf(p, "%sresponses_total{%V,status=\"%s\"} %uA\n",
+                            pfx, &row->labels, s_status_names[st],
+                            row->copy.status[st]);
+        }
+    }
+
+    p = ngx_sprintf(p, "# HELP %slatency_seconds Time to connect, to the "
+                    "first byte and in all.\n# TYPE %slatency_seconds "
+                    "histogram\n", pfx, pfx);
+
+    for(i = 0, row = rows; i < n; ++i, ++row) {
+        if(peers != (SPHX2_METRICS_PEER == row->node->command)) {
+            continue;
+        }
+
+        for(ph = 0; ph < SPHX2_METRICS_PHASES; ++ph) {
+
+            /* every bucket, empty or not, so that a series has the same
+             * buckets from one scrape to the next; the last has no upper
+             * bound
+             */
+            for(cum = 0, b = 0; b < SPHX2_METRICS_BUCKETS - 1; ++b) {
+                cum += row->copy.hist[ph][b];
+                le = ngx_http_sphinx2_status_bound(b);
+
+                p = ngx_sprintf(p, "%slatency_seconds_bucket{%V,phase=\"%s\","
+                                "le=\"%M.%03M\"} %uA\n", pfx, &row->labels,
+                                s_phase_names[ph], le / 1000, le % 1000, cum);
+            }
+
+            cum += row->copy.hist[ph][b];
+
+            p = ngx_sprintf(p, "%slatency_seconds_bucket{%V,phase=\"%s\","
+                            "le=\"+Inf\"} %uA\n"
+                            "%slatency_seconds_sum{%V,phase=\"%s\"} "
+                            "%uA.%03uA\n"
+                            "%slatency_seconds_count{%V,phase=\"%s\"} %uA\n",
+                            pfx, &row->labels, s_phase_names[ph], cum,
+                            pfx, &row->labels, s_phase_names[ph],
+                            row->copy.sum[ph] / 1000, row->copy.sum[ph] % 1000,
+                            pfx, &row->labels, s_phase_names[ph], cum);
+        }
+    }
+
+    return p;
+}
+
+
+static double
+ngx_http_sphinx2_status_ratio(ngx_atomic_uint_t a, ngx_atomic_uint_t b)
+{
+    return b ? (double) a / b : 0;
+}
+
+
+/* a row as a JSON object */
+static u_char *
+ngx_http_sphinx2_status_json(u_char *p, ngx_http_sphinx2_status_row_t *row)
+{
+    ngx_http_sphinx2_metrics_node_t  * c = &row->copy;
+    ngx_uint_t                         st, ph, b;
+    ngx_atomic_uint_t                  cum;
+    u_char                           * sep;
+
+    p = ngx_sprintf(p, "{%V,\"requests\":%uA,\"qps\":%uA,\"in_flight\":%uA,"
+                    "\"failed\":%uA,\"responses\":{",
+                    &row->labels, c->requests, row->qps, c->in_flight,
+                    c->failed);
+
+    for(st = 0; st < SPHX2_METRICS_STATUSES; ++st) {
+        p = ngx_sprintf(p, "%s\"%s\":%uA", st ? "," : "", s_status_names[st],
+                        c->status[st]);
+    }
+
+    /* a RETRY is searchd turning the request away, so an error too */
+    p = ngx_sprintf(p, "},\"error_rate\":%.4f,\"bytes_in\":%uA,"
+                    "\"bytes_out\":%uA,",
+                    ngx_http_sphinx2_status_ratio(c->failed
+                        + c->status[SPHX2_SEARCHD_ERROR]
+                        + c->status[SPHX2_SEARCHD_RETRY], c->requests),
+                    c->bytes_in, c->bytes_out);
+
+    if(SPHX2_METRICS_PEER != row->node->command) {
+        p = ngx_sprintf(p, "\"cache\":{\"hits\":%uA,\"misses\":%uA,"
+                        "\"hit_ratio\":%.4f},",
+                        c->cache_hits, c->cache_misses,
+                        ngx_http_sphinx2_status_ratio(c->cache_hits,
+                            c->cache_hits + c->cache_misses));
+    }
+
+    p = ngx_sprintf(p, "\"latency_ms\":{");
+
+    for(ph = 0; ph < SPHX2_METRICS_PHASES; ++ph) {
+        p = ngx_sprintf(p, "%s\"%s\":{\"buckets\":[", ph ? "," : "",
+                        s_phase_names[ph]);
+
+        /* [upper bound, count up to it], as the prometheus buckets are */
+        for(sep = (u_char *) "", cum = 0, b = 0;
+            b < SPHX2_METRICS_BUCKETS - 1; ++b)
+        {
+            if(0 == c->hist[ph][b]) {
+                continue;
+            }
+
+            cum += c->hist[ph][b];
+
+            p = ngx_sprintf(p, "%s[%M,%uA]", sep,
+                            ngx_http_sphinx2_status_bound(b), cum);
+            sep = (u_char *) ",";
+        }
+
+        cum += c->hist[ph][b];
+
+        p = ngx_sprintf(p, "],\"count\":%uA,\"sum\":%uA}", cum, c->sum[ph]);
+    }
+
+    return ngx_sprintf(p, "}}");
+}
+
+
+static ngx_int_t
+ngx_http_sphinx2_status_handler(ngx_http_request_t *r)
+{
+    ngx_http_sphinx2_loc_conf_t      * slcf;
+    ngx_http_sphinx2_metrics_t       * metrics;
+    ngx_http_sphinx2_status_row_t    * row;
+    ngx_array_t                        rows;
+    ngx_buf_t                        * b;
+    ngx_chain_t                        out;
+    ngx_str_t                          format;
+    ngx_uint_t                         json, i, peers;
+    ngx_int_t                          rc;
+    size_t                             len;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (ngx_http_discard_request_body(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+    metrics = slcf->status_zone->data;
+
+    json = (NGX_OK == ngx_http_arg(r, (u_char *) "format",
+                                   sizeof("format") - 1, &format)
+            && format.len == sizeof("json") - 1
+            && 0 == ngx_strncmp(format.data, "json", format.len));
+
+    if(NGX_OK != ngx_http_sphinx2_status_rows(r, metrics, &rows)) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    len = SPHX2_STATUS_HEADERS_LEN;
+
+    for(i = 0, row = rows.elts; i < rows.nelts; ++i, ++row) {
+        if(NGX_OK != ngx_http_sphinx2_status_labels(r, row, json)) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        len += ngx_http_sphinx2_status_row_len(row);
+    }
+
+    if(NULL == (b = ngx_create_temp_buf(r->pool, len))) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(json) {
+        b->last = ngx_sprintf(b->last, "{\"uptime\":%T,\"overflow\":%uA",
+                              ngx_time() - metrics->sh->start,
+                              metrics->sh->overflow);
+
+        for(peers = 0; peers < 2; ++peers) {
+            b->last = ngx_sprintf(b->last, ",\"%s\":[",
+                                  peers ? "peers" : "indexes");
+
+            for(i = 0, row = rows.elts, len = 0; i < rows.nelts; ++i, ++row) {
+                if(peers != (SPHX2_METRICS_PEER == row->node->command)) {
+                    continue;
+                }
+
+                if(len++) {
+                    *b->last++ = ',';
+                }
+
+                b->last = ngx_http_sphinx2_status_json(b->last, row);
+            }
+
+            *b->last++ = ']';
+        }
+
+        *b->last++ = '}';
+        *b->last++ = LF;
+
+        r->headers_out.content_type_len = sizeof("application/json") - 1;
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+
+    } else {
+        b->last = ngx_sprintf(b->last, "# HELP sphinx2_metrics_overflow_total "
+                              "Requests not counted for want of room.\n"
+                              "# TYPE sphinx2_metrics_overflow_total counter\n"
+                              "sphinx2_metrics_overflow_total %uA\n",
+                              metrics->sh->overflow);
+
+        b->last = ngx_http_sphinx2_status_prometheus(b->last, rows.elts,
+                                                     rows.nelts, 0);
+        b->last = ngx_http_sphinx2_status_prometheus(b->last, rows.elts,
+                                                     rows.nelts, 1);
+
+        r->headers_out.content_type_len =
+            sizeof("text/plain; version=0.0.4") - 1;
+        ngx_str_set(&r->headers_out.content_type,
+                    "text/plain; version=0.0.4");
+    }
+
+    r->headers_out.content_type_lowcase = NULL;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/* sphinx2_status <zone> */
+char *
+ngx_http_sphinx2_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_loc_conf_t  * slcf = conf;
+    ngx_http_core_loc_conf_t     * clcf;
+    ngx_str_t                    * value;
+
+    if (slcf->status_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (NULL == (slcf->status_zone = ngx_http_sphinx2_metrics_get_zone(cf,
+                                         &value[1])))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf->handler = ngx_http_sphinx2_status_handler;
+
+    return NGX_CONF_OK;
+}
@@ -6,69 +6,81 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 #include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_args_parser.h"
+#include "ngx_http_sphinx2_result.h"
+#include "ngx_http_sphinx2_json.h"
+#include "ngx_http_sphinx2_module.h"
 
 /* TYPES */
 
-typedef enum {
-    SPHX2_ARG_OFFSET = 0,
-    SPHX2_ARG_NUM_RESULTS,
-    SPHX2_ARG_MATCH_MODE,
-    SPHX2_ARG_RANKER,
-    SPHX2_ARG_RANK_EXPR,
-    SPHX2_ARG_SORT_MODE,
-    SPHX2_ARG_SORT_BY,
-    SPHX2_ARG_KEYWORDS,
-    SPHX2_ARG_INDEX,
-    SPHX2_ARG_FILTERS,
-    SPHX2_ARG_GROUP,
-    SPHX2_ARG_MAX_MATCHES,
-    SPHX2_ARG_GEO,
-    SPHX2_ARG_INDEX_WEIGHTS,
-    SPHX2_ARG_FIELD_WEIGHTS,
-    SPHX2_ARG_OUTPUT_FORMAT,
-    SPHX2_ARG_DOCS,
-    SPHX2_ARG_EXCERPT_OPTS,
-    SPHX2_ARG_COUNT
-} sphx2_args_t;
-
+/* per request peer data wrapping that of the balancer in use */
 typedef struct {
-    ngx_http_upstream_conf_t       upstream;
-    ngx_int_t                      cmd_idx;
-    ngx_int_t                      arg_idx[SPHX2_ARG_COUNT];
-} ngx_http_sphinx2_loc_conf_t;
+    void                         * data;
+    ngx_event_get_peer_pt          original_get_peer;
+    ngx_event_free_peer_pt         original_free_peer;
+    ngx_http_request_t           * request;
+    ngx_http_upstream_srv_conf_t * uscf;
+    ngx_http_sphinx2_breaker_try_t breaker;   /* conf NULL - none */
+} ngx_http_sphinx2_peer_data_t;
 
 typedef struct {
-    ngx_http_request_t           * request;
+    ngx_str_t                      name;
     sphx2_command_t                command;
-    sphx2_response_ctx_t           repctx;
-} ngx_http_sphinx2_ctx_t;
+    ngx_uint_t                     batch;
+} ngx_http_sphinx2_cmd_t;
 
 
 /* PROTOTYPES */
 
+static ngx_int_t   ngx_http_sphinx2_add_variables(ngx_conf_t *cf);
+static ngx_int_t   ngx_http_sphinx2_postconfiguration(ngx_conf_t *cf);
+static void      * ngx_http_sphinx2_create_main_conf(ngx_conf_t *cf);
 static void      * ngx_http_sphinx2_create_loc_conf(ngx_conf_t *cf);
 static char      * ngx_http_sphinx2_merge_loc_conf(ngx_conf_t *cf, void 
                        *parent, void *child);
 
 static ngx_int_t   ngx_http_sphinx2_handler(ngx_http_request_t *r);
+static void        ngx_http_sphinx2_launch(ngx_http_request_t *r);
+static void        ngx_http_sphinx2_admit(ngx_http_request_t *r,
+                       ngx_http_sphinx2_ctx_t *ctx);
 static ngx_int_t   ngx_http_sphinx2_create_request(ngx_http_request_t *r);
 static ngx_int_t   ngx_http_sphinx2_reinit_request(ngx_http_request_t *r);
 static ngx_int_t   ngx_http_sphinx2_process_header(ngx_http_request_t *r);
-#if 0
 static ngx_int_t   ngx_http_sphinx2_filter_init(void *data);
 static ngx_int_t   ngx_http_sphinx2_filter(void *data, ssize_t bytes);
-#endif
 static void        ngx_http_sphinx2_abort_request(ngx_http_request_t *r);
 static void        ngx_http_sphinx2_finalize_request(ngx_http_request_t *r, 
 ngx_int_t rc);
 
 static char      * ngx_http_sphinx2_pass(ngx_conf_t *cf, ngx_command_t *cmd, 
                        void *conf);
+static char      * ngx_http_sphinx2_shards(ngx_conf_t *cf, ngx_command_t *cmd,
+                       void *conf);
+static char      * ngx_http_sphinx2_fixed_arg(ngx_conf_t *cf,
+                       ngx_command_t *cmd, void *conf);
+static char      * ngx_http_sphinx2_limit(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char      * ngx_http_sphinx2_deadline(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char      * ngx_http_sphinx2_merge_template(ngx_conf_t *cf,
+                       ngx_http_sphinx2_loc_conf_t *prev,
+                       ngx_http_sphinx2_loc_conf_t *conf);
+
+static ngx_int_t   ngx_http_sphinx2_init_peer(ngx_http_request_t *r,
+                       ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t   ngx_http_sphinx2_get_peer(ngx_peer_connection_t *pc,
+                       void *data);
+static ngx_int_t   ngx_http_sphinx2_output_filter(void *data,
+                       ngx_chain_t *in);
+static void        ngx_http_sphinx2_free_peer(ngx_peer_connection_t *pc,
+                       void *data, ngx_uint_t state);
 
 /* LOCALS */
 
 static ngx_str_t  ngx_http_sphinx2_command = ngx_string("sphinx2_command");
 
+#define SPHX2_ARG_BIT(arg)   ((ngx_uint_t) 1 << (arg))
+
 static ngx_str_t ngx_http_sphinx2_args[] = {
     ngx_string("sphx_offset"),       /* SPHX2_ARG_OFFSET */
     ngx_string("sphx_numresults"),   /* SPHX2_ARG_NUM_RESULTS */
@@ -90,10 +102,33 @@ static ngx_str_t ngx_http_sphinx2_args[] = {
     ngx_string("sphx_excerpt_opts"), /* SPHX2_ARG_EXCERPT_OPTS */
 };
 
-static const char* sphx2_command_strs[] = {
-    "search",  /* SPHX2_COMMAND_SEARCH =      0, */
-    "excerpt", /* SPHX2_COMMAND_EXCERPT =     1 */
-    NULL
+/* query string params read with 'sphinx2_query_args on' */
+static ngx_str_t ngx_http_sphinx2_params[] = {
+    ngx_string("offset"),            /* SPHX2_ARG_OFFSET */
+    ngx_string("nres"),              /* SPHX2_ARG_NUM_RESULTS */
+    ngx_string("match"),             /* SPHX2_ARG_MATCH_MODE */
+    ngx_string("ranker"),            /* SPHX2_ARG_RANKER */
+    ngx_string("rankexpr"),          /* SPHX2_ARG_RANK_EXPR */
+    ngx_string("sort"),              /* SPHX2_ARG_SORT_MODE */
+    ngx_string("sortby"),            /* SPHX2_ARG_SORT_BY */
+    ngx_string("keywords"),          /* SPHX2_ARG_KEYWORDS */
+    ngx_string("index"),             /* SPHX2_ARG_INDEX */
+    ngx_string("filters"),           /* SPHX2_ARG_FILTERS */
+    ngx_string("group"),             /* SPHX2_ARG_GROUP */
+    ngx_string("maxres"),            /* SPHX2_ARG_MAX_MATCHES */
+    ngx_string("geo"),               /* SPHX2_ARG_GEO */
+    ngx_string("idxweights"),        /* SPHX2_ARG_INDEX_WEIGHTS */
+    ngx_string("fldweights"),        /* SPHX2_ARG_FIELD_WEIGHTS */
+    ngx_string("format"),            /* SPHX2_ARG_OUTPUT_FORMAT */
+    ngx_string("docs"),              /* SPHX2_ARG_DOCS */
+    ngx_string("opts"),              /* SPHX2_ARG_EXCERPT_OPTS */
+};
+
+static ngx_http_sphinx2_cmd_t ngx_http_sphinx2_cmds[] = {
+    { ngx_string("search"),      SPHX2_COMMAND_SEARCH,  0 },
+    { ngx_string("excerpt"),     SPHX2_COMMAND_EXCERPT, 0 },
+    { ngx_string("multisearch"), SPHX2_COMMAND_SEARCH,  1 },
+    { ngx_null_string,           SPHX2_COMMAND_NONE,    0 }
 };
 
 /* MODULE GLOBALS */
@@ -103,6 +138,7 @@ static ngx_conf_bitmask_t ngx_http_sphinx2_next_upstream_masks[] = {
     { ngx_string("timeout"),          NGX_HTTP_UPSTREAM_FT_TIMEOUT },
     { ngx_string("invalid_response"), NGX_HTTP_UPSTREAM_FT_INVALID_HEADER },
     { ngx_string("not_found"),        NGX_HTTP_UPSTREAM_FT_HTTP_404 },
+    { ngx_string("retry"),            NGX_HTTP_UPSTREAM_FT_HTTP_503 },
     { ngx_string("off"),              NGX_HTTP_UPSTREAM_FT_OFF },
     { ngx_null_string, 0 }
 };
@@ -118,6 +154,149 @@ static ngx_command_t ngx_http_sphinx2_commands[] = {
       0,
       NULL },
 
+    { ngx_string("sphinx2_shards"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_sphinx2_shards,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_persist"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, persist),
+      NULL },
+
+    { ngx_string("sphinx2_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_http_sphinx2_cache_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_cache_valid"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, cache_valid),
+      NULL },
+
+    { ngx_string("sphinx2_cache_max_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, cache_max_size),
+      NULL },
+
+    { ngx_string("sphinx2_coalesce"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, coalesce),
+      NULL },
+
+    { ngx_string("sphinx2_coalesce_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, coalesce_timeout),
+      NULL },
+
+    { ngx_string("sphinx2_query_args"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, query_args),
+      NULL },
+
+    /* query arguments fixed for a location, instead of taken from the
+     * $sphx_* variables
+     */
+    { ngx_string("sphinx2_index"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_fixed_arg,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, fixed[SPHX2_ARG_INDEX]),
+      NULL },
+
+    { ngx_string("sphinx2_match_mode"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_fixed_arg,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, fixed[SPHX2_ARG_MATCH_MODE]),
+      NULL },
+
+    { ngx_string("sphinx2_ranker"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_fixed_arg,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, fixed[SPHX2_ARG_RANKER]),
+      NULL },
+
+    { ngx_string("sphinx2_rank_expr"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_fixed_arg,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, fixed[SPHX2_ARG_RANK_EXPR]),
+      NULL },
+
+    { ngx_string("sphinx2_sort_mode"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_fixed_arg,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, fixed[SPHX2_ARG_SORT_MODE]),
+      NULL },
+
+    { ngx_string("sphinx2_sort_by"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_fixed_arg,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, fixed[SPHX2_ARG_SORT_BY]),
+      NULL },
+
+    { ngx_string("sphinx2_group"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_fixed_arg,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, fixed[SPHX2_ARG_GROUP]),
+      NULL },
+
+    { ngx_string("sphinx2_max_matches"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_fixed_arg,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, fixed[SPHX2_ARG_MAX_MATCHES]),
+      NULL },
+
+    { ngx_string("sphinx2_geo"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_fixed_arg,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, fixed[SPHX2_ARG_GEO]),
+      NULL },
+
+    { ngx_string("sphinx2_index_weights"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_fixed_arg,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, fixed[SPHX2_ARG_INDEX_WEIGHTS]),
+      NULL },
+
+    { ngx_string("sphinx2_field_weights"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_fixed_arg,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, fixed[SPHX2_ARG_FIELD_WEIGHTS]),
+      NULL },
+
     /* standard ones for upstream module */
     { ngx_string("sphinx2_bind"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
@@ -126,6 +305,132 @@ static ngx_command_t ngx_http_sphinx2_commands[] = {
       offsetof(ngx_http_sphinx2_loc_conf_t, upstream.local),
       NULL },
 
+    { ngx_string("sphinx2_trace"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_trace,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_trace_log"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_trace_log,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_metrics_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_http_sphinx2_metrics_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_metrics"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_metrics,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_sphinx2_check,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_balancer"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_1MORE,
+      ngx_http_sphinx2_balancer,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_breaker"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_sphinx2_breaker,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_concurrency"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_sphinx2_concurrency,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_filter_set"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_filter_set,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_hedge"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_hedge,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_excerpt_split"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_sphinx2_excerpt_split,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("sphinx2_class"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, query_class),
+      NULL },
+
+    { ngx_string("sphinx2_max_query_time"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_limit,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, max_query_time),
+      NULL },
+
+    { ngx_string("sphinx2_cutoff"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_limit,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, cutoff),
+      NULL },
+
+    { ngx_string("sphinx2_retry_count"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_limit,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, retry_count),
+      NULL },
+
+    { ngx_string("sphinx2_retry_delay"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_limit,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sphinx2_loc_conf_t, retry_delay),
+      NULL },
+
+    { ngx_string("sphinx2_deadline"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_sphinx2_deadline,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("sphinx2_connect_timeout"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -158,18 +463,76 @@ static ngx_command_t ngx_http_sphinx2_commands[] = {
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
       ngx_conf_set_bitmask_slot,
       NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_sphinx2_loc_conf_t, upstream.upstream),
+      offsetof(ngx_http_sphinx2_loc_conf_t, upstream.next_upstream),
       &ngx_http_sphinx2_next_upstream_masks },
 
       ngx_null_command
 };
 
+static ngx_int_t   ngx_http_sphinx2_usec_variable(ngx_http_request_t *r,
+                       ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t   ngx_http_sphinx2_first_byte_variable(ngx_http_request_t *r,
+                       ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t   ngx_http_sphinx2_response_len_variable(
+                       ngx_http_request_t *r, ngx_http_variable_value_t *v,
+                       uintptr_t data);
+static ngx_int_t   ngx_http_sphinx2_status_variable(ngx_http_request_t *r,
+                       ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t   ngx_http_sphinx2_total_found_variable(
+                       ngx_http_request_t *r, ngx_http_variable_value_t *v,
+                       uintptr_t data);
+static ngx_int_t   ngx_http_sphinx2_hedge_variable(ngx_http_request_t *r,
+                       ngx_http_variable_value_t *v, uintptr_t data);
+
+/* per-request timings and outcome, for access logs */
+static ngx_http_variable_t ngx_http_sphinx2_vars[] = {
+
+    { ngx_string("sphinx2_parse_time"), NULL,
+      ngx_http_sphinx2_usec_variable,
+      offsetof(ngx_http_sphinx2_ctx_t, parse_usec),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("sphinx2_serialize_time"), NULL,
+      ngx_http_sphinx2_usec_variable,
+      offsetof(ngx_http_sphinx2_ctx_t, serialize_usec),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("sphinx2_upstream_first_byte"), NULL,
+      ngx_http_sphinx2_first_byte_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("sphinx2_response_len"), NULL,
+      ngx_http_sphinx2_response_len_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("sphinx2_status"), NULL,
+      ngx_http_sphinx2_status_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("sphinx2_total_found"), NULL,
+      ngx_http_sphinx2_total_found_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("sphinx2_hedge"), NULL,
+      ngx_http_sphinx2_hedge_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+static ngx_str_t ngx_http_sphinx2_status_names[] = {
+    ngx_string("ok"),           /* SPHX2_SEARCHD_OK */
+    ngx_string("error"),        /* SPHX2_SEARCHD_ERROR */
+    ngx_string("retry"),        /* SPHX2_SEARCHD_RETRY */
+    ngx_string("warning")       /* SPHX2_SEARCHD_WARNING */
+};
+
 
 static ngx_http_module_t  ngx_http_sphinx2_module_ctx = {
-    NULL,                                  /* preconfiguration */
-    NULL,                                  /* postconfiguration */
+    ngx_http_sphinx2_add_variables,        /* preconfiguration */
+    ngx_http_sphinx2_postconfiguration,    /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
+    ngx_http_sphinx2_create_main_conf,     /* create main configuration */
     NULL,                                  /* init main configuration */
 
     NULL,                                  /* create server configuration */
@@ -187,7 +550,7 @@ ngx_module_t ngx_http_sphinx2_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_sphinx2_check_init_process,   /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -198,6 +561,77 @@ ngx_module_t ngx_http_sphinx2_module = {
 
 /* FUNCTION DEFINITIONS */
 
+static ngx_int_t
+ngx_http_sphinx2_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_sphinx2_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+/* main conf creation */
+static void*
+ngx_http_sphinx2_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_sphinx2_main_conf_t  *smcf;
+
+    if(NULL == (smcf = ngx_pcalloc(cf->pool,
+                           sizeof(ngx_http_sphinx2_main_conf_t))))
+    {
+        return NULL;
+    }
+
+    if(NGX_OK != ngx_array_init(&smcf->upstreams, cf->pool, 4,
+                                sizeof(ngx_http_sphinx2_upstream_t))
+       || NGX_OK != ngx_array_init(&smcf->checks, cf->pool, 2,
+                                   sizeof(ngx_http_sphinx2_check_conf_t))
+       || NGX_OK != ngx_array_init(&smcf->balancers, cf->pool, 2,
+                                   sizeof(ngx_http_sphinx2_balancer_conf_t))
+       || NGX_OK != ngx_array_init(&smcf->breakers, cf->pool, 2,
+                                   sizeof(ngx_http_sphinx2_breaker_conf_t))
+       || NGX_OK != ngx_array_init(&smcf->concurrencies, cf->pool, 2,
+                         sizeof(ngx_http_sphinx2_concurrency_conf_t *))
+       || NGX_OK != ngx_array_init(&smcf->filter_sets, cf->pool, 2,
+                                   sizeof(sphx2_filter_set_t)))
+    {
+        return NULL;
+    }
+
+    return smcf;
+}
+
+/* hook into peer init of every upstream used by sphinx2_pass. The
+ * balancers have set up their peer init by now (upstream main conf init
+ * runs before any postconfiguration)
+ */
+static ngx_int_t
+ngx_http_sphinx2_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_http_sphinx2_main_conf_t  *smcf;
+    ngx_http_sphinx2_upstream_t   *sus;
+    ngx_uint_t                     i;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_sphinx2_module);
+
+    sus = smcf->upstreams.elts;
+    for(i = 0; i < smcf->upstreams.nelts; ++i) {
+        sus[i].original_init_peer = sus[i].uscf->peer.init;
+        sus[i].uscf->peer.init = ngx_http_sphinx2_init_peer;
+    }
+
+    return ngx_http_sphinx2_breaker_init(cf);
+}
+
 /* location conf creation */
 static void*
 ngx_http_sphinx2_create_loc_conf(ngx_conf_t *cf)
@@ -219,6 +653,13 @@ ngx_http_sphinx2_create_loc_conf(ngx_conf_t *cf)
      *     conf->upstream.temp_path = NULL;
      *     conf->upstream.uri = { 0, NULL };
      *     conf->upstream.location = NULL;
+     *     conf->shards = NULL;
+     *     conf->max_query_time = NULL;
+     *     conf->cutoff = NULL;
+     *     conf->retry_count = NULL;
+     *     conf->retry_delay = NULL;
+     *     conf->deadline_budget = NULL;
+     *     conf->query_class = NULL;
      */
 
     conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
@@ -246,6 +687,20 @@ ngx_http_sphinx2_create_loc_conf(ngx_conf_t *cf)
     for(i = 0; i < SPHX2_ARG_COUNT; ++i) {
         conf->arg_idx[i] = NGX_CONF_UNSET;
     }
+    conf->query_args = NGX_CONF_UNSET;
+    conf->persist = NGX_CONF_UNSET;
+    conf->cache_zone = NGX_CONF_UNSET_PTR;
+    conf->cache_valid = NGX_CONF_UNSET;
+    conf->cache_max_size = NGX_CONF_UNSET_SIZE;
+    conf->coalesce = NGX_CONF_UNSET;
+    conf->coalesce_timeout = NGX_CONF_UNSET_MSEC;
+    conf->trace = NGX_CONF_UNSET_UINT;
+    conf->trace_log = NGX_CONF_UNSET_PTR;
+    conf->metrics_zone = NGX_CONF_UNSET_PTR;
+    conf->status_zone = NGX_CONF_UNSET_PTR;
+    conf->hedge_after = NGX_CONF_UNSET_MSEC;
+    conf->excerpt_split = NGX_CONF_UNSET_UINT;
+    conf->deadline = NGX_CONF_UNSET;
 
     return conf;
 }
@@ -286,70 +741,249 @@ ngx_http_sphinx2_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     if(conf->cmd_idx == NGX_CONF_UNSET) {
         conf->cmd_idx = prev->cmd_idx;
     }
+
+    ngx_conf_merge_value(conf->query_args, prev->query_args, 0);
+
+    if(NGX_CONF_OK != ngx_http_sphinx2_merge_template(cf, prev, conf)) {
+        return NGX_CONF_ERROR;
+    }
+
     for(i = 0; i < SPHX2_ARG_COUNT; ++i) {
         if(conf->arg_idx[i] == NGX_CONF_UNSET) {
             conf->arg_idx[i] = prev->arg_idx[i];
         }
+
+        /* a sphinx2 location takes the args it doesn't fix from the
+         * $sphx_* variables, unless it reads the query string itself
+         */
+        if(conf->arg_idx[i] != NGX_CONF_UNSET
+           || conf->cmd_idx == NGX_CONF_UNSET
+           || conf->query_args
+           || (conf->fixed_args & SPHX2_ARG_BIT(i)))
+        {
+            continue;
+        }
+
+        if(NGX_ERROR == (conf->arg_idx[i] = ngx_http_get_variable_index(
+                                      cf, &ngx_http_sphinx2_args[i])))
+        {
+            ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+                 "Can't get variable index for '%s' key",
+                    ngx_http_sphinx2_args[i].data);
+            return NGX_CONF_ERROR;
+        }
     }
 
-    return NGX_CONF_OK;
-}
+    ngx_conf_merge_value(conf->persist, prev->persist, 0);
 
-/* pass */
-static char*
-ngx_http_sphinx2_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_sphinx2_loc_conf_t *slcf = conf;
-    ngx_str_t                  *value;
-    ngx_url_t                   url;
-    ngx_http_core_loc_conf_t   *clcf;
-    size_t                      i;
+    ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+    ngx_conf_merge_sec_value(conf->cache_valid, prev->cache_valid, 60);
+    ngx_conf_merge_size_value(conf->cache_max_size, prev->cache_max_size,
+                              64 * 1024);
 
-    if (slcf->upstream.upstream) {
-        return "is duplicate";
+    ngx_conf_merge_value(conf->coalesce, prev->coalesce, 0);
+    ngx_conf_merge_msec_value(conf->coalesce_timeout, prev->coalesce_timeout,
+                              conf->upstream.read_timeout);
+
+    if(conf->trace == NGX_CONF_UNSET_UINT) {
+        conf->trace = (prev->trace == NGX_CONF_UNSET_UINT)
+                          ? SPHX2_TRACE_OFF : prev->trace;
+        conf->trace_sample = prev->trace_sample;
     }
 
-    value = cf->args->elts;
+    ngx_conf_merge_ptr_value(conf->trace_log, prev->trace_log, NULL);
 
-    ngx_memzero(&url, sizeof(ngx_url_t));
+    ngx_conf_merge_ptr_value(conf->metrics_zone, prev->metrics_zone, NULL);
 
-    url.url = value[1];
-    url.no_resolve = 1;
+    if(conf->status_zone == NGX_CONF_UNSET_PTR) {
+        conf->status_zone = NULL;
+    }
 
-    slcf->upstream.upstream = ngx_http_upstream_add(cf, &url, 0);
-    if (slcf->upstream.upstream == NULL) {
-        return NGX_CONF_ERROR;
+    if(conf->hedge_after == NGX_CONF_UNSET_MSEC) {
+        conf->hedge_after = (prev->hedge_after == NGX_CONF_UNSET_MSEC)
+                                ? 0 : prev->hedge_after;
+        conf->hedge_percent = prev->hedge_percent;
     }
 
-    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    if(conf->excerpt_split == NGX_CONF_UNSET_UINT) {
+        conf->excerpt_split = (prev->excerpt_split == NGX_CONF_UNSET_UINT)
+                                  ? 0 : prev->excerpt_split;
+        conf->excerpt_split_min = prev->excerpt_split_min;
+    }
 
-    clcf->handler = ngx_http_sphinx2_handler;
+    if(conf->max_query_time == NULL) {
+        conf->max_query_time = prev->max_query_time;
+    }
 
-    if (clcf->name.data[clcf->name.len - 1] == '/') {
-        clcf->auto_redirect = 1;
+    if(conf->cutoff == NULL) {
+        conf->cutoff = prev->cutoff;
     }
 
-    if(NGX_ERROR == (slcf->cmd_idx = ngx_http_get_variable_index(
-                                      cf, &ngx_http_sphinx2_command)))
-    {
-        ngx_log_error(NGX_LOG_ERR, cf->log, 0,
-             "Can't get variable index for 'sphinx2_command'");
-        return NGX_CONF_ERROR;
+    if(conf->retry_count == NULL) {
+        conf->retry_count = prev->retry_count;
     }
 
-    for(i = 0; i < SPHX2_ARG_COUNT; ++i) {
-        if(NGX_ERROR == (slcf->arg_idx[i] = ngx_http_get_variable_index(
-                                      cf, &ngx_http_sphinx2_args[i])))
-        {
-            ngx_log_error(NGX_LOG_ERR, cf->log, 0,
-                 "Can't get variable index for '%s' key",
-                    ngx_http_sphinx2_args[i].data);
-            return NGX_CONF_ERROR;
-        }
+    if(conf->retry_delay == NULL) {
+        conf->retry_delay = prev->retry_delay;
     }
 
-    return NGX_CONF_OK;
-}
+    if(conf->query_class == NULL) {
+        conf->query_class = prev->query_class;
+    }
+
+    if(conf->deadline == NGX_CONF_UNSET) {
+        conf->deadline = (prev->deadline == NGX_CONF_UNSET)
+                             ? 0 : prev->deadline;
+        conf->deadline_budget = prev->deadline_budget;
+    }
+
+    /* a percentile is of the location's own first byte times */
+    if(conf->hedge_percent && NULL == conf->metrics_zone
+       && NULL != conf->upstream.upstream)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"sphinx2_hedge after=p%ui\" needs "
+                           "\"sphinx2_metrics\"", conf->hedge_percent);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* add an upstream and remember it, to wrap its peer init at
+ * postconfiguration
+ */
+static ngx_http_upstream_srv_conf_t*
+ngx_http_sphinx2_add_upstream(ngx_conf_t *cf, ngx_str_t *name)
+{
+    ngx_http_sphinx2_main_conf_t *smcf;
+    ngx_http_sphinx2_upstream_t *sus;
+    ngx_http_upstream_srv_conf_t *uscf;
+    ngx_url_t                   url;
+    size_t                      i;
+
+    ngx_memzero(&url, sizeof(ngx_url_t));
+
+    url.url = *name;
+    url.no_resolve = 1;
+
+    if (NULL == (uscf = ngx_http_upstream_add(cf, &url, 0))) {
+        return NULL;
+    }
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_sphinx2_module);
+
+    sus = smcf->upstreams.elts;
+    for(i = 0; i < smcf->upstreams.nelts; ++i) {
+        if(sus[i].uscf == uscf) {
+            return uscf;
+        }
+    }
+
+    if(NULL == (sus = ngx_array_push(&smcf->upstreams))) {
+        return NULL;
+    }
+    sus->uscf = uscf;
+    sus->original_init_peer = NULL;
+
+    return uscf;
+}
+
+/* make the location a sphinx2 one */
+static char*
+ngx_http_sphinx2_set_handler(ngx_conf_t *cf, ngx_http_sphinx2_loc_conf_t *slcf)
+{
+    ngx_http_core_loc_conf_t   *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf->handler = ngx_http_sphinx2_handler;
+
+    if (clcf->name.data[clcf->name.len - 1] == '/') {
+        clcf->auto_redirect = 1;
+    }
+
+    if(NGX_ERROR == (slcf->cmd_idx = ngx_http_get_variable_index(
+                                      cf, &ngx_http_sphinx2_command)))
+    {
+        ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+             "Can't get variable index for 'sphinx2_command'");
+        return NGX_CONF_ERROR;
+    }
+
+    /* the indexes of the argument variables are taken at merge, once it
+     * is known which of the arguments the location fixes
+     */
+
+    return NGX_CONF_OK;
+}
+
+/* pass */
+static char*
+ngx_http_sphinx2_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_loc_conf_t *slcf = conf;
+    ngx_str_t                  *value;
+
+    if (slcf->shards) {
+        return "is not allowed with \"sphinx2_shards\"";
+    }
+
+    if (slcf->upstream.upstream) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    slcf->upstream.upstream = ngx_http_sphinx2_add_upstream(cf, &value[1]);
+    if (slcf->upstream.upstream == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return ngx_http_sphinx2_set_handler(cf, slcf);
+}
+
+/* shards - searches go to every upstream given, excerpts to the first */
+static char*
+ngx_http_sphinx2_shards(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_loc_conf_t *slcf = conf;
+    ngx_http_upstream_srv_conf_t **uscfp;
+    ngx_str_t                  *value;
+    size_t                      i;
+
+    if (slcf->shards) {
+        return "is duplicate";
+    }
+
+    if (slcf->upstream.upstream) {
+        return "is not allowed with \"sphinx2_pass\"";
+    }
+
+    value = cf->args->elts;
+
+    if(NULL == (slcf->shards = ngx_array_create(cf->pool, cf->args->nelts - 1,
+                                   sizeof(ngx_http_upstream_srv_conf_t*))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    for(i = 1; i < cf->args->nelts; ++i) {
+        if(NULL == (uscfp = ngx_array_push(slcf->shards))
+           || NULL == (*uscfp = ngx_http_sphinx2_add_upstream(cf, &value[i])))
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /* the shard subrequests start from this conf; each is then pointed at
+     * its own shard
+     */
+    slcf->upstream.upstream = *(ngx_http_upstream_srv_conf_t**)
+                                  slcf->shards->elts;
+
+    return ngx_http_sphinx2_set_handler(cf, slcf);
+}
 
 /* upstream handler to provide the callbacks */
 ngx_int_t
@@ -360,9 +994,9 @@ ngx_http_sphinx2_handler(ngx_http_request_t *r)
     ngx_http_sphinx2_ctx_t          *ctx;
     ngx_http_sphinx2_loc_conf_t     *slcf;
 
-    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST))) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "sphinx2_handler: http method is not GET or HEAD");
+            "sphinx2_handler: http method is not GET, HEAD or POST");
         return NGX_HTTP_NOT_ALLOWED;
     }
 
@@ -394,20 +1028,36 @@ ngx_http_sphinx2_handler(ngx_http_request_t *r)
     u->abort_request = ngx_http_sphinx2_abort_request;
     u->finalize_request = ngx_http_sphinx2_finalize_request;
 
-    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_sphinx2_ctx_t));
+    /* a shard subrequest comes with its context set up */
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
     if (ctx == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+        ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_sphinx2_ctx_t));
+        if (ctx == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ctx->request = r;
+        ctx->persist = slcf->persist ? 1 : 0;
 
-    /* TODO upstream context's sphinx specific members init here */
+        ngx_http_set_ctx(r, ctx, ngx_http_sphinx2_module);
 
-    ngx_http_set_ctx(r, ctx, ngx_http_sphinx2_module);
+    } else if (ctx->shard
+               && NGX_OK != ngx_http_sphinx2_fanout_init_shard(r, ctx))
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-    /*u->input_filter_init = ngx_http_sphinx2_filter_init;
+    u->input_filter_init = ngx_http_sphinx2_filter_init;
     u->input_filter = ngx_http_sphinx2_filter;
-    u->input_filter_ctx = ctx;*/
+    u->input_filter_ctx = ctx;
+
+    /* the arguments of a POST refer to its body, which is kept in one
+     * buffer if it fits in client_body_buffer_size
+     */
+    r->request_body_in_single_buf = 1;
 
-    rc = ngx_http_read_client_request_body(r, ngx_http_upstream_init);
+    rc = ngx_http_read_client_request_body(r, ngx_http_sphinx2_launch);
 
     if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
         return rc;
@@ -416,32 +1066,37 @@ ngx_http_sphinx2_handler(ngx_http_request_t *r)
     return NGX_DONE;
 }
 
-/* Macros for argument parsing code for search, excerpt etc. */
+/* Macros for argument parsing code for search, excerpt etc. An arg fixed
+ * for the location is left as the template has it.
+ */
+
+#define SKIP_FIXED_ARG(arg_no) \
+    if(slcf->fixed_args & SPHX2_ARG_BIT(arg_no)) { break; }
 
-#define GET_INDEXED_VARIABLE_VAL(r, slcf, arg_no) \
-    ngx_int_t i = slcf->arg_idx[arg_no]; \
-    ngx_http_variable_value_t * vv = ngx_http_get_indexed_variable(r, i); \
-    if (vv == NULL || vv->not_found) { \
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, \
-            "'%s' variable is not set", ngx_http_sphinx2_args[arg_no].data); \
+#define GET_INDEXED_VARIABLE_SLICE(r, slcf, arg_no) \
+    ngx_str_t vvq; \
+    if(NGX_OK != ngx_http_sphinx2_arg_value(r, slcf, arg_no, q, &vvq)) { \
         return NGX_ERROR; \
-    } \
+    }
+
+#define GET_INDEXED_VARIABLE_STR(r, slcf, arg_no) \
+    GET_INDEXED_VARIABLE_SLICE(r, slcf, arg_no); \
     ngx_str_t* vvs = ngx_palloc(r->pool, sizeof(ngx_str_t)); \
-    if(NULL == vvs) { return NGX_ERROR; } \
-    if(vv->len != 0) { \
-        if(NULL == (vvs->data = ngx_palloc(r->pool, vv->len))) { \
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, \
-                "Failed to allocate while getting indexed variable"); \
-            return NGX_ERROR; \
-        } \
-        memcpy(vvs->data, vv->data, vv->len); \
-    } else { vvs->data = NULL; } \
-    vvs->len = vv->len;
+    if(NULL == vvs) { return NGX_ERROR; }
+
+/* the parsers neither write to the value nor need it null terminated, so
+ * it is referred to as it is
+ */
+#define GET_INDEXED_VARIABLE_VAL(r, slcf, arg_no) \
+    GET_INDEXED_VARIABLE_STR(r, slcf, arg_no); \
+    vvs->data = vvq.len ? vvq.data : NULL; \
+    vvs->len = vvq.len;
 
 #define MUST_HAVE_ARG(arg_no) \
 do { \
-    GET_INDEXED_VARIABLE_VAL(r, slcf, arg_no); \
-    if(0 == vvs->len) { \
+    SKIP_FIXED_ARG(arg_no); \
+    GET_INDEXED_VARIABLE_SLICE(r, slcf, arg_no); \
+    if(0 == vvq.len) { \
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, \
             "No value for arg '%s' specified\n", \
             ngx_http_sphinx2_args[arg_no].data); \
@@ -449,30 +1104,50 @@ do { \
     } \
 } while(0)
 
+/* plain strings aren't parsed - they refer to the value as it is */
 #define GET_ARG(arg_no, var) \
 do { \
-    GET_INDEXED_VARIABLE_VAL(r, slcf, arg_no); \
+    SKIP_FIXED_ARG(arg_no); \
+    GET_INDEXED_VARIABLE_STR(r, slcf, arg_no); \
+    vvs->data = vvq.len ? vvq.data : NULL; \
+    vvs->len = vvq.len; \
     input->var = vvs; \
 } while(0)
 
 #define PARSE_INT_ARG(arg_no, var, dflt)   \
 do { \
+    SKIP_FIXED_ARG(arg_no); \
     GET_INDEXED_VARIABLE_VAL(r, slcf, arg_no); \
-    if(vvs->len != 0) { \
-        input->var = atoi((const char*)(vvs->data)); \
-    } else { input->var = dflt; } \
+    if(vvs->len == 0) { \
+        input->var = dflt; \
+    } else if(NGX_OK != sphx2_arg_parse_int(vvs, &input->var)) { \
+        return NGX_ERROR; \
+    } \
 } while(0)
 
 #define PARSE_LIST_ARG(arg_no, key) \
 do { \
+    SKIP_FIXED_ARG(arg_no); \
     GET_INDEXED_VARIABLE_VAL(r, slcf, arg_no); \
     if(vvs->len != 0 && NGX_OK != sphx2_parse_ ## key ## _str( \
                 r->pool, vvs, &(input->key), &(input->num_ ## key))) \
     { return NGX_ERROR; } \
 } while(0)
 
+/* filters - a 'set' filter names one of the configuration's sets */
+#define PARSE_FILTERS_ARG(arg_no) \
+do { \
+    SKIP_FIXED_ARG(arg_no); \
+    GET_INDEXED_VARIABLE_VAL(r, slcf, arg_no); \
+    if(vvs->len != 0 && NGX_OK != sphx2_parse_filters_str(r->pool, \
+                &smcf->filter_sets, vvs, &input->filters, \
+                &input->num_filters)) \
+    { return NGX_ERROR; } \
+} while(0)
+
 #define PARSE_ELEM_ARG(arg_no, key) \
 do { \
+    SKIP_FIXED_ARG(arg_no); \
     GET_INDEXED_VARIABLE_VAL(r, slcf, arg_no); \
     if(vvs->len != 0 && NGX_OK != sphx2_parse_ ## key ## _str( \
                              r->pool, vvs, &input->key)) \
@@ -481,12 +1156,202 @@ do { \
 
 #define PARSE_ELEM_ARG_2(arg_no, key) \
 do { \
+    SKIP_FIXED_ARG(arg_no); \
     GET_INDEXED_VARIABLE_VAL(r, slcf, arg_no); \
     if(NGX_OK != sphx2_parse_ ## key ## _str( \
                              r->pool, vvs, &input->key)) \
     { return NGX_ERROR; } \
 } while(0)
 
+/* narrow a variable value down to the value of query 'q' of a batch;
+ * values are separated by SPHX2_QUERY_DELIM and a value without any
+ * separator is shared by all the queries. q < 0 means no batching.
+ */
+static void
+ngx_http_sphinx2_query_slice(ngx_str_t *v, ngx_int_t q)
+{
+    u_char      * start, * last, * p;
+    ngx_int_t     n;
+
+    if(q < 0 || 0 == v->len
+       || NULL == memchr(v->data, SPHX2_QUERY_DELIM, v->len))
+    {
+        return;
+    }
+
+    start = v->data;
+    last = v->data + v->len;
+
+    for(n = 0; n < q; ++n) {
+        if(NULL == (p = memchr(start, SPHX2_QUERY_DELIM, last - start))) {
+            /* fewer values than queries - fall back to defaults */
+            v->len = 0;
+            return;
+        }
+        start = p + 1;
+    }
+
+    p = memchr(start, SPHX2_QUERY_DELIM, last - start);
+
+    v->data = start;
+    v->len = ((NULL != p) ? p : last) - start;
+}
+
+/* the index of the query argument a param is named for, SPHX2_ARG_COUNT
+ * if none
+ */
+ngx_uint_t
+ngx_http_sphinx2_param(u_char *name, size_t len)
+{
+    ngx_uint_t                   i;
+
+    for(i = 0; i < SPHX2_ARG_COUNT; ++i) {
+        if(ngx_http_sphinx2_params[i].len == len
+           && 0 == ngx_strncmp(ngx_http_sphinx2_params[i].data, name, len))
+        {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/* unescape the query string params which are query arguments, for
+ * 'sphinx2_query_args on'. The values go into one buffer; a param given
+ * more than once has its first value used, as with $arg_*.
+ */
+static ngx_int_t
+ngx_http_sphinx2_scan_args(ngx_http_request_t *r, ngx_http_sphinx2_ctx_t *ctx)
+{
+    u_char                     * p, * last, * amp, * eq, * dst, * src;
+    ngx_str_t                  * args;
+    size_t                       name_len;
+    ngx_uint_t                   i;
+
+    if(NULL == (args = ngx_pcalloc(r->pool,
+                           SPHX2_ARG_COUNT * sizeof(ngx_str_t)))
+       || NULL == (dst = ngx_pnalloc(r->pool, r->args.len)))
+    {
+        return NGX_ERROR;
+    }
+
+    p = r->args.data;
+    last = r->args.data + r->args.len;
+
+    while(p < last) {
+        if(NULL == (amp = memchr(p, '&', last - p))) {
+            amp = last;
+        }
+
+        eq = memchr(p, '=', amp - p);
+        name_len = ((NULL != eq) ? eq : amp) - p;
+
+        i = ngx_http_sphinx2_param(p, name_len);
+
+        p = amp + 1;
+
+        if(SPHX2_ARG_COUNT == i || NULL != args[i].data) {
+            continue;
+        }
+
+        args[i].data = dst;
+
+        if(NULL != eq) {
+            /* '+' is a space in a query string; %XX is undone after */
+            for(src = eq + 1; src < amp; ++src) {
+                *dst++ = ('+' == *src) ? ' ' : *src;
+            }
+
+            src = args[i].data;
+            dst = args[i].data;
+
+            ngx_unescape_uri(&dst, &src, amp - eq - 1, 0);
+        }
+
+        args[i].len = dst - args[i].data;
+    }
+
+    ctx->args = args;
+
+    return NGX_OK;
+}
+
+/* the value of an argument, for query 'q' of a batch - from the request
+ * body, or else from the query string or its $sphx_* variable
+ */
+static ngx_int_t
+ngx_http_sphinx2_arg_value(
+    ngx_http_request_t                  * r,
+    ngx_http_sphinx2_loc_conf_t         * slcf,
+    ngx_uint_t                            arg_no,
+    ngx_int_t                             q,
+    ngx_str_t                           * v)
+{
+    ngx_http_sphinx2_ctx_t     * ctx;
+    ngx_http_variable_value_t  * vv;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(NULL != ctx->body_args && NULL != ctx->body_args[arg_no].data) {
+        *v = ctx->body_args[arg_no];
+
+    } else if(slcf->query_args) {
+        *v = ctx->args[arg_no];
+
+    } else {
+        vv = ngx_http_get_indexed_variable(r, slcf->arg_idx[arg_no]);
+
+        if (vv == NULL || vv->not_found) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "'%s' variable is not set",
+                ngx_http_sphinx2_args[arg_no].data);
+            return NGX_ERROR;
+        }
+
+        v->len = vv->len;
+        v->data = vv->data;
+    }
+
+    ngx_http_sphinx2_query_slice(v, q);
+
+    return NGX_OK;
+}
+
+/* number of queries in a batch - the most values any argument has */
+static ngx_uint_t
+ngx_http_sphinx2_count_queries(
+    ngx_http_request_t                  * r,
+    ngx_http_sphinx2_loc_conf_t         * slcf)
+{
+    ngx_str_t                    v;
+    ngx_uint_t                   i, n, max = 1;
+    u_char                     * p, * last;
+
+    for(i = 0; i < SPHX2_ARG_COUNT; ++i) {
+        if(slcf->fixed_args & SPHX2_ARG_BIT(i)) {
+            continue;
+        }
+
+        if(NGX_OK != ngx_http_sphinx2_arg_value(r, slcf, i, -1, &v)
+           || 0 == v.len)
+        {
+            continue;
+        }
+
+        n = 1;
+        p = v.data;
+        last = v.data + v.len;
+
+        while(NULL != (p = memchr(p, SPHX2_QUERY_DELIM, last - p))) {
+            ++n; ++p;
+        }
+
+        if(n > max) max = n;
+    }
+
+    return max;
+}
+
 /* parse search arguments */
 
 static ngx_str_t s_empty_str = ngx_null_string;
@@ -495,8 +1360,17 @@ static ngx_int_t
 ngx_http_sphinx2_parse_search_args(
     ngx_http_request_t                  * r,
     ngx_http_sphinx2_loc_conf_t         * slcf,
+    ngx_int_t                             q,
     sphx2_search_input_t                * input)
 {
+    ngx_http_sphinx2_main_conf_t        * smcf;
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_sphinx2_module);
+
+    if(NULL != slcf->tmpl) {
+        *input = *slcf->tmpl;
+    }
+
     MUST_HAVE_ARG(SPHX2_ARG_KEYWORDS); 
 
     MUST_HAVE_ARG(SPHX2_ARG_INDEX);
@@ -538,7 +1412,7 @@ ngx_http_sphinx2_parse_search_args(
     GET_ARG(SPHX2_ARG_INDEX, index);
 
     /* filters */
-    PARSE_LIST_ARG(SPHX2_ARG_FILTERS, filters);
+    PARSE_FILTERS_ARG(SPHX2_ARG_FILTERS);
 
     /* group */
     PARSE_ELEM_ARG_2(SPHX2_ARG_GROUP, group);
@@ -568,6 +1442,9 @@ ngx_http_sphinx2_parse_excerpt_args(
     ngx_http_sphinx2_loc_conf_t         * slcf,
     sphx2_excerpt_input_t               * input)
 {
+    ngx_int_t q = -1; /* excerpts are never batched */
+    ngx_http_sphinx2_ctx_t *ctx;
+
     MUST_HAVE_ARG(SPHX2_ARG_KEYWORDS); 
 
     MUST_HAVE_ARG(SPHX2_ARG_INDEX);
@@ -578,8 +1455,19 @@ ngx_http_sphinx2_parse_excerpt_args(
     /* index */
     GET_ARG(SPHX2_ARG_INDEX, index);
 
-    /* docs */
-    PARSE_LIST_ARG(SPHX2_ARG_DOCS, docs);
+    if(slcf->fixed_args & SPHX2_ARG_BIT(SPHX2_ARG_INDEX)) {
+        input->index = slcf->tmpl->index;
+    }
+
+    /* docs - one by one from a body, referred to where they are in it */
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(NULL != ctx->body_docs) {
+        input->docs = ctx->body_docs->elts;
+        input->num_docs = ctx->body_docs->nelts;
+    } else {
+        PARSE_LIST_ARG(SPHX2_ARG_DOCS, docs);
+    }
 
     /* excerpt opts */
     PARSE_ELEM_ARG_2(SPHX2_ARG_EXCERPT_OPTS, excerpt_opts);
@@ -590,180 +1478,1457 @@ ngx_http_sphinx2_parse_excerpt_args(
 }
 
 
-/* create request callback */
+/* Location templates - query args fixed in the config are parsed once,
+ * and the parts of the query made only of them are serialized once
+ */
+
+/* parse the value of a fixed arg as that of its $sphx_* variable is; the
+ * value is kept with the conf, so the input refers to it
+ */
 static ngx_int_t
-ngx_http_sphinx2_create_request(ngx_http_request_t *r)
+ngx_http_sphinx2_parse_fixed_arg(
+    ngx_pool_t                          * pool,
+    sphx2_search_input_t                * input,
+    ngx_uint_t                            arg,
+    ngx_str_t                           * v)
 {
-    ngx_buf_t                      * b;
-    ngx_chain_t                    * cl;
-    ngx_http_sphinx2_loc_conf_t    * slcf;
-    ngx_http_sphinx2_ctx_t         * ctx;
-    ngx_http_variable_value_t      * vv;
-    sphx2_input_t                    input;
-    sphx2_command_t                  cmd;
-    ngx_str_t                        dbg;
- 
-    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+    switch(arg) {
+        case SPHX2_ARG_INDEX:
+            input->index = v;
+            break;
+        case SPHX2_ARG_RANK_EXPR:
+            input->rank_expr = v;
+            break;
+        case SPHX2_ARG_SORT_BY:
+            input->sort_by = v;
+            break;
+        case SPHX2_ARG_MAX_MATCHES:
+            if(0 == v->len) {
+                input->max_matches = sphx2_default_max_matches;
+                break;
+            }
+            return sphx2_arg_parse_int(v, &input->max_matches);
+        case SPHX2_ARG_MATCH_MODE:
+            return (0 == v->len) ? NGX_OK
+                : sphx2_parse_match_mode_str(pool, v, &input->match_mode);
+        case SPHX2_ARG_RANKER:
+            return (0 == v->len) ? NGX_OK
+                : sphx2_parse_ranker_str(pool, v, &input->ranker);
+        case SPHX2_ARG_SORT_MODE:
+            return (0 == v->len) ? NGX_OK
+                : sphx2_parse_sort_mode_str(pool, v, &input->sort_mode);
+        case SPHX2_ARG_GROUP:
+            return sphx2_parse_group_str(pool, v, &input->group);
+        case SPHX2_ARG_GEO:
+            return (0 == v->len) ? NGX_OK
+                : sphx2_parse_geo_str(pool, v, &input->geo);
+        case SPHX2_ARG_INDEX_WEIGHTS:
+            return (0 == v->len) ? NGX_OK
+                : sphx2_parse_index_weights_str(pool, v,
+                      &input->index_weights, &input->num_index_weights);
+        case SPHX2_ARG_FIELD_WEIGHTS:
+            return (0 == v->len) ? NGX_OK
+                : sphx2_parse_field_weights_str(pool, v,
+                      &input->field_weights, &input->num_field_weights);
+        default:
+            return(NGX_ERROR);
+    }
 
-    /* find the sphinx2 command */
-    vv = ngx_http_get_indexed_variable(r, slcf->cmd_idx);
+    return(NGX_OK);
+}
+
+/* sphinx2_index, sphinx2_ranker etc. - the value is checked here, so that
+ * an error points at it, and parsed for good at merge
+ */
+static char*
+ngx_http_sphinx2_fixed_arg(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_loc_conf_t *slcf = conf;
+    ngx_str_t                  *field, *value;
+    sphx2_search_input_t        scratch;
+
+    field = (ngx_str_t *) ((char *) conf + cmd->offset);
+
+    if (field->data) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&scratch, sizeof(sphx2_search_input_t));
+
+    if(NGX_OK != ngx_http_sphinx2_parse_fixed_arg(cf->pool, &scratch,
+                     field - slcf->fixed, &value[1]))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    *field = value[1];
+
+    return NGX_CONF_OK;
+}
+
+/* the args needed by each part of a query, which has to have them all
+ * fixed to be serialized ahead of time
+ */
+static ngx_uint_t
+ngx_http_sphinx2_part_args(sphx2_search_input_t *tmpl, sphx2_query_part_t part)
+{
+    ngx_uint_t                       args;
+
+    switch(part) {
+        case SPHX2_PART_RANKING:
+            args = SPHX2_ARG_BIT(SPHX2_ARG_MATCH_MODE)
+                 | SPHX2_ARG_BIT(SPHX2_ARG_RANKER)
+                 | SPHX2_ARG_BIT(SPHX2_ARG_SORT_MODE);
+            if(SPHX2_RANK_EXPR == tmpl->ranker) {
+                args |= SPHX2_ARG_BIT(SPHX2_ARG_RANK_EXPR);
+            }
+            if(SPHX2_SORT_ATTR_ASC == tmpl->sort_mode ||
+               SPHX2_SORT_ATTR_DESC == tmpl->sort_mode)
+            {
+                args |= SPHX2_ARG_BIT(SPHX2_ARG_SORT_BY);
+            }
+            return(args);
+        case SPHX2_PART_INDEX:
+            return SPHX2_ARG_BIT(SPHX2_ARG_INDEX);
+        case SPHX2_PART_TAIL:
+            return SPHX2_ARG_BIT(SPHX2_ARG_GROUP)
+                 | SPHX2_ARG_BIT(SPHX2_ARG_MAX_MATCHES)
+                 | SPHX2_ARG_BIT(SPHX2_ARG_GEO)
+                 | SPHX2_ARG_BIT(SPHX2_ARG_INDEX_WEIGHTS)
+                 | SPHX2_ARG_BIT(SPHX2_ARG_FIELD_WEIGHTS);
+        default:
+            return(0);
+    }
+}
+
+/* inherit the fixed args, and build the location's template if it fixes
+ * any of its own
+ */
+static char*
+ngx_http_sphinx2_merge_template(ngx_conf_t *cf,
+    ngx_http_sphinx2_loc_conf_t *prev, ngx_http_sphinx2_loc_conf_t *conf)
+{
+    sphx2_search_input_t           * tmpl;
+    ngx_uint_t                       i, own, args;
+
+    own = 0;
+
+    for(i = 0; i < SPHX2_ARG_COUNT; ++i) {
+        if(NULL == conf->fixed[i].data) {
+            conf->fixed[i] = prev->fixed[i];
+        } else {
+            own = 1;
+        }
+
+        if(NULL != conf->fixed[i].data) {
+            conf->fixed_args |= SPHX2_ARG_BIT(i);
+        }
+    }
+
+    if(!own) {
+        conf->tmpl = prev->tmpl;
+        return NGX_CONF_OK;
+    }
+
+    if(NULL == (tmpl = ngx_pcalloc(cf->pool, sizeof(sphx2_search_input_t)))) {
+        return NGX_CONF_ERROR;
+    }
+
+    tmpl->sort_by = &s_empty_str;
+
+    for(i = 0; i < SPHX2_ARG_COUNT; ++i) {
+        if((conf->fixed_args & SPHX2_ARG_BIT(i))
+           && NGX_OK != ngx_http_sphinx2_parse_fixed_arg(cf->pool, tmpl, i,
+                            &conf->fixed[i]))
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /* as with the variables, there is a sort by only for an attr sort */
+    if((conf->fixed_args & SPHX2_ARG_BIT(SPHX2_ARG_SORT_MODE))
+       && SPHX2_SORT_ATTR_ASC != tmpl->sort_mode
+       && SPHX2_SORT_ATTR_DESC != tmpl->sort_mode)
+    {
+        tmpl->sort_by = &s_empty_str;
+    }
+
+    for(i = 0; i < SPHX2_PART_COUNT; ++i) {
+        args = ngx_http_sphinx2_part_args(tmpl, i);
+
+        if((conf->fixed_args & args) == args
+           && NGX_OK != sphx2_create_query_part(cf->pool, tmpl, i))
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    conf->tmpl = tmpl;
+
+    return NGX_CONF_OK;
+}
+
+
+/* searchd limits of a query - its max query time, cutoff and the retries
+ * of its distributed agents. They may have variables, and so differ from
+ * request to request.
+ */
+
+/* the directive fields which are times, the others being counts */
+#define SPHX2_LIMIT_IS_TIME(offset)                                          \
+    ((offset) == offsetof(ngx_http_sphinx2_loc_conf_t, max_query_time)       \
+     || (offset) == offsetof(ngx_http_sphinx2_loc_conf_t, retry_delay)       \
+     || (offset) == offsetof(ngx_http_sphinx2_loc_conf_t, deadline_budget))
+
+static ngx_int_t
+ngx_http_sphinx2_parse_limit(ngx_str_t *v, ngx_uint_t time, uint32_t *n)
+{
+    ngx_int_t                        k;
+
+    k = time ? ngx_parse_time(v, 0) : ngx_atoi(v->data, v->len);
+
+    if(NGX_ERROR == k || k > (ngx_int_t) 0x7fffffff) {
+        return NGX_ERROR;
+    }
+
+    *n = (uint32_t) k;
+
+    return NGX_OK;
+}
+
+/* sphinx2_max_query_time, sphinx2_cutoff, sphinx2_retry_count,
+ * sphinx2_retry_delay - a value without variables is checked here
+ */
+static char*
+ngx_http_sphinx2_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_complex_value_t      ** cv;
+    ngx_str_t                      * value;
+    uint32_t                         n;
+    char                           * rv;
+
+    if(NGX_CONF_OK != (rv = ngx_http_set_complex_value_slot(cf, cmd, conf))) {
+        return rv;
+    }
+
+    cv = (ngx_http_complex_value_t **) ((char *) conf + cmd->offset);
+    value = cf->args->elts;
+
+    if(NULL != (*cv)->lengths
+       || (cmd->offset == offsetof(ngx_http_sphinx2_loc_conf_t, cutoff)
+           && 0 == ngx_strcmp(value[1].data, "auto"))
+       || NGX_OK == ngx_http_sphinx2_parse_limit(&value[1],
+                        SPHX2_LIMIT_IS_TIME(cmd->offset), &n))
+    {
+        return NGX_CONF_OK;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid value \"%V\" in \"%V\" directive",
+                       &value[1], &cmd->name);
+    return NGX_CONF_ERROR;
+}
+
+/* sphinx2_deadline off|on|<budget> */
+static char*
+ngx_http_sphinx2_deadline(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_loc_conf_t *slcf = conf;
+    ngx_http_compile_complex_value_t ccv;
+    ngx_str_t                  *value;
+    uint32_t                    n;
+
+    if (slcf->deadline != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        slcf->deadline = 0;
+        return NGX_CONF_OK;
+    }
+
+    slcf->deadline = 1;
+
+    if (ngx_strcmp(value[1].data, "on") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (NULL == (slcf->deadline_budget = ngx_palloc(cf->pool,
+                                          sizeof(ngx_http_complex_value_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = slcf->deadline_budget;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (slcf->deadline_budget->lengths == NULL
+        && (NGX_OK != ngx_http_sphinx2_parse_limit(&value[1], 1, &n)
+            || 0 == n))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive, "
+                           "it must be \"off\", \"on\" or a time",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* the value of a limit for the request - NGX_DECLINED if it has none,
+ * which is not an error: an empty value is no limit, and an invalid one
+ * from a variable is logged and ignored
+ */
+static ngx_int_t
+ngx_http_sphinx2_limit_value(
+    ngx_http_request_t                  * r,
+    ngx_http_complex_value_t            * cv,
+    ngx_uint_t                            time,
+    ngx_str_t                           * v,
+    uint32_t                            * n)
+{
+    if(NULL == cv) {
+        return(NGX_DECLINED);
+    }
+
+    if(NGX_OK != ngx_http_complex_value(r, cv, v)) {
+        return(NGX_ERROR);
+    }
+
+    if(0 == v->len) {
+        return(NGX_DECLINED);
+    }
+
+    if(NGX_OK != ngx_http_sphinx2_parse_limit(v, time, n)) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+            "sphinx2: invalid searchd limit \"%V\" ignored", v);
+        return(NGX_DECLINED);
+    }
+
+    return(NGX_OK);
+}
+
+/* set the limits of every query of a request. NGX_DECLINED if its
+ * deadline has passed already.
+ *
+ * With a deadline the max query time is the time left of the budget, and
+ * is rounded down to 4 significant bits, so that requests with about as
+ * much time left send the same bytes - to the cache and to coalescing
+ * they are one request. The request may wait yet, for another one's
+ * response or for a slot of the upstream, so the deadline itself is kept
+ * to be checked again when it goes to searchd.
+ */
+static ngx_int_t
+ngx_http_sphinx2_search_limits(
+    ngx_http_request_t                  * r,
+    ngx_http_sphinx2_loc_conf_t         * slcf,
+    sphx2_search_input_t                * srch,
+    ngx_uint_t                            n)
+{
+    ngx_http_sphinx2_ctx_t         * ctx;
+    ngx_time_t                     * tp;
+    ngx_str_t                        v;
+    ngx_msec_int_t                   left;
+    ngx_uint_t                       q, e, cutoff_auto;
+    uint32_t                         max_query_time, cutoff;
+    uint32_t                         retry_count, retry_delay, budget;
+
+    max_query_time = cutoff = retry_count = retry_delay = 0;
+    cutoff_auto = 0;
+
+    if(NGX_ERROR == ngx_http_sphinx2_limit_value(r, slcf->max_query_time, 1,
+                                                 &v, &max_query_time)
+       || NGX_ERROR == ngx_http_sphinx2_limit_value(r, slcf->retry_count, 0,
+                                                    &v, &retry_count)
+       || NGX_ERROR == ngx_http_sphinx2_limit_value(r, slcf->retry_delay, 1,
+                                                    &v, &retry_delay))
+    {
+        return(NGX_ERROR);
+    }
+
+    if(NULL != slcf->cutoff) {
+        if(NGX_OK != ngx_http_complex_value(r, slcf->cutoff, &v)) {
+            return(NGX_ERROR);
+        }
+
+        if(4 == v.len && 0 == ngx_strncmp(v.data, "auto", 4)) {
+            cutoff_auto = 1;
+
+        } else if(NGX_ERROR == ngx_http_sphinx2_limit_value(r, slcf->cutoff,
+                                   0, &v, &cutoff))
+        {
+            return(NGX_ERROR);
+        }
+    }
+
+    if(slcf->deadline) {
+        budget = (uint32_t) slcf->upstream.read_timeout;
+
+        if(NGX_ERROR == ngx_http_sphinx2_limit_value(r, slcf->deadline_budget,
+                            1, &v, &budget))
+        {
+            return(NGX_ERROR);
+        }
+
+        /* no more than nginx waits for searchd anyway */
+        budget = ngx_min(budget, (uint32_t) slcf->upstream.read_timeout);
+
+        tp = ngx_timeofday();
+
+        left = (ngx_msec_int_t) budget
+               - (ngx_msec_int_t) ((tp->sec - r->start_sec) * 1000
+                                   + (tp->msec - r->start_msec));
+
+        if(left <= 0) {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                "sphinx2: deadline of %uDms passed before searchd was asked",
+                budget);
+            return(NGX_DECLINED);
+        }
+
+        ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+        ctx->deadline = ngx_current_msec + left;
+
+        for(e = 0; left >> (e + 4); ++e) { /* void */ }
+        left = (left >> e) << e;
+
+        if(0 == max_query_time || (uint32_t) left < max_query_time) {
+            max_query_time = (uint32_t) left;
+        }
+    }
+
+    for(q = 0; q < n; ++q) {
+        srch[q].max_query_time = max_query_time;
+        srch[q].cutoff = cutoff_auto ? srch[q].offset + srch[q].num_results
+                                     : cutoff;
+        srch[q].retry_count = retry_count;
+        srch[q].retry_delay = retry_delay;
+
+        /* a template serialized its tail with no limits */
+        if(srch[q].max_query_time || srch[q].cutoff
+           || srch[q].retry_count || srch[q].retry_delay)
+        {
+            srch[q].parts[SPHX2_PART_TAIL].len = 0;
+        }
+    }
+
+    return(NGX_OK);
+}
+
+
+/* a shard can't know which of its matches make the page, so it is asked
+ * for everything up to the end of it; what was asked for is kept for the
+ * merge
+ */
+static ngx_int_t
+ngx_http_sphinx2_shard_search(
+    ngx_http_request_t                  * r,
+    ngx_http_sphinx2_ctx_t              * ctx,
+    sphx2_search_input_t                * srch,
+    ngx_uint_t                            n)
+{
+    sphx2_merge_spec_t             * spec;
+    ngx_uint_t                       q;
+    uint32_t                         upto;
+
+    if(NULL == (ctx->merge = ngx_palloc(r->pool,
+                                 n * sizeof(sphx2_merge_spec_t))))
+    {
+        return(NGX_ERROR);
+    }
+
+    for(q = 0; q < n; ++q) {
+        spec = &ctx->merge[q];
+
+        spec->offset = srch[q].offset;
+        spec->num_results = srch[q].num_results;
+        spec->max_matches = srch[q].max_matches;
+        spec->sort_mode = srch[q].sort_mode;
+        spec->sort_by = *srch[q].sort_by;
+        spec->group = (NULL != srch[q].group && 0 != srch[q].group->attr->len);
+
+        if(spec->group) {
+            spec->group_sort = *srch[q].group->sort;
+        }
+
+        upto = srch[q].offset + srch[q].num_results;
+
+        srch[q].offset = 0;
+        srch[q].num_results = upto;
+
+        if(srch[q].max_matches < upto) {
+            srch[q].max_matches = upto;
+            /* no longer what the template serialized */
+            srch[q].parts[SPHX2_PART_TAIL].len = 0;
+        }
+    }
+
+    return(NGX_OK);
+}
+
+
+/* wall clock in microseconds, for timing steps well under a millisecond */
+ngx_uint_t
+ngx_http_sphinx2_usec(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (ngx_uint_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* serialize the searchd request from the arguments; this happens before
+ * the upstream is started, so that the request bytes can key the cache.
+ * NGX_DECLINED if the request is out of time already.
+ */
+static ngx_int_t
+ngx_http_sphinx2_build_request(ngx_http_request_t *r)
+{
+    ngx_buf_t                      * hs;
+    ngx_chain_t                    * cl;
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+    ngx_http_sphinx2_ctx_t         * ctx;
+    ngx_http_variable_value_t      * vv;
+    ngx_http_sphinx2_cmd_t         * cmd;
+    sphx2_input_t                    input;
+    sphx2_search_input_t           * srch;
+    ngx_uint_t                       n, q;
+    ngx_uint_t                       start, serialize;
+    ngx_str_t                        dbg;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    start = ngx_http_sphinx2_usec();
+
+    /* find the sphinx2 command */
+    vv = ngx_http_get_indexed_variable(r, slcf->cmd_idx);
+
+    if (vv == NULL || vv->not_found || vv->len == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "the \"sphinx2_command\" variable is not set");
+        return NGX_ERROR;
+    }
+
+    for(cmd = ngx_http_sphinx2_cmds; cmd->name.len; ++cmd) {
+        if(cmd->name.len == vv->len &&
+           !ngx_strncmp(cmd->name.data, vv->data, vv->len)) {
+            break;
+        }
+    }
+
+    if(0 == cmd->name.len) {
+        dbg.data = vv->data; dbg.len = vv->len;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+             "Sphinx command \"%V\" is not recognized", &dbg);
+        return(NGX_ERROR);
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(slcf->query_args && NGX_OK != ngx_http_sphinx2_scan_args(r, ctx)) {
+        return(NGX_ERROR);
+    }
+
+    if((r->method & NGX_HTTP_POST)
+       && NGX_OK != ngx_http_sphinx2_body_args(r, ctx))
+    {
+        return(NGX_ERROR);
+    }
+
+    n = 1;
+
+    switch(cmd->command) {
+        case SPHX2_COMMAND_SEARCH:
+            if(cmd->batch) {
+                n = ngx_http_sphinx2_count_queries(r, slcf);
+                if(n > SPHX2_MAX_QUERIES) {
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                        "Sphinx2 batch of %ui queries exceeds the max of %d",
+                        n, SPHX2_MAX_QUERIES);
+                    return(NGX_ERROR);
+                }
+            }
+            if(NULL == (srch = ngx_pcalloc(r->pool,
+                                   n * sizeof(sphx2_search_input_t)))) {
+                return(NGX_ERROR);
+            }
+            for(q = 0; q < n; ++q) {
+                if(NGX_OK != ngx_http_sphinx2_parse_search_args(r, slcf,
+                                 cmd->batch ? (ngx_int_t)q : -1, &srch[q])) {
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                        "Sphinx2 query args parse error (query %ui)", q);
+                    return(NGX_ERROR);
+                }
+            }
+            switch(ngx_http_sphinx2_search_limits(r, slcf, srch, n)) {
+            case NGX_OK:
+                break;
+            case NGX_DECLINED:
+                return(NGX_DECLINED);
+            default:
+                return(NGX_ERROR);
+            }
+            /* one response, so one output type for a whole batch */
+            ctx->output_type = srch[0].output_type;
+            if(NULL != srch[0].index) {
+                ctx->index = *srch[0].index;
+            }
+            if(NULL != slcf->shards
+               && NGX_OK != ngx_http_sphinx2_shard_search(r, ctx, srch, n))
+            {
+                return(NGX_ERROR);
+            }
+            serialize = ngx_http_sphinx2_usec();
+            if(NGX_ERROR == sphx2_create_search_request(r->pool,
+                                                        srch, n, &cl))
+            {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "Sphinx2 upstream search req creation failed");
+                return(NGX_ERROR);
+            }
+            break;
+        case SPHX2_COMMAND_EXCERPT:
+            memset(&input, 0, sizeof(input));
+            if(NGX_OK != ngx_http_sphinx2_parse_excerpt_args(
+                             r, slcf, &input.exrp)) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "Sphinx2 query args parse error");
+                return(NGX_ERROR);
+            }
+            if(NULL != input.exrp.index) {
+                ctx->index = *input.exrp.index;
+            }
+            serialize = ngx_http_sphinx2_usec();
+            if(NGX_ERROR == sphx2_create_excerpt_request(r->pool,
+                                                         &input.exrp, &cl))
+            {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "Sphinx2 upstream search req creation failed");
+                return(NGX_ERROR);
+            }
+            if(slcf->excerpt_split
+               && NGX_OK != ngx_http_sphinx2_fanout_split(r, ctx,
+                                                          &input.exrp))
+            {
+                return(NGX_ERROR);
+            }
+            break;
+        default:
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "Sphinx2 upstream unsupported req type - %d", cmd->command);
+            return NGX_ERROR;
+    }
+
+    ctx->command = cmd->command;
+    ctx->num_queries = n;
+
+    ctx->parse_usec = serialize - start;
+    ctx->serialize_usec = ngx_http_sphinx2_usec() - serialize;
+
+    /* long strings in the request refer to the argument values, so that
+     * they go out without being copied
+     */
+    ctx->request_cl = cl;
+
+    /* the handshake is sent only on a fresh connection; get_peer picks
+     * the chain to send once it knows which kind of connection it got
+     */
+    if(NGX_OK != sphx2_create_handshake(r->pool, ctx->persist, &hs)) {
+        return NGX_ERROR;
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = hs;
+    cl->next = ctx->request_cl;
+
+    ctx->handshake_cl = cl;
+
+    return NGX_OK;
+}
+
+
+/* runs once the client request body is in */
+static void
+ngx_http_sphinx2_launch(ngx_http_request_t *r)
+{
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+    ngx_http_sphinx2_ctx_t         * ctx;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    /* the parent has built the request and looked for it in the cache */
+    if(ctx->shard) {
+        ngx_http_sphinx2_admit(r, ctx);
+        return;
+    }
+
+    switch(ngx_http_sphinx2_build_request(r)) {
+    case NGX_OK:
+        break;
+    case NGX_DECLINED:
+        /* out of time before searchd is even asked */
+        ngx_http_finalize_request(r, NGX_HTTP_GATEWAY_TIME_OUT);
+        return;
+    default:
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if(NULL != slcf->cache_zone || slcf->coalesce) {
+        ngx_http_sphinx2_cache_key(slcf, ctx);
+    }
+
+    ngx_http_sphinx2_forward(r);
+}
+
+
+/* get the response for a built request - from the cache, from an identical
+ * request already in flight, or from searchd
+ */
+void
+ngx_http_sphinx2_forward(ngx_http_request_t *r)
+{
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+    ngx_http_sphinx2_ctx_t         * ctx;
+    ngx_buf_t                      * b;
+    ngx_int_t                        rc;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(slcf->coalesce) {
+        rc = ngx_http_sphinx2_coalesce_join(r, ctx);
+
+        if(NGX_AGAIN == rc) {
+            return;
+        }
+
+        if(NGX_ERROR == rc) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+    if(NULL != slcf->cache_zone) {
+        rc = ngx_http_sphinx2_cache_lookup(r, ctx, &b,
+                 slcf->coalesce && !ctx->alone && !ctx->claimed);
+
+        if(NGX_OK == rc) {
+            ngx_http_sphinx2_metrics_cache(r, ctx, 1);
+            ngx_http_sphinx2_coalesce_done(r, ctx, b);
+            ngx_http_finalize_request(r, ngx_http_sphinx2_send_response(r, b));
+            return;
+        }
+
+        if(NGX_BUSY == rc) {
+            ngx_http_sphinx2_coalesce_poll(r, ctx);
+            return;
+        }
+
+        if(NGX_ERROR == rc) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+    /* going to searchd - a miss, whether or not a waiter shares it */
+    if(NULL != slcf->cache_zone) {
+        ngx_http_sphinx2_metrics_cache(r, ctx, 0);
+    }
+
+    /* shards, or the runs of a split excerpt request */
+    if(NULL != slcf->shards || NULL != ctx->shards) {
+        if(NGX_OK != ngx_http_sphinx2_fanout(r, ctx)) {
+            ngx_http_sphinx2_coalesce_done(r, ctx, NULL);
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        }
+        return;
+    }
+
+    ngx_http_sphinx2_admit(r, ctx);
+}
+
+
+/* go to searchd, once the upstream's concurrency limit lets the request
+ * through
+ */
+static void
+ngx_http_sphinx2_admit(ngx_http_request_t *r, ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_int_t                        rc;
+
+    switch(ngx_http_sphinx2_concurrency_acquire(r, ctx)) {
+    case NGX_OK:
+        ngx_http_sphinx2_start(r);
+        return;
+    case NGX_AGAIN:
+        return;
+    case NGX_BUSY:
+        rc = NGX_HTTP_SERVICE_UNAVAILABLE;
+        break;
+    default:
+        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        break;
+    }
+
+    ngx_http_sphinx2_coalesce_done(r, ctx, NULL);
+    ngx_http_finalize_request(r, rc);
+}
+
+
+/* open the upstream request - the limit has let it through */
+void
+ngx_http_sphinx2_start(ngx_http_request_t *r)
+{
+    ngx_http_sphinx2_ctx_t         * ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    /* time was spent waiting since the max query time was set */
+    if(0 != ctx->deadline
+       && (ngx_msec_int_t) (ctx->deadline - ngx_current_msec) <= 0)
+    {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "sphinx2: deadline passed while waiting to be sent "
+                      "to searchd");
+        ngx_http_sphinx2_concurrency_release(r, ctx, NGX_ERROR);
+        ngx_http_sphinx2_coalesce_done(r, ctx, NULL);
+        ngx_http_finalize_request(r, NGX_HTTP_GATEWAY_TIME_OUT);
+        return;
+    }
+
+    /* a shard is not hedged, it has its own peers */
+    if(!ctx->shard && NGX_ERROR == ngx_http_sphinx2_hedge_arm(r, ctx)) {
+        ngx_http_sphinx2_coalesce_done(r, ctx, NULL);
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_http_upstream_init(r);
+}
+
+
+/* JSON is sent instead of the searchd bytes */
+static void
+ngx_http_sphinx2_set_json_type(ngx_http_request_t *r)
+{
+    r->headers_out.content_type_len = sizeof("application/json") - 1;
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_lowcase = NULL;
+}
+
+
+/* the whole of a search response body as JSON */
+static ngx_int_t
+ngx_http_sphinx2_json_body(ngx_http_request_t *r, ngx_buf_t *b,
+    ngx_chain_t **out)
+{
+    ngx_http_sphinx2_ctx_t         * ctx;
+    ngx_http_sphinx2_loc_conf_t    * slcf;
+    sphx2_json_t                   * j;
+    ngx_chain_t                    * free = NULL;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    if(NULL == (j = sphx2_json_create(r->pool, ctx->repctx.srch.status,
+                        ctx->num_queries, b->last - b->pos, &free,
+                        (ngx_buf_tag_t) &ngx_http_sphinx2_module,
+                        slcf->upstream.buffer_size)))
+    {
+        return NGX_ERROR;
+    }
+
+    if(NGX_DONE != sphx2_json_feed(j, b->pos, b->last - b->pos, out)) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "sphinx2: malformed search response");
+        return NGX_ERROR;
+    }
+
+    /* kept for $sphinx2_total_found */
+    ctx->json = j;
+
+    return NGX_OK;
+}
+
+
+/* send a complete response body not coming from the upstream */
+ngx_int_t
+ngx_http_sphinx2_send_response(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    ngx_http_sphinx2_ctx_t         * ctx;
+    ngx_chain_t                      raw, * out, * cl;
+    ngx_int_t                        rc;
+    off_t                            len;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    raw.buf = b;
+    raw.next = NULL;
+    out = &raw;
+
+    if(SPHX2_OUTPUT_JSON == ctx->output_type) {
+        if(NGX_OK != ngx_http_sphinx2_json_body(r, b, &out)) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        ngx_http_sphinx2_set_json_type(r);
+    }
+
+    for(len = 0, cl = out; cl->next; cl = cl->next) {
+        len += cl->buf->last - cl->buf->pos;
+    }
+    len += cl->buf->last - cl->buf->pos;
+
+    r->headers_out.status = (SPHX2_SEARCHD_RETRY == ctx->repctx.srch.status)
+                            ? NGX_HTTP_SERVICE_UNAVAILABLE : NGX_HTTP_OK;
+    r->headers_out.content_length_n = len;
+
+    rc = ngx_http_send_header(r);
+
+    if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b = cl->buf;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    if(b->last == b->pos) {
+        b->temporary = 0;
+        b->memory = 0;
+        b->sync = 1;
+    }
+
+    return ngx_http_output_filter(r, out);
+}
+
+
+/* create request callback - the request has been built already */
+static ngx_int_t
+ngx_http_sphinx2_create_request(ngx_http_request_t *r)
+{
+    ngx_http_sphinx2_ctx_t         * ctx;
+#if (NGX_DEBUG)
+    ngx_chain_t                    * cl;
+    ngx_str_t                        dbg;
+#endif
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(NULL == ctx->handshake_cl) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->request_bufs = ctx->handshake_cl;
+
+    ngx_http_sphinx2_trace_request(r, ctx);
+
+#if (NGX_DEBUG)
+    for(cl = ctx->request_cl; cl; cl = cl->next) {
+        dbg.data = cl->buf->pos;
+        dbg.len = cl->buf->last - cl->buf->pos;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "sphinx2 request: \"%V\"", &dbg);
+    }
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_sphinx2_reinit_request(ngx_http_request_t *r)
+{
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_sphinx2_process_header(ngx_http_request_t *r)
+{
+    ngx_http_upstream_t        * u;
+    ngx_http_sphinx2_ctx_t     * ctx;
+    ngx_buf_t                  * b;
+    ngx_int_t                    status;
+    size_t                       hdr_len;
+    u_char                     * start;
+
+    u = r->upstream;
+    b = &u->buffer;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(!ctx->first_byte) {
+        ctx->first_byte = 1;
+        ctx->first_byte_time = ngx_current_msec - ctx->peer_start;
+    }
+
+    /* no searchd version precedes the header on a kept-alive connection */
+    hdr_len = sphx2_min_search_header_len
+                  - (ctx->cached ? sphx2_handshake_len : 0);
+
+    /* not enough bytes read to parse status */
+    if((b->last - b->pos) < (ssize_t)hdr_len) {
+        return(NGX_AGAIN);
+    }
+
+    start = b->pos;
+
+    switch(ctx->command) {
+    case SPHX2_COMMAND_SEARCH:
+        status = sphx2_parse_search_response_header(r->pool, b, !ctx->cached,
+                                                    &ctx->repctx.srch);
+        break;
+    case SPHX2_COMMAND_EXCERPT:
+        status = sphx2_parse_excerpt_response_header(r->pool, b, !ctx->cached,
+                                                     &ctx->repctx.exrp);
+        break;
+    default:
+        return(NGX_ERROR);
+    }
+
+    ngx_http_sphinx2_trace_response(r, ctx, start, b->last, status);
+
+    if(NGX_OK != status) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "Sphinx2 upstream error processing %s response header",
+            (SPHX2_COMMAND_SEARCH == ctx->command) ? "search" : "excerpt");
+        return status;
+    }
+
+    ctx->header = 1;
+    ctx->bytes_in += hdr_len;
+
+    if(SPHX2_OUTPUT_JSON == ctx->output_type && !ctx->shard) {
+        ngx_http_sphinx2_set_json_type(r);
+    }
+
+    /* searchd is too busy to take the request: a failure of the peer,
+     * passed on to the next one with 'sphinx2_next_upstream retry' - the
+     * way nginx does it for a 503. A hedge may answer meanwhile
+     */
+    if(SPHX2_SEARCHD_RETRY == ctx->repctx.srch.status) {
+        u->headers_in.status_n = NGX_HTTP_SERVICE_UNAVAILABLE;
+        u->state->status = NGX_HTTP_SERVICE_UNAVAILABLE;
+
+        if(u->peer.tries > 1
+           && (u->conf->next_upstream & NGX_HTTP_UPSTREAM_FT_HTTP_503))
+        {
+            return NGX_OK;
+        }
+
+        /* no other peer is tried. The body of an in-memory subrequest with
+         * a status of 300 or more is dropped, though its length is still
+         * read; a shard reads it all, and the parent finds the RETRY in the
+         * shard's response context
+         */
+        if(ctx->shard) {
+            u->headers_in.status_n = NGX_HTTP_OK;
+        }
+
+    } else {
+        u->headers_in.status_n = NGX_HTTP_OK;
+        u->state->status = NGX_HTTP_OK;
+    }
+
+    /* the upstream answered first */
+    ngx_http_sphinx2_hedge_cancel(ctx);
+
+    return NGX_OK;
+}
+
+/* pass the next bytes of a search response through the JSON decoder */
+static ngx_int_t
+ngx_http_sphinx2_json_filter(ngx_http_sphinx2_ctx_t *ctx, u_char *p,
+    size_t len)
+{
+    ngx_http_upstream_t        * u;
+    ngx_chain_t                * cl, ** ll, * out;
+    ngx_int_t                    rc;
+
+    u = ctx->request->upstream;
+
+    rc = sphx2_json_feed(ctx->json, p, len, &out);
+
+    if(NGX_ERROR == rc) {
+        ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0,
+                      "sphinx2: malformed search response");
+        return NGX_ERROR;
+    }
+
+    for(cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+        ll = &cl->next;
+    }
+
+    *ll = out;
+
+    return NGX_OK;
+}
+
+
+/* the response body length is known from the header, so the end of the
+ * response is found without waiting for searchd to close the connection
+ */
+static ngx_int_t
+ngx_http_sphinx2_filter_init(void *data)
+{
+    ngx_http_sphinx2_ctx_t      * ctx = data;
+    ngx_http_sphinx2_loc_conf_t * slcf;
+    ngx_http_upstream_t         * u;
+
+    u = ctx->request->upstream;
+
+    /* len is the first member in either response context */
+    u->length = ctx->repctx.srch.len;
+
+    /* a shard's response is all kept, for the parent to merge */
+    if(ctx->shard) {
+        if(NULL == (ctx->body = ngx_create_temp_buf(ctx->request->pool,
+                                    u->length ? u->length : 1)))
+        {
+            return NGX_ERROR;
+        }
+
+        if(0 == u->length && ctx->persist) {
+            u->keepalive = 1;
+        }
+
+        return NGX_OK;
+    }
+
+    slcf = ngx_http_get_module_loc_conf(ctx->request, ngx_http_sphinx2_module);
+
+    /* collect a copy of a cacheable response, or of one that waiters share,
+     * as it passes through; the size limit is the cache's, and waiters get
+     * a response of any size
+     */
+    if((NULL != slcf->cache_zone
+        && SPHX2_SEARCHD_OK == ctx->repctx.srch.status
+        && ctx->repctx.srch.len <= slcf->cache_max_size)
+       || NULL != ctx->flight)
+    {
+        if(NULL == (ctx->body = ngx_create_temp_buf(ctx->request->pool,
+                                    ctx->repctx.srch.len + 1)))
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    /* nothing to share - let the waiters go without waiting for the end */
+    if(NULL == ctx->body) {
+        ngx_http_sphinx2_coalesce_done(ctx->request, ctx, NULL);
+    }
+
+    if(SPHX2_OUTPUT_JSON == ctx->output_type) {
+        if(NULL == (ctx->json = sphx2_json_create(ctx->request->pool,
+                                    ctx->repctx.srch.status, ctx->num_queries,
+                                    u->length, &u->free_bufs, u->output.tag,
+                                    slcf->upstream.buffer_size)))
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if(0 == u->length) {
+        if(ctx->persist) {
+            u->keepalive = 1;
+        }
 
-    if (vv == NULL || vv->not_found || vv->len == 0) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "the \"sphinx2_command\" variable is not set");
-        return NGX_ERROR;
+        if(NULL != ctx->json
+           && NGX_OK != ngx_http_sphinx2_json_filter(ctx, u->buffer.last, 0))
+        {
+            return NGX_ERROR;
+        }
+
+        if(NULL != ctx->body) {
+            if(NULL != slcf->cache_zone
+               && SPHX2_SEARCHD_OK == ctx->repctx.srch.status
+               && ctx->repctx.srch.len <= slcf->cache_max_size)
+            {
+                (void)ngx_http_sphinx2_cache_store(ctx->request, ctx);
+            }
+
+            ngx_http_sphinx2_coalesce_done(ctx->request, ctx, ctx->body);
+        }
     }
 
-    for(cmd = SPHX2_COMMAND_SEARCH; cmd < SPHX2_COMMAND_COUNT; ++cmd) {
-        if(!strncmp(sphx2_command_strs[cmd],
-                    (const char*)vv->data, vv->len)) {
-            break;
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_sphinx2_filter(void *data, ssize_t bytes)
+{
+    ngx_http_sphinx2_ctx_t     * ctx = data;
+    ngx_http_sphinx2_loc_conf_t* slcf;
+    ngx_http_request_t         * r;
+    ngx_http_upstream_t        * u;
+    ngx_buf_t                  * b;
+    ngx_chain_t                * cl, ** ll;
+    ngx_uint_t                   overrun = 0;
+
+    r = ctx->request;
+    u = r->upstream;
+    b = &u->buffer;
+
+    if(bytes > u->length) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+            "sphinx2: searchd sent %O bytes past the response length",
+            (off_t)bytes - u->length);
+        bytes = (ssize_t)u->length;
+        overrun = 1;
+    }
+
+    ctx->bytes_in += bytes;
+
+    /* an in-memory subrequest - the upstream buffer is only where the
+     * bytes arrive, and is read into again from the same spot
+     */
+    if(ctx->shard) {
+        ctx->body->last = ngx_cpymem(ctx->body->last, b->last, bytes);
+
+        u->length -= bytes;
+
+        if(0 == u->length && ctx->persist && !overrun) {
+            u->keepalive = 1;
         }
+
+        return NGX_OK;
     }
 
-    if(cmd == SPHX2_COMMAND_COUNT) {
-        dbg.data = vv->data; dbg.len = vv->len;
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-             "Sphinx command \"%V\" is not recognized", &dbg);
-        return(NGX_ERROR);
+    if(NULL != ctx->body) {
+        ctx->body->last = ngx_cpymem(ctx->body->last, b->last, bytes);
     }
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+    if(NULL != ctx->json) {
+        /* decoded as it comes - the upstream buffer is read into again */
+        if(NGX_OK != ngx_http_sphinx2_json_filter(ctx, b->last, bytes)) {
+            return NGX_ERROR;
+        }
 
-    switch(cmd) {
-        case SPHX2_COMMAND_SEARCH:
-            memset(&input, 0, sizeof(input));
-            if(NGX_OK != ngx_http_sphinx2_parse_search_args(
-                             r, slcf, &input.srch)) {
-                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "Sphinx2 query args parse error");
-                return(NGX_ERROR);
-            }
-            if(NGX_ERROR == sphx2_create_search_request(r->pool,
-                                                        &input.srch, &b))
-            {
-                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "Sphinx2 upstream search req creation failed");
-                return(NGX_ERROR);
-            }
-            break;
-        case SPHX2_COMMAND_EXCERPT:
-            memset(&input, 0, sizeof(input));
-            if(NGX_OK != ngx_http_sphinx2_parse_excerpt_args(
-                             r, slcf, &input.exrp)) {
-                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "Sphinx2 query args parse error");
-                return(NGX_ERROR);
-            }
-            if(NGX_ERROR == sphx2_create_excerpt_request(r->pool,
-                                                         &input.exrp, &b))
-            {
-                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "Sphinx2 upstream search req creation failed");
-                return(NGX_ERROR);
-            }
-            break;
-        default:
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                "Sphinx2 upstream unsupported req type - %u", cmd);
+    } else {
+        for(cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+            ll = &cl->next;
+        }
+
+        if(NULL == (cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs))) {
             return NGX_ERROR;
-    }
+        }
 
-    ctx->command = cmd;
+        cl->buf->flush = 1;
+        cl->buf->memory = 1;
+        cl->buf->tag = u->output.tag;
 
-    cl = ngx_alloc_chain_link(r->pool);
-    if (cl == NULL) {
-        return NGX_ERROR;
+        *ll = cl;
+
+        cl->buf->pos = b->last;
+        b->last += bytes;
+        cl->buf->last = b->last;
     }
 
-    cl->buf = b;
-    cl->next = NULL;
+    u->length -= bytes;
+
+    if(0 != u->length) {
+        return NGX_OK;
+    }
 
-    r->upstream->request_bufs = cl;
+    /* the connection is clean for reuse only if nothing followed */
+    if(ctx->persist && !overrun) {
+        u->keepalive = 1;
+    }
 
-    ctx->request = r;
+    if(NULL != ctx->body && !overrun) {
+        slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
 
-    dbg.data = b->pos;
-    dbg.len = b->last - b->pos;
+        if(NULL != slcf->cache_zone
+           && SPHX2_SEARCHD_OK == ctx->repctx.srch.status
+           && ctx->repctx.srch.len <= slcf->cache_max_size)
+        {
+            (void)ngx_http_sphinx2_cache_store(r, ctx);
+        }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-        "sphinx2 request: \"%V\"", &dbg);
+        ngx_http_sphinx2_coalesce_done(r, ctx, ctx->body);
+    }
 
     return NGX_OK;
 }
 
+/* peer wrapping - lets the module see which connection a request gets */
 
 static ngx_int_t
-ngx_http_sphinx2_reinit_request(ngx_http_request_t *r)
+ngx_http_sphinx2_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
 {
+    ngx_http_sphinx2_main_conf_t  * smcf;
+    ngx_http_sphinx2_upstream_t   * sus;
+    ngx_http_sphinx2_peer_data_t  * pd;
+    ngx_http_upstream_t           * u;
+    ngx_uint_t                      i;
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_sphinx2_module);
+
+    sus = smcf->upstreams.elts;
+    for(i = 0; i < smcf->upstreams.nelts; ++i) {
+        if(sus[i].uscf == us) {
+            break;
+        }
+    }
+
+    if(i == smcf->upstreams.nelts) {
+        return NGX_ERROR;
+    }
+
+    if(NGX_OK != sus[i].original_init_peer(r, us)) {
+        return NGX_ERROR;
+    }
+
+    if(NULL == (pd = ngx_palloc(r->pool,
+                           sizeof(ngx_http_sphinx2_peer_data_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    u = r->upstream;
+
+    pd->data = u->peer.data;
+    pd->original_get_peer = u->peer.get;
+    pd->original_free_peer = u->peer.free;
+    pd->request = r;
+    pd->uscf = us;
+    pd->breaker.conf = ngx_http_sphinx2_breaker_conf(smcf, us);
+
+    u->peer.data = pd;
+    u->peer.get = ngx_http_sphinx2_get_peer;
+    u->peer.free = ngx_http_sphinx2_free_peer;
+
     return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_sphinx2_process_header(ngx_http_request_t *r)
+ngx_http_sphinx2_get_peer(ngx_peer_connection_t *pc, void *data)
 {
-    ngx_http_upstream_t        * u;
-    ngx_http_sphinx2_ctx_t     * ctx;
-    ngx_buf_t                  * b;
-    ngx_int_t                    status;
+    ngx_http_sphinx2_peer_data_t  * pd = data;
+    ngx_http_sphinx2_loc_conf_t   * slcf;
+    ngx_http_sphinx2_ctx_t        * ctx;
+    ngx_chain_t                   * cl;
+    ngx_int_t                       rc;
+
+    if(NULL != pd->breaker.conf) {
+        rc = ngx_http_sphinx2_breaker_get_peer(&pd->breaker, pc,
+                                               pd->original_get_peer,
+                                               pd->data);
+    } else {
+        rc = pd->original_get_peer(pc, pd->data);
+    }
 
-    u = r->upstream;
-    b = &u->buffer;
+    ctx = ngx_http_get_module_ctx(pd->request, ngx_http_sphinx2_module);
 
-    /* not enough bytes read to parse status */
-    if((b->last - b->pos) < (ssize_t)sphx2_min_search_header_len) {
-        return(NGX_AGAIN);
+    if(NULL == ctx || NULL == ctx->handshake_cl) {
+        return rc;
     }
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+    /* NGX_DONE - a cached connection which has had its handshake */
+    ctx->cached = (NGX_DONE == rc) ? 1 : 0;
 
-    switch(ctx->command) {
-    case SPHX2_COMMAND_SEARCH:
-        if(NGX_OK != (status =
-            sphx2_parse_search_response_header(r->pool, b, &ctx->repctx.srch)))
-        {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                "Sphinx2 upstream error processing search response header");
-            return status;
-        }
-        break;
-    case SPHX2_COMMAND_EXCERPT:
-        if(NGX_OK != (status =
-            sphx2_parse_excerpt_response_header(r->pool, b, &ctx->repctx.exrp)))
-        {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                "Sphinx2 upstream error processing excerpt response header");
-            return status;
+    /* timings are of the peer that answers, or of the last one tried */
+    ctx->peer_start = ngx_current_msec;
+    ctx->connected = 0;
+    ctx->first_byte = 0;
+    ctx->header = 0;
+
+    if(0 == ctx->start) {
+        ctx->start = ctx->peer_start;
+    }
+
+    slcf = ngx_http_get_module_loc_conf(pd->request, ngx_http_sphinx2_module);
+
+    /* the upstream writes the request once it is connected - nginx keeps
+     * no time of its own for that, so the first write is caught here
+     */
+    if(NULL != slcf->metrics_zone) {
+        pd->request->upstream->output.output_filter =
+            ngx_http_sphinx2_output_filter;
+
+        if(NGX_OK == rc || NGX_DONE == rc) {
+            ngx_http_sphinx2_metrics_peer(pd->request, ctx, &pd->uscf->host,
+                                          pc->name);
         }
-        break;
-    default:
-        return(NGX_ERROR);
     }
 
-    u->headers_in.status_n = NGX_HTTP_OK;
-    u->state->status = NGX_HTTP_OK;
+    for(cl = ctx->handshake_cl; cl; cl = cl->next) {
+        cl->buf->pos = cl->buf->start;
+    }
+
+    pd->request->upstream->request_bufs =
+        ctx->cached ? ctx->request_cl : ctx->handshake_cl;
 
-    return NGX_OK;
+    return rc;
 }
 
-#if 0
+
+/* the upstream's writer, noting when it is first called for a peer */
 static ngx_int_t
-ngx_http_sphinx2_filter_init(void *data)
+ngx_http_sphinx2_output_filter(void *data, ngx_chain_t *in)
 {
-    return NGX_OK;
+    ngx_chain_writer_ctx_t        * wctx = data;
+    ngx_http_request_t            * r;
+    ngx_http_sphinx2_ctx_t        * ctx;
+
+    r = wctx->connection->data;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(NULL != ctx && !ctx->connected) {
+        ctx->connected = 1;
+        ctx->connect_time = ngx_current_msec - ctx->peer_start;
+    }
+
+    return ngx_chain_writer(data, in);
 }
 
 
-static ngx_int_t
-ngx_http_sphinx2_filter(void *data, ssize_t bytes)
+static void
+ngx_http_sphinx2_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
 {
-    /*ngx_http_sphinx2_ctx_t  *ctx = data;*/
+    ngx_http_sphinx2_peer_data_t  * pd = data;
+    ngx_http_sphinx2_ctx_t        * ctx;
+
+    ctx = ngx_http_get_module_ctx(pd->request, ngx_http_sphinx2_module);
 
-    /* TODO filter impl here */
-    return 0; /*ctx->filter(ctx, bytes);*/
+    if(NULL != ctx) {
+        ngx_http_sphinx2_metrics_free_peer(ctx, state);
+    }
+
+    if(NULL != pd->breaker.conf) {
+        ngx_http_sphinx2_breaker_free_peer(&pd->breaker, pc, ctx, state);
+    }
+
+    pd->original_free_peer(pc, pd->data, state);
 }
-#endif
 
 static void
 ngx_http_sphinx2_abort_request(ngx_http_request_t *r)
@@ -777,7 +2942,210 @@ ngx_http_sphinx2_abort_request(ngx_http_request_t *r)
 static void
 ngx_http_sphinx2_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
 {
+    ngx_http_sphinx2_ctx_t        * ctx;
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "finalize http sphinx2 request");
+
+    ngx_http_sphinx2_trace_finalize(r, rc);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(NULL != ctx) {
+        ngx_http_sphinx2_hedge_cancel(ctx);
+        ngx_http_sphinx2_concurrency_release(r, ctx, rc);
+        ngx_http_sphinx2_metrics_record(r, ctx);
+    }
+
     return;
 }
+
+
+/* variables */
+
+/* $sphinx2_parse_time, $sphinx2_serialize_time - seconds, to the usec */
+static ngx_int_t
+ngx_http_sphinx2_usec_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_sphinx2_ctx_t        * ctx;
+    ngx_uint_t                      usec;
+    u_char                        * p;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(NULL == ctx || NULL == ctx->request_cl) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    if(NULL == (p = ngx_pnalloc(r->pool, NGX_INT_T_LEN + 8))) {
+        return NGX_ERROR;
+    }
+
+    usec = *(ngx_uint_t *) ((u_char *) ctx + data);
+
+    v->len = ngx_sprintf(p, "%ui.%06ui", usec / 1000000, usec % 1000000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+/* $sphinx2_upstream_first_byte - seconds from the connect to searchd to
+ * the first bytes of its response, as $upstream_response_time has them
+ */
+static ngx_int_t
+ngx_http_sphinx2_first_byte_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_sphinx2_ctx_t        * ctx;
+    u_char                        * p;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(NULL == ctx || !ctx->first_byte) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    if(NULL == (p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4))) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%M.%03M", ctx->first_byte_time / 1000,
+                         ctx->first_byte_time % 1000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+/* $sphinx2_response_len - body length from the searchd response header */
+static ngx_int_t
+ngx_http_sphinx2_response_len_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_sphinx2_ctx_t        * ctx;
+    u_char                        * p;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(NULL == ctx || !ctx->header) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    if(NULL == (p = ngx_pnalloc(r->pool, NGX_INT32_LEN))) {
+        return NGX_ERROR;
+    }
+
+    /* len is the first member in either response context */
+    v->len = ngx_sprintf(p, "%uD", ctx->repctx.srch.len) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+/* $sphinx2_status - ok, error, retry or warning */
+static ngx_int_t
+ngx_http_sphinx2_status_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_sphinx2_ctx_t        * ctx;
+    ngx_str_t                     * name;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(NULL == ctx || !ctx->header) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    name = &ngx_http_sphinx2_status_names[ctx->repctx.srch.status];
+
+    v->len = name->len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = name->data;
+
+    return NGX_OK;
+}
+
+/* $sphinx2_total_found - of each query, comma separated. Only a response
+ * sent as JSON is decoded, so only such a response has one.
+ */
+static ngx_int_t
+ngx_http_sphinx2_total_found_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_sphinx2_ctx_t        * ctx;
+    uint32_t                      * totals;
+    ngx_uint_t                      n, q;
+    u_char                        * p;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(NULL == ctx || NULL == ctx->json
+       || 0 == (n = sphx2_json_totals(ctx->json, &totals)))
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    if(NULL == (p = ngx_pnalloc(r->pool, n * (NGX_INT32_LEN + 1)))) {
+        return NGX_ERROR;
+    }
+
+    v->data = p;
+
+    for(q = 0; q < n; ++q) {
+        p = ngx_sprintf(p, q ? ",%uD" : "%uD", totals[q]);
+    }
+
+    v->len = p - v->data;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+/* $sphinx2_hedge - "won" if the request's hedge answered it, "lost" if it
+ * was hedged and the upstream answered, or the hedge failed
+ */
+static ngx_int_t
+ngx_http_sphinx2_hedge_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_sphinx2_ctx_t        * ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(NULL == ctx || !ctx->hedged) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    if(ctx->hedge_won) {
+        v->len = sizeof("won") - 1;
+        v->data = (u_char *) "won";
+    } else {
+        v->len = sizeof("lost") - 1;
+        v->data = (u_char *) "lost";
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
@@ -0,0 +1,390 @@
+/*
+ * Sphinx2 upstream module - types shared by the module's source files
+ */
+
+#ifndef NGX_HTTP_SPHINX2_MODULE_H
+#define NGX_HTTP_SPHINX2_MODULE_H
+
+
+/* TYPES */
+
+typedef enum {
+    SPHX2_ARG_OFFSET = 0,
+    SPHX2_ARG_NUM_RESULTS,
+    SPHX2_ARG_MATCH_MODE,
+    SPHX2_ARG_RANKER,
+    SPHX2_ARG_RANK_EXPR,
+    SPHX2_ARG_SORT_MODE,
+    SPHX2_ARG_SORT_BY,
+    SPHX2_ARG_KEYWORDS,
+    SPHX2_ARG_INDEX,
+    SPHX2_ARG_FILTERS,
+    SPHX2_ARG_GROUP,
+    SPHX2_ARG_MAX_MATCHES,
+    SPHX2_ARG_GEO,
+    SPHX2_ARG_INDEX_WEIGHTS,
+    SPHX2_ARG_FIELD_WEIGHTS,
+    SPHX2_ARG_OUTPUT_FORMAT,
+    SPHX2_ARG_DOCS,
+    SPHX2_ARG_EXCERPT_OPTS,
+    SPHX2_ARG_COUNT
+} sphx2_args_t;
+
+/* sphinx2_trace */
+typedef enum {
+    SPHX2_TRACE_OFF = 0,
+    SPHX2_TRACE_SAMPLE,                 /* one request in trace_sample */
+    SPHX2_TRACE_ERRORS                  /* requests that fail */
+} sphx2_trace_t;
+
+/* sphinx2_metrics - latency phases, and histogram buckets of a phase */
+typedef enum {
+    SPHX2_METRICS_CONNECT = 0,
+    SPHX2_METRICS_FIRST_BYTE,
+    SPHX2_METRICS_TOTAL,
+    SPHX2_METRICS_PHASES
+} sphx2_metrics_phase_t;
+
+#define SPHX2_METRICS_PEER          ((ngx_uint_t) -1)  /* not a command */
+#define SPHX2_METRICS_STATUSES      4   /* sphx2_searchd_status_t */
+#define SPHX2_METRICS_SUB_BITS      3
+#define SPHX2_METRICS_LINEAR        (2 << SPHX2_METRICS_SUB_BITS)
+#define SPHX2_METRICS_MAX_EXP       20
+#define SPHX2_METRICS_BUCKETS                                                \
+    (SPHX2_METRICS_LINEAR                                                    \
+     + ((SPHX2_METRICS_MAX_EXP - SPHX2_METRICS_SUB_BITS - 1)                 \
+        << SPHX2_METRICS_SUB_BITS))
+
+typedef struct {
+    ngx_http_upstream_conf_t       upstream;
+    ngx_int_t                      cmd_idx;
+    ngx_int_t                      arg_idx[SPHX2_ARG_COUNT];
+    ngx_flag_t                     query_args;   /* not from variables */
+    ngx_str_t                      fixed[SPHX2_ARG_COUNT]; /* sphinx2_<arg> */
+    ngx_uint_t                     fixed_args;   /* a bit per fixed arg */
+    sphx2_search_input_t         * tmpl;         /* the fixed args, parsed */
+    ngx_flag_t                     persist;
+    ngx_shm_zone_t               * cache_zone;
+    time_t                         cache_valid;
+    size_t                         cache_max_size;
+    ngx_flag_t                     coalesce;
+    ngx_msec_t                     coalesce_timeout;
+    ngx_array_t                  * shards;  /* ngx_http_upstream_srv_conf_t* */
+    ngx_uint_t                     trace;        /* sphx2_trace_t */
+    ngx_uint_t                     trace_sample;
+    ngx_open_file_t              * trace_log;    /* NULL - the error log */
+    ngx_shm_zone_t               * metrics_zone;
+    ngx_shm_zone_t               * status_zone;  /* sphinx2_status */
+    ngx_msec_t                     hedge_after;  /* 0 - not hedged */
+    ngx_uint_t                     hedge_percent;/* after a percentile */
+    ngx_http_complex_value_t     * max_query_time; /* searchd limits */
+    ngx_http_complex_value_t     * cutoff;
+    ngx_http_complex_value_t     * retry_count;
+    ngx_http_complex_value_t     * retry_delay;
+    ngx_flag_t                     deadline;
+    ngx_http_complex_value_t     * deadline_budget; /* NULL - read_timeout */
+    ngx_http_complex_value_t     * query_class;  /* sphinx2_class */
+    ngx_uint_t                     excerpt_split; /* 0 - not split */
+    size_t                         excerpt_split_min; /* bytes per run */
+} ngx_http_sphinx2_loc_conf_t;
+
+/* an upstream used by sphinx2_pass along with its original peer init */
+typedef struct {
+    ngx_http_upstream_srv_conf_t * uscf;
+    ngx_http_upstream_init_peer_pt original_init_peer;
+} ngx_http_sphinx2_upstream_t;
+
+/* sphinx2_check of an upstream */
+typedef struct {
+    ngx_http_upstream_srv_conf_t * uscf;
+    ngx_msec_t                     interval;
+    ngx_msec_t                     timeout;
+    ngx_uint_t                     fails;     /* to be marked down */
+    ngx_uint_t                     passes;    /* to be back up */
+    ngx_msec_t                     max_time;  /* 0 - not checked */
+    ngx_uint_t                     max_queue; /* 0 - not checked */
+} ngx_http_sphinx2_check_conf_t;
+
+typedef struct ngx_http_sphinx2_ewma_sh_s     ngx_http_sphinx2_ewma_sh_t;
+typedef struct ngx_http_sphinx2_ewma_local_s  ngx_http_sphinx2_ewma_local_t;
+
+/* sphinx2_balancer ewma of an upstream */
+typedef struct {
+    ngx_http_upstream_srv_conf_t * uscf;
+    ngx_msec_t                     decay;
+    ngx_msec_t                     slow_start;
+    ngx_shm_zone_t               * shm_zone;
+    ngx_http_sphinx2_ewma_sh_t   * sh;      /* of all the workers */
+    ngx_http_sphinx2_ewma_local_t * local;  /* of this worker */
+    ngx_uint_t                     number;  /* primary and backup peers */
+    uint32_t                       sig;     /* crc32 of the peer names */
+} ngx_http_sphinx2_balancer_conf_t;
+
+typedef struct ngx_http_sphinx2_breaker_sh_s  ngx_http_sphinx2_breaker_sh_t;
+
+/* sphinx2_breaker of an upstream */
+typedef struct {
+    ngx_http_upstream_srv_conf_t * uscf;
+    ngx_uint_t                     failures;     /* in a row, 0 - any */
+    ngx_uint_t                     error_rate;   /* percent, 0 - any */
+    ngx_uint_t                     min_requests; /* for the error rate */
+    ngx_msec_t                     window;       /* of the error rate */
+    ngx_msec_t                     open;         /* until a probe */
+    ngx_shm_zone_t               * shm_zone;
+    ngx_http_sphinx2_breaker_sh_t * sh;          /* of all the workers */
+    u_char                       * masked;       /* left out, per peer */
+    ngx_uint_t                     number;  /* primary and backup peers */
+    uint32_t                       sig;     /* crc32 of the peer names */
+} ngx_http_sphinx2_breaker_conf_t;
+
+/* the peer a request went to, as the breaker of the upstream knows it */
+typedef struct {
+    ngx_http_sphinx2_breaker_conf_t * conf;
+    ngx_uint_t                     current;      /* of all the peers */
+    unsigned                       probe:1;      /* of an open peer */
+} ngx_http_sphinx2_breaker_try_t;
+
+typedef struct ngx_http_sphinx2_concurrency_sh_s
+                                   ngx_http_sphinx2_concurrency_sh_t;
+
+/* with the default one */
+#define SPHX2_CONCURRENCY_CLASSES  16
+
+/* a class of requests to an upstream, in this worker */
+typedef struct {
+    ngx_str_t                      name;      /* empty - the default */
+    ngx_uint_t                     weight;
+    ngx_queue_t                    waiters;
+    ngx_uint_t                     waiting;
+} ngx_http_sphinx2_concurrency_class_t;
+
+/* sphinx2_concurrency of an upstream */
+typedef struct {
+    ngx_http_upstream_srv_conf_t * uscf;
+    ngx_uint_t                     min;
+    ngx_uint_t                     max;
+    ngx_uint_t                     queue;     /* per class and worker */
+    ngx_msec_t                     timeout;   /* of a wait in the queue */
+    ngx_shm_zone_t               * shm_zone;
+    ngx_http_sphinx2_concurrency_sh_t * sh;   /* of all the workers */
+    ngx_http_sphinx2_concurrency_class_t * classes;
+    ngx_uint_t                     nclasses;
+} ngx_http_sphinx2_concurrency_conf_t;
+
+typedef struct {
+    ngx_array_t                    upstreams; /* ngx_http_sphinx2_upstream_t */
+    ngx_array_t                    checks;  /* ngx_http_sphinx2_check_conf_t */
+    ngx_array_t                    balancers;
+                                   /* ngx_http_sphinx2_balancer_conf_t */
+    ngx_array_t                    breakers;
+                                   /* ngx_http_sphinx2_breaker_conf_t */
+    ngx_array_t                    concurrencies;
+                                   /* ngx_http_sphinx2_concurrency_conf_t * */
+    ngx_array_t                    filter_sets;   /* sphx2_filter_set_t */
+} ngx_http_sphinx2_main_conf_t;
+
+typedef struct ngx_http_sphinx2_flight_s  ngx_http_sphinx2_flight_t;
+typedef struct ngx_http_sphinx2_shard_s   ngx_http_sphinx2_shard_t;
+typedef struct ngx_http_sphinx2_hedge_s   ngx_http_sphinx2_hedge_t;
+typedef struct ngx_http_sphinx2_metrics_node_s
+                                          ngx_http_sphinx2_metrics_node_t;
+
+typedef struct {
+    ngx_http_request_t           * request;
+    sphx2_command_t                command;
+    ngx_uint_t                     num_queries;
+    sphx2_response_ctx_t           repctx;
+    ngx_chain_t                  * handshake_cl; /* handshake + request */
+    ngx_chain_t                  * request_cl;   /* request only */
+    u_char                         key[16];      /* md5 of request_cl */
+    ngx_buf_t                    * body;         /* copy of the response */
+    ngx_http_sphinx2_flight_t    * flight;       /* led by this request */
+    ngx_queue_t                    wait;         /* in a flight's waiters */
+    ngx_event_t                    wait_ev;
+    ngx_msec_t                     wait_deadline;
+    ngx_http_sphinx2_shard_t     * shards;       /* fanned out to */
+    ngx_uint_t                     num_shards;
+    ngx_uint_t                     pending;
+    sphx2_merge_spec_t           * merge;        /* one per query */
+    sphx2_output_type_t            output_type;
+    ngx_str_t                    * args;         /* from the query string */
+    ngx_str_t                    * body_args;    /* from a POST body */
+    ngx_array_t                  * body_docs;    /* sphx2_doc_t, of it */
+    struct sphx2_json_s          * json;         /* JSON output decoder */
+    ngx_str_t                      index;        /* of the first query */
+    ngx_msec_t                     deadline;     /* out of time, 0 - no
+                                                    sphinx2_deadline */
+    ngx_msec_t                     start;        /* first peer tried */
+    ngx_msec_t                     peer_start;   /* current peer tried */
+    ngx_msec_t                     connect_time; /* from peer_start */
+    ngx_msec_t                     first_byte_time;
+    size_t                         bytes_in;
+    ngx_uint_t                     parse_usec;   /* of the args */
+    ngx_uint_t                     serialize_usec; /* of the request */
+    ngx_http_sphinx2_metrics_node_t * metrics;    /* of the index */
+    ngx_http_sphinx2_metrics_node_t * peer_metrics; /* of the peer */
+    ngx_http_sphinx2_hedge_t     * hedge;
+    ngx_http_sphinx2_concurrency_conf_t * limiter; /* of the upstream */
+    ngx_queue_t                    limit_wait;   /* for a slot of it */
+    ngx_event_t                    limit_ev;
+    ngx_msec_t                     limit_deadline;
+    ngx_uint_t                     limit_start;  /* usec, slot taken */
+    ngx_uint_t                     limit_class;  /* of the limiter's */
+    ngx_uint_t                     limit_passes; /* over for other classes */
+    unsigned                       persist:1;
+    unsigned                       cached:1;     /* on a kept-alive conn */
+    unsigned                       claimed:1;    /* in-flight in the zone */
+    unsigned                       alone:1;      /* not coalescing */
+    unsigned                       waiting:1;
+    unsigned                       cleanup:1;
+    unsigned                       shard:1;      /* a shard subrequest */
+    unsigned                       merged:1;
+    unsigned                       unsent:1;     /* shards left unsent */
+    unsigned                       trace:1;      /* sampled for tracing */
+    unsigned                       traced:1;     /* its request written */
+    unsigned                       connected:1;  /* to the current peer */
+    unsigned                       first_byte:1; /* from the current peer */
+    unsigned                       header:1;     /* response header valid */
+    unsigned                       counted:1;    /* in flight in metrics */
+    unsigned                       peer_recorded:1;
+    unsigned                       hedged:1;     /* sent to a second peer */
+    unsigned                       hedge_won:1;  /* which answered first */
+    unsigned                       limited:1;    /* holds a slot */
+    unsigned                       limit_waiting:1;
+} ngx_http_sphinx2_ctx_t;
+
+
+/* PROTOTYPES */
+
+/* module */
+ngx_int_t   ngx_http_sphinx2_send_response(ngx_http_request_t *r,
+                ngx_buf_t *b);
+void        ngx_http_sphinx2_forward(ngx_http_request_t *r);
+void        ngx_http_sphinx2_start(ngx_http_request_t *r);
+ngx_uint_t  ngx_http_sphinx2_usec(void);
+ngx_uint_t  ngx_http_sphinx2_param(u_char *name, size_t len);
+
+/* request bodies */
+ngx_int_t   ngx_http_sphinx2_body_args(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx);
+
+/* response cache */
+char      * ngx_http_sphinx2_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                void *conf);
+char      * ngx_http_sphinx2_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+                void *conf);
+void        ngx_http_sphinx2_cache_key(ngx_http_sphinx2_loc_conf_t *slcf,
+                ngx_http_sphinx2_ctx_t *ctx);
+ngx_int_t   ngx_http_sphinx2_cache_lookup(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx, ngx_buf_t **b, ngx_uint_t claim);
+ngx_int_t   ngx_http_sphinx2_cache_store(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx);
+void        ngx_http_sphinx2_cache_abandon(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx);
+
+/* request coalescing */
+ngx_int_t   ngx_http_sphinx2_coalesce_join(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx);
+void        ngx_http_sphinx2_coalesce_done(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx, ngx_buf_t *b);
+void        ngx_http_sphinx2_coalesce_poll(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx);
+
+/* shard fan-out */
+char      * ngx_http_sphinx2_excerpt_split(ngx_conf_t *cf, ngx_command_t *cmd,
+                void *conf);
+ngx_int_t   ngx_http_sphinx2_fanout_split(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx, sphx2_excerpt_input_t *input);
+ngx_int_t   ngx_http_sphinx2_fanout(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx);
+ngx_int_t   ngx_http_sphinx2_fanout_init_shard(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx);
+
+/* wire tracing */
+char      * ngx_http_sphinx2_trace(ngx_conf_t *cf, ngx_command_t *cmd,
+                void *conf);
+char      * ngx_http_sphinx2_trace_log(ngx_conf_t *cf, ngx_command_t *cmd,
+                void *conf);
+void        ngx_http_sphinx2_trace_request(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx);
+void        ngx_http_sphinx2_trace_response(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx, u_char *start, u_char *last,
+                ngx_int_t rc);
+void        ngx_http_sphinx2_trace_finalize(ngx_http_request_t *r,
+                ngx_int_t rc);
+
+/* traffic metrics */
+char      * ngx_http_sphinx2_metrics_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                void *conf);
+char      * ngx_http_sphinx2_metrics(ngx_conf_t *cf, ngx_command_t *cmd,
+                void *conf);
+ngx_uint_t  ngx_http_sphinx2_metrics_bucket(ngx_msec_t ms);
+ngx_msec_t  ngx_http_sphinx2_metrics_quantile(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx, ngx_uint_t phase,
+                ngx_uint_t percent, ngx_uint_t min);
+void        ngx_http_sphinx2_metrics_cache(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx, ngx_uint_t hit);
+void        ngx_http_sphinx2_metrics_peer(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx, ngx_str_t *upstream,
+                ngx_str_t *peer);
+void        ngx_http_sphinx2_metrics_free_peer(ngx_http_sphinx2_ctx_t *ctx,
+                ngx_uint_t state);
+void        ngx_http_sphinx2_metrics_record(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx);
+char      * ngx_http_sphinx2_status(ngx_conf_t *cf, ngx_command_t *cmd,
+                void *conf);
+
+/* health checks */
+char      * ngx_http_sphinx2_check(ngx_conf_t *cf, ngx_command_t *cmd,
+                void *conf);
+ngx_int_t   ngx_http_sphinx2_check_init_process(ngx_cycle_t *cycle);
+
+/* latency-aware balancer */
+char      * ngx_http_sphinx2_balancer(ngx_conf_t *cf, ngx_command_t *cmd,
+                void *conf);
+
+/* hedged requests */
+char      * ngx_http_sphinx2_hedge(ngx_conf_t *cf, ngx_command_t *cmd,
+                void *conf);
+ngx_int_t   ngx_http_sphinx2_hedge_arm(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx);
+void        ngx_http_sphinx2_hedge_cancel(ngx_http_sphinx2_ctx_t *ctx);
+
+/* circuit breakers */
+char      * ngx_http_sphinx2_breaker(ngx_conf_t *cf, ngx_command_t *cmd,
+                void *conf);
+ngx_int_t   ngx_http_sphinx2_breaker_init(ngx_conf_t *cf);
+ngx_http_sphinx2_breaker_conf_t * ngx_http_sphinx2_breaker_conf(
+                ngx_http_sphinx2_main_conf_t *smcf,
+                ngx_http_upstream_srv_conf_t *us);
+ngx_uint_t  ngx_http_sphinx2_breaker_is_open(
+                ngx_http_sphinx2_breaker_conf_t *bcf, ngx_uint_t n);
+ngx_int_t   ngx_http_sphinx2_breaker_get_peer(
+                ngx_http_sphinx2_breaker_try_t *bt, ngx_peer_connection_t *pc,
+                ngx_event_get_peer_pt get, void *data);
+void        ngx_http_sphinx2_breaker_free_peer(
+                ngx_http_sphinx2_breaker_try_t *bt, ngx_peer_connection_t *pc,
+                ngx_http_sphinx2_ctx_t *ctx, ngx_uint_t state);
+
+/* concurrency limits */
+char      * ngx_http_sphinx2_concurrency(ngx_conf_t *cf, ngx_command_t *cmd,
+                void *conf);
+ngx_int_t   ngx_http_sphinx2_concurrency_acquire(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx);
+void        ngx_http_sphinx2_concurrency_release(ngx_http_request_t *r,
+                ngx_http_sphinx2_ctx_t *ctx, ngx_int_t rc);
+ngx_int_t   ngx_http_sphinx2_concurrency_take_hedge(ngx_http_request_t *r,
+                ngx_http_sphinx2_concurrency_conf_t **ccfp);
+void        ngx_http_sphinx2_concurrency_put_hedge(
+                ngx_http_sphinx2_concurrency_conf_t *ccf);
+
+/* filter sets */
+char      * ngx_http_sphinx2_filter_set(ngx_conf_t *cf, ngx_command_t *cmd,
+                void *conf);
+
+
+/* GLOBALS */
+
+extern ngx_module_t  ngx_http_sphinx2_module;
+
+#endif /* NGX_HTTP_SPHINX2_MODULE_H */
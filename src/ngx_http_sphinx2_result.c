@@ -0,0 +1,1227 @@
+/*
+ * Sphinx2 search result sets - decoding, encoding and merging
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_stream.h"
+#include "ngx_http_sphinx2_result.h"
+
+
+/* TYPES */
+
+/* What a sort key looks at */
+typedef enum {
+    SPHX2_KEY_WEIGHT,
+    SPHX2_KEY_ID,
+    SPHX2_KEY_ATTR,
+    SPHX2_KEY_TIME_SEGMENT
+} sphx2_key_type_t;
+
+typedef struct {
+    sphx2_key_type_t       type;
+    ngx_uint_t             attr;
+    ngx_uint_t             desc;
+} sphx2_sort_key_t;
+
+/* Max keys in an extended sort clause (as in searchd) */
+#define SPHX2_MAX_SORT_KEYS     5
+
+typedef struct {
+    sphx2_result_t       * schema;
+    sphx2_sort_key_t       keys[SPHX2_MAX_SORT_KEYS + 1]; /* + id tiebreak */
+    ngx_uint_t             num_keys;
+    time_t                 now;
+} sphx2_sorter_t;
+
+/* A group of a grouped result being merged: the match that stands for it,
+ * and its counts over all the results
+ */
+typedef struct {
+    sphx2_result_t       * res;
+    sphx2_result_match_t * m;
+    u_char               * key;
+    size_t                 key_len;
+    uint64_t               count;
+    uint64_t               distinct;
+} sphx2_group_row_t;
+
+
+/* LOCAL GLOBALS */
+
+static const size_t sz32 = sizeof(uint32_t),
+                    sz64 = sizeof(uint64_t);
+
+static ngx_str_t s_schema_mismatch = ngx_string("schema mismatch");
+
+/* the order groups are sorted in, for the qsort callback */
+static sphx2_sorter_t * s_group_sorter;
+
+
+/* FUNCTION DEFINITIONS */
+
+/* fixed size of an attribute value on the wire, 0 if it varies */
+static size_t
+s_attr_size(uint32_t type)
+{
+    switch(type) {
+        case SPHX2_ATTR_BIGINT:
+            return sz64;
+        case SPHX2_ATTR_STRING:
+        case SPHX2_ATTR_MULTI:
+        case SPHX2_ATTR_MULTI64:
+            return 0;
+        default:
+            return sz32;
+    }
+}
+
+static uint32_t
+s_get_int32(u_char * p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sz32);
+
+    return(ntohl(v));
+}
+
+static uint64_t
+s_get_int64(u_char * p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sz64);
+
+    return(__bswap_64(v));
+}
+
+/* Decoding */
+
+static ngx_int_t
+s_decode_match_attrs(
+    sphx2_stream_t       * st,
+    ngx_pool_t           * pool,
+    sphx2_result_t       * res,
+    sphx2_result_match_t * m)
+{
+    ngx_uint_t       j;
+    uint32_t         len;
+    u_char         * p;
+
+    if(NULL == (m->attr_off = ngx_palloc(pool, res->num_attrs * sz32))) {
+        return(NGX_ERROR);
+    }
+
+    if(NGX_OK != sphx2_stream_skip(st, 0, &m->attrs)) {
+        return(NGX_ERROR);
+    }
+
+    for(j = 0; j < res->num_attrs; ++j) {
+        if(NGX_OK != sphx2_stream_skip(st, 0, &p)) {
+            return(NGX_ERROR);
+        }
+
+        m->attr_off[j] = p - m->attrs;
+
+        switch(res->attrs[j].type) {
+            case SPHX2_ATTR_STRING:
+                if(NGX_OK != sphx2_stream_read_int32(st, &len)
+                   || NGX_OK != sphx2_stream_skip(st, len, NULL))
+                {
+                    return(NGX_ERROR);
+                }
+                break;
+            case SPHX2_ATTR_MULTI:
+            case SPHX2_ATTR_MULTI64:
+                /* the count is of dwords for either */
+                if(NGX_OK != sphx2_stream_read_int32(st, &len)
+                   || len > sphx2_stream_offset(st) / sz32
+                   || NGX_OK != sphx2_stream_skip(st, len * sz32, NULL))
+                {
+                    return(NGX_ERROR);
+                }
+                break;
+            default:
+                if(NGX_OK != sphx2_stream_skip(st,
+                                 s_attr_size(res->attrs[j].type), NULL))
+                {
+                    return(NGX_ERROR);
+                }
+        }
+    }
+
+    if(NGX_OK != sphx2_stream_skip(st, 0, &p)) {
+        return(NGX_ERROR);
+    }
+
+    m->attrs_len = p - m->attrs;
+
+    return(NGX_OK);
+}
+
+static ngx_int_t
+s_decode_result(
+    sphx2_stream_t       * st,
+    ngx_pool_t           * pool,
+    sphx2_result_t       * res)
+{
+    ngx_int_t                status;
+    ngx_uint_t               i, var;
+    uint32_t                 n, v;
+    size_t                   fixed, size;
+    sphx2_result_match_t   * m;
+
+    if(NGX_OK != sphx2_stream_read_int32(st, &v)) {
+        return(NGX_ERROR);
+    }
+
+    res->status = (sphx2_searchd_status_t)v;
+
+    if(SPHX2_SEARCHD_OK != res->status) {
+        if(NGX_OK != sphx2_stream_read_string_ref(st, &res->message)) {
+            return(NGX_ERROR);
+        }
+        if(SPHX2_SEARCHD_WARNING != res->status) {
+            return(NGX_OK);
+        }
+    }
+
+    /* fields */
+    if(NGX_OK != sphx2_stream_read_int32(st, &n)
+       || n > sphx2_stream_offset(st) / sz32)
+    {
+        return(NGX_ERROR);
+    }
+
+    res->num_fields = n;
+
+    if(NULL == (res->fields = ngx_palloc(pool, (n + 1) * sizeof(ngx_str_t))))
+    {
+        return(NGX_ERROR);
+    }
+
+    for(i = 0; i < n; ++i) {
+        if(NGX_OK != sphx2_stream_read_string_ref(st, &res->fields[i])) {
+            return(NGX_ERROR);
+        }
+    }
+
+    /* attributes */
+    if(NGX_OK != sphx2_stream_read_int32(st, &n)
+       || n > sphx2_stream_offset(st) / (2 * sz32))
+    {
+        return(NGX_ERROR);
+    }
+
+    res->num_attrs = n;
+
+    if(NULL == (res->attrs = ngx_palloc(pool,
+                                 (n + 1) * sizeof(sphx2_result_attr_t)))
+       || NULL == (res->attr_off = ngx_palloc(pool, (n + 1) * sz32)))
+    {
+        return(NGX_ERROR);
+    }
+
+    fixed = 0;
+    var = 0;
+
+    for(i = 0; i < n; ++i) {
+        if(NGX_OK != (status =
+                sphx2_stream_read_string_ref(st, &res->attrs[i].name)
+             || sphx2_stream_read_int32(st, &res->attrs[i].type)))
+        {
+            return(NGX_ERROR);
+        }
+
+        res->attr_off[i] = fixed;
+
+        if(0 == (size = s_attr_size(res->attrs[i].type))) {
+            var = 1;
+        }
+
+        fixed += size;
+    }
+
+    if(var) {
+        res->attr_off = NULL;
+    }
+
+    /* matches */
+    if(NGX_OK != (status =
+            sphx2_stream_read_int32(st, &n)
+         || sphx2_stream_read_int32(st, &res->id64)))
+    {
+        return(NGX_ERROR);
+    }
+
+    size = (res->id64 ? sz64 : sz32) + sz32 + (var ? 0 : fixed);
+
+    if(n > sphx2_stream_offset(st) / size) {
+        return(NGX_ERROR);
+    }
+
+    res->num_matches = n;
+
+    if(NULL == (res->matches = ngx_palloc(pool,
+                                   (n + 1) * sizeof(sphx2_result_match_t))))
+    {
+        return(NGX_ERROR);
+    }
+
+    for(i = 0; i < n; ++i) {
+        m = &res->matches[i];
+
+        if(res->id64) {
+            status = sphx2_stream_read_int64(st, &m->id);
+        } else {
+            status = sphx2_stream_read_int32(st, &v);
+            m->id = v;
+        }
+
+        if(NGX_OK != status
+           || NGX_OK != sphx2_stream_read_int32(st, &m->weight))
+        {
+            return(NGX_ERROR);
+        }
+
+        if(var) {
+            if(NGX_OK != s_decode_match_attrs(st, pool, res, m)) {
+                return(NGX_ERROR);
+            }
+            continue;
+        }
+
+        if(NGX_OK != sphx2_stream_skip(st, fixed, &m->attrs)) {
+            return(NGX_ERROR);
+        }
+
+        m->attrs_len = fixed;
+        m->attr_off = NULL;
+    }
+
+    /* totals and words */
+    if(NGX_OK != (status =
+            sphx2_stream_read_int32(st, &res->total)
+         || sphx2_stream_read_int32(st, &res->total_found)
+         || sphx2_stream_read_int32(st, &res->time_msec)
+         || sphx2_stream_read_int32(st, &n)))
+    {
+        return(NGX_ERROR);
+    }
+
+    if(n > sphx2_stream_offset(st) / (3 * sz32)) {
+        return(NGX_ERROR);
+    }
+
+    res->num_words = n;
+
+    if(NULL == (res->words = ngx_palloc(pool,
+                                 (n + 1) * sizeof(sphx2_result_word_t))))
+    {
+        return(NGX_ERROR);
+    }
+
+    for(i = 0; i < n; ++i) {
+        if(NGX_OK != (status =
+                sphx2_stream_read_string_ref(st, &res->words[i].word)
+             || sphx2_stream_read_int32(st, &res->words[i].docs)
+             || sphx2_stream_read_int32(st, &res->words[i].hits)))
+        {
+            return(NGX_ERROR);
+        }
+    }
+
+    return(NGX_OK);
+}
+
+ngx_int_t
+sphx2_decode_search_response(
+    ngx_pool_t           * pool,
+    ngx_buf_t            * b,
+    sphx2_searchd_status_t status,
+    ngx_uint_t             num_queries,
+    sphx2_result_t      ** results)
+{
+    sphx2_stream_t       * st;
+    sphx2_result_t       * res;
+    ngx_buf_t              rb;
+    ngx_str_t              message;
+    ngx_uint_t             i;
+
+    /* read through a copy so that the caller's buffer is left as it is */
+    rb = *b;
+
+    if(NULL == (st = sphx2_stream_create(pool))
+       || NGX_OK != sphx2_stream_set_buf(st, &rb))
+    {
+        return(NGX_ERROR);
+    }
+
+    if(NULL == (res = ngx_pcalloc(pool,
+                          num_queries * sizeof(sphx2_result_t))))
+    {
+        return(NGX_ERROR);
+    }
+
+    /* the message of a failed request stands for all its queries; that of
+     * a warning precedes the result sets
+     */
+    if(SPHX2_SEARCHD_OK != status) {
+        if(NGX_OK != sphx2_stream_read_string_ref(st, &message)) {
+            return(NGX_ERROR);
+        }
+
+        if(SPHX2_SEARCHD_WARNING != status) {
+            for(i = 0; i < num_queries; ++i) {
+                res[i].status = status;
+                res[i].message = message;
+            }
+            *results = res;
+            return(NGX_OK);
+        }
+    }
+
+    for(i = 0; i < num_queries; ++i) {
+        if(NGX_OK != s_decode_result(st, pool, &res[i])) {
+            return(NGX_ERROR);
+        }
+    }
+
+    *results = res;
+
+    return(NGX_OK);
+}
+
+/* Encoding */
+
+static size_t
+s_result_size(sphx2_result_t * res)
+{
+    size_t       size;
+    ngx_uint_t   i;
+
+    size = sz32;
+
+    if(SPHX2_SEARCHD_OK != res->status) {
+        size += sz32 + res->message.len;
+        if(SPHX2_SEARCHD_WARNING != res->status) {
+            return(size);
+        }
+    }
+
+    size += sz32;
+    for(i = 0; i < res->num_fields; ++i) {
+        size += sz32 + res->fields[i].len;
+    }
+
+    size += sz32;
+    for(i = 0; i < res->num_attrs; ++i) {
+        size += 2 * sz32 + res->attrs[i].name.len;
+    }
+
+    size += 2 * sz32;
+    for(i = 0; i < res->num_matches; ++i) {
+        size += (res->id64 ? sz64 : sz32) + sz32
+              + res->matches[i].attrs_len;
+    }
+
+    size += 4 * sz32;
+    for(i = 0; i < res->num_words; ++i) {
+        size += 3 * sz32 + res->words[i].word.len;
+    }
+
+    return(size);
+}
+
+static ngx_int_t
+s_encode_result(
+    sphx2_stream_t       * st,
+    sphx2_result_t       * res)
+{
+    ngx_int_t                status;
+    ngx_uint_t               i;
+    sphx2_result_match_t   * m;
+
+    if(NGX_OK != sphx2_stream_write_int32(st, res->status)) {
+        return(NGX_ERROR);
+    }
+
+    if(SPHX2_SEARCHD_OK != res->status) {
+        if(NGX_OK != sphx2_stream_write_string(st, &res->message)) {
+            return(NGX_ERROR);
+        }
+        if(SPHX2_SEARCHD_WARNING != res->status) {
+            return(NGX_OK);
+        }
+    }
+
+    if(NGX_OK != sphx2_stream_write_int32(st, res->num_fields)) {
+        return(NGX_ERROR);
+    }
+
+    for(i = 0; i < res->num_fields; ++i) {
+        if(NGX_OK != sphx2_stream_write_string(st, &res->fields[i])) {
+            return(NGX_ERROR);
+        }
+    }
+
+    if(NGX_OK != sphx2_stream_write_int32(st, res->num_attrs)) {
+        return(NGX_ERROR);
+    }
+
+    for(i = 0; i < res->num_attrs; ++i) {
+        if(NGX_OK != (status =
+                sphx2_stream_write_string(st, &res->attrs[i].name)
+             || sphx2_stream_write_int32(st, res->attrs[i].type)))
+        {
+            return(NGX_ERROR);
+        }
+    }
+
+    if(NGX_OK != (status =
+            sphx2_stream_write_int32(st, res->num_matches)
+         || sphx2_stream_write_int32(st, res->id64)))
+    {
+        return(NGX_ERROR);
+    }
+
+    for(i = 0; i < res->num_matches; ++i) {
+        m = &res->matches[i];
+
+        if(res->id64) {
+            status = sphx2_stream_write_int64(st, m->id);
+        } else {
+            status = sphx2_stream_write_int32(st, (uint32_t)m->id);
+        }
+
+        if(NGX_OK != (status = status
+             || sphx2_stream_write_int32(st, m->weight)
+             || sphx2_stream_write_bytes(st, m->attrs, m->attrs_len)))
+        {
+            return(NGX_ERROR);
+        }
+    }
+
+    if(NGX_OK != (status =
+            sphx2_stream_write_int32(st, res->total)
+         || sphx2_stream_write_int32(st, res->total_found)
+         || sphx2_stream_write_int32(st, res->time_msec)
+         || sphx2_stream_write_int32(st, res->num_words)))
+    {
+        return(NGX_ERROR);
+    }
+
+    for(i = 0; i < res->num_words; ++i) {
+        if(NGX_OK != (status =
+                sphx2_stream_write_string(st, &res->words[i].word)
+             || sphx2_stream_write_int32(st, res->words[i].docs)
+             || sphx2_stream_write_int32(st, res->words[i].hits)))
+        {
+            return(NGX_ERROR);
+        }
+    }
+
+    return(NGX_OK);
+}
+
+ngx_int_t
+sphx2_encode_search_response(
+    ngx_pool_t           * pool,
+    sphx2_result_t       * results,
+    ngx_uint_t             num_queries,
+    ngx_buf_t           ** b)
+{
+    sphx2_stream_t       * st;
+    size_t                 len;
+    ngx_uint_t             i;
+
+    for(len = 0, i = 0; i < num_queries; ++i) {
+        len += s_result_size(&results[i]);
+    }
+
+    if(NULL == (st = sphx2_stream_create(pool))
+       || NGX_OK != sphx2_stream_alloc(st, len ? len : 1))
+    {
+        return(NGX_ERROR);
+    }
+
+    for(i = 0; i < num_queries; ++i) {
+        if(NGX_OK != s_encode_result(st, &results[i])) {
+            return(NGX_ERROR);
+        }
+    }
+
+    *b = sphx2_stream_get_buf(st);
+
+    return(NGX_OK);
+}
+
+/* Merging */
+
+static ngx_int_t
+s_same_schema(sphx2_result_t * a, sphx2_result_t * b)
+{
+    ngx_uint_t i;
+
+    if(a->num_attrs != b->num_attrs) {
+        return(0);
+    }
+
+    for(i = 0; i < a->num_attrs; ++i) {
+        if(a->attrs[i].type != b->attrs[i].type
+           || a->attrs[i].name.len != b->attrs[i].name.len
+           || ngx_memcmp(a->attrs[i].name.data, b->attrs[i].name.data,
+                         a->attrs[i].name.len))
+        {
+            return(0);
+        }
+    }
+
+    return(1);
+}
+
+#define NAME_IS(p, len, str) \
+    ((len) == sizeof(str) - 1 && 0 == ngx_strncasecmp(p, (u_char*)str, len))
+
+/* add a key on the named attribute or magic name; unknown ones are
+ * ignored as they can't have been sorted on by searchd either
+ */
+static void
+s_add_sort_key(
+    sphx2_sorter_t       * s,
+    u_char               * name,
+    size_t                 len,
+    sphx2_key_type_t       type,
+    ngx_uint_t             desc)
+{
+    sphx2_sort_key_t     * k;
+    ngx_uint_t             i;
+
+    if(s->num_keys == SPHX2_MAX_SORT_KEYS) {
+        return;
+    }
+
+    k = &s->keys[s->num_keys];
+    k->desc = desc;
+
+    if(NAME_IS(name, len, "@weight") || NAME_IS(name, len, "@relevance")
+       || NAME_IS(name, len, "@rank"))
+    {
+        k->type = SPHX2_KEY_WEIGHT;
+        ++s->num_keys;
+        return;
+    }
+
+    if(NAME_IS(name, len, "@id")) {
+        k->type = SPHX2_KEY_ID;
+        ++s->num_keys;
+        return;
+    }
+
+    /* the group key is the @groupby attribute of a grouped result */
+    if(NAME_IS(name, len, "@group")) {
+        name = (u_char*)"@groupby";
+        len = sizeof("@groupby") - 1;
+    }
+
+    for(i = 0; i < s->schema->num_attrs; ++i) {
+        if(s->schema->attrs[i].name.len == len
+           && 0 == ngx_strncasecmp(s->schema->attrs[i].name.data, name, len))
+        {
+            k->type = type;
+            k->attr = i;
+            ++s->num_keys;
+            return;
+        }
+    }
+}
+
+/* "attr1 desc, @weight asc, ..." */
+static void
+s_parse_sort_clause(sphx2_sorter_t * s, ngx_str_t * clause)
+{
+    u_char   * p, * end, * name, * dir;
+    size_t     name_len, dir_len;
+
+    p = clause->data;
+    end = p + clause->len;
+
+    while(p < end) {
+        while(p < end && (' ' == *p || ',' == *p)) ++p;
+
+        for(name = p; p < end && ' ' != *p && ',' != *p; ++p) /* void */;
+        name_len = p - name;
+
+        while(p < end && ' ' == *p) ++p;
+
+        for(dir = p; p < end && ' ' != *p && ',' != *p; ++p) /* void */;
+        dir_len = p - dir;
+
+        if(name_len) {
+            s_add_sort_key(s, name, name_len, SPHX2_KEY_ATTR,
+                           NAME_IS(dir, dir_len, "desc"));
+        }
+    }
+}
+
+static void
+s_init_sorter(
+    sphx2_sorter_t       * s,
+    sphx2_result_t       * schema,
+    sphx2_merge_spec_t   * spec)
+{
+    static u_char   weight[] = "@weight";
+    static u_char   expr[] = "@expr";
+
+    s->schema = schema;
+    s->num_keys = 0;
+    s->now = ngx_time();
+
+    switch(spec->sort_mode) {
+        case SPHX2_SORT_ATTR_DESC:
+        case SPHX2_SORT_ATTR_ASC:
+            s_add_sort_key(s, spec->sort_by.data, spec->sort_by.len,
+                           SPHX2_KEY_ATTR,
+                           SPHX2_SORT_ATTR_DESC == spec->sort_mode);
+            break;
+        case SPHX2_SORT_TIME_SEGMENTS:
+            s_add_sort_key(s, spec->sort_by.data, spec->sort_by.len,
+                           SPHX2_KEY_TIME_SEGMENT, 0);
+            break;
+        case SPHX2_SORT_EXTENDED:
+            s_parse_sort_clause(s, &spec->sort_by);
+            break;
+        case SPHX2_SORT_EXPR:
+            s_add_sort_key(s, expr, sizeof(expr) - 1, SPHX2_KEY_ATTR, 1);
+            break;
+        default:
+            break;
+    }
+
+    if(SPHX2_SORT_EXTENDED != spec->sort_mode) {
+        s_add_sort_key(s, weight, sizeof(weight) - 1, SPHX2_KEY_WEIGHT, 1);
+    }
+
+    /* searchd breaks ties on document id */
+    s->keys[s->num_keys].type = SPHX2_KEY_ID;
+    s->keys[s->num_keys].desc = 0;
+    ++s->num_keys;
+}
+
+#define CMP(a, b) (((a) > (b)) - ((a) < (b)))
+
+/* last hour, day, week, month, 3 months, the rest */
+static ngx_uint_t
+s_time_segment(time_t now, uint32_t ts)
+{
+    time_t age = now - (time_t)ts;
+
+    return (age < 3600) ? 0 : (age < 86400) ? 1 : (age < 7 * 86400) ? 2
+         : (age < 30 * 86400) ? 3 : (age < 90 * 86400) ? 4 : 5;
+}
+
+static ngx_int_t
+s_compare_attr(uint32_t type, u_char * a, u_char * b)
+{
+    uint32_t     ua, ub;
+    float        fa, fb;
+    int64_t      la, lb;
+    ngx_int_t    rc;
+
+    switch(type) {
+        case SPHX2_ATTR_FLOAT:
+            ua = s_get_int32(a);
+            ub = s_get_int32(b);
+            memcpy(&fa, &ua, sz32);
+            memcpy(&fb, &ub, sz32);
+            return(CMP(fa, fb));
+        case SPHX2_ATTR_BIGINT:
+            la = (int64_t)s_get_int64(a);
+            lb = (int64_t)s_get_int64(b);
+            return(CMP(la, lb));
+        case SPHX2_ATTR_STRING:
+            ua = s_get_int32(a);
+            ub = s_get_int32(b);
+            rc = ngx_memcmp(a + sz32, b + sz32, ngx_min(ua, ub));
+            return(rc ? rc : CMP(ua, ub));
+        case SPHX2_ATTR_MULTI:
+        case SPHX2_ATTR_MULTI64:
+            return(0);
+        default:
+            ua = s_get_int32(a);
+            ub = s_get_int32(b);
+            return(CMP(ua, ub));
+    }
+}
+
+/* < 0 if match 'a' of 'ra' goes before match 'b' of 'rb' */
+static ngx_int_t
+s_compare(
+    sphx2_sorter_t       * s,
+    sphx2_result_t       * ra,
+    sphx2_result_match_t * a,
+    sphx2_result_t       * rb,
+    sphx2_result_match_t * b)
+{
+    sphx2_sort_key_t     * k;
+    ngx_uint_t             i;
+    ngx_int_t              rc;
+
+    for(i = 0; i < s->num_keys; ++i) {
+        k = &s->keys[i];
+
+        switch(k->type) {
+            case SPHX2_KEY_WEIGHT:
+                rc = CMP(a->weight, b->weight);
+                break;
+            case SPHX2_KEY_ID:
+                rc = CMP(a->id, b->id);
+                break;
+            case SPHX2_KEY_TIME_SEGMENT:
+                rc = CMP(s_time_segment(s->now, s_get_int32(
+                             sphx2_result_attr_value(ra, a, k->attr))),
+                         s_time_segment(s->now, s_get_int32(
+                             sphx2_result_attr_value(rb, b, k->attr))));
+                break;
+            default:
+                rc = s_compare_attr(s->schema->attrs[k->attr].type,
+                         sphx2_result_attr_value(ra, a, k->attr),
+                         sphx2_result_attr_value(rb, b, k->attr));
+        }
+
+        if(0 != rc) {
+            return(k->desc ? -rc : rc);
+        }
+    }
+
+    return(0);
+}
+
+static ngx_int_t
+s_merge_words(
+    ngx_pool_t           * pool,
+    sphx2_result_t      ** in,
+    ngx_uint_t             n,
+    sphx2_result_t       * out)
+{
+    sphx2_result_word_t  * w, * ow;
+    ngx_uint_t             i, j, k, max;
+
+    for(max = 0, i = 0; i < n; ++i) {
+        max += in[i]->num_words;
+    }
+
+    if(NULL == (out->words = ngx_palloc(pool,
+                                 (max + 1) * sizeof(sphx2_result_word_t))))
+    {
+        return(NGX_ERROR);
+    }
+
+    out->num_words = 0;
+
+    for(i = 0; i < n; ++i) {
+        for(j = 0; j < in[i]->num_words; ++j) {
+            w = &in[i]->words[j];
+
+            for(k = 0; k < out->num_words; ++k) {
+                ow = &out->words[k];
+                if(ow->word.len == w->word.len
+                   && 0 == ngx_memcmp(ow->word.data, w->word.data,
+                                      w->word.len))
+                {
+                    break;
+                }
+            }
+
+            if(k == out->num_words) {
+                out->words[out->num_words++] = *w;
+            } else {
+                out->words[k].docs += w->docs;
+                out->words[k].hits += w->hits;
+            }
+        }
+    }
+
+    return(NGX_OK);
+}
+
+/* k-way merge of the already sorted results, up to offset + limit */
+static ngx_int_t
+s_merge_matches(
+    ngx_pool_t           * pool,
+    sphx2_result_t      ** use,
+    ngx_uint_t             nuse,
+    sphx2_result_t       * schema,
+    sphx2_merge_spec_t   * spec,
+    sphx2_result_t       * out)
+{
+    ngx_uint_t             k, best, picked, need, max;
+    ngx_uint_t           * heads;
+    sphx2_sorter_t         sorter;
+
+    s_init_sorter(&sorter, schema, spec);
+
+    for(max = 0, k = 0; k < nuse; ++k) {
+        max += use[k]->num_matches;
+    }
+
+    need = (ngx_uint_t)spec->offset + spec->num_results;
+    max = ngx_min(max, (ngx_uint_t)spec->num_results);
+
+    if(NULL == (heads = ngx_pcalloc(pool, nuse * sizeof(ngx_uint_t)))
+       || NULL == (out->matches = ngx_palloc(pool,
+                        (max + 1) * sizeof(sphx2_result_match_t))))
+    {
+        return(NGX_ERROR);
+    }
+
+    for(picked = 0; picked < need; ++picked) {
+        best = nuse;
+
+        for(k = 0; k < nuse; ++k) {
+            if(heads[k] == use[k]->num_matches) {
+                continue;
+            }
+            if(best == nuse
+               || s_compare(&sorter,
+                      use[k], &use[k]->matches[heads[k]],
+                      use[best], &use[best]->matches[heads[best]]) < 0)
+            {
+                best = k;
+            }
+        }
+
+        if(best == nuse) {
+            break;
+        }
+
+        if(picked >= spec->offset) {
+            out->matches[out->num_matches++] =
+                use[best]->matches[heads[best]];
+        }
+
+        ++heads[best];
+    }
+
+    return(NGX_OK);
+}
+
+/* index of the named attribute, num_attrs if there is none */
+static ngx_uint_t
+s_find_attr(sphx2_result_t * schema, char * name)
+{
+    ngx_uint_t   i;
+    size_t       len = ngx_strlen(name);
+
+    for(i = 0; i < schema->num_attrs; ++i) {
+        if(schema->attrs[i].name.len == len
+           && 0 == ngx_memcmp(schema->attrs[i].name.data, name, len))
+        {
+            break;
+        }
+    }
+
+    return(i);
+}
+
+/* bytes of an attribute value on the wire */
+static size_t
+s_attr_len(uint32_t type, u_char * p)
+{
+    size_t   len;
+
+    if(0 != (len = s_attr_size(type))) {
+        return(len);
+    }
+
+    /* a string has a length in bytes, an MVA a count of dwords */
+    len = s_get_int32(p);
+
+    return(sz32 + ((SPHX2_ATTR_STRING == type) ? len : len * sz32));
+}
+
+static void
+s_add_count(sphx2_result_t * res, sphx2_result_match_t * m, ngx_uint_t attr,
+    uint64_t * sum)
+{
+    *sum += s_get_int32(sphx2_result_attr_value(res, m, attr));
+}
+
+static void
+s_set_count(sphx2_result_t * res, sphx2_result_match_t * m, ngx_uint_t attr,
+    uint64_t sum)
+{
+    uint32_t   v;
+
+    v = htonl((uint32_t)ngx_min(sum, (uint64_t)0xffffffff));
+
+    memcpy(sphx2_result_attr_value(res, m, attr), &v, sz32);
+}
+
+static int ngx_libc_cdecl
+s_compare_group(const void * one, const void * two)
+{
+    const sphx2_group_row_t * a = one, * b = two;
+
+    return((int)s_compare(s_group_sorter, a->res, a->m, b->res, b->m));
+}
+
+/* grouped results: the rows of a group from all the results are one row,
+ * with their @count and @distinct summed, that stands for the group with
+ * the match which is first in the sort order within groups, as searchd's
+ * distributed indexes do. The groups are then sorted by the group sort
+ * clause and paged
+ */
+static ngx_int_t
+s_merge_groups(
+    ngx_pool_t           * pool,
+    sphx2_result_t      ** use,
+    ngx_uint_t             nuse,
+    sphx2_result_t       * schema,
+    sphx2_merge_spec_t   * spec,
+    sphx2_result_t       * out)
+{
+    sphx2_group_row_t    * rows, * g;
+    sphx2_result_match_t * m;
+    sphx2_result_t       * r;
+    sphx2_merge_spec_t     gspec;
+    sphx2_sorter_t         within, groups;
+    ngx_uint_t             i, j, k, h, nrows, mask, found;
+    ngx_uint_t             key_attr, count_attr, distinct_attr;
+    ngx_uint_t           * slots;
+    u_char               * key;
+    size_t                 key_len;
+
+    key_attr = s_find_attr(schema, "@groupby");
+    count_attr = s_find_attr(schema, "@count");
+    distinct_attr = s_find_attr(schema, "@distinct");
+
+    /* not a grouped result after all */
+    if(key_attr == schema->num_attrs || count_attr == schema->num_attrs) {
+        return(s_merge_matches(pool, use, nuse, schema, spec, out));
+    }
+
+    for(nrows = 0, i = 0; i < nuse; ++i) {
+        nrows += use[i]->num_matches;
+    }
+
+    /* an open addressing table of row numbers + 1, at most half full */
+    for(mask = 1; mask < 2 * nrows; mask <<= 1) /* void */;
+
+    if(NULL == (rows = ngx_palloc(pool,
+                           (nrows + 1) * sizeof(sphx2_group_row_t)))
+       || NULL == (slots = ngx_pcalloc(pool, mask * sizeof(ngx_uint_t))))
+    {
+        return(NGX_ERROR);
+    }
+
+    --mask;
+
+    s_init_sorter(&within, schema, spec);
+
+    for(nrows = 0, i = 0; i < nuse; ++i) {
+        r = use[i];
+
+        for(j = 0; j < r->num_matches; ++j) {
+            m = &r->matches[j];
+
+            key = sphx2_result_attr_value(r, m, key_attr);
+            key_len = s_attr_len(schema->attrs[key_attr].type, key);
+
+            for(found = 0, h = ngx_hash_key(key, key_len) & mask;
+                0 != (k = slots[h]);
+                h = (h + 1) & mask)
+            {
+                g = &rows[k - 1];
+
+                if(g->key_len == key_len
+                   && 0 == ngx_memcmp(g->key, key, key_len))
+                {
+                    found = 1;
+                    break;
+                }
+            }
+
+            if(!found) {
+                g = &rows[nrows++];
+                slots[h] = nrows;
+
+                g->res = r;
+                g->m = m;
+                g->key = key;
+                g->key_len = key_len;
+                g->count = 0;
+                g->distinct = 0;
+
+            } else if(s_compare(&within, r, m, g->res, g->m) < 0) {
+                g->res = r;
+                g->m = m;
+            }
+
+            s_add_count(r, m, count_attr, &g->count);
+
+            if(distinct_attr != schema->num_attrs) {
+                s_add_count(r, m, distinct_attr, &g->distinct);
+            }
+        }
+    }
+
+    /* the counts go into the match standing for the group - it is in the
+     * buffer of its shard's response, and stands for no other group
+     */
+    for(k = 0; k < nrows; ++k) {
+        g = &rows[k];
+
+        s_set_count(g->res, g->m, count_attr, g->count);
+
+        if(distinct_attr != schema->num_attrs) {
+            s_set_count(g->res, g->m, distinct_attr, g->distinct);
+        }
+    }
+
+    gspec = *spec;
+    gspec.sort_mode = SPHX2_SORT_EXTENDED;
+    gspec.sort_by = spec->group_sort;
+
+    s_init_sorter(&groups, schema, &gspec);
+
+    s_group_sorter = &groups;
+    ngx_qsort(rows, nrows, sizeof(sphx2_group_row_t), s_compare_group);
+    s_group_sorter = NULL;
+
+    /* a group cut off by one shard's limit may be in another's results,
+     * so there are at least as many groups as the largest count of one
+     */
+    out->total = (uint32_t)ngx_min(nrows, (ngx_uint_t)spec->max_matches);
+    out->total_found = nrows;
+
+    for(i = 0; i < nuse; ++i) {
+        out->total_found = ngx_max(out->total_found, use[i]->total_found);
+    }
+
+    if(NULL == (out->matches = ngx_palloc(pool,
+                    (ngx_min(nrows, (ngx_uint_t)spec->num_results) + 1)
+                    * sizeof(sphx2_result_match_t))))
+    {
+        return(NGX_ERROR);
+    }
+
+    for(k = spec->offset;
+        k < nrows && out->num_matches < spec->num_results;
+        ++k)
+    {
+        out->matches[out->num_matches++] = *rows[k].m;
+    }
+
+    return(NGX_OK);
+}
+
+ngx_int_t
+sphx2_merge_results(
+    ngx_pool_t           * pool,
+    sphx2_result_t      ** in,
+    ngx_uint_t             n,
+    sphx2_merge_spec_t   * spec,
+    sphx2_result_t       * out)
+{
+    sphx2_result_t      ** use, * schema, * warned, * r;
+    ngx_str_t            * failed;
+    ngx_uint_t             i, nuse, nfailed;
+    uint64_t               total;
+
+    ngx_memzero(out, sizeof(sphx2_result_t));
+
+    if(NULL == (use = ngx_palloc(pool, n * sizeof(sphx2_result_t*)))) {
+        return(NGX_ERROR);
+    }
+
+    schema = NULL;
+    warned = NULL;
+    failed = NULL;
+    nuse = 0;
+    nfailed = 0;
+
+    /* the first good result gives the schema, which the rest must share */
+    for(i = 0; i < n; ++i) {
+        r = in[i];
+
+        if(SPHX2_SEARCHD_OK != r->status
+           && SPHX2_SEARCHD_WARNING != r->status)
+        {
+            if(0 == nfailed++) {
+                failed = &r->message;
+                out->status = r->status;
+            }
+            continue;
+        }
+
+        if(NULL == schema) {
+            schema = r;
+        } else if(!s_same_schema(schema, r)) {
+            if(0 == nfailed++) {
+                failed = &s_schema_mismatch;
+            }
+            continue;
+        }
+
+        if(SPHX2_SEARCHD_WARNING == r->status && NULL == warned) {
+            warned = r;
+        }
+
+        use[nuse++] = r;
+    }
+
+    if(0 == nuse) {
+        out->message = *failed;
+        return(NGX_OK);
+    }
+
+    out->num_fields = schema->num_fields;
+    out->fields = schema->fields;
+    out->num_attrs = schema->num_attrs;
+    out->attrs = schema->attrs;
+    out->attr_off = schema->attr_off;
+
+    for(total = 0, i = 0; i < nuse; ++i) {
+        out->id64 |= use[i]->id64;
+        total += use[i]->total;
+        out->total_found += use[i]->total_found;
+        out->time_msec = ngx_max(out->time_msec, use[i]->time_msec);
+    }
+
+    out->total = (uint32_t)ngx_min(total, (uint64_t)spec->max_matches);
+
+    if(NGX_OK != s_merge_words(pool, use, nuse, out)) {
+        return(NGX_ERROR);
+    }
+
+    if(NGX_OK != (spec->group
+                  ? s_merge_groups(pool, use, nuse, schema, spec, out)
+                  : s_merge_matches(pool, use, nuse, schema, spec, out)))
+    {
+        return(NGX_ERROR);
+    }
+
+    if(nfailed) {
+        out->status = SPHX2_SEARCHD_WARNING;
+        if(NULL == (out->message.data = ngx_pnalloc(pool,
+                                            failed->len + 64)))
+        {
+            return(NGX_ERROR);
+        }
+        out->message.len = ngx_sprintf(out->message.data,
+                               "%ui of %ui shards failed: %V",
+                               nfailed, n, failed)
+                         - out->message.data;
+    } else if(NULL != warned) {
+        out->status = SPHX2_SEARCHD_WARNING;
+        out->message = warned->message;
+    } else {
+        out->status = SPHX2_SEARCHD_OK;
+    }
+
+    return(NGX_OK);
+}
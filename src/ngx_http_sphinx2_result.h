@@ -0,0 +1,103 @@
+/*
+ * Sphinx2 search result sets - decoding, encoding and merging
+ */
+
+#ifndef NGX_HTTP_SPHINX2_RESULT_H
+#define NGX_HTTP_SPHINX2_RESULT_H
+
+
+/* TYPES */
+
+/* Attribute types in a search result */
+typedef enum {
+    SPHX2_ATTR_INTEGER =        1,
+    SPHX2_ATTR_TIMESTAMP =      2,
+    SPHX2_ATTR_ORDINAL =        3,
+    SPHX2_ATTR_BOOL =           4,
+    SPHX2_ATTR_FLOAT =          5,
+    SPHX2_ATTR_BIGINT =         6,
+    SPHX2_ATTR_STRING =         7,
+    SPHX2_ATTR_MULTI =          0x40000001,
+    SPHX2_ATTR_MULTI64 =        0x40000002
+} sphx2_attr_type_t;
+
+/* An attribute in the result schema */
+typedef struct {
+    ngx_str_t              name;
+    uint32_t               type;
+} sphx2_result_attr_t;
+
+/* A match. Attribute values are kept as searchd sent them. */
+typedef struct {
+    uint64_t               id;
+    uint32_t               weight;
+    u_char               * attrs;
+    uint32_t               attrs_len;
+    uint32_t             * attr_off;   /* only if the schema has variable
+                                          length attributes */
+} sphx2_result_match_t;
+
+/* Per keyword stats */
+typedef struct {
+    ngx_str_t              word;
+    uint32_t               docs;
+    uint32_t               hits;
+} sphx2_result_word_t;
+
+/* Result set of one query. Strings and attribute values point into the
+ * buffer the result was decoded from.
+ */
+typedef struct {
+    sphx2_searchd_status_t status;
+    ngx_str_t              message;
+    ngx_uint_t             num_fields;
+    ngx_str_t            * fields;
+    ngx_uint_t             num_attrs;
+    sphx2_result_attr_t  * attrs;
+    uint32_t             * attr_off;   /* if all attributes are fixed size */
+    uint32_t               id64;
+    ngx_uint_t             num_matches;
+    sphx2_result_match_t * matches;
+    uint32_t               total;
+    uint32_t               total_found;
+    uint32_t               time_msec;
+    ngx_uint_t             num_words;
+    sphx2_result_word_t  * words;
+} sphx2_result_t;
+
+/* How results of a query are to be merged */
+typedef struct {
+    uint32_t               offset;
+    uint32_t               num_results;
+    uint32_t               max_matches;
+    sphx2_sort_mode_t      sort_mode;
+    ngx_str_t              sort_by;
+    ngx_uint_t             group;      /* the query groups its matches */
+    ngx_str_t              group_sort;
+} sphx2_merge_spec_t;
+
+
+/* FUNCTION PROTOTYPES */
+
+/* Decode the body of a search response with the given status (from the
+ * response header) into 'n' result sets
+ */
+ngx_int_t
+sphx2_decode_search_response(ngx_pool_t*, ngx_buf_t*, sphx2_searchd_status_t,
+    ngx_uint_t, sphx2_result_t**);
+
+/* Encode result sets as the body of a search response */
+ngx_int_t
+sphx2_encode_search_response(ngx_pool_t*, sphx2_result_t*, ngx_uint_t,
+    ngx_buf_t**);
+
+/* Merge the result sets of one query from several sources */
+ngx_int_t
+sphx2_merge_results(ngx_pool_t*, sphx2_result_t**, ngx_uint_t,
+    sphx2_merge_spec_t*, sphx2_result_t*);
+
+/* Raw value of attribute 'i' of a match */
+#define sphx2_result_attr_value(res, m, i) \
+    ((m)->attrs + ((m)->attr_off ? (m)->attr_off[i] : (res)->attr_off[i]))
+
+#endif /* NGX_HTTP_SPHINX2_RESULT_H */
@@ -11,10 +11,6 @@
 #include "ngx_http_sphinx2_stream.h"
 
 
-/* MACROS */
-
-#define LIST_ADD(l, n, sz) { (n)->next = (l); (l) = (n); ++(sz); }
-
 /* GLOBALS */
 
 sphx2_match_mode_t  sphx2_default_match_mode = SPHX2_MATCH_ALL;
@@ -31,97 +27,81 @@ ngx_uint_t          sphx2_default_max_matches = 1000;
 
 size_t              sphx2_min_search_header_len = 12; /* hs (4) + hdr(8) */
 
+size_t              sphx2_handshake_len = 4;
+
 /* LOCAL GLOBALS */
 
-static const char* s_match_mode_strs[] = {
-    "all",      /* SPHX2_MATCH_ALL =           0, */
-    "any",      /* SPHX2_MATCH_ANY =           1, */
-    "phrase",   /* SPHX2_MATCH_PHRASE =        2, */
-    "boolean",  /* SPHX2_MATCH_BOOLEAN =       3, */
-    "extended", /* SPHX2_MATCH_EXTENDED =      4, */
-    "fullscan", /* SPHX2_MATCH_FULLSCAN =      5, */
+/* a filter naming a filter set, which is sent as a values filter */
+#define SPHX2_FILTER_SET    0x100
+
+/* enum names, each at its sphx2_arg_enum_hash() slot */
+
+static const sphx2_arg_enum_t s_match_mode_enum[SPHX2_ARG_ENUM_SLOTS] = {
+    [28] = { ngx_string("all"),        SPHX2_MATCH_ALL },
+    [22] = { ngx_string("any"),        SPHX2_MATCH_ANY },
+    [0]  = { ngx_string("phrase"),     SPHX2_MATCH_PHRASE },
+    [5]  = { ngx_string("boolean"),    SPHX2_MATCH_BOOLEAN },
+    [21] = { ngx_string("extended"),   SPHX2_MATCH_EXTENDED },
+    [10] = { ngx_string("fullscan"),   SPHX2_MATCH_FULLSCAN },
 #if 0
     -- not supported for near future removal --
     SPHX2_MATCH_EXTENDED2 =     6
 #endif
 };
 
-static const size_t sz_match_mode_strs =
-    sizeof(s_match_mode_strs) / sizeof(const char*);
-
-static const char* s_ranker_strs[] = {
-    "proxbm25",  /* SPHX2_RANK_PROXIMITY_BM25 = 0, */
-    "bm25",      /* SPHX2_RANK_BM25 =           1, */
-    "none",      /* SPHX2_RANK_NONE =           2, */
-    "wordcount", /* SPHX2_RANK_WORDCOUNT =      3, */
-    "prox",      /* SPHX2_RANK_PROXIMITY =      4, */
-    "matchany",  /* SPHX2_RANK_MATCHANY =       5, */
-    "fieldmask", /* SPHX2_RANK_FIELDMASK =      6, */
-    "sph04",     /* SPHX2_RANK_SPH04 =          7, */
-    "expr",      /* SPHX2_RANK_EXPR =           8, */
-    "total",     /* SPHX2_RANK_TOTAL =          9 */
+static const sphx2_arg_enum_t s_ranker_enum[SPHX2_ARG_ENUM_SLOTS] = {
+    [2]  = { ngx_string("proxbm25"),   SPHX2_RANK_PROXIMITY_BM25 },
+    [16] = { ngx_string("bm25"),       SPHX2_RANK_BM25 },
+    [28] = { ngx_string("none"),       SPHX2_RANK_NONE },
+    [8]  = { ngx_string("wordcount"),  SPHX2_RANK_WORDCOUNT },
+    [4]  = { ngx_string("prox"),       SPHX2_RANK_PROXIMITY },
+    [7]  = { ngx_string("matchany"),   SPHX2_RANK_MATCHANY },
+    [5]  = { ngx_string("fieldmask"),  SPHX2_RANK_FIELDMASK },
+    [0]  = { ngx_string("sph04"),      SPHX2_RANK_SPH04 },
+    [13] = { ngx_string("expr"),       SPHX2_RANK_EXPR },
+    [17] = { ngx_string("total"),      SPHX2_RANK_TOTAL },
 };
 
-static const size_t sz_ranker_strs =
-    sizeof(s_ranker_strs) / sizeof(const char*);
-
-static const char* s_sort_mode_strs[] = {
-    "relevance", /* SPHX2_SORT_RELEVANCE =      0, */
-    "attr_desc", /* SPHX2_SORT_ATTR_DESC =      1, */
-    "attr_asc",  /* SPHX2_SORT_ATTR_ASC =       2, */
-    "time_seg",  /* SPHX2_SORT_TIME_SEGMENTS =  3, */
-    "extendex",  /* SPHX2_SORT_EXTENDED =       4, */
-    "expr",      /* SPHX2_SORT_EXPR =           5 */
+static const sphx2_arg_enum_t s_sort_mode_enum[SPHX2_ARG_ENUM_SLOTS] = {
+    [5]  = { ngx_string("relevance"),  SPHX2_SORT_RELEVANCE },
+    [16] = { ngx_string("attr_desc"),  SPHX2_SORT_ATTR_DESC },
+    [15] = { ngx_string("attr_asc"),   SPHX2_SORT_ATTR_ASC },
+    [10] = { ngx_string("time_seg"),   SPHX2_SORT_TIME_SEGMENTS },
+    [21] = { ngx_string("extended"),   SPHX2_SORT_EXTENDED },
+    [29] = { ngx_string("extendex"),   SPHX2_SORT_EXTENDED }, /* old typo */
+    [13] = { ngx_string("expr"),       SPHX2_SORT_EXPR },
 };
 
-static const size_t sz_sort_mode_strs =
-    sizeof(s_sort_mode_strs) / sizeof(const char*);
-
-static const char* s_filter_type_strs[] = {
-    "vals",     /* SPHX2_FILTER_VALUES =       0, */
-    "range",    /* SPHX2_FILTER_RANGE =        1, */
-    "frange",   /* SPHX2_FILTER_FLOATRANGE =   2, */
+static const sphx2_arg_enum_t s_filter_type_enum[SPHX2_ARG_ENUM_SLOTS] = {
+    [0]  = { ngx_string("vals"),       SPHX2_FILTER_VALUES },
+    [1]  = { ngx_string("range"),      SPHX2_FILTER_RANGE },
+    [22] = { ngx_string("frange"),     SPHX2_FILTER_FLOATRANGE },
+    [30] = { ngx_string("set"),        SPHX2_FILTER_SET },
 };
 
-static const size_t sz_filter_type_strs =
-    sizeof(s_filter_type_strs)/sizeof(const char*);
-
-static const char* s_filter_exclude_strs[] = {
-    "in",
-    "ex"
+static const sphx2_arg_enum_t s_filter_exclude_enum[SPHX2_ARG_ENUM_SLOTS] = {
+    [7]  = { ngx_string("in"),         0 },
+    [23] = { ngx_string("ex"),         1 },
 };
 
-static const size_t sz_filter_exclude_strs =
-    sizeof(s_filter_exclude_strs)/sizeof(const char*);
-
-static const char* s_group_type_strs[] = {
-    "day",      /* SPHX2_GROUPBY_DAY =             0, */
-    "week",     /* SPHX2_GROUPBY_WEEK =            1, */
-    "month",    /* SPHX2_GROUPBY_MONTH =           2, */
-    "year",     /* SPHX2_GROUPBY_YEAR =            3, */
-    "attr",     /* SPHX2_GROUPBY_ATTR =            4, */
-    "attrpair", /* SPHX2_GROUPBY_ATTRPAIR =        5, */
+static const sphx2_arg_enum_t s_group_type_enum[SPHX2_ARG_ENUM_SLOTS] = {
+    [25] = { ngx_string("day"),        SPHX2_GROUPBY_DAY },
+    [17] = { ngx_string("week"),       SPHX2_GROUPBY_WEEK },
+    [2]  = { ngx_string("month"),      SPHX2_GROUPBY_MONTH },
+    [1]  = { ngx_string("year"),       SPHX2_GROUPBY_YEAR },
+    [9]  = { ngx_string("attr"),       SPHX2_GROUPBY_ATTR },
+    [13] = { ngx_string("attrpair"),   SPHX2_GROUPBY_ATTRPAIR },
 };
 
-static const size_t sz_group_type_strs =
-    sizeof(s_group_type_strs)/sizeof(const char*);
-
-static const char* s_output_type_strs[] = {
-    "raw",
-    "text",
-    "json",
-    "xml"
+static const sphx2_arg_enum_t s_output_type_enum[SPHX2_ARG_ENUM_SLOTS] = {
+    [3]  = { ngx_string("raw"),        SPHX2_OUTPUT_RAW },
+    [0]  = { ngx_string("text"),       SPHX2_OUTPUT_TEXT },
+    [10] = { ngx_string("json"),       SPHX2_OUTPUT_JSON },
+    [19] = { ngx_string("xml"),        SPHX2_OUTPUT_XML },
 };
 
-static const size_t sz_output_type_strs = 
-    sizeof(s_output_type_strs)/sizeof(const char*);
-
-static sphx2_arg_parse_ctx_t s_main_ctxt, s_sec_ctxt;
-
-static const char* s_no_delim = "$";
-static const char* s_set_delim = ",";
-static const char* s_key_val_delim = ":";
-static const char* s_multi_delim = ";";
+static const u_char s_set_delim = ',';
+static const u_char s_multi_delim = ';';
 
 static const size_t sz16 = sizeof(uint16_t),
                     sz32 = sizeof(uint32_t),
@@ -133,18 +113,53 @@ static ngx_str_t default_select = ngx_string("*");
 
 /* FUNCTION DEFINITIONS */
 
-#include <ctype.h>
+/* Functions to handle the connection handshake */
+
+/*
+ * The client version is sent once per connection, right after connecting.
+ * With 'persist' a PERSIST command follows it, asking searchd to keep the
+ * connection open after the response, so that further requests on it go
+ * without any handshake.
+ */
+ngx_int_t
+sphx2_create_handshake(
+    ngx_pool_t             * pool,
+    ngx_uint_t               persist,
+    ngx_buf_t             ** b)
+{
+    /* data to send =
+     *   handshake = version [4]
+     * . [persist] header = command [2] . command_version [2]
+     *             . bytes following [4] . persist flag [4]
+     */
+    size_t buf_len = sz32 + (persist ? (2 * sz16 + 2 * sz32) : 0);
+
+    sphx2_stream_t* st;
+
+    ngx_int_t status;
+
+    if(NULL == (st = sphx2_stream_create(pool))) {
+        return(NGX_ERROR);
+    }
 
-static void s_dump_buffer(u_char* ptr, size_t len) {
-    size_t i; char c;
-    fprintf(stderr, "buf [%lu]: ", len);
-    for(i = 0; i < len; ++i) {
-        c = ptr[i];
-        if(isprint(c)) fprintf(stderr, "%c", c);
-        else if(c < 0x10) fprintf(stderr, "0%x", c);
-        else fprintf(stderr, "%x", c);
+    if(NGX_ERROR == sphx2_stream_alloc(st, buf_len)) {
+        return(NGX_ERROR);
     }
-    fprintf(stderr, "\n");
+
+    status =
+           sphx2_stream_write_int32(st, (uint32_t)SPHX2_CLI_VERSION)
+        || (persist
+              ? (   sphx2_stream_write_int16(st, (uint16_t)SPHX2_COMMAND_PERSIST)
+                 || sphx2_stream_write_int16(st,
+                        (uint16_t)SPHX2_VER_COMMAND_PERSIST)
+                 || sphx2_stream_write_int32(st, (uint32_t)sz32)
+                 || sphx2_stream_write_int32(st, (uint32_t)1))
+              : NGX_OK)
+        ;
+
+    *b = sphx2_stream_get_buf(st);
+
+    return (NGX_OK == status) ? NGX_OK : NGX_ERROR;
 }
 
 /* Functions to handle search request */
@@ -158,51 +173,68 @@ static void s_dump_buffer(u_char* ptr, size_t len) {
  * 1  deprecated 'weights' field not supported. corresponding num-weights
  *    field is always 0.
  *
- * 2  'values' filter is not supported. only 'range' and 'float range'.
+ * 2  a 'values' filter has its values sorted and without duplicates,
+ *    which searchd doesn't need but makes the request, and a cache key of
+ *    it, the same for the same set.
  *
  * 3  'overrides' not supported. field having number of overrides is 0 always.
  *
- * 4  For distributed search - 0 is default for cutoff, retrycount, retrydelay
- *
- * 5  'maxquerytime' is 0 (unlimited)
+ * 4  'cutoff', 'retrycount', 'retrydelay' and 'maxquerytime' are 0 unless
+ *    set by the location (sphinx2_cutoff etc.); a template serializes its
+ *    tail with them 0, so a query which has any of them set has its tail
+ *    serialized afresh
  */
 
+/* match mode .. sort by */
 static size_t
-s_sphx2_search_request_len(sphx2_search_input_t * srch_input)
+s_sphx2_ranking_part_len(sphx2_search_input_t * srch_input)
 {
-    /* Default part of the request */
+    /* uint32_t vars:
+     *     mode, ranker, sort mode, sort by len
+     */
+    static const size_t num_default_32s = 4;
+
+    return num_default_32s * sz32
+        + ((SPHX2_RANK_EXPR==srch_input->ranker) /* rank expr */
+            ? (sz32 + srch_input->rank_expr->len) : 0)
+        + srch_input->sort_by->len; /* sort by */
+}
 
+/* [depre] num weights .. [depre] id range */
+static size_t
+s_sphx2_index_part_len(sphx2_search_input_t * srch_input)
+{
     /* uint32_t vars:
-     *     offset, limit, mode, ranker, sort mode, sort by len,
-     *     keywords len, [depre] num weights (always 0), index len,
-     *     id range marker, num filters, group type, group by len,
-     *     max matches, group sort len, cutoff, retry count,
-     *     retry delay, group distinct len, is geo there?,
-     *     num index weights, max query time, num field weights,
-     *     comment len, num overrides, select len
+     *     [depre] num weights (always 0), index len, id range marker
      *
      * uint64_t vars:
      *     [depre] idx min, [depre] idx max
      */
-
-    static const size_t num_default_32s = 26,
+    static const size_t num_default_32s = 3,
                         num_default_64s = 2;
 
-    size_t request_len = num_default_32s * sz32 + num_default_64s * sz64;
+    return num_default_32s * sz32 + num_default_64s * sz64
+        + srch_input->index->len; /* index */
+}
 
-    sphx2_filter_t* f;
-    sphx2_weight_t* w;
+/* group type .. select */
+static size_t
+s_sphx2_tail_part_len(sphx2_search_input_t * srch_input)
+{
+    /* uint32_t vars:
+     *     group type, group by len, max matches, group sort len, cutoff,
+     *     retry count, retry delay, group distinct len, is geo there?,
+     *     num index weights, max query time, num field weights,
+     *     comment len, num overrides, select len
+     */
+    static const size_t num_default_32s = 15;
+
+    size_t request_len = num_default_32s * sz32;
 
     size_t i;
 
-    /* Calculate variable length of the request */
     request_len +=
-        ((SPHX2_RANK_EXPR==srch_input->ranker) /* rank expr */
-            ? (sz32 + srch_input->rank_expr->len) : 0)
-        + srch_input->sort_by->len /* sort by */
-        + srch_input->keywords->len /* keywords */
-        + srch_input->index->len /* index */
-        + srch_input->group->attr->len + /* group by attr */
+          srch_input->group->attr->len /* group by attr */
         + srch_input->group->sort->len /* group sort type */
         + srch_input->group->distinct->len /* group distinct */
         + ((NULL != srch_input->geo) /* geo */
@@ -212,32 +244,68 @@ s_sphx2_search_request_len(sphx2_search_input_t * srch_input)
         + default_select.len;/* select */
         ;
 
+    /* Weights */
+    for(i = 0; i < srch_input->num_index_weights; ++i) {
+        request_len += (sz32 + srch_input->index_weights[i].entity.len
+                        + sz32); /* idx, weight */
+    }
+    for(i = 0; i < srch_input->num_field_weights; ++i) {
+        request_len += (sz32 + srch_input->field_weights[i].entity.len
+                        + sz32); /* field, weight */
+    }
+
+    return(request_len);
+}
+
+static size_t (*s_sphx2_part_len[SPHX2_PART_COUNT])(sphx2_search_input_t*) = {
+    s_sphx2_ranking_part_len,   /* SPHX2_PART_RANKING */
+    s_sphx2_index_part_len,     /* SPHX2_PART_INDEX */
+    s_sphx2_tail_part_len       /* SPHX2_PART_TAIL */
+};
+
+/* a part is as long as it was when serialized ahead of time, if it was */
+#define PART_LEN(input, part) \
+    ((input)->parts[part].len \
+        ? (input)->parts[part].len : s_sphx2_part_len[part](input))
+
+static size_t
+s_sphx2_search_request_len(sphx2_search_input_t * srch_input)
+{
+    /* Default part of the request */
+
+    /* uint32_t vars:
+     *     offset, limit, keywords len, num filters
+     */
+
+    static const size_t num_default_32s = 4;
+
+    size_t request_len = num_default_32s * sz32;
+
+    sphx2_filter_t* f;
+
+    size_t i;
+
+    /* Calculate variable length of the request */
+    request_len +=
+          srch_input->keywords->len /* keywords */
+        + PART_LEN(srch_input, SPHX2_PART_RANKING)
+        + PART_LEN(srch_input, SPHX2_PART_INDEX)
+        + PART_LEN(srch_input, SPHX2_PART_TAIL)
+        ;
+
     /* Filters */
     f = srch_input->filters;
-    for(i = 0; i < srch_input->num_filters; ++i) {
+    for(i = 0; i < srch_input->num_filters; ++i, ++f) {
         request_len +=
-            (sz32 + f->attr->len) /* attr */ + 2 * sz32; /* type, exclude */
+            (sz32 + f->attr.len) /* attr */ + 2 * sz32; /* type, exclude */
         switch(f->type) {
-            /*case SPHX2_FILTER_VALUES:
+            case SPHX2_FILTER_VALUES:
                 request_len += (sz32 + sz64 * f->spec.vals.n);
-                break;*/
+                break;
             case SPHX2_FILTER_RANGE: request_len += 2 * sz64; break;
             case SPHX2_FILTER_FLOATRANGE: request_len += 2 * szf; break;
             default: return (NGX_ERROR);
         }
-        f = f->next;
-    }
-
-    /* Weights */
-    w = srch_input->index_weights; /* index weights */
-    for(i = 0; i < srch_input->num_index_weights; ++i) {
-        request_len += (sz32 + w->entity->len + sz32); /* idx, weight */
-        w = w->next;
-    }
-    w = srch_input->field_weights; /* field weights */
-    for(i = 0; i < srch_input->num_field_weights; ++i) {
-        request_len += (sz32 + w->entity->len + sz32); /* field, weight */
-        w = w->next;
     }
 
     return(request_len);
@@ -254,20 +322,40 @@ s_write_filters_to_stream(
 
     f = input->filters;
 
-    for(i = 0; i < input->num_filters; ++i) {
+    for(i = 0; i < input->num_filters; ++i, ++f) {
         status =
-               sphx2_stream_write_string(st, f->attr)
-            || sphx2_stream_write_int32(st, (uint32_t)f->type)
-            || ((SPHX2_FILTER_RANGE == f->type)
-                 ? (   sphx2_stream_write_int64(st, f->spec.ir.min)
-                    || sphx2_stream_write_int64(st, f->spec.ir.max))
-                 : (   sphx2_stream_write_float(st, (float)f->spec.fr.min)
-                    || sphx2_stream_write_float(st, (float)f->spec.fr.max)))
-            || sphx2_stream_write_int32(st, (uint32_t)f->exclude);
+               sphx2_stream_write_string(st, &f->attr)
+            || sphx2_stream_write_int32(st, (uint32_t)f->type);
 
         if(NGX_OK != status) return(status);
 
-        f = f->next;
+        switch(f->type) {
+            case SPHX2_FILTER_VALUES:
+                status =
+                       sphx2_stream_write_int32(st, (uint32_t)f->spec.vals.n)
+                    || ((NULL != f->spec.vals.wire)
+                         ? sphx2_stream_write_bytes_ref(st,
+                               f->spec.vals.wire,
+                               f->spec.vals.n * sizeof(uint64_t))
+                         : sphx2_stream_write_int64s(st, f->spec.vals.v,
+                                                     f->spec.vals.n));
+                break;
+            case SPHX2_FILTER_RANGE:
+                status =
+                       sphx2_stream_write_int64(st, f->spec.ir.min)
+                    || sphx2_stream_write_int64(st, f->spec.ir.max);
+                break;
+            default:
+                status =
+                       sphx2_stream_write_float(st, (float)f->spec.fr.min)
+                    || sphx2_stream_write_float(st, (float)f->spec.fr.max);
+                break;
+        }
+
+        status = status
+            || sphx2_stream_write_int32(st, (uint32_t)f->exclude);
+
+        if(NGX_OK != status) return(status);
     }
 
     return(NGX_OK);
@@ -285,82 +373,60 @@ s_write_weights_to_stream(
 
     w = weights;
 
-    for(i = 0; i < num_weights; ++i) {
+    for(i = 0; i < num_weights; ++i, ++w) {
         status =
-               sphx2_stream_write_string(st, w->entity)
+               sphx2_stream_write_string(st, &w->entity)
             || sphx2_stream_write_int32(st, (uint32_t)w->weight);
 
         if(NGX_OK != status) return(status);
-
-        w = w->next;
     }
 
     return(NGX_OK);
 }
 
-ngx_int_t
-sphx2_create_search_request(
-    ngx_pool_t             * pool,
+static ngx_int_t
+s_write_ranking_part_to_stream(
     sphx2_search_input_t   * input,
-    ngx_buf_t             ** b)
+    sphx2_stream_t         * st)
 {
-    size_t request_len = s_sphx2_search_request_len(input);
-
-    /* data to send =
-     *   handshake = version [4]
-     * . header = command [2] . command_version [2] . bytes following [4]
-     *            . 0 [4] . num_queries [4]
-     * . request [request_len]
-     */
-    size_t buf_len =
-        (2 * sz16 + 4 * sz32) + request_len;
-
-    sphx2_stream_t* st = sphx2_stream_create(pool);
-
-    ngx_int_t status;
-
-    if(NGX_ERROR == sphx2_stream_alloc(st, buf_len)) {
-        return(NGX_ERROR);
-    }
-
-    status =
-           /* handshake */
-           sphx2_stream_write_int32(st, (uint32_t)SPHX2_CLI_VERSION)
-           /* header - command */
-        || sphx2_stream_write_int16(st, (uint16_t)SPHX2_COMMAND_SEARCH)
-           /* header - command ver */
-        || sphx2_stream_write_int16(st, (uint16_t)SPHX2_VER_COMMAND_SEARCH)
-           /* bytes after this variable in the request */
-        || sphx2_stream_write_int32(st, (uint32_t)(request_len + 2 * sz32))
-        || sphx2_stream_write_int32(st, (uint32_t)0) /* 0 in 2.x */
-        || sphx2_stream_write_int32(st, (uint32_t)1) /* query count */
-           /* the single search query request here onwards ... */
-        || sphx2_stream_write_int32(st, (uint32_t)input->offset)
-        || sphx2_stream_write_int32(st, (uint32_t)input->num_results)
-        || sphx2_stream_write_int32(st, (uint32_t)input->match_mode)
+    return
+           sphx2_stream_write_int32(st, (uint32_t)input->match_mode)
         || sphx2_stream_write_int32(st, (uint32_t)input->ranker)
         || ((SPHX2_RANK_EXPR == input->ranker)
               ? sphx2_stream_write_string(st, input->rank_expr)
               : NGX_OK)
         || sphx2_stream_write_int32(st, (uint32_t)input->sort_mode)
         || sphx2_stream_write_string(st, input->sort_by)
-        || sphx2_stream_write_string(st, input->keywords)
-        || sphx2_stream_write_int32(st, (uint32_t)0) /* [d] weights count */
+        ;
+}
+
+static ngx_int_t
+s_write_index_part_to_stream(
+    sphx2_search_input_t   * input,
+    sphx2_stream_t         * st)
+{
+    return
+           sphx2_stream_write_int32(st, (uint32_t)0) /* [d] weights count */
         || sphx2_stream_write_string(st, input->index)
         || sphx2_stream_write_int32(st, (uint32_t)1) /* [d] range marker */
         || sphx2_stream_write_int64(st, (uint64_t)0) /* [d] min */
         || sphx2_stream_write_int64(st, (uint64_t)0) /* [d] max */
-        || sphx2_stream_write_int32(st, (uint32_t)input->num_filters)
-        || ((0 != input->num_filters)
-              ? s_write_filters_to_stream(input, st)
-              : NGX_OK)
-        || sphx2_stream_write_int32(st, (uint32_t)input->group->type)
+        ;
+}
+
+static ngx_int_t
+s_write_tail_part_to_stream(
+    sphx2_search_input_t   * input,
+    sphx2_stream_t         * st)
+{
+    return
+           sphx2_stream_write_int32(st, (uint32_t)input->group->type)
         || sphx2_stream_write_string(st, input->group->attr)
         || sphx2_stream_write_int32(st, (uint32_t)input->max_matches)
         || sphx2_stream_write_string(st, input->group->sort)
-        || sphx2_stream_write_int32(st, (uint32_t)0) /* cut off */
-        || sphx2_stream_write_int32(st, (uint32_t)0) /* retry count */
-        || sphx2_stream_write_int32(st, (uint32_t)0) /* retry delay */
+        || sphx2_stream_write_int32(st, input->cutoff)
+        || sphx2_stream_write_int32(st, input->retry_count)
+        || sphx2_stream_write_int32(st, input->retry_delay)
         || sphx2_stream_write_string(st, input->group->distinct)
         || ((NULL != input->geo)
               ? (    sphx2_stream_write_int32(st, (uint32_t)1) /* have geo */
@@ -374,7 +440,7 @@ sphx2_create_search_request(
               ? s_write_weights_to_stream(input->num_index_weights,
                                           input->index_weights, st)
               : NGX_OK)
-        || sphx2_stream_write_int32(st, (uint32_t)0) /* maxqtime - no limit */
+        || sphx2_stream_write_int32(st, input->max_query_time)
         || sphx2_stream_write_int32(st, (uint32_t)input->num_field_weights)
         || ((0 != input->num_field_weights)
               ? s_write_weights_to_stream(input->num_field_weights,
@@ -384,12 +450,139 @@ sphx2_create_search_request(
         || sphx2_stream_write_int32(st, (uint32_t)0) /* [us] num overrides */
         || sphx2_stream_write_string(st, &default_select) /* select all attrs */
         ;
+}
 
-    *b = sphx2_stream_get_buf(st);
+static ngx_int_t (*s_write_part_to_stream[SPHX2_PART_COUNT])(
+                     sphx2_search_input_t*, sphx2_stream_t*) = {
+    s_write_ranking_part_to_stream,    /* SPHX2_PART_RANKING */
+    s_write_index_part_to_stream,      /* SPHX2_PART_INDEX */
+    s_write_tail_part_to_stream        /* SPHX2_PART_TAIL */
+};
 
-    s_dump_buffer((*b)->pos, buf_len);
+/* a part serialized ahead of time is spliced in as it is */
+static ngx_int_t
+s_write_part(
+    sphx2_search_input_t   * input,
+    sphx2_query_part_t       part,
+    sphx2_stream_t         * st)
+{
+    if(0 != input->parts[part].len) {
+        return sphx2_stream_write_bytes(st, input->parts[part].data,
+                                        input->parts[part].len);
+    }
 
-    return status;
+    return s_write_part_to_stream[part](input, st);
+}
+
+static ngx_int_t
+s_write_search_query_to_stream(
+    sphx2_search_input_t   * input,
+    sphx2_stream_t         * st)
+{
+    return
+           sphx2_stream_write_int32(st, (uint32_t)input->offset)
+        || sphx2_stream_write_int32(st, (uint32_t)input->num_results)
+        || s_write_part(input, SPHX2_PART_RANKING, st)
+        || sphx2_stream_write_string(st, input->keywords)
+        || s_write_part(input, SPHX2_PART_INDEX, st)
+        || sphx2_stream_write_int32(st, (uint32_t)input->num_filters)
+        || ((0 != input->num_filters)
+              ? s_write_filters_to_stream(input, st)
+              : NGX_OK)
+        || s_write_part(input, SPHX2_PART_TAIL, st)
+        ;
+}
+
+/* serialize a part of the query ahead of time, into input->parts; it is
+ * then used for every request made from the input
+ */
+ngx_int_t
+sphx2_create_query_part(
+    ngx_pool_t             * pool,
+    sphx2_search_input_t   * input,
+    sphx2_query_part_t       part)
+{
+    sphx2_stream_t * st;
+    ngx_buf_t      * b;
+    size_t           len;
+
+    input->parts[part].len = 0;
+
+    len = s_sphx2_part_len[part](input);
+
+    if(NULL == (st = sphx2_stream_create(pool))
+       || NGX_OK != sphx2_stream_alloc(st, len)
+       || NGX_OK != s_write_part_to_stream[part](input, st))
+    {
+        return(NGX_ERROR);
+    }
+
+    b = sphx2_stream_get_buf(st);
+
+    input->parts[part].data = b->pos;
+    input->parts[part].len = b->last - b->pos;
+
+    return(NGX_OK);
+}
+
+/* 'input' is an array of 'num_queries' search queries which all go into
+ * a single SEARCH packet; searchd answers with one result set per query,
+ * in the same order
+ */
+ngx_int_t
+sphx2_create_search_request(
+    ngx_pool_t             * pool,
+    sphx2_search_input_t   * input,
+    ngx_uint_t               num_queries,
+    ngx_chain_t           ** cl)
+{
+    size_t request_len = 0, buf_len;
+    ngx_uint_t i;
+
+    sphx2_stream_t* st;
+
+    ngx_int_t status;
+
+    assert(0 < num_queries && SPHX2_MAX_QUERIES >= num_queries);
+
+    for(i = 0; i < num_queries; ++i) {
+        request_len += s_sphx2_search_request_len(&input[i]);
+    }
+
+    /* data to send (handshake goes separately, see sphx2_create_handshake)
+     *   header = command [2] . command_version [2] . bytes following [4]
+     *            . 0 [4] . num_queries [4]
+     * . request [request_len] (all queries back to back)
+     */
+    buf_len = (2 * sz16 + 3 * sz32) + request_len;
+
+    if(NULL == (st = sphx2_stream_create(pool))) {
+        return(NGX_ERROR);
+    }
+
+    if(NGX_ERROR == sphx2_stream_alloc_chain(st, buf_len)) {
+        return(NGX_ERROR);
+    }
+
+    status =
+           /* header - command */
+           sphx2_stream_write_int16(st, (uint16_t)SPHX2_COMMAND_SEARCH)
+           /* header - command ver */
+        || sphx2_stream_write_int16(st, (uint16_t)SPHX2_VER_COMMAND_SEARCH)
+           /* bytes after this variable in the request */
+        || sphx2_stream_write_int32(st, (uint32_t)(request_len + 2 * sz32))
+        || sphx2_stream_write_int32(st, (uint32_t)0) /* 0 in 2.x */
+        || sphx2_stream_write_int32(st, (uint32_t)num_queries) /* query count */
+        ;
+
+    /* the search queries here onwards ... */
+    for(i = 0; NGX_OK == status && i < num_queries; ++i) {
+        status = s_write_search_query_to_stream(&input[i], st);
+    }
+
+    *cl = sphx2_stream_get_chain(st);
+
+    return (NGX_OK == status) ? NGX_OK : NGX_ERROR;
 }
 
 /* Functions to handle excerpt request */
@@ -411,8 +604,6 @@ s_sphx2_excerpt_request_len(sphx2_excerpt_input_t * input)
 
     size_t request_len = sz32 * num_default_32s, i;
 
-    sphx2_doc_t * doc;
-
     /* variable part */
     request_len += input->index->len
         + input->keywords->len
@@ -422,10 +613,8 @@ s_sphx2_excerpt_request_len(sphx2_excerpt_input_t * input)
         + input->excerpt_opts->html_strip_mode->len
         + input->excerpt_opts->passage_boundary->len;
 
-    doc = input->docs;
     for(i = 0; i < input->num_docs; ++i) {
-        request_len += (sz32 + doc->doc->len);
-        doc = doc->next;
+        request_len += (sz32 + input->docs[i].doc.len);
     }
 
     return(request_len);
@@ -443,12 +632,10 @@ s_write_docs_to_stream(
 
     d = docs;
 
-    for(i = 0; i < num_docs; ++i) {
-        status = sphx2_stream_write_string(st, d->doc);
+    for(i = 0; i < num_docs; ++i, ++d) {
+        status = sphx2_stream_write_string(st, &d->doc);
 
         if(NGX_OK != status) return(status);
-
-        d = d->next;
     }
 
     return(NGX_OK);
@@ -458,30 +645,27 @@ ngx_int_t
 sphx2_create_excerpt_request(
     ngx_pool_t             * pool,
     sphx2_excerpt_input_t  * input,
-    ngx_buf_t             ** b)
+    ngx_chain_t           ** cl)
 {
     size_t request_len = s_sphx2_excerpt_request_len(input);
 
-    /* data to send =
-     *   handshake = version [4]
-     * . header = command [2] . command_version [2] . bytes following [4]
+    /* data to send (handshake goes separately, see sphx2_create_handshake)
+     *   header = command [2] . command_version [2] . bytes following [4]
      * . request [request_len]
      */
-    size_t buf_len = (2 * sz16 + 2 * sz32) + request_len;
+    size_t buf_len = (2 * sz16 + sz32) + request_len;
 
     sphx2_stream_t* st = sphx2_stream_create(pool);
 
     ngx_int_t status;
 
-    if(NGX_ERROR == sphx2_stream_alloc(st, buf_len)) {
+    if(NULL == st || NGX_ERROR == sphx2_stream_alloc_chain(st, buf_len)) {
         return(NGX_ERROR);
     }
 
     status =
-           /* handshake */
-           sphx2_stream_write_int32(st, (uint32_t)SPHX2_CLI_VERSION)
            /* header - command */
-        || sphx2_stream_write_int16(st, (uint16_t)SPHX2_COMMAND_EXCERPT)
+           sphx2_stream_write_int16(st, (uint16_t)SPHX2_COMMAND_EXCERPT)
            /* header - command ver */
         || sphx2_stream_write_int16(st, (uint16_t)SPHX2_VER_COMMAND_EXCERPT)
            /* bytes after this variable in the request */
@@ -507,20 +691,23 @@ sphx2_create_excerpt_request(
              : NGX_OK)
         ;
 
-    *b = sphx2_stream_get_buf(st);
-
-    s_dump_buffer((*b)->pos, buf_len);
+    *cl = sphx2_stream_get_chain(st);
 
     return status;
 }
 
 /* Functions to work with searchd response */
 
+/* 'handshake' tells if the response is the first one on the connection
+ * and so starts with the searchd protocol version
+ */
 static ngx_int_t
 s_sphx2_parse_response_header(
     ngx_pool_t      * pool,
     ngx_buf_t       * b,
-    uint32_t        * len)
+    ngx_uint_t        handshake,
+    uint32_t        * len,
+    sphx2_searchd_status_t * status_out)
 {
     ngx_int_t       status;
     sphx2_stream_t* st;
@@ -536,15 +723,18 @@ s_sphx2_parse_response_header(
         return(NGX_ERROR);
     }
 
-    if(NGX_ERROR == (status =
-                         sphx2_stream_read_int32(st, &searchd_proto)
-                      || sphx2_stream_read_int16(st, &sphx_status)
-                      || sphx2_stream_read_int16(st, &version)))
-    {
-        return(NGX_HTTP_UPSTREAM_INVALID_HEADER);
+    if(handshake) {
+        if(NGX_OK != sphx2_stream_read_int32(st, &searchd_proto)
+           || SPHX2_SEARCHD_PROTO != searchd_proto)
+        {
+            return(NGX_HTTP_UPSTREAM_INVALID_HEADER);
+        }
     }
 
-    if(SPHX2_SEARCHD_PROTO != searchd_proto) {
+    if(NGX_OK != (status =
+                         sphx2_stream_read_int16(st, &sphx_status)
+                      || sphx2_stream_read_int16(st, &version)))
+    {
         return(NGX_HTTP_UPSTREAM_INVALID_HEADER);
     }
 
@@ -556,7 +746,7 @@ s_sphx2_parse_response_header(
             if(NGX_ERROR == sphx2_stream_read_int32(st, len)) {
                 return(NGX_HTTP_UPSTREAM_INVALID_HEADER);
             }
-            s_dump_buffer(b->pos, *len);
+            *status_out = (sphx2_searchd_status_t)sphx_status;
             break;
         default:
             return(NGX_HTTP_UPSTREAM_INVALID_HEADER);
@@ -569,18 +759,146 @@ ngx_int_t
 sphx2_parse_search_response_header(
     ngx_pool_t                     * pool,
     ngx_buf_t                      * b,
+    ngx_uint_t                       handshake,
     sphx2_search_response_ctx_t    * ctx)
 {
-    return(s_sphx2_parse_response_header(pool, b, &ctx->len));
+    return(s_sphx2_parse_response_header(pool, b, handshake, &ctx->len,
+                                         &ctx->status));
 }
 
 ngx_int_t
 sphx2_parse_excerpt_response_header(
     ngx_pool_t                     * pool,
     ngx_buf_t                      * b,
+    ngx_uint_t                       handshake,
     sphx2_excerpt_response_ctx_t    * ctx)
 {
-    return(s_sphx2_parse_response_header(pool, b, &ctx->len));
+    return(s_sphx2_parse_response_header(pool, b, handshake, &ctx->len,
+                                         &ctx->status));
+}
+
+/* Functions to handle status request */
+
+ngx_int_t
+sphx2_create_status_request(
+    ngx_pool_t             * pool,
+    ngx_buf_t             ** b)
+{
+    /* data to send =
+     *   handshake = version [4]
+     * . header = command [2] . command_version [2] . bytes following [4]
+     * . global [4] -- 1 for the counters of the daemon, not the session
+     */
+    size_t buf_len = sz32 + 2 * sz16 + 2 * sz32;
+
+    sphx2_stream_t* st;
+
+    ngx_int_t status;
+
+    if(NULL == (st = sphx2_stream_create(pool))) {
+        return(NGX_ERROR);
+    }
+
+    if(NGX_ERROR == sphx2_stream_alloc(st, buf_len)) {
+        return(NGX_ERROR);
+    }
+
+    status =
+           sphx2_stream_write_int32(st, (uint32_t)SPHX2_CLI_VERSION)
+        || sphx2_stream_write_int16(st, (uint16_t)SPHX2_COMMAND_STATUS)
+        || sphx2_stream_write_int16(st, (uint16_t)SPHX2_VER_COMMAND_STATUS)
+        || sphx2_stream_write_int32(st, (uint32_t)sz32)
+        || sphx2_stream_write_int32(st, (uint32_t)1)
+        ;
+
+    *b = sphx2_stream_get_buf(st);
+
+    return (NGX_OK == status) ? NGX_OK : NGX_ERROR;
+}
+
+/*
+ * response = searchd version [4] . header [8] . rows [4] . columns [4]
+ *          . rows * columns strings
+ *
+ * The first two columns of a row are the name of a counter and its value.
+ * NGX_AGAIN while 'b' doesn't hold the whole response yet, NGX_DECLINED
+ * if searchd answered with anything but OK. 'b' itself is left as it is.
+ */
+ngx_int_t
+sphx2_parse_status_response(
+    ngx_pool_t             * pool,
+    ngx_buf_t              * b,
+    ngx_array_t           ** rows_out)
+{
+    ngx_buf_t               buf;
+    sphx2_stream_t        * st;
+    sphx2_searchd_status_t  status;
+    sphx2_status_row_t    * row;
+    ngx_array_t           * rows;
+    ngx_str_t               str;
+    uint32_t                len, num_rows, num_cols, i, j;
+
+    if((size_t)(b->last - b->pos) < 2 * sz32 + 2 * sz16) {
+        return(NGX_AGAIN);
+    }
+
+    buf = *b;
+
+    if(NGX_OK != s_sphx2_parse_response_header(pool, &buf, 1, &len, &status))
+    {
+        return(NGX_ERROR);
+    }
+
+    if((size_t)(buf.last - buf.pos) < len) {
+        return(NGX_AGAIN);
+    }
+
+    if(SPHX2_SEARCHD_OK != status) {
+        return(NGX_DECLINED);
+    }
+
+    buf.last = buf.pos + len;
+
+    if(NULL == (st = sphx2_stream_create(pool))
+       || NGX_OK != sphx2_stream_set_buf(st, &buf))
+    {
+        return(NGX_ERROR);
+    }
+
+    if(NGX_OK != sphx2_stream_read_int32(st, &num_rows)
+       || NGX_OK != sphx2_stream_read_int32(st, &num_cols)
+       || num_cols < 2
+       /* a string takes its length at least */
+       || (uint64_t)num_rows * num_cols * sz32 > len)
+    {
+        return(NGX_ERROR);
+    }
+
+    if(NULL == (rows = ngx_array_create(pool, ngx_max(num_rows, 1),
+                                        sizeof(sphx2_status_row_t))))
+    {
+        return(NGX_ERROR);
+    }
+
+    for(i = 0; i < num_rows; ++i) {
+        row = ngx_array_push(rows);
+
+        if(NGX_OK != sphx2_stream_read_string_ref(st, &row->name)
+           || NGX_OK != sphx2_stream_read_string_ref(st, &row->value))
+        {
+            return(NGX_ERROR);
+        }
+
+        for(j = 2; j < num_cols; ++j) {
+            if(NGX_OK != sphx2_stream_read_string_ref(st, &str)) {
+                return(NGX_ERROR);
+            }
+        }
+    }
+
+    *rows_out = rows;
+
+    return(NGX_OK);
 }
 
 /* Functions to work with URL query param arg parsing */
@@ -592,27 +910,15 @@ sphx2_parse_ ## key ## _str( \
     ngx_str_t           * key ##_str, \
     sphx2_## key ##_t   * key) \
 { \
-    int32_t  i = 0; \
- \
-    sphx2_arg_parse_hint_t s_ ## key ## _hints[] = \
-    { \
-        { SPHX2_ARG_TYPE_ENUM, s_ ## key ## _strs, sz_ ## key ## _strs }, \
-        { SPHX2_ARG_TYPE_NONE, NULL, 0 } \
-    }; \
+    ngx_int_t  i; \
  \
     if(NULL == key ## _str || 0 == key ## _str->len) { \
         *key = sphx2_default_ ## key; \
         return(NGX_OK); \
     } \
  \
-    if(NGX_ERROR == sphx2_arg_parse_register(&s_main_ctxt, \
-        pool, (char*)key ## _str->data, s_ ## key ## _hints, s_no_delim)) \
-    { \
-        return(NGX_ERROR); \
-    } \
- \
-    if(NGX_ERROR == (i = \
-        sphx2_arg_parse_get_enum_arg(&s_main_ctxt, NULL, 0))) \
+    if(NGX_ERROR == (i = sphx2_arg_parse_enum(key ## _str, \
+                             s_ ## key ## _enum))) \
     { \
         return(NGX_ERROR); \
     } \
@@ -621,127 +927,296 @@ sphx2_parse_ ## key ## _str( \
     return NGX_OK; \
 }
 
-#define MULTI_ARG_PARSE_FUNCTION_SIGNATURE(key) \
+/* a list arg is parsed into an array, sized by counting the items first,
+ * with s_parse_<key>() parsing an item in place
+ */
+#define MULTI_ARG_PARSE_FUNCTION(key) \
 ngx_int_t \
 sphx2_parse_ ## key ## s_str( \
     ngx_pool_t        * pool, \
     ngx_str_t         * key ## s_str, \
     sphx2_## key ## _t   ** key ## s, \
-    uint32_t          * num_ ## key ## s)
-
-#define MULTI_ARG_PARSE_FUNCTION_BODY(key, elem_delim) \
-    sphx2_ ## key ## _t *key; \
+    uint32_t          * num_ ## key ## s) \
+{ \
+    sphx2_arg_parse_ctx_t   ctxt; \
+    ngx_str_t               tok; \
+    sphx2_ ## key ## _t   * key; \
  \
     assert(NULL != key ## s_str && 0 != key ## s_str->len); \
  \
-    *key ## s = NULL; \
-    *num_ ## key ## s = 0; \
+    sphx2_arg_parse_init(&ctxt, key ## s_str, s_multi_delim); \
  \
-    if(NGX_ERROR == sphx2_arg_parse_register(&s_main_ctxt, \
-        pool, (char*)key ## s_str->data, NULL, s_multi_delim)) \
+    if(NULL == (key = ngx_palloc(pool, \
+                    sphx2_arg_count(&ctxt) * sizeof(sphx2_ ## key ## _t)))) \
     { \
-        return(NGX_ERROR); \
+        return NGX_ERROR; \
     } \
  \
-    while(NGX_ERROR != sphx2_arg_step(&s_main_ctxt)) { \
+    *key ## s = key; \
+    *num_ ## key ## s = 0; \
  \
-        if(NGX_ERROR == sphx2_arg_parse_register_child( \
-                           &s_sec_ctxt, &s_main_ctxt, pool, \
-                           s_ ## key ## _hints, elem_delim)) \
-        { \
-            return(NGX_ERROR); \
-        } \
+    while(NGX_OK == sphx2_arg_next(&ctxt, &tok)) { \
  \
-        if(NULL == (key = \
-                ngx_pcalloc(pool, sizeof(sphx2_ ## key ## _t)))) \
-        { \
+        if(NGX_OK != s_parse_ ## key(pool, &tok, key)) { \
             return NGX_ERROR; \
         } \
  \
-        if(NGX_ERROR == sphx2_arg_parse_whole_using_hints(&s_sec_ctxt, key)) \
-        { \
-            return NGX_ERROR; \
-        } \
- \
-        LIST_ADD(*key ## s, key, *num_ ## key ## s); \
+        ++key; \
+        ++*num_ ## key ## s; \
     } \
  \
-    return NGX_OK;
-
-#define SET_ARG_PARSE_FUNCTION_SIGNATURE(key) \
-ngx_int_t \
-sphx2_parse_ ## key ## _str( \
-    ngx_pool_t          * pool, \
-    ngx_str_t           * key ## _str, \
-    sphx2_ ## key ## _t ** key) \
+    return NGX_OK; \
+}
 
-#define SET_ARG_PARSE_FUNCTION_BODY(key) \
-    if(NGX_ERROR == sphx2_arg_parse_register(&s_main_ctxt, \
-        pool, (char*)key ## _str->data, s_ ## key ## _hints, s_set_delim)) \
-    { \
-        return(NGX_ERROR); \
-    } \
- \
-    if(NULL == (*key = ngx_pcalloc(pool, sizeof(sphx2_ ## key ## _t)))) { \
-        return NGX_ERROR; \
-    } \
- \
-    return(sphx2_arg_parse_whole_using_hints(&s_main_ctxt, *key));
+/* next token of a set, as a string / an enum */
+#define NEXT_STR_ARG(ctxt, tok, pool, var) \
+    (NGX_OK != sphx2_arg_next(ctxt, tok) \
+     || NULL == ((var) = sphx2_arg_parse_str(pool, tok)))
 
+#define NEXT_ENUM_ARG(ctxt, tok, table, var) \
+    (NGX_OK != sphx2_arg_next(ctxt, tok) \
+     || NGX_ERROR == ((var) = sphx2_arg_parse_enum(tok, table)))
 
 DEFINE_ENUM_ARG_PARSE_FUNCTION(match_mode)
 DEFINE_ENUM_ARG_PARSE_FUNCTION(ranker)
 DEFINE_ENUM_ARG_PARSE_FUNCTION(sort_mode)
 DEFINE_ENUM_ARG_PARSE_FUNCTION(output_type)
 
-MULTI_ARG_PARSE_FUNCTION_SIGNATURE(weight)
+/* entity:weight */
+static ngx_int_t
+s_parse_weight(ngx_pool_t * pool, ngx_str_t * tok, sphx2_weight_t * w)
+{
+    if(NGX_OK != sphx2_arg_parse_keyval(tok, &w->entity)) {
+        return(NGX_ERROR);
+    }
+
+    return(sphx2_arg_parse_int(tok, &w->weight));
+}
+
+MULTI_ARG_PARSE_FUNCTION(weight)
+
+/* signed, as searchd has them */
+static int ngx_libc_cdecl
+s_cmp_value(const void * one, const void * two)
+{
+    int64_t a = (int64_t) *(const uint64_t *) one,
+            b = (int64_t) *(const uint64_t *) two;
+
+    return (a < b) ? -1 : (a > b);
+}
+
+/* the values of a filter, sorted without duplicates; a list that comes
+ * in order - as ID lists mostly do - isn't sorted again
+ */
+static ngx_int_t
+s_parse_filter_values(
+    ngx_pool_t              * pool,
+    sphx2_arg_parse_ctx_t   * ctxt,
+    sphx2_filter_values_t   * vals)
+{
+    uint64_t   * v;
+    ngx_uint_t   i, j, n, sorted;
+
+    if(NGX_OK != sphx2_arg_parse_int64_list(pool, ctxt, &vals->v, &n)) {
+        return(NGX_ERROR);
+    }
+
+    vals->wire = NULL;
+
+    v = vals->v;
+
+    for(sorted = 1, i = 1; i < n; ++i) {
+        if((int64_t) v[i - 1] >= (int64_t) v[i]) {
+            sorted = 0;
+            break;
+        }
+    }
+
+    if(!sorted) {
+        ngx_qsort(v, n, sizeof(uint64_t), s_cmp_value);
+
+        for(j = 0, i = 1; i < n; ++i) {
+            if(v[i] != v[j]) {
+                v[++j] = v[i];
+            }
+        }
+
+        n = j + 1;
+    }
+
+    vals->n = n;
+
+    return(NGX_OK);
+}
+
+/* the values of a filter set, by its name */
+static ngx_int_t
+s_parse_filter_set(
+    ngx_array_t           * sets,
+    ngx_str_t             * name,
+    sphx2_filter_values_t * vals)
 {
-    sphx2_arg_parse_hint_t s_weight_hints[] =
+    sphx2_filter_set_t  * set;
+    ngx_uint_t            i;
+
+    if(NULL == sets) {
+        return(NGX_ERROR);
+    }
+
+    set = sets->elts;
+
+    for(i = 0; i < sets->nelts; ++i) {
+        if(set[i].name.len == name->len
+           && 0 == ngx_strncmp(set[i].name.data, name->data, name->len))
+        {
+            vals->v = NULL;
+            vals->wire = set[i].wire;
+            vals->n = set[i].n;
+
+            return(NGX_OK);
+        }
+    }
+
+    return(NGX_ERROR);
+}
+
+/* attr,in|ex,range|frange,min,max
+ * attr,in|ex,vals,value[,value...]
+ * attr,in|ex,set,name
+ */
+static ngx_int_t
+s_parse_filter(
+    ngx_pool_t            * pool,
+    ngx_array_t           * sets,
+    ngx_str_t             * item,
+    sphx2_filter_t        * f)
+{
+    sphx2_arg_parse_ctx_t   ctxt;
+    ngx_str_t               tok;
+    ngx_int_t               v;
+    ngx_int_t               status;
+
+    sphx2_arg_parse_init(&ctxt, item, s_set_delim);
+
+    if(NGX_OK != sphx2_arg_next(&ctxt, &f->attr)
+       || NEXT_ENUM_ARG(&ctxt, &tok, s_filter_exclude_enum, v))
     {
-        { SPHX2_ARG_TYPE_STRING, NULL, 0 },
-        { SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_NONE, NULL, 0 }
-    };
+        return(NGX_ERROR);
+    }
+
+    f->exclude = (int32_t)v;
+
+    if(NEXT_ENUM_ARG(&ctxt, &tok, s_filter_type_enum, v)) {
+        return(NGX_ERROR);
+    }
+
+    if(SPHX2_FILTER_SET == v) {
+        f->type = SPHX2_FILTER_VALUES;
+
+        status =
+               sphx2_arg_next(&ctxt, &tok)
+            || s_parse_filter_set(sets, &tok, &f->spec.vals);
 
-    MULTI_ARG_PARSE_FUNCTION_BODY(weight, s_key_val_delim)
+        if(NGX_OK != status || NGX_DONE != sphx2_arg_next(&ctxt, &tok)) {
+            return(NGX_ERROR);
+        }
+
+        return(NGX_OK);
+    }
+
+    f->type = (sphx2_filter_type_t)v;
+
+    switch(f->type) {
+        case SPHX2_FILTER_RANGE:
+            status =
+                   sphx2_arg_next(&ctxt, &tok)
+                || sphx2_arg_parse_int64(&tok, &f->spec.ir.min)
+                || sphx2_arg_next(&ctxt, &tok)
+                || sphx2_arg_parse_int64(&tok, &f->spec.ir.max);
+            break;
+        case SPHX2_FILTER_FLOATRANGE:
+            status =
+                   sphx2_arg_next(&ctxt, &tok)
+                || sphx2_arg_parse_double(&tok, &f->spec.fr.min)
+                || sphx2_arg_next(&ctxt, &tok)
+                || sphx2_arg_parse_double(&tok, &f->spec.fr.max);
+            break;
+        case SPHX2_FILTER_VALUES:
+            /* the values are the rest of the item */
+            return s_parse_filter_values(pool, &ctxt, &f->spec.vals);
+        default:
+            return(NGX_ERROR);
+    }
+
+    if(NGX_OK != status || NGX_DONE != sphx2_arg_next(&ctxt, &tok)) {
+        return(NGX_ERROR);
+    }
+
+    return(NGX_OK);
 }
 
-MULTI_ARG_PARSE_FUNCTION_SIGNATURE(filter)
+/* as MULTI_ARG_PARSE_FUNCTION would have it, with the sets 'set' filters
+ * are looked up in
+ */
+ngx_int_t
+sphx2_parse_filters_str(
+    ngx_pool_t        * pool,
+    ngx_array_t       * sets,
+    ngx_str_t         * filters_str,
+    sphx2_filter_t   ** filters,
+    uint32_t          * num_filters)
 {
-    sphx2_arg_parse_hint_t s_filter_hints[] =
+    sphx2_arg_parse_ctx_t   ctxt;
+    ngx_str_t               tok;
+    sphx2_filter_t        * filter;
+
+    assert(NULL != filters_str && 0 != filters_str->len);
+
+    sphx2_arg_parse_init(&ctxt, filters_str, s_multi_delim);
+
+    if(NULL == (filter = ngx_palloc(pool,
+                             sphx2_arg_count(&ctxt) * sizeof(sphx2_filter_t))))
     {
-        { SPHX2_ARG_TYPE_STRING, NULL, 0 },
-        { SPHX2_ARG_TYPE_ENUM, s_filter_exclude_strs, sz_filter_exclude_strs },
-        { SPHX2_ARG_TYPE_ENUM, s_filter_type_strs, sz_filter_type_strs },
-        { SPHX2_ARG_TYPE_INTEGER64, NULL, 0 },
-        { SPHX2_ARG_TYPE_INTEGER64, NULL, 0 },
-        { SPHX2_ARG_TYPE_NONE, NULL, 0 }
-    };
+        return NGX_ERROR;
+    }
+
+    *filters = filter;
+    *num_filters = 0;
+
+    while(NGX_OK == sphx2_arg_next(&ctxt, &tok)) {
+
+        if(NGX_OK != s_parse_filter(pool, sets, &tok, filter)) {
+            return NGX_ERROR;
+        }
+
+        ++filter;
+        ++*num_filters;
+    }
 
-    MULTI_ARG_PARSE_FUNCTION_BODY(filter, s_set_delim)
+    return NGX_OK;
 }
 
 static ngx_str_t s_dflt_sort = ngx_string("@group desc");
 static ngx_str_t s_empty_str = ngx_null_string;
 
-SET_ARG_PARSE_FUNCTION_SIGNATURE(group)
+/* type,attr,sort[,distinct] */
+ngx_int_t
+sphx2_parse_group_str(
+    ngx_pool_t          * pool,
+    ngx_str_t           * group_str,
+    sphx2_group_t      ** group)
 {
-    sphx2_arg_parse_hint_t s_group_hints[] =
-    {
-        { SPHX2_ARG_TYPE_ENUM, s_group_type_strs, sz_group_type_strs },
-        { SPHX2_ARG_TYPE_STRING, NULL, 0 },
-        { SPHX2_ARG_TYPE_STRING, NULL, 0 },
-        { SPHX2_ARG_TYPE_STRING, NULL, 0 },
-        { SPHX2_ARG_TYPE_NONE, NULL, 0 }
-    };
+    sphx2_arg_parse_ctx_t   ctxt;
+    ngx_str_t               tok;
+    ngx_int_t               v;
+
+    if(NULL == (*group = ngx_pcalloc(pool, sizeof(sphx2_group_t)))) {
+        return NGX_ERROR;
+    }
 
     /* there must be a default group specification as per Sphinx 2.0 protocol */
     if(NULL == group_str || 0 == group_str->len) {
 
-        if(NULL == (*group = ngx_pcalloc(pool, sizeof(sphx2_group_t)))) {
-            return NGX_ERROR;
-        }
-
         (*group)->type = SPHX2_GROUPBY_DAY;
         (*group)->sort = &s_dflt_sort;
         (*group)->attr = &s_empty_str;
@@ -750,63 +1225,93 @@ SET_ARG_PARSE_FUNCTION_SIGNATURE(group)
         return(NGX_OK);
     }
 
-    SET_ARG_PARSE_FUNCTION_BODY(group)
-}
+    sphx2_arg_parse_init(&ctxt, group_str, s_set_delim);
 
-SET_ARG_PARSE_FUNCTION_SIGNATURE(geo)
-{
-    sphx2_arg_parse_hint_t s_geo_hints[] =
+    if(NEXT_ENUM_ARG(&ctxt, &tok, s_group_type_enum, v)
+       || NEXT_STR_ARG(&ctxt, &tok, pool, (*group)->attr)
+       || NEXT_STR_ARG(&ctxt, &tok, pool, (*group)->sort))
     {
-        { SPHX2_ARG_TYPE_STRING, NULL, 0 },
-        { SPHX2_ARG_TYPE_STRING, NULL, 0 },
-        { SPHX2_ARG_TYPE_FLOAT, NULL, 0 },
-        { SPHX2_ARG_TYPE_FLOAT, NULL, 0 },
-        { SPHX2_ARG_TYPE_NONE, NULL, 0 }
-    };
+        return(NGX_ERROR);
+    }
 
-    assert(NULL != geo_str && 0 != geo_str->len);
+    (*group)->type = (sphx2_group_type_t)v;
 
-    SET_ARG_PARSE_FUNCTION_BODY(geo)
+    if(NGX_DONE == sphx2_arg_next(&ctxt, &tok)) {
+        (*group)->distinct = &s_empty_str;
+        return(NGX_OK);
+    }
+
+    return (NULL == ((*group)->distinct = sphx2_arg_parse_str(pool, &tok)))
+        ? NGX_ERROR : NGX_OK;
 }
 
-MULTI_ARG_PARSE_FUNCTION_SIGNATURE(doc)
+/* lat_attr,lon_attr,lat,lon */
+ngx_int_t
+sphx2_parse_geo_str(
+    ngx_pool_t          * pool,
+    ngx_str_t           * geo_str,
+    sphx2_geo_t        ** geo)
 {
-    sphx2_arg_parse_hint_t s_doc_hints[] =
+    sphx2_arg_parse_ctx_t   ctxt;
+    ngx_str_t               tok;
+    double                  lat, lon;
+
+    assert(NULL != geo_str && 0 != geo_str->len);
+
+    if(NULL == (*geo = ngx_pcalloc(pool, sizeof(sphx2_geo_t)))) {
+        return NGX_ERROR;
+    }
+
+    sphx2_arg_parse_init(&ctxt, geo_str, s_set_delim);
+
+    if(NEXT_STR_ARG(&ctxt, &tok, pool, (*geo)->lat_attr)
+       || NEXT_STR_ARG(&ctxt, &tok, pool, (*geo)->lon_attr)
+       || NGX_OK != sphx2_arg_next(&ctxt, &tok)
+       || NGX_OK != sphx2_arg_parse_double(&tok, &lat)
+       || NGX_OK != sphx2_arg_next(&ctxt, &tok)
+       || NGX_OK != sphx2_arg_parse_double(&tok, &lon))
     {
-        { SPHX2_ARG_TYPE_STRING, NULL, 0 },
-        { SPHX2_ARG_TYPE_NONE, NULL, 0 }
-    };
+        return(NGX_ERROR);
+    }
 
-    MULTI_ARG_PARSE_FUNCTION_BODY(doc, s_no_delim)
+    (*geo)->lat = (float)lat;
+    (*geo)->lon = (float)lon;
+
+    return(NGX_OK);
 }
 
-SET_ARG_PARSE_FUNCTION_SIGNATURE(excerpt_opts)
+/* a doc is the item as it is */
+static ngx_int_t
+s_parse_doc(ngx_pool_t * pool, ngx_str_t * tok, sphx2_doc_t * d)
 {
-    sphx2_arg_parse_hint_t s_excerpt_opts_hints[] =
-    {
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_STRING, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_STRING, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_STRING, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_STRING, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_STRING, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_KEYVAL | SPHX2_ARG_TYPE_INTEGER, NULL, 0 },
-        { SPHX2_ARG_TYPE_NONE, NULL, 0 }
-    };
+    d->doc = *tok;
+
+    return(NGX_OK);
+}
+
+MULTI_ARG_PARSE_FUNCTION(doc)
+
+/* key:value pairs of all the opts, in the order of sphx2_excerpt_opts_t;
+ * the keys are only for readability
+ */
+#define NEXT_OPT(ctxt, tok, key) \
+    (NGX_OK != sphx2_arg_next(ctxt, tok) \
+     || NGX_OK != sphx2_arg_parse_keyval(tok, key))
+
+#define STR_OPT(f) \
+    (NEXT_OPT(&ctxt, &tok, &key) \
+     || NULL == ((*excerpt_opts)->f = sphx2_arg_parse_str(pool, &tok)))
+
+#define INT_OPT(f) \
+    (NEXT_OPT(&ctxt, &tok, &key) \
+     || NGX_OK != sphx2_arg_parse_int(&tok, &(*excerpt_opts)->f))
 
+ngx_int_t
+sphx2_parse_excerpt_opts_str(
+    ngx_pool_t            * pool,
+    ngx_str_t             * excerpt_opts_str,
+    sphx2_excerpt_opts_t ** excerpt_opts)
+{
     static ngx_str_t s_default_before_match = ngx_string("<b>");
     static ngx_str_t s_default_after_match = ngx_string("</b>");
     static ngx_str_t s_default_chunk_separator = ngx_string(" ... ");
@@ -816,13 +1321,16 @@ SET_ARG_PARSE_FUNCTION_SIGNATURE(excerpt_opts)
     static ngx_str_t s_default_html_strip_mode = ngx_string("index");
     static ngx_str_t s_default_passage_boundary = ngx_string("none");
 
-    if(NULL == excerpt_opts_str || 0 == excerpt_opts_str->len) {
+    sphx2_arg_parse_ctx_t   ctxt;
+    ngx_str_t               tok, key;
 
-        if(NULL == (*excerpt_opts = ngx_pcalloc(pool,
-                                       sizeof(sphx2_excerpt_opts_t))))
-        {
-            return NGX_ERROR;
-        }
+    if(NULL == (*excerpt_opts = ngx_pcalloc(pool,
+                                   sizeof(sphx2_excerpt_opts_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    if(NULL == excerpt_opts_str || 0 == excerpt_opts_str->len) {
 
         (*excerpt_opts)->before_match = &s_default_before_match;
         (*excerpt_opts)->after_match = &s_default_after_match;
@@ -848,7 +1356,33 @@ SET_ARG_PARSE_FUNCTION_SIGNATURE(excerpt_opts)
         return(NGX_OK);
     }
 
-    SET_ARG_PARSE_FUNCTION_BODY(excerpt_opts)
+    sphx2_arg_parse_init(&ctxt, excerpt_opts_str, s_set_delim);
+
+    if(   STR_OPT(before_match)
+       || STR_OPT(after_match)
+       || STR_OPT(chunk_separator)
+       || INT_OPT(limit)
+       || INT_OPT(limit_passages)
+       || INT_OPT(limit_words)
+       || INT_OPT(around)
+       || INT_OPT(exact_phrase)
+       || INT_OPT(single_passage)
+       || INT_OPT(use_boundaries)
+       || INT_OPT(weight_order)
+       || INT_OPT(query_mode)
+       || INT_OPT(force_all_words)
+       || INT_OPT(start_passage_id)
+       || INT_OPT(load_files)
+       || STR_OPT(html_strip_mode)
+       || INT_OPT(allow_empty)
+       || STR_OPT(passage_boundary)
+       || INT_OPT(emit_zones)
+       || INT_OPT(load_files_scattered))
+    {
+        return(NGX_ERROR);
+    }
+
+    return(NGX_OK);
 }
 
 void
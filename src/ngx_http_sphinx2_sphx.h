@@ -11,18 +11,24 @@
 #define SPHX2_CLI_VERSION       1
 #define SPHX2_SEARCHD_PROTO     1
 
+/* Max search queries in one batch (searchd's max_batch_queries default) */
+#define SPHX2_MAX_QUERIES       32
+
+/* Separates per-query values of an argument for a batched search */
+#define SPHX2_QUERY_DELIM       '\n'
+
 /* Codes of commands to be sent to Sphinx search daemon */
 typedef enum {
     SPHX2_COMMAND_NONE =       -1,
     SPHX2_COMMAND_SEARCH =      0,
     SPHX2_COMMAND_EXCERPT =     1,
+    SPHX2_COMMAND_PERSIST =     4,
+    SPHX2_COMMAND_STATUS =      5,  /* health checks only */
 #if 0
     -- not supported as of this release --
 
     SPHX2_COMMAND_UPDATE =      2,
     SPHX2_COMMAND_KEYWORDS =    3,
-    SPHX2_COMMAND_PERSIST =     4,
-    SPHX2_COMMAND_STATUS =      5,
     SPHX2_COMMAND_FLUSHATTRS =  7
 #endif
     SPHX2_COMMAND_COUNT
@@ -31,12 +37,13 @@ typedef enum {
 /* Versions of commands to be sent to Sphinx search daemon */
 typedef enum {
     SPHX2_VER_COMMAND_SEARCH =      0x119,
-    SPHX2_VER_COMMAND_EXCERPT =     0x104
+    SPHX2_VER_COMMAND_EXCERPT =     0x104,
+    SPHX2_VER_COMMAND_PERSIST =     0x000,
+    SPHX2_VER_COMMAND_STATUS =      0x100
 #if 0
     -- not supported as of this release --
     SPHX2_VER_COMMAND_UPDATE =      0x102,
     SPHX2_VER_COMMAND_KEYWORDS =    0x100,
-    SPHX2_VER_COMMAND_STATUS =      0x100,
     SPHX2_VER_COMMAND_QUERY =       0x100,
     SPHX2_VER_COMMAND_FLUSHATTRS =  0x100
 #endif
@@ -119,21 +126,27 @@ typedef enum {
 } sphx2_searchd_status_t;
 
 /* Specify weight of a field */
-typedef struct _sphx2_weight sphx2_weight_t;
-
-struct _sphx2_weight {
-    ngx_str_t            * entity;
+typedef struct {
+    ngx_str_t              entity;
     uint32_t               weight;
-    sphx2_weight_t       * next;
-};
+} sphx2_weight_t;
 
-/* Filter values (int64)
-typedef struct _sphx2_filter_value sphx2_filter_value_t;
+/* Filter values (int64), sorted with no duplicates; those of a filter set
+ * come already in wire order
+ */
+typedef struct {
+    uint64_t             * v;
+    u_char               * wire;            /* or, of a set */
+    ngx_uint_t             n;
+} sphx2_filter_values_t;
 
-struct _sphx2_filter_value {
-    uint64_t                           value;
-    sphx2_filter_value_t  * next;
-};*/
+/* A named set of filter values, loaded at startup */
+typedef struct {
+    ngx_str_t              name;
+    u_char               * wire;            /* n big endian int64s */
+    ngx_uint_t             n;
+    size_t                 size;            /* of the mapping */
+} sphx2_filter_set_t;
 
 /* Filter range (int64) */
 typedef struct {
@@ -149,24 +162,18 @@ typedef struct {
 
 /* Filter spec */
 typedef union {
-    /*struct {
-        sphx2_filter_value_t  * v;
-        ngx_uint_t              n;
-    } vals;*/
+    sphx2_filter_values_t      vals;
     sphx2_filter_int_range_t   ir;
     sphx2_filter_float_range_t fr;
 } sphx2_filter_spec_t;
 
 /* Filter */
-typedef struct _sphx2_filter sphx2_filter_t;
-
-struct _sphx2_filter {
-    ngx_str_t            * attr;
+typedef struct {
+    ngx_str_t              attr;
     int32_t                exclude;
     sphx2_filter_type_t    type;
     sphx2_filter_spec_t    spec;
-    sphx2_filter_t       * next;
-};
+} sphx2_filter_t;
 
 /* Grouping */
 typedef struct {
@@ -184,6 +191,16 @@ typedef struct {
     float                  lon;
 } sphx2_geo_t;
 
+/* Parts of a search query which can be serialized ahead of time, when
+ * all that goes into them is known up front
+ */
+typedef enum {
+    SPHX2_PART_RANKING =        0,  /* match mode .. sort by */
+    SPHX2_PART_INDEX =          1,  /* index .. [deprecated] id range */
+    SPHX2_PART_TAIL =           2,  /* group .. select list */
+    SPHX2_PART_COUNT
+} sphx2_query_part_t;
+
 /* Input to search query */
 typedef struct {
     uint32_t               offset;
@@ -196,24 +213,26 @@ typedef struct {
     ngx_str_t            * keywords;
     ngx_str_t            * index;
     uint32_t               num_filters;
-    sphx2_filter_t       * filters;
+    sphx2_filter_t       * filters;         /* array of num_filters */
     sphx2_group_t        * group;
     uint32_t               max_matches;
     sphx2_geo_t          * geo;
     uint32_t               num_index_weights;
-    sphx2_weight_t       * index_weights;
+    sphx2_weight_t       * index_weights;   /* array */
     uint32_t               num_field_weights;
-    sphx2_weight_t       * field_weights;
+    sphx2_weight_t       * field_weights;   /* array */
+    uint32_t               cutoff;          /* 0 - all matches */
+    uint32_t               retry_count;     /* of distributed agents */
+    uint32_t               retry_delay;     /* ms */
+    uint32_t               max_query_time;  /* ms, 0 - no limit */
     sphx2_output_type_t    output_type;
+    ngx_str_t              parts[SPHX2_PART_COUNT]; /* serialized, if len */
 } sphx2_search_input_t;
 
 /* A document */
-typedef struct sphx2_doc_s sphx2_doc_t;
-
-struct sphx2_doc_s {
-    ngx_str_t            * doc;
-    sphx2_doc_t          * next;
-};
+typedef struct {
+    ngx_str_t              doc;
+} sphx2_doc_t;
 
 /* Excerpt opts */
 typedef struct {
@@ -245,7 +264,7 @@ typedef struct {
     ngx_str_t            * keywords;
     ngx_str_t            * index;
     uint32_t               num_docs;
-    sphx2_doc_t          * docs;
+    sphx2_doc_t          * docs;            /* array of num_docs */
     sphx2_excerpt_opts_t * excerpt_opts;
 } sphx2_excerpt_input_t;
 
@@ -258,13 +277,21 @@ typedef union {
 /* Search response context */
 typedef struct {
     uint32_t               len;
+    sphx2_searchd_status_t status;
 } sphx2_search_response_ctx_t;
 
 /* Excerpt command response */
 typedef struct {
     uint32_t               len;
+    sphx2_searchd_status_t status;
 } sphx2_excerpt_response_ctx_t;
 
+/* A row of STATUS command response - a searchd counter and its value */
+typedef struct {
+    ngx_str_t              name;
+    ngx_str_t              value;
+} sphx2_status_row_t;
+
 /* Response context */
 typedef union {
     sphx2_search_response_ctx_t     srch;
@@ -274,7 +301,10 @@ typedef union {
 
 /* FUNCTION PROTOTYPES */
 
-/* Parse URL arguments */
+/* Parse URL arguments. The parsed input refers to the bytes of the
+ * argument values, which must be kept as long as it is; the values are
+ * never modified.
+ */
 ngx_int_t
 sphx2_parse_match_mode_str(ngx_pool_t*, ngx_str_t*, sphx2_match_mode_t*);
 
@@ -290,8 +320,12 @@ sphx2_parse_weights_str(ngx_pool_t*, ngx_str_t*, sphx2_weight_t**, uint32_t*);
 #define sphx2_parse_index_weights_str sphx2_parse_weights_str
 #define sphx2_parse_field_weights_str sphx2_parse_weights_str
 
+/* 'set' filters have the values of the set of that name in the array
+ * given (of sphx2_filter_set_t), which may be NULL if there are none
+ */
 ngx_int_t
-sphx2_parse_filters_str(ngx_pool_t*, ngx_str_t*, sphx2_filter_t**, uint32_t*);
+sphx2_parse_filters_str(ngx_pool_t*, ngx_array_t*, ngx_str_t*,
+    sphx2_filter_t**, uint32_t*);
 
 ngx_int_t
 sphx2_parse_group_str(ngx_pool_t*, ngx_str_t*, sphx2_group_t**);
@@ -313,20 +347,42 @@ sphx2_create_opts_flag(sphx2_excerpt_opts_t*);
 
 
 /* Requests & Responses */
+ngx_int_t
+sphx2_create_handshake(ngx_pool_t*, ngx_uint_t, ngx_buf_t**);
+
+/* The request chains refer to long strings of the input instead of copying
+ * them, so the input must be kept as long as the chain is.
+ */
 ngx_int_t  
-sphx2_create_search_request(ngx_pool_t*, sphx2_search_input_t*, ngx_buf_t**);
+sphx2_create_search_request(ngx_pool_t*, sphx2_search_input_t*, ngx_uint_t,
+    ngx_chain_t**);
 
 ngx_int_t
-sphx2_parse_search_response_header(ngx_pool_t*, ngx_buf_t*,
+sphx2_create_query_part(ngx_pool_t*, sphx2_search_input_t*,
+    sphx2_query_part_t);
+
+ngx_int_t
+sphx2_parse_search_response_header(ngx_pool_t*, ngx_buf_t*, ngx_uint_t,
     sphx2_search_response_ctx_t*);
 
 ngx_int_t  
-sphx2_create_excerpt_request(ngx_pool_t*, sphx2_excerpt_input_t*, ngx_buf_t**);
+sphx2_create_excerpt_request(ngx_pool_t*, sphx2_excerpt_input_t*,
+    ngx_chain_t**);
 
 ngx_int_t
-sphx2_parse_excerpt_response_header(ngx_pool_t*, ngx_buf_t*,
+sphx2_parse_excerpt_response_header(ngx_pool_t*, ngx_buf_t*, ngx_uint_t,
     sphx2_excerpt_response_ctx_t*);
 
+/* The STATUS request goes with the handshake, being the only one sent on
+ * its connection. The rows of the response refer to the bytes of the
+ * buffer.
+ */
+ngx_int_t
+sphx2_create_status_request(ngx_pool_t*, ngx_buf_t**);
+
+ngx_int_t
+sphx2_parse_status_response(ngx_pool_t*, ngx_buf_t*, ngx_array_t**);
+
 /* GLOBALS */
 
 extern sphx2_match_mode_t  sphx2_default_match_mode;
@@ -343,4 +399,6 @@ extern ngx_uint_t          sphx2_default_max_matches;
 
 extern size_t              sphx2_min_search_header_len;
 
+extern size_t              sphx2_handshake_len;
+
 #endif /* NGX_HTTP_SPHINX2_SPHX_H */
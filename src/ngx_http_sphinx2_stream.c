@@ -8,13 +8,35 @@
 #include <ngx_http.h>
 #include "ngx_http_sphinx2_stream.h"
 
+/* byte shuffles for the bulk swap, if the compiler is let use them
+ * (--with-cc-opt=-mssse3 or -mavx2)
+ */
+#if (defined __AVX2__)
+#include <immintrin.h>
+#elif (defined __SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 /* TYPES */
 
 struct sphx2_stream_s {
     ngx_pool_t           * pool;
     ngx_buf_t            * b;
+    /* chain mode (see sphx2_stream_alloc_chain) */
+    ngx_chain_t          * chain;
+    ngx_chain_t         ** last_cl;
+    size_t                 left;       /* bytes yet to be written */
+    unsigned               ref:1;      /* last link refers to a string */
 };
 
+/* LOCALS */
+
+/* in chain mode, strings at least this long are referred to, not copied */
+#define SPHX2_STREAM_REF_MIN      1024
+
+/* most memory taken at a time for the copied parts of a chain */
+#define SPHX2_STREAM_CHUNK_LEN    4096
+
 /* FUNCTION DEFINITIONS */
 
 /* create stream */
@@ -41,9 +63,117 @@ sphx2_stream_alloc(
         return(NGX_ERROR);
     }
 
+    strm->left = len;
+
+    return(NGX_OK);
+}
+
+/* append a link to the chain */
+static ngx_int_t
+s_stream_append(
+    sphx2_stream_t * strm,
+    ngx_buf_t      * b)
+{
+    ngx_chain_t * cl;
+
+    if(NULL == (cl = ngx_alloc_chain_link(strm->pool))) {
+        return(NGX_ERROR);
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    *strm->last_cl = cl;
+    strm->last_cl = &cl->next;
+
+    return(NGX_OK);
+}
+
+/* start a new link for copied bytes, carrying on in the memory left after
+ * the current one if there is enough of it
+ */
+static ngx_int_t
+s_stream_new_segment(
+    sphx2_stream_t * strm,
+    size_t           need)
+{
+    ngx_buf_t * b;
+    u_char    * p, * end;
+    size_t      size;
+
+    if(NULL != strm->b && (size_t)(strm->b->end - strm->b->last) >= need) {
+        p = strm->b->last;
+        end = strm->b->end;
+        /* the old link must not grow into the new one */
+        strm->b->end = strm->b->last;
+    } else {
+        size = ngx_min(strm->left, SPHX2_STREAM_CHUNK_LEN);
+        size = ngx_max(size, need);
+        if(NULL == (p = ngx_palloc(strm->pool, size))) {
+            return(NGX_ERROR);
+        }
+        end = p + size;
+    }
+
+    if(NULL == (b = ngx_calloc_buf(strm->pool))) {
+        return(NGX_ERROR);
+    }
+
+    b->start = b->pos = b->last = p;
+    b->end = end;
+    b->temporary = 1;
+
+    if(NGX_OK != s_stream_append(strm, b)) {
+        return(NGX_ERROR);
+    }
+
+    strm->b = b;
+    strm->ref = 0;
+
     return(NGX_OK);
 }
 
+/* make room for 'len' bytes to be copied */
+static ngx_int_t
+s_stream_reserve(
+    sphx2_stream_t * strm,
+    size_t           len)
+{
+    if(!strm->ref && len <= (size_t)(strm->b->end - strm->b->last)) {
+        return(NGX_OK);
+    }
+
+    if(NULL == strm->last_cl || len > strm->left) {
+        return(NGX_ERROR);
+    }
+
+    return s_stream_new_segment(strm, len);
+}
+
+/* allocate a chain (for writes) of 'len' bytes in all; long strings get
+ * links of their own which refer to the string data, so that they go out
+ * by writev without being copied. The strings must outlive the chain.
+ */
+ngx_int_t
+sphx2_stream_alloc_chain(
+    sphx2_stream_t * strm,
+    size_t           len)
+{
+    strm->b = NULL;
+    strm->chain = NULL;
+    strm->last_cl = &strm->chain;
+    strm->left = len;
+
+    return s_stream_new_segment(strm, 0);
+}
+
+/* get the chain */
+ngx_chain_t*
+sphx2_stream_get_chain(sphx2_stream_t * strm)
+{
+    return(strm->chain);
+}
+
 /* set given buffer (for reads) */
 ngx_int_t
 sphx2_stream_set_buf(
@@ -82,24 +212,62 @@ sphx2_stream_maxsize(sphx2_stream_t * strm)
 
 #define CHECK_AND_APPEND(strm, type, val)     \
 do { \
-    if(sizeof(type) > (size_t)(strm->b->end - strm->b->last)) { \
+    if(NGX_OK != s_stream_reserve(strm, sizeof(type))) { \
         return (NGX_ERROR); \
     } \
     memcpy(strm->b->last, &val, sizeof(type)); \
     strm->b->last += sizeof(type); \
+    strm->left -= sizeof(type); \
 } while(0)
 
 #define CHECK_AND_APPEND_STR(strm, val)     \
 do { \
     uint32_t conv = htonl((uint32_t)val->len); \
     CHECK_AND_APPEND(strm, uint32_t, conv); \
-    if(val->len > (size_t)(strm->b->end - strm->b->last)) { \
+    if(NULL != strm->last_cl && SPHX2_STREAM_REF_MIN <= val->len) { \
+        if(NGX_OK != s_stream_write_ref(strm, val)) { \
+            return (NGX_ERROR); \
+        } \
+        break; \
+    } \
+    if(NGX_OK != s_stream_reserve(strm, val->len)) { \
         return (NGX_ERROR); \
     } \
     memcpy(strm->b->last, val->data, val->len); \
     strm->b->last += val->len; \
+    strm->left -= val->len; \
 } while(0)
 
+/* a link of its own which refers to the string */
+static ngx_int_t
+s_stream_write_ref(
+    sphx2_stream_t * strm,
+    ngx_str_t      * val)
+{
+    ngx_buf_t * b;
+
+    if(val->len > strm->left) {
+        return(NGX_ERROR);
+    }
+
+    if(NULL == (b = ngx_calloc_buf(strm->pool))) {
+        return(NGX_ERROR);
+    }
+
+    b->start = b->pos = val->data;
+    b->end = b->last = val->data + val->len;
+    b->memory = 1;
+
+    if(NGX_OK != s_stream_append(strm, b)) {
+        return(NGX_ERROR);
+    }
+
+    strm->left -= val->len;
+    strm->ref = 1;
+
+    return(NGX_OK);
+}
+
 ngx_int_t
 sphx2_stream_write_int16(
     sphx2_stream_t * strm,
@@ -142,6 +310,74 @@ sphx2_stream_write_int64(
     return(NGX_OK);
 }
 
+/* the values of a filter may run to tens of thousands: they are swapped
+ * 2 or 4 at a time with SSSE3 or AVX2. 'dst' may be 'src' itself
+ */
+void
+sphx2_swap_int64s(u_char * dst, const uint64_t * src, size_t n)
+{
+    uint64_t    v;
+    size_t      i;
+
+    i = 0;
+
+#if (defined __AVX2__)
+    {
+        const __m256i swap = _mm256_set_epi8(
+                                 8, 9, 10, 11, 12, 13, 14, 15,
+                                 0, 1, 2, 3, 4, 5, 6, 7,
+                                 8, 9, 10, 11, 12, 13, 14, 15,
+                                 0, 1, 2, 3, 4, 5, 6, 7);
+
+        for( ; i + 4 <= n; i += 4) {
+            _mm256_storeu_si256((__m256i *) (dst + i * sizeof(uint64_t)),
+                _mm256_shuffle_epi8(
+                    _mm256_loadu_si256((const __m256i *) &src[i]), swap));
+        }
+    }
+#elif (defined __SSSE3__)
+    {
+        const __m128i swap = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15,
+                                          0, 1, 2, 3, 4, 5, 6, 7);
+
+        for( ; i + 2 <= n; i += 2) {
+            _mm_storeu_si128((__m128i *) (dst + i * sizeof(uint64_t)),
+                _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i *) &src[i]), swap));
+        }
+    }
+#endif
+
+    for( ; i < n; ++i) {
+        v = __bswap_64(src[i]);
+        memcpy(dst + i * sizeof(uint64_t), &v, sizeof(uint64_t));
+    }
+}
+
+ngx_int_t
+sphx2_stream_write_int64s(
+    sphx2_stream_t * strm,
+    const uint64_t * vals,
+    size_t           n)
+{
+    size_t      len;
+
+    assert(NULL != strm->b && NULL != strm->b->last);
+
+    len = n * sizeof(uint64_t);
+
+    if(NGX_OK != s_stream_reserve(strm, len)) {
+        return (NGX_ERROR);
+    }
+
+    sphx2_swap_int64s(strm->b->last, vals, n);
+
+    strm->b->last += len;
+    strm->left -= len;
+
+    return(NGX_OK);
+}
+
 ngx_int_t
 sphx2_stream_write_float(
     sphx2_stream_t * strm,
@@ -171,6 +407,44 @@ sphx2_stream_write_string(
     return(NGX_OK);
 }
 
+ngx_int_t
+sphx2_stream_write_bytes(
+    sphx2_stream_t * strm,
+    u_char         * p,
+    size_t           len)
+{
+    assert(NULL != strm->b && NULL != strm->b->last);
+
+    if(NGX_OK != s_stream_reserve(strm, len)) {
+        return (NGX_ERROR);
+    }
+
+    strm->b->last = ngx_cpymem(strm->b->last, p, len);
+    strm->left -= len;
+
+    return(NGX_OK);
+}
+
+ngx_int_t
+sphx2_stream_write_bytes_ref(
+    sphx2_stream_t * strm,
+    u_char         * p,
+    size_t           len)
+{
+    ngx_str_t   val;
+
+    assert(NULL != strm->b && NULL != strm->b->last);
+
+    if(NULL == strm->last_cl || SPHX2_STREAM_REF_MIN > len) {
+        return sphx2_stream_write_bytes(strm, p, len);
+    }
+
+    val.data = p;
+    val.len = len;
+
+    return s_stream_write_ref(strm, &val);
+}
+
 /* reads */
 
 #define CHECK_AND_READ(strm, type, val)     \
@@ -272,3 +546,48 @@ sphx2_stream_read_string(
 
     return(NGX_OK);
 }
+
+ngx_int_t
+sphx2_stream_read_string_ref(
+    sphx2_stream_t * strm,
+    ngx_str_t      * val)
+{
+    uint32_t len;
+
+    assert(NULL != strm->b && NULL != strm->b->pos);
+
+    CHECK_AND_READ(strm, uint32_t, &len);
+
+    len = ntohl(len);
+
+    if(len > (size_t)(strm->b->last - strm->b->pos)) {
+        return (NGX_ERROR);
+    }
+
+    val->len = len;
+    val->data = strm->b->pos;
+    strm->b->pos += len;
+
+    return(NGX_OK);
+}
+
+ngx_int_t
+sphx2_stream_skip(
+    sphx2_stream_t * strm,
+    size_t           len,
+    u_char        ** p)
+{
+    assert(NULL != strm->b && NULL != strm->b->pos);
+
+    if(len > (size_t)(strm->b->last - strm->b->pos)) {
+        return (NGX_ERROR);
+    }
+
+    if(NULL != p) {
+        *p = strm->b->pos;
+    }
+
+    strm->b->pos += len;
+
+    return(NGX_OK);
+}
@@ -1,5 +1,5 @@
 /*
- * Stream abstraction for ngx_buf_t
+ * Stream abstraction for ngx_buf_t and ngx_chain_t
  */
 
 #ifndef NGX_HTTP_SPHINX2_STREAM_H
@@ -19,6 +19,14 @@ sphx2_stream_create(ngx_pool_t*);
 ngx_int_t
 sphx2_stream_alloc(sphx2_stream_t * strm, size_t len);
 
+/* allocate a chain (for writes) */
+ngx_int_t
+sphx2_stream_alloc_chain(sphx2_stream_t * strm, size_t len);
+
+/* get the chain */
+ngx_chain_t*
+sphx2_stream_get_chain(sphx2_stream_t * strm);
+
 /* set given buffer (for reads) */
 ngx_int_t
 sphx2_stream_set_buf(sphx2_stream_t * strm, ngx_buf_t * b);
@@ -45,12 +53,30 @@ sphx2_stream_write_int32(sphx2_stream_t * strm, uint32_t val);
 ngx_int_t
 sphx2_stream_write_int64(sphx2_stream_t * strm, uint64_t val);
 
+/* 'n' int64s byte-swapped in bulk, to wire order */
+void
+sphx2_swap_int64s(u_char * dst, const uint64_t * src, size_t n);
+
+/* 'n' int64s in a row, byte-swapped in bulk */
+ngx_int_t
+sphx2_stream_write_int64s(sphx2_stream_t * strm, const uint64_t * vals,
+    size_t n);
+
 ngx_int_t
 sphx2_stream_write_float(sphx2_stream_t * strm, float val);
 
 ngx_int_t
 sphx2_stream_write_string(sphx2_stream_t * strm, ngx_str_t * val);
 
+ngx_int_t
+sphx2_stream_write_bytes(sphx2_stream_t * strm, u_char * p, size_t len);
+
+/* as sphx2_stream_write_bytes, but in chain mode long runs of bytes are
+ * referred to, as strings are; they must be kept as long as the chain is
+ */
+ngx_int_t
+sphx2_stream_write_bytes_ref(sphx2_stream_t * strm, u_char * p, size_t len);
+
 /* reads */
 ngx_int_t
 sphx2_stream_read_int16(sphx2_stream_t * strm, uint16_t * val);
@@ -67,4 +93,11 @@ sphx2_stream_read_float(sphx2_stream_t * strm, float * val);
 ngx_int_t
 sphx2_stream_read_string(sphx2_stream_t * strm, ngx_str_t ** val);
 
+/* reads that refer to the buffer instead of copying out of it */
+ngx_int_t
+sphx2_stream_read_string_ref(sphx2_stream_t * strm, ngx_str_t * val);
+
+ngx_int_t
+sphx2_stream_skip(sphx2_stream_t * strm, size_t len, u_char ** p);
+
 #endif /* NGX_HTTP_SPHINX2_STREAM_H */
@@ -0,0 +1,338 @@
+/*
+ * Sphinx2 wire tracing - searchd requests and responses dumped to a log,
+ * for a sample of the requests or for those that fail
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_sphinx2_sphx.h"
+#include "ngx_http_sphinx2_result.h"
+#include "ngx_http_sphinx2_module.h"
+
+/*
+ * A traced frame is a line saying what it is, decoded from its header,
+ * followed by a hex dump of its bytes. The whole frame is formatted in the
+ * request's pool and goes to the log with one write, as nginx's own log
+ * lines do, so tracing costs nothing for the requests that aren't traced
+ * and one write per frame for those that are.
+ *
+ * With 'errors' nothing is written until it is known that the request
+ * failed - searchd answered with a status other than OK, its response
+ * header was bad, or the upstream gave up on it - and then the request
+ * is written along with what came back, if anything did.
+ */
+
+/* LOCALS */
+
+/* bytes of a frame that are dumped; the rest are only counted */
+#define SPHX2_TRACE_MAX_BYTES       4096
+
+/* bytes per dump line, and the length of a line:
+ * "  offs  " . 3 per byte . " |" . 1 per byte . "|\n"
+ */
+#define SPHX2_TRACE_LINE_BYTES      16
+#define SPHX2_TRACE_LINE_LEN        (8 + 4 * SPHX2_TRACE_LINE_BYTES + 4)
+
+/* the line a frame starts with */
+#define SPHX2_TRACE_INFO_LEN        256
+
+static ngx_uint_t   s_trace_count;  /* requests seen, for sampling */
+
+static u_char       s_hex[] = "0123456789abcdef";
+
+static const char * s_status_names[] = {
+    "ok",       /* SPHX2_SEARCHD_OK */
+    "error",    /* SPHX2_SEARCHD_ERROR */
+    "retry",    /* SPHX2_SEARCHD_RETRY */
+    "warning"   /* SPHX2_SEARCHD_WARNING */
+};
+
+static const char * s_command_names[] = {
+    "search",   /* SPHX2_COMMAND_SEARCH */
+    "excerpt"   /* SPHX2_COMMAND_EXCERPT */
+};
+
+
+/* FUNCTION DEFINITIONS */
+
+/* sphinx2_trace off|sample=N|errors */
+char*
+ngx_http_sphinx2_trace(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_loc_conf_t *slcf = conf;
+    ngx_str_t                  *value;
+    ngx_int_t                   n;
+
+    if (slcf->trace != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        slcf->trace = SPHX2_TRACE_OFF;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[1].data, "errors") == 0) {
+        slcf->trace = SPHX2_TRACE_ERRORS;
+        return NGX_CONF_OK;
+    }
+
+    if (value[1].len > sizeof("sample=") - 1
+        && ngx_strncmp(value[1].data, "sample=", sizeof("sample=") - 1) == 0)
+    {
+        n = ngx_atoi(value[1].data + sizeof("sample=") - 1,
+                     value[1].len - (sizeof("sample=") - 1));
+
+        if (n != NGX_ERROR && n > 0) {
+            slcf->trace = SPHX2_TRACE_SAMPLE;
+            slcf->trace_sample = (ngx_uint_t) n;
+            return NGX_CONF_OK;
+        }
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid value \"%V\" in \"%V\" directive, "
+                       "it must be \"off\", \"sample=N\" or \"errors\"",
+                       &value[1], &cmd->name);
+
+    return NGX_CONF_ERROR;
+}
+
+/* sphinx2_trace_log <path> */
+char*
+ngx_http_sphinx2_trace_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sphinx2_loc_conf_t *slcf = conf;
+    ngx_str_t                  *value;
+
+    if (slcf->trace_log != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    /* opened, and reopened on USR1, along with the other logs */
+    if (NULL == (slcf->trace_log = ngx_conf_open_file(cf->cycle, &value[1])))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* one dump line of up to SPHX2_TRACE_LINE_BYTES bytes */
+static u_char*
+ngx_http_sphinx2_trace_line(u_char *p, size_t off, u_char *bytes, size_t n)
+{
+    size_t i;
+
+    p = ngx_sprintf(p, "  %04xz  ", off);
+
+    for(i = 0; i < SPHX2_TRACE_LINE_BYTES; ++i) {
+        if(i < n) {
+            *p++ = s_hex[bytes[i] >> 4];
+            *p++ = s_hex[bytes[i] & 0xf];
+        } else {
+            *p++ = ' ';
+            *p++ = ' ';
+        }
+        *p++ = ' ';
+    }
+
+    *p++ = ' ';
+    *p++ = '|';
+
+    for(i = 0; i < n; ++i) {
+        *p++ = (bytes[i] >= 0x20 && bytes[i] < 0x7f) ? bytes[i] : '.';
+    }
+
+    *p++ = '|';
+    *p++ = LF;
+
+    return p;
+}
+
+/* write a frame - its info line and a dump of the bytes of 'in' */
+static void
+ngx_http_sphinx2_trace_frame(ngx_http_request_t *r, u_char *info,
+    size_t info_len, ngx_chain_t *in)
+{
+    ngx_http_sphinx2_loc_conf_t * slcf;
+    ngx_open_file_t             * file;
+    ngx_chain_t                 * cl;
+    u_char                      * buf, * p, * q, line[SPHX2_TRACE_LINE_BYTES];
+    size_t                        total, dump, off, n;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    file = (NULL != slcf->trace_log) ? slcf->trace_log
+                                     : r->connection->log->file;
+
+    for(total = 0, cl = in; cl; cl = cl->next) {
+        total += cl->buf->last - cl->buf->start;
+    }
+
+    dump = ngx_min(total, SPHX2_TRACE_MAX_BYTES);
+
+    if(NULL == (buf = ngx_pnalloc(r->pool, ngx_cached_err_log_time.len
+                                  + SPHX2_TRACE_INFO_LEN + info_len
+                                  + (dump / SPHX2_TRACE_LINE_BYTES + 2)
+                                      * SPHX2_TRACE_LINE_LEN)))
+    {
+        return;
+    }
+
+    p = ngx_cpymem(buf, ngx_cached_err_log_time.data,
+                   ngx_cached_err_log_time.len);
+
+    p = ngx_sprintf(p, " [sphinx2] *%uA %*s, %uz bytes",
+                    r->connection->number, info_len, info, total);
+    *p++ = LF;
+
+    /* the bytes of a frame are split across the links of a chain */
+    for(off = 0, n = 0, cl = in; cl && off + n < dump; cl = cl->next) {
+        for(q = cl->buf->start; q < cl->buf->last && off + n < dump; ++q) {
+            line[n++] = *q;
+
+            if(SPHX2_TRACE_LINE_BYTES == n) {
+                p = ngx_http_sphinx2_trace_line(p, off, line, n);
+                off += n;
+                n = 0;
+            }
+        }
+    }
+
+    if(0 != n) {
+        p = ngx_http_sphinx2_trace_line(p, off, line, n);
+    }
+
+    if(total > dump) {
+        p = ngx_sprintf(p, "  ... %uz more bytes", total - dump);
+        *p++ = LF;
+    }
+
+    (void) ngx_write_fd(file->fd, buf, p - buf);
+}
+
+/* write the request, decoding its header:
+ * command [2] . version [2] . length [4] [ . 0 [4] . queries [4] ]
+ */
+static void
+ngx_http_sphinx2_trace_request_frame(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, const char *note)
+{
+    u_char                        info[SPHX2_TRACE_INFO_LEN], * p, * s;
+    ngx_buf_t                   * b;
+
+    b = ctx->request_cl->buf;
+    s = b->start;
+
+    p = ngx_sprintf(info, "%s request", note);
+
+    if(b->last - s >= 8) {
+        p = ngx_sprintf(p, " %s v0x%xd length %uD",
+                (SPHX2_COMMAND_EXCERPT == ((s[0] << 8) | s[1]))
+                    ? s_command_names[1] : s_command_names[0],
+                (int) ((s[2] << 8) | s[3]),
+                (uint32_t) ((s[4] << 24) | (s[5] << 16) | (s[6] << 8) | s[7]));
+    }
+
+    if(SPHX2_COMMAND_SEARCH == ctx->command) {
+        p = ngx_sprintf(p, " queries %ui", ctx->num_queries);
+    }
+
+    ngx_http_sphinx2_trace_frame(r, info, p - info, ctx->request_cl);
+
+    ctx->traced = 1;
+}
+
+/* a request is sampled as it is sent */
+void
+ngx_http_sphinx2_trace_request(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx)
+{
+    ngx_http_sphinx2_loc_conf_t * slcf;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    if(SPHX2_TRACE_SAMPLE != slcf->trace
+       || 0 != ++s_trace_count % slcf->trace_sample)
+    {
+        return;
+    }
+
+    ctx->trace = 1;
+
+    ngx_http_sphinx2_trace_request_frame(r, ctx, "sampled");
+}
+
+/* the response as far as it has been read when its header is parsed -
+ * from 'start', which is where the header began, to 'last'. rc is what
+ * parsing the header came to.
+ */
+void
+ngx_http_sphinx2_trace_response(ngx_http_request_t *r,
+    ngx_http_sphinx2_ctx_t *ctx, u_char *start, u_char *last, ngx_int_t rc)
+{
+    ngx_http_sphinx2_loc_conf_t * slcf;
+    u_char                        info[SPHX2_TRACE_INFO_LEN], * p;
+    ngx_buf_t                     b;
+    ngx_chain_t                   cl;
+    ngx_uint_t                    failed;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+
+    /* len and status are where they are in either response context */
+    failed = (NGX_OK != rc || SPHX2_SEARCHD_OK != ctx->repctx.srch.status);
+
+    if(!ctx->trace && !(SPHX2_TRACE_ERRORS == slcf->trace && failed)) {
+        return;
+    }
+
+    if(!ctx->traced) {
+        ngx_http_sphinx2_trace_request_frame(r, ctx, "failed");
+    }
+
+    if(NGX_OK == rc) {
+        p = ngx_sprintf(info, "response status %s length %uD%s",
+                        s_status_names[ctx->repctx.srch.status],
+                        ctx->repctx.srch.len,
+                        ctx->cached ? "" : ", after searchd version");
+    } else {
+        p = ngx_sprintf(info, "invalid response");
+    }
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.start = start;
+    b.pos = start;
+    b.last = last;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    ngx_http_sphinx2_trace_frame(r, info, p - info, &cl);
+}
+
+/* a request the upstream gave up on without a response */
+void
+ngx_http_sphinx2_trace_finalize(ngx_http_request_t *r, ngx_int_t rc)
+{
+    ngx_http_sphinx2_loc_conf_t * slcf;
+    ngx_http_sphinx2_ctx_t      * ctx;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sphinx2_module);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sphinx2_module);
+
+    if(SPHX2_TRACE_ERRORS != slcf->trace || NULL == ctx || ctx->traced
+       || NULL == ctx->request_cl
+       || (NGX_ERROR != rc && rc < NGX_HTTP_SPECIAL_RESPONSE))
+    {
+        return;
+    }
+
+    ngx_http_sphinx2_trace_request_frame(r, ctx, "failed");
+}
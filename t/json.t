@@ -0,0 +1,37 @@
+# vi:filetype=perl
+
+use lib 't/lib';
+use FakeSearchd;
+use Test::Nginx::Socket;
+
+repeat_each(2);
+
+plan tests => repeat_each() * 2 * blocks();
+
+$ENV{TEST_NGINX_SEARCHD_PORT} ||= 19312;
+
+my $long = 'a_very_long_attribute_name_well_past_the_number_buffer';
+
+# one match with a timestamp attribute and an int one
+searchd($ENV{TEST_NGINX_SEARCHD_PORT},
+        search_ok(fields => ['title'],
+                  attrs => [[$long, 2], ['g"q', 1]],
+                  matches => [[7, 3, 1700000000, 42]],
+                  time => 4));
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: long and escaped attribute names
+--- config
+    location /search {
+        set $sphinx2_command search;
+        sphinx2_query_args on;
+        sphinx2_pass 127.0.0.1:$TEST_NGINX_SEARCHD_PORT;
+    }
+--- request
+GET /search?index=test&keywords=foo&format=json
+--- response_body chomp
+{"status":"ok","results":[{"status":"ok","fields":["title"],"attrs":[{"name":"a_very_long_attribute_name_well_past_the_number_buffer","type":"timestamp"},{"name":"g\"q","type":"int"}],"matches":[{"id":7,"weight":3,"attrs":{"a_very_long_attribute_name_well_past_the_number_buffer":1700000000,"g\"q":42}}],"total":1,"total_found":1,"time":0.004,"words":[]}]}
@@ -0,0 +1,126 @@
+package FakeSearchd;
+
+# A stand-in for searchd in the tests: it listens on a port and answers
+# each request it is sent with the bytes given, or with those a callback
+# makes of the request's command and body
+
+use strict;
+use warnings;
+
+use IO::Socket::INET;
+use POSIX ();
+use Exporter 'import';
+
+our @EXPORT = qw(searchd search_ok search_status sphx_str);
+
+my $parent = $$;
+my @pids;
+
+# a length prefixed string
+sub sphx_str {
+    my ($s) = @_;
+
+    return pack('N/a*', $s);
+}
+
+# a response header and body; searchd's version is sent once, on connect
+sub response {
+    my ($status, $body) = @_;
+
+    return pack('nnN', $status, 0x119, length $body) . $body;
+}
+
+# a search answered with one result set:
+#   fields  => [name, ...]
+#   attrs   => [[name, type], ...]      (fixed size 32 bit types only)
+#   matches => [[id, weight, value, ...], ...]
+#   time    => msec
+sub search_ok {
+    my (%r) = @_;
+    my $fields = $r{fields} || [];
+    my $attrs = $r{attrs} || [];
+    my $matches = $r{matches} || [];
+    my $b;
+
+    $b = pack('N', 0);
+    $b .= pack('N', scalar @$fields) . join('', map { sphx_str($_) } @$fields);
+    $b .= pack('N', scalar @$attrs)
+          . join('', map { sphx_str($_->[0]) . pack('N', $_->[1]) } @$attrs);
+    $b .= pack('NN', scalar @$matches, 0);
+    $b .= join('', map { pack('N*', @$_) } @$matches);
+    $b .= pack('NNNN', scalar @$matches, scalar @$matches, $r{time} || 0, 0);
+
+    return response(0, $b);
+}
+
+# a request failed as a whole: ERROR (1) or RETRY (2), with a message
+sub search_status {
+    my ($status, $message) = @_;
+
+    return response($status, sphx_str($message));
+}
+
+sub readn {
+    my ($c, $n) = @_;
+    my ($buf, $got) = ('');
+
+    while (length $buf < $n) {
+        $got = sysread($c, $buf, $n - length $buf, length $buf);
+        return undef unless $got;
+    }
+
+    return $buf;
+}
+
+# serve 'reply' on 127.0.0.1:port until the test exits
+sub searchd {
+    my ($port, $reply) = @_;
+    my ($ls, $pid, $c, $hdr, $body, $cmd, $len);
+
+    $ls = IO::Socket::INET->new(LocalAddr => '127.0.0.1',
+                                LocalPort => $port,
+                                Proto => 'tcp',
+                                Listen => 16,
+                                ReuseAddr => 1)
+        or die "fake searchd: can't listen on $port: $!\n";
+
+    $pid = fork;
+    die "fake searchd: fork failed: $!\n" unless defined $pid;
+
+    if ($pid) {
+        close $ls;
+        push @pids, $pid;
+        return;
+    }
+
+    while ($c = $ls->accept) {
+        syswrite($c, pack('N', 1));
+
+        # the client's version, then requests until it closes
+        if (defined readn($c, 4)) {
+            while (defined($hdr = readn($c, 8))) {
+                ($cmd, undef, $len) = unpack('nnN', $hdr);
+
+                last unless defined($body = readn($c, $len));
+
+                # persist is not answered
+                next if $cmd == 4;
+
+                syswrite($c, ref $reply ? $reply->($cmd, $body) : $reply);
+            }
+        }
+
+        close $c;
+    }
+
+    POSIX::_exit(0);
+}
+
+END {
+    if ($$ == $parent && @pids) {
+        kill TERM => @pids;
+        waitpid($_, 0) for @pids;
+    }
+}
+
+1;
@@ -0,0 +1,79 @@
+# vi:filetype=perl
+
+use lib 't/lib';
+use FakeSearchd;
+use Test::Nginx::Socket;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+$ENV{TEST_NGINX_SEARCHD_PORT} ||= 19312;
+$ENV{TEST_NGINX_SEARCHD2_PORT} ||= 19313;
+
+# the first server is out of children, the second answers
+searchd($ENV{TEST_NGINX_SEARCHD_PORT}, search_status(2, 'maxed out'));
+searchd($ENV{TEST_NGINX_SEARCHD2_PORT}, search_ok(fields => ['second']));
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: RETRY passed on to the next server
+--- http_config
+    upstream searchd {
+        server 127.0.0.1:$TEST_NGINX_SEARCHD_PORT;
+        server 127.0.0.1:$TEST_NGINX_SEARCHD2_PORT;
+    }
+--- config
+    location /search {
+        set $sphinx2_command search;
+        sphinx2_query_args on;
+        sphinx2_pass searchd;
+        sphinx2_next_upstream error timeout retry;
+    }
+--- request
+GET /search?index=test&keywords=foo&format=json
+--- response_body chomp
+{"status":"ok","results":[{"status":"ok","fields":["second"],"attrs":[],"matches":[],"total":0,"total_found":0,"time":0.000,"words":[]}]}
+
+
+
+=== TEST 2: directive before sphinx2_pass
+--- http_config
+    upstream searchd {
+        server 127.0.0.1:$TEST_NGINX_SEARCHD_PORT;
+        server 127.0.0.1:$TEST_NGINX_SEARCHD2_PORT;
+    }
+--- config
+    location /search {
+        set $sphinx2_command search;
+        sphinx2_query_args on;
+        sphinx2_next_upstream error timeout retry;
+        sphinx2_pass searchd;
+    }
+--- request
+GET /search?index=test&keywords=foo&format=json
+--- response_body chomp
+{"status":"ok","results":[{"status":"ok","fields":["second"],"attrs":[],"matches":[],"total":0,"total_found":0,"time":0.000,"words":[]}]}
+
+
+
+=== TEST 3: RETRY passed on to the client without 'retry'
+--- http_config
+    upstream searchd {
+        server 127.0.0.1:$TEST_NGINX_SEARCHD_PORT;
+        server 127.0.0.1:$TEST_NGINX_SEARCHD2_PORT;
+    }
+--- config
+    location /search {
+        set $sphinx2_command search;
+        sphinx2_query_args on;
+        sphinx2_pass searchd;
+    }
+--- request
+GET /search?index=test&keywords=foo&format=json
+--- response_body chomp
+{"status":"retry","error":"maxed out","results":[]}
+--- error_code: 503